@@ -0,0 +1,56 @@
+#ifndef ACTOR_H
+#define ACTOR_H
+
+#include <semaphore.h>
+
+/*
+ * The actor module serializes the work done on an object by turning each
+ * operation into a message to the object's mailbox.  The messages of an
+ * actor are handled one at a time, in the order they were posted, so the
+ * handlers need no locks of their own.
+ *
+ * An actor has no thread of its own.  The thread that posts a message to
+ * an idle actor handles it itself, and goes on to handle whatever other
+ * threads post in the meantime, all the messages that have piled up
+ * being taken out of the mailbox at once; the other threads just wait
+ * for their messages to have been handled.  So an actor that only one
+ * thread uses costs no more than the call, and one that many threads use
+ * has them queue on the mailbox rather than on a lock.
+ *
+ * The mailbox is a lock-free stack onto which messages are pushed.
+ * A handler must not post to another actor and wait for it, since that
+ * actor's handlers may be waiting for this one; posting to its own actor
+ * runs the message on the spot.
+ */
+
+typedef struct actor_msg {
+    struct actor_msg *next;
+    void (*handle)(struct actor_msg *);
+    sem_t done;
+} ACTOR_MSG;
+
+typedef struct actor {
+    ACTOR_MSG *mailbox;         //newest message first
+    int running;                //set while some thread handles the messages
+} ACTOR;
+
+/*
+ * Initialize an actor with an empty mailbox.
+ *
+ * @param actor  The actor to be initialized.
+ */
+void actor_init(ACTOR *actor);
+
+/*
+ * Post a message to an actor and wait for it to have been handled.
+ * The message is usually embedded in a larger structure that carries the
+ * arguments and results of the operation, which handle() recovers from
+ * the ACTOR_MSG it is given.
+ *
+ * @param actor  The actor.
+ * @param msg  The message, which must stay valid until this returns.
+ * @param handle  The function that carries out the operation.
+ */
+void actor_call(ACTOR *actor, ACTOR_MSG *msg, void (*handle)(ACTOR_MSG *));
+
+#endif
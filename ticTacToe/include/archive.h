@@ -0,0 +1,243 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "player.h"
+#include "game.h"
+#include "game_ext.h"
+
+/*
+ * The game archive keeps a permanent record of every completed game.
+ *
+ * Records are appended to a sequence of segment files in the archive
+ * directory.  Each segment "games-NNNNNN.log" is accompanied by an index
+ * "games-NNNNNN.idx" of fixed-size entries, one per record, in the order
+ * the records were written.  Entries are ordered by end time, so the index
+ * can be memory-mapped and binary-searched by time, and each entry holds
+ * hashes of the players' names so that it can be filtered by player
+ * without reading the log.
+ *
+ * Completed games are handed to a background writer thread, which
+ * serializes everything that has accumulated since its last pass and
+ * appends it with one write per file.  Nothing on the request path waits
+ * for the disk.
+ *
+ * All multi-byte fields are in network byte order.
+ *
+ * Log record:
+ *   offset  size
+ *   0       4     magic ARCHIVE_MAGIC
+ *   4       4     total length of the record
+ *   8       4     game ID
+ *   12      8     start time, milliseconds since the epoch
+ *   20      8     end time, milliseconds since the epoch
+ *   28      1     result: 0 draw, 1 first player won, 2 second player won
+ *   29      1     reason the game ended (ARCHIVE_END_*)
+ *   30      1     number of moves N
+ *   31      2     length A of the first player's name
+ *   33      2     length B of the second player's name
+ *   35      1     reserved (zero)
+ *   36      16    ratings: first before, first after, second before,
+ *                 second after (int32, hundredths of a point)
+ *   52      6*N   moves: cell (1), role (1), milliseconds since start (4)
+ *   52+6N   A     first player's name
+ *   52+6N+A B     second player's name
+ *
+ * Index entry:
+ *   0       8     end time, milliseconds since the epoch
+ *   8       4     offset of the record in the log
+ *   12      4     length of the record
+ *   16      4     hash of the first player's name
+ *   20      4     hash of the second player's name
+ *
+ * Each player also has a posting list "players/HHHHHHHH.pst", named by
+ * the hash of the player's name, with one entry appended for every game
+ * the player took part in.  A player's most recent games are the last
+ * entries of the list, so they are found without touching the segment
+ * indexes.  Each pair of players who have met likewise has a posting
+ * list "pairs/HHHHHHHH.pst", named by a hash of the two name hashes, in
+ * which the last field is the higher of the two.  Names can collide, so
+ * the names in the records a list refers to are checked when it is read.
+ *
+ * Posting list entry:
+ *   0       8     end time, milliseconds since the epoch
+ *   8       4     segment number
+ *   12      4     offset of the record in the log
+ *   16      4     length of the record
+ *   20      4     hash of the opponent's name
+ */
+
+#define ARCHIVE_MAGIC 0x4a584731          /* "JXG1" */
+#define ARCHIVE_RECORD_FIXED 52
+#define ARCHIVE_MOVE_SIZE 6
+#define ARCHIVE_INDEX_ENTRY 24
+#define ARCHIVE_POSTING_ENTRY 24
+
+/*
+ * Segments are rotated once they reach this size.
+ */
+#define ARCHIVE_SEGMENT_MAX (64 * 1024 * 1024)
+
+/*
+ * Records that cannot be written yet, as when the next segment cannot be
+ * opened, are kept and tried again every ARCHIVE_RETRY_MS, up to
+ * ARCHIVE_RETRY_MAX of them.  Beyond that, and at shutdown, the oldest are
+ * given up on and counted as lost.
+ */
+#define ARCHIVE_RETRY_MS 1000
+#define ARCHIVE_RETRY_MAX 65536
+
+/*
+ * Reasons for which a game ended.
+ */
+#define ARCHIVE_END_NORMAL 0
+#define ARCHIVE_END_RESIGN 1
+#define ARCHIVE_END_TIME 2
+
+/*
+ * A reference to a record in the archive.
+ */
+typedef struct archive_ref {
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t length;
+    uint64_t end_ms;
+} ARCHIVE_REF;
+
+/*
+ * A record read back from the archive.  The names point into the buffer
+ * the record was decoded from and are not NUL-terminated.
+ */
+typedef struct archive_record {
+    uint32_t game_id;
+    uint64_t start_ms;
+    uint64_t end_ms;
+    int result;
+    int reason;
+    int moves;
+    uint8_t cells[GAME_MAX_MOVES];
+    uint8_t roles[GAME_MAX_MOVES];
+    uint32_t times[GAME_MAX_MOVES];     //milliseconds since start
+    int ratings[4];                     //hundredths, as in the log
+    char *first;
+    size_t first_len;
+    char *second;
+    size_t second_len;
+} ARCHIVE_RECORD;
+
+/*
+ * Open the archive in a directory, creating the directory if necessary,
+ * and start the writer thread.  New records are appended to the most
+ * recent segment found there.
+ *
+ * @param dir  The archive directory.
+ * @return 0 if successful, otherwise -1.
+ */
+int archive_init(char *dir);
+
+/*
+ * Write out any records that are still queued, stop the writer thread
+ * and close the archive.
+ */
+void archive_fini(void);
+
+/*
+ * Record a completed GAME.  The record is built from the game's move
+ * history and the players' ratings, and is queued for the writer thread.
+ * This does nothing if the archive is not open.
+ *
+ * @param game  The GAME that has ended.
+ * @param first  The PLAYER in the first player role.
+ * @param second  The PLAYER in the second player role.
+ * @param result  0 if drawn, 1 if the first player won, 2 if the second.
+ * @param reason  Why the game ended (ARCHIVE_END_*).
+ * @param before  The first and second players' ratings before the result
+ * was posted.
+ * @param after  Their ratings after the result was posted, as changed
+ * together with before (see player_post_result_ratings()).
+ */
+void archive_game(GAME *game, PLAYER *first, PLAYER *second, int result,
+                  int reason, double before[2], double after[2]);
+
+/*
+ * Find archived games by player and end time, newest first, using only
+ * the segment indexes.  Because players are matched by name hash, the
+ * caller should check the names in the records that are read.
+ *
+ * @param player  Username to match, or NULL to match every game.
+ * @param since_ms  Earliest end time to include.
+ * @param until_ms  Latest end time to include.
+ * @param refs  Caller-supplied array into which references are stored.
+ * @param max  Size of the refs array.
+ * @return the number of references stored, or -1 on error.
+ */
+int archive_lookup(char *player, uint64_t since_ms, uint64_t until_ms,
+                   ARCHIVE_REF *refs, int max);
+
+/*
+ * Find a player's most recent archived games, newest first, using only
+ * the player's posting list, or the posting list of the player's games
+ * against an opponent.  The records found are read to check the names
+ * in them, and the list is walked until max games pass the check, so the
+ * cost is proportional to the number of games returned, not to the size
+ * of the archive or to the player's other games.
+ *
+ * @param player  Username whose games are wanted.
+ * @param opponent  If not NULL, only games against this username.
+ * @param refs  Caller-supplied array into which references are stored.
+ * @param max  Size of the refs array.
+ * @return the number of references stored, or -1 on error.
+ */
+int archive_player_games(char *player, char *opponent, ARCHIVE_REF *refs, int max);
+
+/*
+ * Read an archived record.
+ *
+ * @param ref  Reference to the record, as returned by archive_lookup().
+ * @param buf  Caller-supplied buffer of at least ref->length bytes.
+ * @return 0 if successful, otherwise -1.
+ */
+int archive_read(ARCHIVE_REF *ref, void *buf);
+
+/*
+ * Decode a record that has been read with archive_read().
+ *
+ * @param buf  The record.
+ * @param len  The length of the record.
+ * @param rec  The ARCHIVE_RECORD to fill in.
+ * @return 0 if successful, -1 if the record is malformed.
+ */
+int archive_decode(void *buf, size_t len, ARCHIVE_RECORD *rec);
+
+/*
+ * Go through every archived game, oldest first, reading each segment's
+ * index and log through a single mapping of each rather than record by
+ * record.
+ *
+ * @param fn  Called with each record, decoded; its names point into the
+ * mapping, and are only valid until fn returns.
+ * @param arg  Passed on to fn.
+ * @return the number of records, or -1 on error.
+ */
+long archive_scan(void (*fn)(ARCHIVE_RECORD *rec, void *arg), void *arg);
+
+/*
+ * Check whether a username is one of the players of a decoded record.
+ *
+ * @param rec  The decoded record.
+ * @param name  The username.
+ * @return 1 if the first player, 2 if the second player, otherwise 0.
+ */
+int archive_record_player(ARCHIVE_RECORD *rec, char *name);
+
+/*
+ * Hash a username as stored in the archive indexes.
+ *
+ * @param name  The username.
+ * @return the 32-bit hash.
+ */
+uint32_t archive_name_hash(char *name);
+
+#endif
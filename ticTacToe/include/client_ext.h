@@ -0,0 +1,361 @@
+#ifndef CLIENT_EXT_H
+#define CLIENT_EXT_H
+
+#include <stdint.h>
+
+#include "client.h"
+#include "game_ext.h"
+
+/*
+ * Extensions to the CLIENT module.
+ */
+
+struct spec_session;
+
+/*
+ * The time to live, in milliseconds, given to invitations that do not
+ * specify their own, or 0 if such invitations never expire.
+ */
+extern uint64_t client_invitation_ttl_ms;
+
+/*
+ * How long, in milliseconds, a connection may go without the server
+ * receiving anything before it is shut down, or 0 for no limit.
+ * A connection that has been idle for half this time is sent a PING.
+ */
+extern uint64_t client_idle_timeout_ms;
+
+/*
+ * Options for a new invitation.
+ */
+typedef struct client_invite_opts {
+    uint64_t ttl_ms;            //time to live, or 0 if it is not to expire
+    uint64_t clock_ms;          //each player's time, or 0 for an untimed game
+    uint64_t increment_ms;      //time added to a player's clock per move
+} CLIENT_INVITE_OPTS;
+
+/*
+ * Make a new invitation, like client_make_invitation(), with options.
+ *
+ * An invitation with a time to live expires if it is still open when
+ * the time runs out.  It is then removed from the lists of both the
+ * source and the target, the source is sent a DECLINED packet and the
+ * target is sent a REVOKED packet, each containing that CLIENT's ID for
+ * the invitation.
+ *
+ * The game of an invitation with a clock is played under time control
+ * (see game_set_clock()).  When a player runs out of time, the result is
+ * posted and both players are sent ENDED with the opponent as winner.
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param source_role  The GAME_ROLE to be played by the source of the INVITATION.
+ * @param target_role  The GAME_ROLE to be played by the target of the INVITATION.
+ * @param opts  The options for the invitation.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_invitation_opts(CLIENT *source, CLIENT *target,
+	GAME_ROLE source_role, GAME_ROLE target_role, CLIENT_INVITE_OPTS *opts);
+
+/*
+ * Try to send a packet to a client without blocking.  If some other
+ * thread is currently sending to the client, or the socket cannot accept
+ * any more data right now, then nothing is sent and the caller may try
+ * again later.  A packet that the socket only partly accepts is left for
+ * the caller to finish by calling again with the same packet, while
+ * everything else sent to the client is kept back behind it, or to hand
+ * over with client_finish_packet().
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent.
+ * @param data  Data payload to be sent, or NULL if none.
+ * @param sent  How much of the packet went out in earlier calls, 0 for a
+ * new packet; updated with what goes out in this one.
+ * A packet for a client whose packets are being held back (see
+ * client_hold_sends()) joins them, and counts as sent.  One for a client
+ * whose connection has yet to take packets sent before (see
+ * client_set_service()) would block.
+ *
+ * @return 1 if the packet was sent, 0 if it was not, or only partly, because
+ * the send would have blocked, -1 if the connection failed.
+ */
+int client_try_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data, size_t *sent);
+
+/*
+ * Hand the rest of a packet that client_try_send_packet() only partly
+ * sent over to the client, to go out ahead of anything kept back behind
+ * it, for a caller that will not try it again.
+ *
+ * @param client  The CLIENT who was being sent the packet.
+ * @param pkt  The header of the packet.
+ * @param data  Data payload of the packet, or NULL if none.
+ * @param sent  How much of the packet went out.
+ */
+void client_finish_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data, size_t sent);
+
+/*
+ * Hold back the packets that the calling thread sends to clients, until it
+ * calls client_release_sends(), so that everything one request causes to
+ * be sent to a client, such as the ACK of a move and the MOVED and ENDED
+ * notifications that go with it, goes out in a single write.  Packets sent
+ * to the same clients by other threads meanwhile are held back behind
+ * them, so that nothing is reordered.  The thread must not wait on other
+ * clients until it releases its packets.
+ */
+void client_hold_sends(void);
+
+/*
+ * Send the packets held back since client_hold_sends(), in one write per
+ * client, and stop holding them back.  As with any packet, what the
+ * connection of a client served by a coroutine does not take is kept for
+ * that coroutine to write (see client_set_service()).
+ */
+void client_release_sends(void);
+
+/*
+ * Say which coroutine serves a client's connection, if it is served by
+ * one.  Packets sent to such a client never wait for its connection:
+ * what the connection does not take at once is kept, along with anything
+ * sent after it, and the service coroutine is woken with coro_wake() to
+ * write it with client_flush().  The service coroutine must set this
+ * back to NULL before it ends.
+ *
+ * @param client  The CLIENT.
+ * @param service  The coroutine, as returned by coro_self(), or NULL.
+ */
+void client_set_service(CLIENT *client, void *service);
+
+/*
+ * Write what a client's connection did not take when it was sent, waiting
+ * for the connection to take more.  Only the coroutine serving the client
+ * calls this, and it lets the other coroutines of its thread run while it
+ * waits.
+ *
+ * @param client  The CLIENT.
+ * @return 0 once all of it is written, or -1 if the connection failed,
+ * in which case it is shut down.
+ */
+int client_flush(CLIENT *client);
+
+/*
+ * Get the spectator session of a CLIENT, which holds the games the
+ * client is watching.  This is managed by the spectator module.
+ *
+ * @param client  The CLIENT to be queried.
+ * @return the spectator session, or NULL if the client is not watching.
+ */
+struct spec_session *client_get_spec_session(CLIENT *client);
+
+/*
+ * Set the spectator session of a CLIENT.
+ *
+ * @param client  The CLIENT to be updated.
+ * @param session  The new spectator session, or NULL.
+ */
+void client_set_spec_session(CLIENT *client, struct spec_session *session);
+
+/*
+ * Get the encoding in which game states are sent to a CLIENT.
+ *
+ * @param client  The CLIENT to be queried.
+ * @return the GAME_ENCODING selected by the client, GAME_ENC_ASCII
+ * by default.
+ */
+GAME_ENCODING client_get_board_encoding(CLIENT *client);
+
+/*
+ * Select the encoding in which game states are sent to a CLIENT.
+ *
+ * @param client  The CLIENT to be updated.
+ * @param enc  The encoding to use from now on.
+ * @return 0 if successful, -1 if enc is not a valid encoding.
+ */
+int client_set_board_encoding(CLIENT *client, int enc);
+
+/*
+ * Send an ACK packet to a client, like client_send_ack(), with a payload
+ * that has already been compressed with compress_payload(), so that a
+ * payload sent to many clients need only be compressed once.  The
+ * compressed payload is sent to clients granted JEUX_CAP_COMPRESS, and
+ * the payload itself to the others.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param data  The payload, or NULL if there is none.
+ * @param datalen  Length of the payload.
+ * @param z  The compressed payload, or NULL if it did not compress.
+ * @param zlen  Length of the compressed payload.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_ack_compressed(CLIENT *client, void *data, size_t datalen, void *z, size_t zlen);
+
+/*
+ * Get the capabilities granted to a CLIENT when it logged in (see
+ * protocol_ext.h).
+ *
+ * @param client  The CLIENT to be queried.
+ * @return the mask of JEUX_CAPABILITY bits, 0 for a client that made no
+ * capability offer.
+ */
+unsigned client_get_caps(CLIENT *client);
+
+/*
+ * Set the capabilities granted to a CLIENT.  From then on, the ACK packets
+ * sent to it are compressed if it was granted JEUX_CAP_COMPRESS, and
+ * payloads too large for one packet are sent in fragments if it was
+ * granted JEUX_CAP_LARGE_PAYLOAD.
+ *
+ * @param client  The CLIENT to be updated.
+ * @param caps  The mask of JEUX_CAPABILITY bits.
+ */
+void client_set_caps(CLIENT *client, unsigned caps);
+
+/*
+ * Start watching a client's connection for idleness, if an idle timeout
+ * has been configured.  The connection is checked from the timer thread,
+ * which pings it when it has been idle for half the timeout and shuts it
+ * down when it has been idle for the whole timeout.  A connection that
+ * is shut down is then cleaned up by its service thread as if the client
+ * had disconnected.
+ *
+ * @param client  The CLIENT whose connection is to be watched.
+ */
+void client_start_heartbeat(CLIENT *client);
+
+/*
+ * Stop watching a client's connection.  This must be called before the
+ * connection is closed.
+ *
+ * @param client  The CLIENT whose connection was being watched.
+ */
+void client_stop_heartbeat(CLIENT *client);
+
+/*
+ * Record that a packet has been received from a client.
+ *
+ * @param client  The CLIENT from which the packet was received.
+ */
+void client_note_activity(CLIENT *client);
+
+/*
+ * Set the sequence number of the request that a client's service thread
+ * is about to carry out (see JEUX_SEQ_FLAG in protocol_ext.h).  Until it
+ * is set again, the ACK, NACK and PONG packets sent to the client are
+ * tagged with it.  Only the service thread sends those, so this needs no
+ * locking.
+ *
+ * @param client  The CLIENT that sent the request.
+ * @param seq  The request's sequence number, or NULL if it is untagged.
+ */
+void client_set_request_seq(CLIENT *client, uint32_t *seq);
+
+/*
+ * The responses to the requests of a BATCH packet, collected in a buffer
+ * rather than sent (see client_set_batch()).  Each is stored as it would
+ * have been sent, a packet header followed by the payload.
+ */
+typedef struct client_batch {
+    char *buf;
+    size_t size;                //of buf
+    size_t len;                 //bytes collected so far
+    size_t reserve;             //room to be kept for the responses still to come
+    int replies;                //responses collected so far
+    int truncated;              //whether some payload had to be left out
+} CLIENT_BATCH;
+
+/*
+ * Collect the ACK, NACK and PONG packets for a client in a CLIENT_BATCH
+ * rather than send them, or go back to sending them.  A response whose
+ * payload does not fit in the batch, leaving room for reserve bytes more,
+ * is collected without its payload.  Like client_set_request_seq(), this
+ * is only for the client's service thread.
+ *
+ * @param client  The CLIENT.
+ * @param batch  The batch in which to collect the responses, or NULL to
+ * send them again.
+ */
+void client_set_batch(CLIENT *client, CLIENT_BATCH *batch);
+
+/*
+ * Update a client's round-trip time estimate from a PONG packet.
+ *
+ * @param client  The CLIENT that sent the PONG.
+ * @param hdr  The header of the PONG packet, which echoes the timestamp
+ * of the PING it answers.
+ */
+void client_note_pong(CLIENT *client, JEUX_PACKET_HEADER *hdr);
+
+/*
+ * Get a client's round-trip time estimate, which is smoothed over the
+ * PING/PONG exchanges with the client.
+ *
+ * @param client  The CLIENT to be queried.
+ * @param srtt_us  Variable into which the smoothed round-trip time is
+ * stored, in microseconds.
+ * @param rttvar_us  Variable into which its mean deviation is stored,
+ * in microseconds.
+ * @return 0 if there is an estimate, -1 if no PONG has been received yet.
+ */
+int client_get_rtt(CLIENT *client, uint32_t *srtt_us, uint32_t *rttvar_us);
+
+/*
+ * An INVITATION as it stands between two CLIENTs, either open or with a
+ * game in progress, described so that it can be rebuilt between the same
+ * two connections in another server process.
+ */
+typedef struct client_inv_snapshot {
+    CLIENT *source;             // in the process that took the snapshot
+    CLIENT *target;
+    int source_id;              // the ID each side knows the invitation by
+    int target_id;
+    GAME_ROLE source_role;
+    GAME_ROLE target_role;
+    uint64_t clock_ms;          // time control, or 0 for an untimed game
+    uint64_t increment_ms;
+    uint64_t expires_ms;        // timer_now_ms() time, or 0 if it does not expire
+    int accepted;               // whether game holds a game in progress
+    GAME_SNAPSHOT game;
+} CLIENT_INV_SNAPSHOT;
+
+/*
+ * Take snapshots of the invitations of which a CLIENT is the source.
+ * Invitations whose game is already over are left out.  Nothing else
+ * may be changing the invitations while this runs.
+ *
+ * @param client  The CLIENT.
+ * @param snaps  Caller-supplied array into which the snapshots are stored.
+ * @param max  Size of the snaps array.
+ * @return the number of snapshots stored.
+ */
+int client_snapshot_invitations(CLIENT *client, CLIENT_INV_SNAPSHOT *snaps, int max);
+
+/*
+ * Rebuild an INVITATION from a snapshot, under the same IDs, with its
+ * expiry or its game and clock running again.  Unlike
+ * client_make_invitation(), nobody is sent anything.
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param snap  The snapshot.
+ * @return 0 if successful, otherwise -1.
+ */
+int client_restore_invitation(CLIENT *source, CLIENT *target, CLIENT_INV_SNAPSHOT *snap);
+
+/*
+ * A CLIENT whose reference count drops to zero is not freed at once, but
+ * retired (see ebr.h), so that a thread in a critical section can still
+ * look at a CLIENT, or at a PLAYER or INVITATION reached through it,
+ * without holding a reference.  Such a thread may take a reference to a
+ * CLIENT it reached this way only if the CLIENT is not being freed.
+ * The reference count is changed by compare-and-swap, without locking
+ * the CLIENT, so that lookups from many threads never wait on it.
+ *
+ * @param client  The CLIENT whose reference count is to be increased.
+ * @param why  A string describing the reason why the reference count is
+ * being increased.
+ * @return  The same CLIENT, or NULL if its reference count had already
+ * dropped to zero.
+ */
+CLIENT *client_ref_live(CLIENT *client, char *why);
+
+#endif
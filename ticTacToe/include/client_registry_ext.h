@@ -0,0 +1,133 @@
+#ifndef CLIENT_REGISTRY_EXT_H
+#define CLIENT_REGISTRY_EXT_H
+
+#include <time.h>
+#include <stdint.h>
+
+#include "client_registry.h"
+
+/*
+ * Extensions to the client registry.
+ *
+ * Besides the table of connected clients, the registry keeps an index
+ * of the logged-in clients ordered by username.  The index is used to
+ * look clients up by name and to answer paginated and filtered queries
+ * on the set of logged-in players without walking every client.
+ *
+ * The registry is split into CREG_SHARDS shards, clients going to a shard
+ * by file descriptor and index entries by username, each shard with its
+ * own lock, so that clients registering, logging in and out and leaving
+ * at the same time seldom contend.  Lookups and queries, which are far
+ * more frequent, take no lock at all: each shard publishes an immutable
+ * copy of its part of the index, which a change replaces with a new copy,
+ * and readers work from whatever copy is published, in a critical section
+ * (see ebr.h).  An old copy is retired rather than freed, as is a CLIENT
+ * whose last reference goes away, so neither disappears under a reader.
+ */
+
+/*
+ * The number of shards.
+ */
+#define CREG_SHARDS 8
+
+/*
+ * A query on the set of logged-in players.
+ */
+typedef struct creg_query {
+    char *cursor;       // Username after which to start (exclusive), or NULL
+    char *prefix;       // Required username prefix, or NULL
+    int limit;          // Maximum number of players to return
+    int min_rating;     // Minimum rating (inclusive)
+    int max_rating;     // Maximum rating (inclusive)
+    int min_deviation;  // Minimum rating deviation (inclusive)
+    int max_deviation;  // Maximum rating deviation (inclusive)
+} CREG_QUERY;
+
+/*
+ * The maximum number of index entries examined by a single query.
+ * Queries with a selective rating filter stop after this many entries
+ * and return a cursor from which the scan can be resumed.
+ */
+#define CREG_QUERY_SCAN_MAX 1024
+
+/*
+ * Add a logged-in CLIENT to the username index.
+ * This fails if some other CLIENT is already indexed under the same
+ * username, so it also serves as the atomic check that a player is
+ * not logged in twice.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT being logged in.
+ * @param player  The PLAYER that the CLIENT is being logged in as.
+ * @return 0 if the CLIENT was added to the index, otherwise -1.
+ */
+int creg_index_add(CLIENT_REGISTRY *cr, CLIENT *client, PLAYER *player);
+
+/*
+ * Remove a CLIENT from the username index.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT being logged out.
+ * @return 0 if the CLIENT was found and removed, otherwise -1.
+ */
+int creg_index_remove(CLIENT_REGISTRY *cr, CLIENT *client);
+
+/*
+ * Return one page of the logged-in players matching a query, in
+ * username order.  The reference count of each returned PLAYER is
+ * incremented, and it is the caller's responsibility to decrement it.
+ *
+ * @param cr  The client registry.
+ * @param q  The query to be performed.
+ * @param players  Caller-supplied array of at least q->limit entries,
+ * into which the matching players are stored.
+ * @param next  Caller-supplied buffer into which the username from which
+ * the next page should be requested is stored, or an empty string if no
+ * further players match.
+ * @param nextlen  Size of the next buffer.
+ * @return the number of players stored, or -1 on error.
+ */
+int creg_query_players(CLIENT_REGISTRY *cr, CREG_QUERY *q, PLAYER **players,
+                       char *next, size_t nextlen);
+
+/*
+ * Wait, for at most a bounded time, for the number of registered clients
+ * to reach zero.
+ *
+ * @param cr  The client registry.
+ * @param deadline  The absolute CLOCK_REALTIME time at which to give up.
+ * @return 0 if the registry became empty, -1 if the deadline passed first.
+ */
+int creg_wait_for_empty_until(CLIENT_REGISTRY *cr, const struct timespec *deadline);
+
+/*
+ * Shut down both directions of all the sockets for connections to
+ * currently registered clients.  Unlike creg_shutdown_all(), this also
+ * makes any send that is blocked on a client that is not reading fail,
+ * so that the thread servicing that client can finish.
+ *
+ * @param cr  The client registry.
+ */
+void creg_force_shutdown_all(CLIENT_REGISTRY *cr);
+
+/*
+ * Get all registered clients, logged in or not.  The reference count of
+ * each of them is incremented to account for the returned pointer.
+ *
+ * @param cr  The client registry.
+ * @param clients  Caller-supplied array of MAX_CLIENTS entries into
+ * which the clients are stored.
+ * @return the number of clients stored.
+ */
+int creg_snapshot(CLIENT_REGISTRY *cr, CLIENT **clients);
+
+/*
+ * Get a number that changes whenever a client logs in or out.  Like
+ * player_rating_version(), it is only bumped once the change can be seen.
+ *
+ * @param cr  The client registry.
+ * @return the number of changes to the username index so far.
+ */
+uint64_t creg_version(CLIENT_REGISTRY *cr);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+/*
+ * The compress module compresses the payloads sent to clients that were
+ * granted the compress capability (see protocol_ext.h): a zlib stream made
+ * with the preset dictionary JEUX_COMPRESS_DICTIONARY, which holds the
+ * tabs, newlines, ratings and digit runs of which USERS and HISTORY
+ * listings are mostly made, so that even short listings shrink.
+ *
+ * Each thread keeps a deflate stream of its own, reset for each payload,
+ * so that compressing costs no allocation beyond the output buffer.
+ */
+
+/*
+ * Payloads smaller than this are not worth compressing.
+ */
+#define COMPRESS_THRESHOLD 256
+
+/*
+ * Compress a payload.
+ *
+ * @param data  The payload.
+ * @param len  Its length.
+ * @param zlen  Variable into which the length of the compressed payload
+ * is stored.
+ * @return the compressed payload, in malloc'd storage, or NULL if it
+ * would not come out smaller than the payload, or compression failed.
+ */
+void *compress_payload(const void *data, size_t len, size_t *zlen);
+
+#endif
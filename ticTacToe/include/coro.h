@@ -0,0 +1,203 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <sys/types.h>
+
+/*
+ * The coro module runs client sessions as coroutines on a small number of
+ * scheduler threads, instead of giving each session a thread of its own.
+ *
+ * Each coroutine has its own small stack, so a session is written as the
+ * same straight-line loop as before.  When it has to wait for its
+ * connection to become readable, it gives its scheduler thread over to
+ * another coroutine instead of blocking it.  Each scheduler thread waits
+ * for the connections of all its coroutines at once, and resumes a
+ * coroutine when its connection is ready.
+ *
+ * How the threads wait is chosen at startup.  With epoll, a connection
+ * that becomes readable wakes its coroutine, which then reads from it.
+ * With io_uring, each connection has one multishot receive outstanding,
+ * which goes on taking data off the connection into buffers provided by
+ * its thread for as long as the connection lasts; the coroutine reads out
+ * of those buffers, so that once a session is under way it takes no
+ * system call to receive anything, and a thread takes one system call to
+ * wait for all its connections and rearm nothing.  New connections are
+ * then accepted through io_uring as well, by a multishot accept.  Should
+ * the kernel not have what this needs, epoll is used instead.  Either
+ * way, writes are made directly, since they are made under locks, and
+ * never wait: what a connection does not take at once is left for the
+ * connection's own coroutine to write, when coro_wait_fd() finds the
+ * connection writable again.
+ *
+ * A coroutine only gives up its thread in coro_wait_fd() and
+ * coro_suspend().  In particular, it keeps its thread for as long as it
+ * holds a lock or is in a mailbox call, so that another coroutine of the
+ * same thread never waits for it; blocking calls made there hold up every
+ * coroutine of the thread, and must be kept short.
+ *
+ * A coroutine always runs on the thread it was started on, so thread-local
+ * variables are shared by all the coroutines of a thread.
+ */
+
+/*
+ * The size of each coroutine's stack.  Only the part of it that is used
+ * takes up memory, typically a few kilobytes, but nothing run by a
+ * session may put large buffers on the stack.
+ */
+#define CORO_STACK_SIZE (64 * 1024)
+
+/*
+ * The largest number of scheduler threads.
+ */
+#define CORO_MAX_THREADS 64
+
+/*
+ * The largest number of listening sockets.
+ */
+#define CORO_MAX_LISTENERS 4
+
+typedef enum coro_backend {
+	CORO_EPOLL,
+	CORO_URING
+} CORO_BACKEND;
+
+/*
+ * Start the scheduler threads.
+ *
+ * @param threads  The number of threads, or 0 for one per processor.
+ * @param backend  How the threads are to wait for connections.  If it is
+ * CORO_URING and io_uring cannot be used, CORO_EPOLL is used instead.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_init(int threads, CORO_BACKEND backend);
+
+/*
+ * Say how the scheduler threads wait for connections.
+ *
+ * @return the backend in use.
+ */
+CORO_BACKEND coro_backend(void);
+
+/*
+ * Start taking connections on a listening socket.  Each connection taken
+ * is handed, as a pointer to a malloc'd int, to a new coroutine running
+ * func, which must free it.
+ *
+ * @param listenfd  The listening socket.
+ * @param func  The function the coroutines run.
+ * @return a descriptor that becomes readable when there are connections
+ * to take, whereupon the caller calls coro_accept() with it, or -1 if
+ * there are CORO_MAX_LISTENERS listening sockets already.  The same
+ * descriptor may be returned for several listening sockets.
+ */
+int coro_listen(int listenfd, void *(*func)(void *));
+
+/*
+ * Take the connections that are waiting, and start a coroutine for each.
+ *
+ * @param fd  The descriptor, returned by coro_listen(), that is readable.
+ */
+void coro_accept(int fd);
+
+/*
+ * Stop taking connections, leaving any that come in on the listening
+ * sockets' backlogs.  Those that were already taken have their coroutines
+ * started.
+ */
+void coro_listen_pause(void);
+
+/*
+ * Start taking connections again after coro_listen_pause().
+ */
+void coro_listen_resume(void);
+
+/*
+ * Start a coroutine, on the scheduler thread with the fewest coroutines.
+ * The coroutine ends when func returns; its return value is ignored.
+ *
+ * @param func  The function the coroutine runs.
+ * @param arg  The argument to pass to func.
+ * @return 0 if successful, otherwise -1.
+ */
+int coro_spawn(void *(*func)(void *), void *arg);
+
+/*
+ * Say whether the caller is a coroutine.
+ *
+ * @return 1 if called from a coroutine, otherwise 0.
+ */
+int coro_running(void);
+
+/*
+ * Wait until a file descriptor is ready.  A coroutine lets other
+ * coroutines run in the meantime; anything else simply blocks in poll(2).
+ * A coroutine waits on one descriptor at a time, usually its connection.
+ *
+ * @param fd  The file descriptor.
+ * @param events  POLLIN and/or POLLOUT.
+ * @return 1 if the descriptor is ready (or has an error or hangup
+ * pending), 0 if the wait was cut short by coro_wake() or coro_wake_all(),
+ * or -1 on error.
+ */
+int coro_wait_fd(int fd, int events);
+
+/*
+ * Read what has been received on the calling coroutine's connection, like
+ * recv(2) with MSG_DONTWAIT.  With io_uring, data may have been taken off
+ * the connection already, so nothing else may read from it.
+ *
+ * @param fd  The connection.
+ * @param buf  The buffer into which to read.
+ * @param n  The most bytes to read.
+ * @return the number of bytes read, 0 at end of file, or -1 with errno
+ * set, to EAGAIN if there is nothing to read yet.
+ */
+ssize_t coro_recv(int fd, void *buf, size_t n);
+
+/*
+ * Stop taking data off the calling coroutine's connection ahead of it
+ * being read, so that whatever the peer sends next stays in the socket,
+ * for example to be read by another process the connection is handed
+ * over to.  The next coro_wait_fd() on the connection starts again.
+ * Does nothing with epoll, which never takes data ahead.
+ *
+ * @param fd  The connection.
+ * @return 1 if data already taken (or end of file, or an error) is still
+ * there to be read, otherwise 0.
+ */
+int coro_hold_fd(int fd);
+
+/*
+ * Suspend the calling coroutine until the next coro_wake_all().
+ * A wakeup that has been asked for but not yet delivered when the
+ * coroutine suspends itself still wakes it.  Does nothing if the caller
+ * is not a coroutine.
+ */
+void coro_suspend(void);
+
+/*
+ * Get a handle on the calling coroutine, by which other threads can wake
+ * it with coro_wake().
+ *
+ * @return the handle, or NULL if the caller is not a coroutine.
+ */
+void *coro_self(void);
+
+/*
+ * Resume a coroutine that is suspended, or waiting in coro_wait_fd(),
+ * which then returns 0 as if cut short by coro_wake_all().  As with
+ * coro_suspend(), a wakeup asked for while the coroutine is running is
+ * delivered when it next waits.  May be called from any thread, but only
+ * while the coroutine is known not to have ended.
+ *
+ * @param handle  The coroutine, as returned by coro_self().
+ */
+void coro_wake(void *handle);
+
+/*
+ * Resume every coroutine that is suspended, or waiting in coro_wait_fd().
+ * May be called from any thread.
+ */
+void coro_wake_all(void);
+
+#endif
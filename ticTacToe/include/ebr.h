@@ -0,0 +1,66 @@
+#ifndef EBR_H
+#define EBR_H
+
+/*
+ * The ebr module defers freeing shared objects until no thread can still
+ * be using them (epoch-based reclamation), so that threads can follow
+ * pointers to CLIENTs, INVITATIONs and the like without locking them or
+ * taking references to them.
+ *
+ * A thread that is going to use such pointers does so inside a critical
+ * section, between ebr_enter() and ebr_exit().  An object that has been
+ * unlinked from everything a thread could reach it through is passed to
+ * ebr_retire() instead of being freed, and is freed once every thread
+ * that was in a critical section when it was retired has left it.
+ *
+ * To tell when that is, there is a global epoch, and a thread entering a
+ * critical section records the epoch it saw.  The epoch is advanced only
+ * once every thread in a critical section has seen the current one, and
+ * an object retired in some epoch is freed when the epoch has advanced
+ * twice more.  Nothing ever waits for this: a thread that stays in its
+ * critical section only holds up the freeing of objects, not other
+ * threads.  Critical sections must therefore be kept short, and must
+ * never be entered for as long as a thread waits for a client to send.
+ *
+ * Critical sections may be nested.  An EBR_NODE is embedded in the object
+ * that is retired and is never allocated or freed by this module.
+ */
+
+typedef struct ebr_node {
+    struct ebr_node *next;
+    void (*reclaim)(void *);
+    void *arg;
+} EBR_NODE;
+
+/*
+ * Enter a critical section.  Until the matching ebr_exit(), no object
+ * that the calling thread can still reach is freed.
+ */
+void ebr_enter(void);
+
+/*
+ * Leave a critical section entered with ebr_enter().  Leaving the
+ * outermost one is a quiescent point for the calling thread, at which
+ * objects whose grace period has ended may be freed.
+ */
+void ebr_exit(void);
+
+/*
+ * Free an object once no thread can still be using it.  The object must
+ * already be unreachable for any thread that is not in a critical section
+ * at the time of the call.
+ *
+ * @param node  The EBR_NODE embedded in the object.
+ * @param reclaim  The function that frees the object.
+ * @param arg  The argument to pass to reclaim, usually the object.
+ */
+void ebr_retire(EBR_NODE *node, void (*reclaim)(void *), void *arg);
+
+/*
+ * Free every retired object, whether or not its grace period has ended.
+ * This is only to be called at shutdown, once no thread other than the
+ * caller can be using any of them.
+ */
+void ebr_fini(void);
+
+#endif
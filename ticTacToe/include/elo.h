@@ -0,0 +1,74 @@
+#ifndef ELO_H
+#define ELO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "player_registry.h"
+
+/*
+ * The elo module computes the rating changes described at
+ * player_post_result(), on unrounded ratings.
+ *
+ * The expected score 1/(1 + 10^(d/400)) of a player rated d points below
+ * the opponent is read from a table of its values at every whole point of
+ * difference up to ELO_TABLE_SPAN either way, interpolated linearly in
+ * between, which is within 1e-6 of the logistic itself.  Larger
+ * differences, which hardly ever occur, are computed directly.  The
+ * second player's expected score is taken as one less the first's, so a
+ * game never creates or destroys rating points.
+ */
+
+#define ELO_K 32.0
+#define ELO_SCALE 400.0
+#define ELO_TABLE_SPAN 2048
+
+/*
+ * The expected score of a player against an opponent.
+ *
+ * @param diff  The opponent's rating less the player's.
+ * @return the expected score, between 0 and 1.
+ */
+double elo_expected(double diff);
+
+/*
+ * Update two ratings for the result of a game between their players.
+ *
+ * @param r1  The first player's rating, which is updated.
+ * @param r2  The second player's rating, which is updated.
+ * @param result  0 if draw, 1 if the first player won, 2 if the second.
+ */
+void elo_update(double *r1, double *r2, int result);
+
+/*
+ * A game to be rated by elo_rate(), between players numbered from 0.
+ */
+typedef struct elo_game {
+	uint32_t first;
+	uint32_t second;
+	uint32_t result;                //as for elo_update()
+} ELO_GAME;
+
+/*
+ * Rate a sequence of games, in order, as elo_update() would.
+ *
+ * @param games  The games.
+ * @param n  The number of games.
+ * @param ratings  The ratings of the players, indexed by their numbers,
+ * which are updated.
+ */
+void elo_rate(ELO_GAME *games, size_t n, double *ratings);
+
+/*
+ * Recompute the rating of every player who has played a game from scratch,
+ * by replaying all the games in the archive, which must be open, from
+ * PLAYER_INITIAL_RATING.  Players that are in the archive but not yet in
+ * the registry are registered; the ratings of players who are not in the
+ * archive are left as they are.
+ *
+ * @param preg  The player registry.
+ * @return the number of players rated, or -1 on error.
+ */
+int elo_rerate_archive(PLAYER_REGISTRY *preg);
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef GAME_EXT_H
+#define GAME_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/*
+ * Extensions to the GAME module.
+ */
+
+/*
+ * Get the server-wide ID of a GAME.  Each GAME is assigned a distinct
+ * nonzero ID when it is created.  Unlike invitation IDs, which are
+ * private to each client, the game ID can be used by any client to
+ * refer to the game, for example in order to watch it.
+ *
+ * @param game  The GAME to be queried.
+ * @return the ID of the GAME, or 0 if game is NULL.
+ */
+uint32_t game_get_id(GAME *game);
+
+/*
+ * Count a spectator starting or stopping to watch a GAME.  The count is
+ * kept in the GAME, so that a notification about the game can be skipped
+ * without taking any lock when nobody is watching.
+ *
+ * @param game  The GAME being watched.
+ * @param delta  1 for a spectator that starts watching, -1 for one that
+ * stops.
+ */
+void game_add_watchers(GAME *game, int delta);
+
+/*
+ * Get the number of spectators watching a GAME.
+ *
+ * @param game  The GAME to be queried.
+ * @return the number of spectators counted by game_add_watchers().
+ */
+int game_get_watchers(GAME *game);
+
+/*
+ * Encodings in which a GAME state can be sent to a client.
+ *
+ * GAME_ENC_ASCII is the original human-readable board: three rows of
+ * three cells separated by '|', each row terminated by a newline.
+ *
+ * GAME_ENC_PACKED is a 32-bit value in network byte order:
+ *   bits  0-17  two bits per cell, row by row from the top left
+ *               (0 empty, 1 first player, 2 second player)
+ *   bit   18    set if the first player's symbol is 'O', clear if 'X'
+ *   bits 19-20  GAME_ROLE of the player to move (NULL_ROLE if over)
+ *   bits 21-24  number of moves made so far
+ *
+ * GAME_ENC_DELTA describes only the last move, in two bytes:
+ *   byte 0      cell of the last move, 0-8 from the top left,
+ *               or 0xff if no move has been made
+ *   byte 1      bits 0-1: GAME_ROLE that made the move,
+ *               bit 2: set if that player's symbol is 'O',
+ *               bits 4-7: number of moves made so far
+ * Since the delta only makes sense relative to a known state, wherever
+ * a full state is needed (the initial state, or after notifications
+ * have been lost) a client that selected GAME_ENC_DELTA is sent
+ * GAME_ENC_PACKED instead.  The two are told apart by payload size.
+ */
+typedef enum game_encoding {
+    GAME_ENC_ASCII,
+    GAME_ENC_PACKED,
+    GAME_ENC_DELTA
+} GAME_ENCODING;
+
+#define GAME_ENC_COUNT 3
+
+/*
+ * The largest encoded GAME state, in bytes.
+ */
+#define GAME_ENC_MAX_SIZE 18
+
+/*
+ * Get the encoding used to send a full GAME state to a client that
+ * has selected the given encoding.
+ *
+ * @param enc  The encoding selected by the client.
+ * @return enc, or GAME_ENC_PACKED if enc is GAME_ENC_DELTA.
+ */
+GAME_ENCODING game_full_encoding(GAME_ENCODING enc);
+
+/*
+ * Get the size of a GAME state in a given encoding.
+ *
+ * @param enc  The encoding.
+ * @return the number of bytes, or 0 if enc is not a valid encoding.
+ */
+size_t game_encoding_size(GAME_ENCODING enc);
+
+/*
+ * Encode the current state of a GAME into a caller-supplied buffer.
+ * Unlike game_unparse_state(), this does not allocate.  The result is
+ * not NUL-terminated.
+ *
+ * @param game  The GAME whose state is to be encoded.
+ * @param enc  The encoding to use.
+ * @param buf  The buffer into which to encode.
+ * @param len  The size of the buffer.
+ * @return the number of bytes stored, or 0 if the encoding is invalid
+ * or the buffer is too small.
+ */
+size_t game_encode_state(GAME *game, GAME_ENCODING enc, void *buf, size_t len);
+
+/*
+ * The most moves a GAME can last.
+ */
+#define GAME_MAX_MOVES 9
+
+/*
+ * A move made in a GAME, as kept in the game's history.
+ */
+typedef struct game_move_record {
+    uint8_t cell;           // 0-8 from the top left
+    uint8_t role;           // GAME_ROLE of the player who moved
+    uint64_t time_ms;       // When the move was made, ms since the epoch
+} GAME_MOVE_RECORD;
+
+/*
+ * Get the time at which a GAME was created.
+ *
+ * @param game  The GAME to be queried.
+ * @return the creation time in milliseconds since the epoch.
+ */
+uint64_t game_get_start_time(GAME *game);
+
+/*
+ * Get the history of moves made in a GAME, oldest first.
+ *
+ * @param game  The GAME to be queried.
+ * @param moves  Caller-supplied array into which the moves are stored.
+ * @param max  Size of the moves array.
+ * @return the number of moves stored.
+ */
+int game_get_moves(GAME *game, GAME_MOVE_RECORD *moves, int max);
+
+/*
+ * Put a GAME under time control, like a chess clock.  Each player starts
+ * with the same amount of time, which runs down while it is that player's
+ * turn, and gains a fixed increment after each move they make.  The first
+ * player's clock starts immediately.  The clocks are driven by the timer
+ * module, so no thread waits on any particular game.
+ *
+ * A move that arrives after the mover's time has run out is rejected.
+ * When a player's time runs out, the game ends with the opponent as the
+ * winner and the flag function is called from the timer thread.
+ * The release function is called with the argument once the clock has
+ * stopped for good, whether the game ended on time or otherwise.
+ *
+ * @param game  The GAME to be put under time control.
+ * @param base_ms  Each player's initial time, in milliseconds.
+ * @param increment_ms  The time added after each move, in milliseconds.
+ * @param flag  The function called when a player's time runs out, with
+ * the GAME, the GAME_ROLE of the player who ran out of time and arg.
+ * @param release  The function called with arg once the clock has
+ * stopped, or NULL.
+ * @param arg  An argument for the flag and release functions.
+ * @return 0 if successful, otherwise -1.
+ */
+int game_set_clock(GAME *game, uint64_t base_ms, uint64_t increment_ms,
+                   void (*flag)(GAME *, GAME_ROLE, void *),
+                   void (*release)(void *), void *arg);
+
+/*
+ * Get the time that each player has left.  The time of the player on
+ * the move is as of now.
+ *
+ * @param game  The GAME to be queried.
+ * @param first_ms  Variable into which the first player's time is stored.
+ * @param second_ms  Variable into which the second player's time is stored.
+ * @return 0 if the game is under time control, otherwise -1.
+ */
+int game_get_clock(GAME *game, uint64_t *first_ms, uint64_t *second_ms);
+
+/*
+ * Everything needed to rebuild a GAME in another process: the board, whose
+ * turn it is and so on follow from the history of moves.  Clock times are
+ * in timer_now_ms() time, which all processes on a machine share, so a
+ * clock keeps running while the game is moved.
+ */
+typedef struct game_snapshot {
+    uint32_t id;
+    uint64_t start_ms;
+    char first_sym;             // ' ' until the first player has moved
+    char second_sym;
+    int moves;
+    GAME_MOVE_RECORD history[GAME_MAX_MOVES];
+    int clocked;
+    uint64_t remaining_ms[2];   // as of turn_start_ms for the player on the move
+    uint64_t increment_ms;
+    uint64_t turn_start_ms;
+} GAME_SNAPSHOT;
+
+/*
+ * Take a snapshot of a GAME.
+ *
+ * @param game  The GAME.
+ * @param snap  The snapshot to be filled in.
+ * @return 0 if successful, or -1 if the game is over.
+ */
+int game_snapshot(GAME *game, GAME_SNAPSHOT *snap);
+
+/*
+ * Rebuild a GAME from a snapshot.  The GAME keeps the ID it had, and no
+ * GAME created afterwards is given an ID that is already in use.  The
+ * clock is not started; see game_restore_clock().
+ *
+ * @param snap  The snapshot.
+ * @return the GAME, with a reference count of one, or NULL if the
+ * snapshot does not describe a game in progress.
+ */
+GAME *game_restore(GAME_SNAPSHOT *snap);
+
+/*
+ * Restart the clock of a GAME rebuilt by game_restore(), with the times
+ * from the snapshot.  Otherwise like game_set_clock().
+ *
+ * @param game  The GAME.
+ * @param snap  The snapshot it was rebuilt from.
+ * @param flag  The function called when a player's time runs out.
+ * @param release  The function called with arg once the clock has
+ * stopped, or NULL.
+ * @param arg  An argument for the flag and release functions.
+ * @return 0 if successful, otherwise -1.
+ */
+int game_restore_clock(GAME *game, GAME_SNAPSHOT *snap,
+                       void (*flag)(GAME *, GAME_ROLE, void *),
+                       void (*release)(void *), void *arg);
+
+/*
+ * Parse a move and apply it to a GAME, as one operation, so that no other
+ * change to the game can come between the two.  Like game_parse_move()
+ * followed by game_apply_move(), but without a GAME_MOVE to be freed.
+ *
+ * Each GAME handles its operations one at a time, in the order they are
+ * made, without locking: see actor.h.
+ *
+ * @param game  The GAME to which the move is to be applied.
+ * @param role  The GAME_ROLE of the player making the move.
+ * @param str  The string that is to be interpreted as a move.
+ * @return 0 if the move was parsed and applied, otherwise -1.
+ */
+int game_play_move(GAME *game, GAME_ROLE role, char *str);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef GLICKO_H
+#define GLICKO_H
+
+#include <stdint.h>
+
+#include "player.h"
+#include "player_registry.h"
+
+/*
+ * The glicko module rates players with Mark Glickman's Glicko-2 system,
+ * as an alternative to the Elo system of player_post_result(), chosen at
+ * startup (see player_ext.h).
+ *
+ * Besides a rating, each player has a rating deviation, which says how
+ * uncertain the rating is, and a volatility, which says how erratic the
+ * player's results are.  A new player starts with a large deviation, so
+ * that the first few results move the rating a long way, and the
+ * deviation shrinks as the player plays and grows again while the player
+ * does not.
+ *
+ * Results are not rated as they come in, but collected into rating
+ * periods of a fixed length.  At the end of each period, a background
+ * thread rates every registered player at once, each against the ratings
+ * the opponents had at the start of the period, so the players are
+ * independent of each other and are split between threads, one for each
+ * core.  Until then, a result does not change any rating.
+ */
+
+/*
+ * The scale between Glicko ratings and the Glicko-2 internal scale.
+ */
+#define GLICKO_SCALE 173.7178
+
+#define GLICKO_INITIAL_DEVIATION 350.0
+#define GLICKO_INITIAL_VOLATILITY 0.06
+
+/*
+ * The system constant, which limits how fast the volatility can change.
+ */
+#define GLICKO_TAU 0.5
+
+/*
+ * The default length of a rating period.
+ */
+#define GLICKO_DEFAULT_PERIOD_MS (5 * 60 * 1000)
+
+/*
+ * Players below this many to a thread are not worth a thread of their
+ * own.
+ */
+#define GLICKO_MIN_PLAYERS_PER_THREAD 64
+
+/*
+ * A player's rating, on the Glicko scale.
+ */
+typedef struct glicko_rating {
+	double rating;
+	double deviation;
+	double volatility;
+} GLICKO_RATING;
+
+/*
+ * A game to be rated, from the point of view of one of its players.
+ */
+typedef struct glicko_game {
+	GLICKO_RATING opponent;         //at the start of the period
+	double score;                   //1 for a win, 0.5 for a draw, 0 for a loss
+} GLICKO_GAME;
+
+/*
+ * Rate a player for a period.
+ *
+ * @param r  The player's rating at the start of the period, which is
+ * updated.
+ * @param games  The games the player played during the period.
+ * @param n  The number of games, which may be 0.
+ */
+void glicko_update(GLICKO_RATING *r, GLICKO_GAME *games, int n);
+
+/*
+ * Start rating periods.
+ *
+ * @param preg  The player registry, whose players are rated.
+ * @param period_ms  The length of a period, in milliseconds.
+ * @return 0 if successful, otherwise -1.
+ */
+int glicko_init(PLAYER_REGISTRY *preg, uint64_t period_ms);
+
+/*
+ * End the current rating period now, rating the results collected in it.
+ * This does nothing unless rating periods were started.
+ */
+void glicko_end_period(void);
+
+/*
+ * End the current rating period, and stop starting new ones.
+ */
+void glicko_fini(void);
+
+/*
+ * Collect the result of a game for the current rating period.
+ *
+ * @param player1  One of the PLAYERs.
+ * @param player2  The other PLAYER.
+ * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
+ */
+void glicko_post_result(PLAYER *player1, PLAYER *player2, int result);
+
+#endif
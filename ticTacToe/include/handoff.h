@@ -0,0 +1,103 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+/*
+ * The handoff module lets a new server process take over from a running
+ * one without dropping any connections, for example to upgrade the server
+ * while games are being played.
+ *
+ * The running server listens on a Unix domain socket, the upgrade socket.
+ * A new server started with the same upgrade socket path connects to it
+ * instead of opening its own listening socket.  The old server then parks
+ * its service threads between requests, holds its timers and sends the
+ * new one, over the upgrade socket:
+ *
+ *   - its listening sockets,
+ *   - the rating of every registered player, with its Glicko-2 deviation
+ *     and volatility, once the current rating period has been rated,
+ *   - every client connection, with the username it is logged in as and
+ *     the board encoding it has selected, and the memfd of its rings if it
+ *     uses shared memory (see local.h),
+ *   - every open invitation, with its expiry, and every game in progress,
+ *     with its moves and clocks, under the IDs the clients know them by.
+ *
+ * Descriptors are passed as SCM_RIGHTS ancillary data, so the connections
+ * themselves never close and whatever clients send in the meantime waits
+ * in the socket buffers.  Once the new server has rebuilt everything it
+ * says so, the old one closes its game archive and answers, and the new
+ * one opens the archive and starts serving.  The old server then exits
+ * without touching the connections.  Should anything go wrong before the
+ * new server has said it is ready, the old server carries on as before.
+ *
+ * Clocks and expiry times are carried over as absolute times of the
+ * monotonic clock, so they keep running through the handoff.  Spectators
+ * stay connected, but must watch their games again.
+ *
+ * The upgrade socket is a SOCK_SEQPACKET socket, and each message on it is
+ * one record: a line of tab-separated fields, the first of which says what
+ * it describes.  Records that carry a descriptor have it attached.
+ */
+
+/*
+ * How long the old server waits for its service threads to park.
+ */
+#define HANDOFF_QUIESCE_MS 2000
+
+/*
+ * Open the upgrade socket, replacing any that is left over at the path.
+ *
+ * @param path  The path of the upgrade socket.
+ * @return the listening socket, or -1 on error.
+ */
+int handoff_listen(char *path);
+
+/*
+ * Connect to the upgrade socket of a running server.
+ *
+ * @param path  The path of the upgrade socket.
+ * @return the connected socket, or -1 if there is no server to take
+ * over from.
+ */
+int handoff_connect(char *path);
+
+/*
+ * The listening sockets for client connections: over TCP, and on a local
+ * and a shared-memory socket (see local.h).  Those a server does not
+ * have are -1.
+ */
+typedef struct handoff_listeners {
+	int tcp;
+	int local;
+	int shm;
+} HANDOFF_LISTENERS;
+
+/*
+ * Hand this server over to the new server that has connected to the
+ * upgrade socket.  If this succeeds, the caller must exit without
+ * shutting down any connections.
+ *
+ * @param sock  The connection from the new server.
+ * @param listeners  The listening sockets for client connections.
+ * @return 0 if the new server has taken over, or -1 if the handoff
+ * failed and this server is to carry on.
+ */
+int handoff_send(int sock, HANDOFF_LISTENERS *listeners);
+
+/*
+ * Take over from the server at the other end of the upgrade socket,
+ * rebuilding its players, clients, invitations and games.  The clients
+ * are not served until handoff_start_sessions() is called, which must
+ * not be before the game archive has been opened.
+ *
+ * @param sock  The connection to the old server.
+ * @param listeners  Set to the listening sockets of the old server.
+ * @return 0 if successful, or -1 if the handoff failed.
+ */
+int handoff_receive(int sock, HANDOFF_LISTENERS *listeners);
+
+/*
+ * Start a session (see coro.h) for each client taken over by handoff_receive().
+ */
+void handoff_start_sessions(void);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef INVITATION_EXT_H
+#define INVITATION_EXT_H
+
+#include <stdint.h>
+
+#include "invitation.h"
+
+/*
+ * Extensions to the INVITATION module.
+ */
+
+/*
+ * Give an open INVITATION a time to live.  When it runs out, the
+ * specified function is called from the timer thread, unless the
+ * invitation has been accepted or closed in the meantime.  A reference
+ * to the INVITATION is held while the expiry is pending, and the function
+ * must not keep the reference it is passed after it returns.
+ *
+ * Because an expiry that is already running cannot be stopped, the
+ * function may still be called just after the invitation has been
+ * accepted or closed; it must check the state of the invitation, for
+ * example by calling inv_close().
+ *
+ * @param inv  The INVITATION that is to expire.
+ * @param ttl_ms  The time to live, in milliseconds.
+ * @param expired  The function to be called when the invitation expires.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_set_expiry(INVITATION *inv, uint64_t ttl_ms, void (*expired)(INVITATION *));
+
+/*
+ * Give an open INVITATION an absolute expiry time, like inv_set_expiry().
+ *
+ * @param inv  The INVITATION that is to expire.
+ * @param when_ms  When it expires, in timer_now_ms() time.
+ * @param expired  The function to be called when the invitation expires.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_set_expiry_at(INVITATION *inv, uint64_t when_ms, void (*expired)(INVITATION *));
+
+/*
+ * Get the time at which an open INVITATION expires.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @return the expiry time in timer_now_ms() time, or 0 if it does not
+ * expire.
+ */
+uint64_t inv_get_expiry(INVITATION *inv);
+
+/*
+ * Record the time control under which the GAME of an INVITATION is to be
+ * played, if it is accepted.
+ *
+ * @param inv  The INVITATION.
+ * @param base_ms  Each player's initial time, in milliseconds.
+ * @param increment_ms  The time added after each move, in milliseconds.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_set_time_control(INVITATION *inv, uint64_t base_ms, uint64_t increment_ms);
+
+/*
+ * Get the time control of an INVITATION.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @param base_ms  Variable into which the initial time is stored.
+ * @param increment_ms  Variable into which the increment is stored.
+ * @return 1 if the invitation has a time control, otherwise 0.
+ */
+int inv_get_time_control(INVITATION *inv, uint64_t *base_ms, uint64_t *increment_ms);
+
+/*
+ * Put a newly created INVITATION straight into the ACCEPTED state with
+ * an existing GAME, as when a game in progress is carried over from
+ * another server process.  The INVITATION takes over the caller's
+ * reference to the GAME.
+ *
+ * @param inv  The INVITATION, which must be in the OPEN state.
+ * @param game  The GAME in progress.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_adopt_game(INVITATION *inv, GAME *game);
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef JIO_H
+#define JIO_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The jio module does the reading and writing on client connections, so
+ * that the protocol code need not know whether it is running in a
+ * coroutine (see coro.h) or in a thread of its own.
+ *
+ * A coroutine that finds nothing to read lets the other coroutines of its
+ * thread run until its connection becomes readable.  Writes do not give
+ * up the thread, since they are made under the destination client's lock,
+ * and they do not wait for it either: jio_try_writev() writes what the
+ * connection takes at once and leaves the rest to the caller, which keeps
+ * it for the connection's own coroutine to write once the connection
+ * takes more (see client_flush() in client_ext.h).  Outside coroutines,
+ * reads and writes simply block.
+ *
+ * What is read from a socket is buffered, so that the several reads the
+ * protocol code makes for a packet, and for each of a run of pipelined
+ * packets, take only one system call.  Since the buffered data would not
+ * go along with the socket if it were handed over to another process
+ * (see handoff.h), jio_readable() counts it as data to read.
+ *
+ * Connections from local clients may carry their data through shared
+ * memory rather than the socket (see local.h), which is also taken care
+ * of here.  Anything that shuts down or closes a client connection must
+ * therefore do so through this module.
+ */
+
+/*
+ * Read from a connection, like read(2).
+ *
+ * @param fd  The connection.
+ * @param buf  The buffer into which to read.
+ * @param n  The most bytes to read.
+ * @return the number of bytes read, 0 at end of file, or -1 on error.
+ */
+ssize_t jio_read(int fd, void *buf, size_t n);
+
+/*
+ * Write the whole of a buffer to a connection.
+ *
+ * @param fd  The connection.
+ * @param buf  The data to write.
+ * @param n  The number of bytes to write.
+ * @return n, or -1 if the connection failed, as for jio_writev().
+ */
+ssize_t jio_write(int fd, const void *buf, size_t n);
+
+/*
+ * The most buffers that jio_writev() takes.
+ */
+#define JIO_MAX_IOV 16
+
+/*
+ * Write the whole of several buffers to a connection, like writev(2), in
+ * as few system calls as the connection takes.  A coroutine does not wait
+ * for a connection that takes less than the whole: the write fails, and
+ * the connection is shut down if only part of the data went out.
+ *
+ * @param fd  The connection.
+ * @param iov  The buffers.
+ * @param iovcnt  The number of buffers, at most JIO_MAX_IOV.
+ * @return the total size of the buffers, or -1 if the connection failed,
+ * with errno set to EAGAIN if it would have had to wait.
+ */
+ssize_t jio_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Write as much of several buffers to a connection as it takes without
+ * waiting.  A connection that goes through shared memory takes the whole.
+ *
+ * @param fd  The connection.
+ * @param iov  The buffers.
+ * @param iovcnt  The number of buffers, at most JIO_MAX_IOV.
+ * @return the number of bytes written, which may be less than the total
+ * size of the buffers, or -1 if the connection failed.
+ */
+ssize_t jio_try_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Say whether there is data to read from a connection without going to
+ * its socket: either data already buffered, or data of a connection that
+ * does not go through its socket.  In the latter case, if there is none,
+ * any that comes later makes the socket readable, so the caller can go on
+ * to wait for that; but the socket may then also become readable with
+ * nothing to read, so the caller must ask again once it has.
+ *
+ * @param fd  The connection.
+ * @return 1 if there is data to read (or the connection has ended), 0 if
+ * not, or -1 if there is none buffered and the connection's data goes
+ * through its socket, which is then to be asked instead.
+ */
+int jio_readable(int fd);
+
+/*
+ * Shut down a connection, like shutdown(2).
+ *
+ * @param fd  The connection.
+ * @param how  SHUT_RD, SHUT_WR or SHUT_RDWR.
+ * @return 0 if successful, otherwise -1.
+ */
+int jio_shutdown(int fd, int how);
+
+/*
+ * Close a connection, like close(2).
+ *
+ * @param fd  The connection.
+ * @return 0 if successful, otherwise -1.
+ */
+int jio_close(int fd);
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The local module lets clients on the same host as the server, such as
+ * bots and tournament runners, connect without going through TCP.
+ *
+ * A local socket is a Unix domain stream socket over which clients speak
+ * the same protocol as over TCP.
+ *
+ * A shared-memory socket is a Unix domain stream socket for trusted
+ * clients, created so that only the server's user may connect to it.  As
+ * soon as a client connects, the server sends it a single byte with a
+ * memfd attached as SCM_RIGHTS ancillary data.  The memfd holds a
+ * LOCAL_SHM: two single-producer, single-consumer rings of bytes, one in
+ * each direction, through which the packets then go, exactly as they
+ * would go over the socket.  The socket itself stays open for as long as
+ * the client is connected, and is only used for the two sides to wake each
+ * other up, and to tell when the other has gone away:
+ *
+ *   - A producer copies bytes into the ring at tail modulo LOCAL_RING_SIZE
+ *     and then advances tail; a consumer copies bytes out at head and then
+ *     advances head.  head and tail only ever increase, wrapping around at
+ *     2^32, and the ring is full when tail - head == LOCAL_RING_SIZE.
+ *   - A consumer that has found its ring empty and is about to wait sets
+ *     sleeping, then looks at tail once more before it waits for its
+ *     socket to become readable.
+ *   - A producer that has advanced tail, and finds sleeping set, clears
+ *     it and sends one byte, of any value, over the socket.  Those bytes
+ *     carry nothing, and a consumer reads and discards them.
+ *
+ * All accesses to head, tail and sleeping must be sequentially consistent.
+ * A client that wants to leave closes its socket, as usual.  A server that
+ * is handed over to a new one (see handoff.h) hands its shared-memory
+ * clients over with their memfds, so they notice nothing.
+ */
+
+/*
+ * The size of each ring.
+ */
+#define LOCAL_RING_SIZE (256 * 1024)
+
+/*
+ * What a LOCAL_SHM starts with.
+ */
+#define LOCAL_SHM_MAGIC "JEUXSHM1"
+
+#define LOCAL_CACHE_LINE 64
+
+typedef struct local_ring {
+	uint32_t head __attribute__((aligned(LOCAL_CACHE_LINE)));
+	uint32_t tail __attribute__((aligned(LOCAL_CACHE_LINE)));
+	uint32_t sleeping __attribute__((aligned(LOCAL_CACHE_LINE)));
+	char data[LOCAL_RING_SIZE] __attribute__((aligned(LOCAL_CACHE_LINE)));
+} LOCAL_RING;
+
+typedef struct local_shm {
+	char magic[8];
+	uint32_t ringSize;              //LOCAL_RING_SIZE
+	LOCAL_RING toServer __attribute__((aligned(LOCAL_CACHE_LINE)));
+	LOCAL_RING toClient;
+} LOCAL_SHM;
+
+/*
+ * Open a local or shared-memory socket, replacing any that is left over
+ * at the path.
+ *
+ * @param path  The path of the socket.
+ * @param shm  Nonzero for a shared-memory socket.
+ * @return the listening socket, or -1 on error.
+ */
+int local_listen(char *path, int shm);
+
+/*
+ * Thread function for a connection taken on a shared-memory socket.  It
+ * sets up the rings and then serves the client like
+ * jeux_client_service().
+ *
+ * @param arg  Pointer to the connection, in malloc'd storage.
+ * @return NULL
+ */
+void *local_shm_service(void *arg);
+
+/*
+ * Find the memfd of a connection's rings, for handing it over to a new
+ * server.
+ *
+ * @param fd  The connection.
+ * @return the memfd, or -1 if the connection does not use shared memory.
+ */
+int local_shm_fd(int fd);
+
+/*
+ * Make a connection taken over from another server use the rings it used
+ * there.
+ *
+ * @param fd  The connection.
+ * @param memfd  The memfd of its rings, which is taken over.
+ * @return 0 if successful, otherwise -1.
+ */
+int local_shm_adopt(int fd, int memfd);
+
+/*
+ * The following are for the jio module, through which all reading and
+ * writing on a shared-memory connection goes.  They take the connection,
+ * and do nothing and return LOCAL_NOT_SHM if it does not use shared memory.
+ */
+#define LOCAL_NOT_SHM (-2)
+
+/*
+ * Read, like jio_read().
+ */
+ssize_t local_read(int fd, void *buf, size_t n);
+
+/*
+ * Write all of a buffer, like jio_write().
+ */
+ssize_t local_write(int fd, const void *buf, size_t n);
+
+/*
+ * Say whether there is something to read, or the connection has ended;
+ * if not, see to it that the socket becomes readable when there is.
+ *
+ * @return 1 or 0.
+ */
+int local_readable(int fd);
+
+/*
+ * Stop the rings in either or both directions, like shutdown(2).
+ *
+ * @return 0.
+ */
+int local_shutdown(int fd, int how);
+
+/*
+ * Stop using the rings before the connection is closed.
+ *
+ * @return 0.
+ */
+int local_detach(int fd);
+
+#endif
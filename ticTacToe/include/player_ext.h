@@ -0,0 +1,114 @@
+#ifndef PLAYER_EXT_H
+#define PLAYER_EXT_H
+
+#include <stdint.h>
+
+#include "player.h"
+
+/*
+ * Extensions to the PLAYER module.
+ */
+
+/*
+ * Set the rating of a PLAYER, as when restoring saved ratings.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, int rating);
+
+/*
+ * The rating systems by which results are rated.
+ */
+typedef enum {
+    PLAYER_RATING_ELO,          //player_post_result() updates the ratings at once
+    PLAYER_RATING_GLICKO2       //results are rated in rating periods (see glicko.h)
+} PLAYER_RATING_SYSTEM;
+
+/*
+ * The rating system in use, which is chosen at startup and never changes
+ * after that.
+ */
+extern PLAYER_RATING_SYSTEM player_rating_system;
+
+/*
+ * Ratings are kept unrounded; player_get_rating() rounds them to the
+ * nearest whole point.  Reading a rating or rating deviation takes no
+ * lock, so it never waits for a rating change, and the two ratings
+ * changed by a result are changed together.
+ */
+
+/*
+ * Get the rating of a player, unrounded.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the rating of the player.
+ */
+double player_get_rating_exact(PLAYER *player);
+
+/*
+ * Post the result of a game, like player_post_result(), and report the
+ * ratings from just before and just after, as they were while both
+ * ratings were being changed.  Under Glicko-2, where the result is not
+ * rated until the end of the rating period, the ratings after are the
+ * same as those before.
+ *
+ * @param player1  One of the PLAYERs that is to be updated.
+ * @param player2  The other PLAYER that is to be updated.
+ * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
+ * @param before  Set to the ratings of player1 and player2 before, or NULL.
+ * @param after  Set to the ratings of player1 and player2 after, or NULL.
+ */
+void player_post_result_ratings(PLAYER *player1, PLAYER *player2, int result,
+                                double before[2], double after[2]);
+
+/*
+ * Set the rating of a PLAYER to an unrounded value, as when restoring
+ * saved ratings or re-rating from the game archive.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ */
+void player_set_rating_exact(PLAYER *player, double rating);
+
+/*
+ * Get the Glicko-2 rating deviation of a player.  Under Elo, it stays at
+ * GLICKO_INITIAL_DEVIATION, unless set otherwise.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the rating deviation of the player.
+ */
+double player_get_deviation(PLAYER *player);
+
+/*
+ * Get the rating, rating deviation and volatility of a player, all as of
+ * the same moment.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @param rating  Set to the rating.
+ * @param deviation  Set to the rating deviation.
+ * @param volatility  Set to the volatility.
+ */
+void player_get_glicko(PLAYER *player, double *rating, double *deviation, double *volatility);
+
+/*
+ * Set the rating, rating deviation and volatility of a player, as at the
+ * end of a rating period or when restoring saved ratings.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ * @param deviation  The new rating deviation.
+ * @param volatility  The new volatility.
+ */
+void player_set_glicko(PLAYER *player, double rating, double deviation, double volatility);
+
+/*
+ * Get a number that changes whenever the rating of some PLAYER changes.
+ * It is only bumped once the change has been made, so anything built from
+ * the ratings after reading a given number is at least as recent as it.
+ *
+ * @return the number of rating changes so far.
+ */
+uint64_t player_rating_version(void);
+
+#endif
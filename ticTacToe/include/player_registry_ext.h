@@ -0,0 +1,56 @@
+#ifndef PLAYER_REGISTRY_EXT_H
+#define PLAYER_REGISTRY_EXT_H
+
+#include "player_registry.h"
+
+/*
+ * Extensions to the player registry.
+ *
+ * The ratings of all registered players can be saved to a file and
+ * restored from it when the server next starts.  The file is plain text
+ * with one line per player, consisting of the username, a tab character
+ * and the rating, unrounded, followed by another tab, the Glicko-2 rating
+ * deviation, a tab and the volatility.  Files without the last two, or
+ * with whole-point ratings, as written by earlier servers, are read as
+ * well.  Players whose names contain a tab or a newline are
+ * not saved.
+ */
+
+/*
+ * Save the ratings of all registered players.  The file is written under
+ * a temporary name, synced and then renamed into place, so a crash never
+ * leaves a partially written file behind.
+ *
+ * @param preg  The player registry.
+ * @param path  The file to be written.
+ * @return 0 if successful, otherwise -1.
+ */
+int preg_save(PLAYER_REGISTRY *preg, char *path);
+
+/*
+ * Register every player listed in a ratings file with the rating saved
+ * for it.  A missing file is not an error.
+ *
+ * @param preg  The player registry.
+ * @param path  The file to be read.
+ * @return the number of players loaded, or -1 on error.
+ */
+int preg_load(PLAYER_REGISTRY *preg, char *path);
+
+/*
+ * The most players a registry can hold.
+ */
+#define PREG_MAX_PLAYERS 1000
+
+/*
+ * Get all registered players.  The reference count of each of them is
+ * incremented to account for the returned pointer.
+ *
+ * @param preg  The player registry.
+ * @param players  Caller-supplied array into which the players are stored.
+ * @param max  Size of the players array.
+ * @return the number of players stored.
+ */
+int preg_snapshot(PLAYER_REGISTRY *preg, PLAYER **players, int max);
+
+#endif
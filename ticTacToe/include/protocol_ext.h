@@ -0,0 +1,371 @@
+#ifndef PROTOCOL_EXT_H
+#define PROTOCOL_EXT_H
+
+#include "protocol.h"
+
+/*
+ * Extensions to the "Jeux" protocol.
+ *
+ * protocol.h is fixed, so packet types added to the protocol after the
+ * original set are declared here.  They are numbered after the last
+ * original packet type, so that a client that only knows the original
+ * protocol never sees them unless it sends one of the new requests.
+ *
+ * Client-to-server requests:
+ *   LOGIN:    As in the original protocol, except that the username in
+ *             the payload may be followed by a null character and a
+ *             capability offer: the version of the protocol that the
+ *             client speaks, followed by the names of the capabilities
+ *             (see below) that it supports, all separated by spaces.
+ *             Names the server does not know are ignored.
+ *   INVITE:   As in the original protocol, except that the username in
+ *             the payload may be followed by optional fields, each
+ *             preceded by a tab character:
+ *               - the invitation's time to live in seconds (0 for none;
+ *                 empty for the server's default, set with the -i option).
+ *                 An invitation that is still open when its time to live
+ *                 runs out is withdrawn: the source is sent DECLINED and
+ *                 the target is sent REVOKED, as if each had been done by
+ *                 the other side.
+ *               - a time control "base" or "base+increment", in
+ *                 milliseconds.  The game is then played with a clock for
+ *                 each player, which starts with base, runs while it is
+ *                 that player's turn and gains increment after each of
+ *                 their moves.  A player whose time runs out loses: both
+ *                 players are sent ENDED, with the winner in the role field.
+ *   USERS_PAGE: Request one page of the currently logged-in users,
+ *             in username order.
+ *             Payload: query string (see below)
+ *   WATCH:    Watch a game in progress as a spectator
+ *             Payload: '#' followed by the decimal game ID, or the
+ *                      username of a player whose most recent game is
+ *                      to be watched
+ *   UNWATCH:  Stop watching a game
+ *             Header: watch ID assigned by the server
+ *   BOARD_FORMAT: Select the encoding of game states sent to this client
+ *             Header: role holds the GAME_ENCODING (see game_ext.h)
+ *   HISTORY:  Request a player's most recent completed games from the
+ *             game archive.
+ *             Payload: query string (see below)
+ *   PING:     Check that the connection is alive.  Accepted at any time,
+ *             even before LOGIN.  Answered with PONG.
+ *   PONG:     Answer to a PING from the server.
+ *             Header: the timestamp fields copied unchanged from the PING
+ *   BATCH:    Carry out several requests, one after the other, with a
+ *             single response.
+ *             Payload: the requests, at most JEUX_BATCH_MAX_ITEMS of them,
+ *                      each as a packet header followed by its payload,
+ *                      just as it would be sent on its own, except that
+ *                      it may be neither a BATCH nor tagged with
+ *                      JEUX_SEQ_FLAG.  The timestamp fields are ignored.
+ *   RATING_HISTORY: Request the ratings a player has had after each rated
+ *             result, for charting.
+ *             Payload: query string (see below)
+ *
+ * Server-to-client responses (synchronous):
+ *   ACK (for LOGIN request with a capability offer)
+ *             Payload: the server's protocol version, followed by the
+ *                      names of the capabilities it has granted, which
+ *                      are those of the offer that it supports, in the
+ *                      same format as the offer.
+ *   ACK (for USERS_PAGE request)
+ *             Header: role is nonzero if the page was cut short and
+ *                     further matching users may follow.
+ *             Payload: the cursor for the next page, terminated by a
+ *                      newline (an empty line if the listing is
+ *                      complete), followed by one line for each user,
+ *                      in the same format as the USERS response.
+ *   ACK (for WATCH request)
+ *             Header: watch ID
+ *             Payload: game ID, terminated by a newline, followed by
+ *                      the current game state
+ *   ACK (for MOVE request in a game with a time control)
+ *             Payload: the time left on the first and second players'
+ *                      clocks, in milliseconds, separated by a tab.
+ *   ACK (for HISTORY request)
+ *             Payload: one line for each game, newest first, with the
+ *                      following fields separated by tab characters:
+ *                      game ID, end time (milliseconds since the epoch),
+ *                      first player, second player, result (0 draw,
+ *                      1 first player won, 2 second player won), reason
+ *                      (0 normal, 1 resignation, 2 time), and the cells played,
+ *                      in order, as a string of digits 1-9 in the
+ *                      notation used by MOVE.
+ *             A NACK is sent if the server is not keeping an archive.
+ *   ACK (for RATING_HISTORY request)
+ *             Payload: one line for each rating, oldest first, with the
+ *                      time it was given (milliseconds since the epoch)
+ *                      and the rating, to two decimal places, separated
+ *                      by a tab.
+ *
+ *   PONG (for PING request)
+ *             Header: the timestamp fields copied unchanged from the PING
+ *   ACK (for BATCH request)
+ *             Header: id is the number of requests carried out; role is
+ *                     nonzero if some of the responses in the payload
+ *                     were cut short.
+ *             Payload: for each request, in order, the response that it
+ *                      would have been sent on its own: the header of an
+ *                      ACK, NACK or PONG packet followed by its payload.
+ *                      A request to which no response is due, such as a
+ *                      PONG, gets an ACK with no payload.  The payload of
+ *                      a response that does not fit in the ACK is left
+ *                      out, and its size field set to 0.
+ *             A NACK is sent, and none of the requests carried out, if
+ *             the payload is not made up of well-formed requests.
+ *             Notifications brought about by the requests may be sent
+ *             before the ACK.
+ *
+ * Server-to-client notifications (asynchronous):
+ *   The game state payloads of ACCEPTED and MOVED notifications, and of
+ *   the ACK for ACCEPT and WATCH requests, use the encoding selected by
+ *   the client with BOARD_FORMAT.  Until one is selected, the original
+ *   ASCII board is sent.
+ *   PING:     Sent when nothing has been received from the client for
+ *             half of the server's idle timeout (set with the -k option).
+ *             The client must answer with PONG; a connection from which
+ *             nothing at all is received for the whole timeout is closed.
+ *             The server measures the round trip from the echoed
+ *             timestamp, and once it has an estimate, reports it in
+ *             the payload.
+ *             Payload: smoothed round-trip time and its mean deviation,
+ *                      in microseconds, separated by a tab (empty if
+ *                      there is no estimate yet)
+ *   MOVED and ENDED are also sent to the spectators of a game.  In that
+ *   case the header ID is the watch ID rather than an invitation ID.
+ *   Watch IDs start at JEUX_WATCH_ID_BASE, so they never collide with
+ *   invitation IDs.
+ *
+ * Capabilities:
+ *   A client that makes no capability offer at LOGIN is served exactly
+ *   as under the original protocol, while one that does gets what it
+ *   was granted, from then until it disconnects:
+ *     binary-board   Game states are sent in GAME_ENC_DELTA from the
+ *                    start, rather than as the ASCII board (see
+ *                    BOARD_FORMAT, which can still change it).
+ *     pipeline       Requests may be tagged (see Pipelining, below).
+ *     batch          BATCH requests may be sent.
+ *     large-payload  A response whose payload is too large for the size
+ *                    field is sent in fragments, each an ACK of its own
+ *                    that has JEUX_MORE_FLAG set in its type, except for
+ *                    the last; the client joins their payloads together.
+ *                    Without it, such payloads are cut short.
+ *     compress       The payload of an ACK may be sent compressed, which
+ *                    is marked by JEUX_ZLIB_FLAG in its type.  It is then
+ *                    a zlib stream (RFC 1950) made with the preset
+ *                    dictionary JEUX_COMPRESS_DICTIONARY, and the size
+ *                    field is that of the compressed payload.  A payload
+ *                    that is also sent in fragments is compressed as a
+ *                    whole: the flag is set on each fragment, and the
+ *                    fragments are joined before being inflated.
+ *     notify-batch   Notifications may be sent together in one packet.
+ *   pipeline and batch are granted to any client that asks, and BATCH and
+ *   tagged requests are accepted even from clients that do not ask;
+ *   notify-batch is not granted by this server.
+ *
+ * Pipelining:
+ *   A client may set JEUX_SEQ_FLAG in the type of any request.  The header
+ *   is then followed by a 4-byte sequence number, in network byte order,
+ *   which is not counted in the size field, and only then by the payload.
+ *   The ACK, NACK or PONG sent in response has JEUX_SEQ_FLAG set in its
+ *   type and is followed by the same sequence number.  The server reads
+ *   and answers requests in the order they arrive, so a client that tags
+ *   its requests need not wait for each response before sending the next
+ *   request, and can still tell which request a response belongs to, even
+ *   with notifications in between.  Requests that are not tagged are
+ *   answered with untagged responses, as before.
+ */
+
+/*
+ * Packet types added by the extensions.
+ */
+typedef enum {
+    JEUX_USERS_PAGE_PKT = JEUX_ENDED_PKT + 1,
+    JEUX_WATCH_PKT,
+    JEUX_UNWATCH_PKT,
+    JEUX_BOARD_FORMAT_PKT,
+    JEUX_HISTORY_PKT,
+    JEUX_PING_PKT,
+    JEUX_PONG_PKT,
+    JEUX_BATCH_PKT,
+    JEUX_RATING_HISTORY_PKT
+} JEUX_PACKET_TYPE_EXT;
+
+/*
+ * The bit of the type field that marks a packet whose header is followed
+ * by a sequence number.
+ */
+#define JEUX_SEQ_FLAG 0x80
+
+/*
+ * The bit of the type field that marks a fragment of a payload which is
+ * continued in the next packet.
+ */
+#define JEUX_MORE_FLAG 0x40
+
+/*
+ * The bit of the type field that marks a compressed payload.
+ */
+#define JEUX_ZLIB_FLAG 0x20
+
+/*
+ * The preset dictionary for compressed payloads, made of the pieces that
+ * USERS and HISTORY listings are mostly made of.  It does not include the
+ * terminating null character.
+ */
+#define JEUX_COMPRESS_DICTIONARY \
+    "\t0\t0\t\t0\t1\t\t1\t0\t\t1\t1\t\t2\t0\t\t2\t1\t\t1\t2\t\t2\t2\t" \
+    "123456789\t17\t\t" \
+    "\t1300\n\t1350\n\t1400\n\t1450\n\t1550\n\t1600\n\t1650\n\t1700\n" \
+    "\t1468\n\t1532\n\t1484\n\t1516\n\t1500\n"
+
+/*
+ * The version of the protocol described here.  The original protocol is
+ * version 1.
+ */
+#define JEUX_PROTOCOL_VERSION 2
+
+/*
+ * Capabilities, as bits of a mask.
+ */
+typedef enum {
+    JEUX_CAP_BINARY_BOARD = 1 << 0,
+    JEUX_CAP_PIPELINE = 1 << 1,
+    JEUX_CAP_BATCH = 1 << 2,
+    JEUX_CAP_LARGE_PAYLOAD = 1 << 3,
+    JEUX_CAP_COMPRESS = 1 << 4,
+    JEUX_CAP_NOTIFY_BATCH = 1 << 5
+} JEUX_CAPABILITY;
+
+#define JEUX_CAP_COUNT 6
+
+/*
+ * The longest capability list, including the version and the terminating
+ * null character.
+ */
+#define JEUX_CAP_MAX_LIST 128
+
+/*
+ * The most requests a BATCH packet may carry.
+ */
+#define JEUX_BATCH_MAX_ITEMS 64
+
+/*
+ * The first watch ID.  Invitation IDs are below MAX_CLIENTS.
+ */
+#define JEUX_WATCH_ID_BASE 64
+
+/*
+ * The USERS_PAGE query string consists of the following fields,
+ * separated by tab characters.  Trailing fields may be omitted and
+ * any field may be left empty to take its default value.
+ *
+ *   cursor     Username after which the page starts (exclusive).
+ *              Empty to start from the beginning.
+ *   limit      Maximum number of users to return.
+ *   prefix     Only users whose name begins with this string.
+ *   min        Only users with at least this rating.
+ *   max        Only users with at most this rating.
+ *   mindev     Only users whose Glicko-2 rating deviation is at least
+ *              this, such as new players whose ratings are still
+ *              uncertain, who are best paired with each other or used to
+ *              pin down their ratings quickly.
+ *   maxdev     Only users whose rating deviation is at most this, whose
+ *              ratings can be trusted for close pairings.
+ *   Rating deviations only change under Glicko-2 (see glicko.h).
+ */
+#define JEUX_USERS_PAGE_DEFAULT_LIMIT 50
+#define JEUX_USERS_PAGE_MAX_LIMIT 500
+
+/*
+ * The HISTORY query string consists of the following fields, separated
+ * by tab characters, in the same way as the USERS_PAGE query string.
+ *
+ *   player     Username whose games are wanted.  Empty for the
+ *              requesting client's own games.
+ *   limit      Maximum number of games to return.
+ *   opponent   Only games against this username (head-to-head).
+ */
+#define JEUX_HISTORY_DEFAULT_LIMIT 10
+#define JEUX_HISTORY_MAX_LIMIT 100
+
+/*
+ * The RATING_HISTORY query string consists of the following fields, in
+ * the same way as the USERS_PAGE query string.
+ *
+ *   player     Username whose ratings are wanted.  Empty for the
+ *              requesting client's own.
+ *   limit      Maximum number of ratings to return, the most recent.
+ *   since      Only ratings given at or after this time, in
+ *              milliseconds since the epoch.
+ */
+#define JEUX_RATING_HISTORY_DEFAULT_LIMIT 100
+#define JEUX_RATING_HISTORY_MAX_LIMIT 2000
+
+/*
+ * Parse a capability offer, or the list of capabilities granted.
+ *
+ * @param list  The capability list, which is not modified.
+ * @param version  Set to the protocol version at the start of the list.
+ * @return the mask of the capabilities named, leaving out unknown names.
+ */
+unsigned proto_parse_caps(const char *list, int *version);
+
+/*
+ * Write out a capability list, as sent in response to an offer.
+ *
+ * @param caps  The mask of the capabilities.
+ * @param buf  Buffer for the list, of at least JEUX_CAP_MAX_LIST bytes.
+ * @return the length of the list, not counting the terminating null
+ * character.
+ */
+size_t proto_format_caps(unsigned caps, char *buf);
+
+/*
+ * Send a packet, like proto_send_packet(), tagged with a sequence number.
+ *
+ * @param fd  The file descriptor on which the packet is to be sent.
+ * @param hdr  The fixed-size packet header, with multi-byte fields
+ * in network byte order.  JEUX_SEQ_FLAG is set in its type if seq is given.
+ * @param seq  The sequence number, or NULL to send an untagged packet.
+ * @param data  The payload, if any.
+ * @return  0 in case of successful transmission, -1 otherwise.
+ */
+int proto_send_packet_seq(int fd, JEUX_PACKET_HEADER *hdr, uint32_t *seq, void *data);
+
+/*
+ * Lay out a packet in memory exactly as proto_send_packet_seq() would send
+ * it, so that it can be sent later together with others.
+ *
+ * @param hdr  The fixed-size packet header, as for proto_send_packet_seq().
+ * @param seq  The sequence number, or NULL for an untagged packet.
+ * @param data  The payload, if any.
+ * @param buf  Storage for the packet, of at least
+ * proto_packed_size(hdr, seq) bytes.
+ * @return the length of the packet.
+ */
+size_t proto_pack_packet_seq(JEUX_PACKET_HEADER *hdr, uint32_t *seq, void *data, void *buf);
+
+/*
+ * The length of a packet laid out by proto_pack_packet_seq().
+ */
+size_t proto_packed_size(JEUX_PACKET_HEADER *hdr, uint32_t *seq);
+
+/*
+ * Receive a packet, like proto_recv_packet(), that may be tagged with a
+ * sequence number.  JEUX_SEQ_FLAG is cleared from the type in the header
+ * that is returned.
+ *
+ * @param fd  The file descriptor from which the packet is to be received.
+ * @param hdr  Pointer to caller-supplied storage for the fixed-size
+ * packet header.
+ * @param seq  Set to the sequence number, in host byte order, if the
+ * packet is tagged.  May be NULL if the caller has no use for it.
+ * @param tagged  Set to 1 if the packet is tagged, otherwise 0.  May be NULL.
+ * @param payloadp  Pointer to a variable into which to store a pointer
+ * to the payload, or NULL if there is none.
+ * @return  0 in case of successful reception, -1 otherwise.
+ */
+int proto_recv_packet_seq(int fd, JEUX_PACKET_HEADER *hdr, uint32_t *seq, int *tagged, void **payloadp);
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef RATING_HISTORY_H
+#define RATING_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The rating history module keeps, for each player, the series of ratings
+ * the player has had after each rated result, for charting.
+ *
+ * The points recorded since a player's series was last spilled are kept in
+ * memory in two columns of bytes, each point taking a few bytes:
+ *
+ *   times    The time of each point, in milliseconds since the epoch,
+ *            as the difference between its distance from the point before
+ *            and that point's distance from the one before it, taken as
+ *            zero for the first point, so that evenly spaced points cost
+ *            one byte each.
+ *   ratings  The rating of each point, in hundredths of a point, as the
+ *            difference from the rating of the point before.
+ *
+ * Both are zigzag-encoded, so that small negative differences are small
+ * numbers too, and written as varints: seven bits to a byte, least
+ * significant first, with the top bit set on every byte but the last.
+ * The first point of a series is kept as it is.
+ *
+ * If the module was given a directory, a background thread appends the
+ * series to files in it every RHIST_SPILL_MS, and the memory they took is
+ * freed.  Each player has a file "HHHHHHHH.rts", named by the hash of the
+ * player's name (see archive_name_hash()), made up of blocks, each a
+ * series as it was in memory when it was spilled:
+ *
+ *   offset  size
+ *   0       4     magic RHIST_MAGIC
+ *   4       2     length N of the player's name
+ *   6       4     number of points
+ *   10      4     length T of the times column
+ *   14      4     length R of the ratings column
+ *   18      8     time of the first point
+ *   26      4     rating of the first point, in hundredths
+ *   30      N     the player's name
+ *   30+N    T     the times column
+ *   30+N+T  R     the ratings column
+ *
+ * All fixed-size fields are in network byte order.  Players whose names
+ * collide share a file, and their blocks are told apart by name.
+ */
+
+#define RHIST_MAGIC 0x4a525431          /* "JRT1" */
+#define RHIST_BLOCK_FIXED 30
+
+#define RHIST_SPILL_MS (60 * 1000)
+
+/*
+ * A point of a player's rating history.
+ */
+typedef struct rhist_point {
+	uint64_t time_ms;
+	int32_t rating;                 //hundredths of a point
+} RHIST_POINT;
+
+/*
+ * Start keeping rating histories.
+ *
+ * @param dir  The directory into which the histories are spilled, which is
+ * created if necessary, or NULL to keep them in memory only.
+ * @return 0 if successful, otherwise -1.
+ */
+int rhist_init(char *dir);
+
+/*
+ * Spill the histories that are in memory, and stop spilling them.
+ */
+void rhist_fini(void);
+
+/*
+ * Spill the histories that are in memory now, as before a handoff.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int rhist_spill(void);
+
+/*
+ * Add a point to a player's rating history.  Nothing waits for the disk.
+ *
+ * @param name  The player's name.
+ * @param time_ms  When the player got the rating, in milliseconds since
+ * the epoch.
+ * @param rating  The rating.
+ */
+void rhist_record(char *name, uint64_t time_ms, double rating);
+
+/*
+ * Get the most recent points of a player's rating history.
+ *
+ * @param name  The player's name.
+ * @param since_ms  The earliest time of a point to include.
+ * @param points  Caller-supplied array into which the points are stored,
+ * oldest first.
+ * @param max  Size of the points array.
+ * @return the number of points stored, or -1 on error.
+ */
+int rhist_query(char *name, uint64_t since_ms, RHIST_POINT *points, int max);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SERVER_EXT_H
+#define SERVER_EXT_H
+
+#include "server.h"
+
+/*
+ * Extensions to the server module.
+ *
+ * When the server hands its clients over to another server process, the
+ * service threads must first stop reading from their connections, so that
+ * whatever the clients send next is left for the new process to read.
+ * A service thread only stops between packets, after it has finished with
+ * the last request it read; this is called parking.
+ */
+
+/*
+ * Park every service thread.  The threads park as soon as they have
+ * finished with the request they are working on.  A thread that is stuck,
+ * for example in a send to a client that is not reading, or in the
+ * middle of receiving a packet, keeps the server from being quiesced.
+ *
+ * @param timeout_ms  How long to wait for the threads to park.
+ * @return 0 if every service thread is parked, otherwise -1, in which
+ * case the threads that did park are let go again.
+ */
+int server_quiesce(int timeout_ms);
+
+/*
+ * Let the service threads parked by server_quiesce() carry on.
+ */
+void server_resume(void);
+
+/*
+ * Thread function for a thread that takes over the service of a client
+ * whose connection was handed over by another server process.  It is
+ * like jeux_client_service(), except that the CLIENT has already been
+ * registered and may already be logged in.
+ *
+ * @param arg  The registered CLIENT.
+ * @return  NULL
+ */
+void *jeux_client_resume(void *arg);
+
+#endif
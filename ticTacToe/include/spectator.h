@@ -0,0 +1,109 @@
+#ifndef SPECTATOR_H
+#define SPECTATOR_H
+
+#include "protocol.h"
+#include "client.h"
+#include "player.h"
+#include "game.h"
+
+/*
+ * The spectator module lets clients watch games that they are not
+ * playing in.  Games in progress are listed in a directory keyed by
+ * game ID.  When a move is made or a game ends, the notification is
+ * published once, with its payload encoded once into a reference-counted
+ * message.  A single fan-out thread then queues a reference to that
+ * message for each spectator of the game and sends it with non-blocking
+ * writes, so a game with many spectators never slows down the players.
+ *
+ * A spectator that falls behind has its oldest queued MOVED notifications
+ * dropped, since each one carries the full game state (a spectator that
+ * selected the delta board encoding is sent a full state after a drop).
+ * A packet that a spectator's connection only partly takes is finished
+ * on later passes of the fan-out thread, which never waits for it.
+ */
+
+/*
+ * The maximum number of games that one client may watch at a time.
+ */
+#define SPEC_MAX_WATCHES 16
+
+/*
+ * The number of notifications that may be queued for one spectator.
+ */
+#define SPEC_QUEUE_DEPTH 32
+
+/*
+ * Marks a WATCH argument as a game ID rather than a username, which may
+ * itself be all digits.
+ */
+#define SPEC_GAME_ID_PREFIX '#'
+
+/*
+ * Start the spectator module and its fan-out thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int spec_init(void);
+
+/*
+ * Stop the fan-out thread and free the spectator directory.
+ * This should not be called while there are registered clients.
+ */
+void spec_fini(void);
+
+/*
+ * Add a newly started GAME to the directory of games that can be watched.
+ * A reference to the GAME is retained until the game has ended.
+ *
+ * @param game  The GAME that has started.
+ * @param first  The PLAYER in the first player role.
+ * @param second  The PLAYER in the second player role.
+ * @return 0 if successful, otherwise -1.
+ */
+int spec_game_started(GAME *game, PLAYER *first, PLAYER *second);
+
+/*
+ * Start watching a game.  If successful, an ACK containing the watch ID
+ * and the current game state is sent to the client before any
+ * notifications for the game are.
+ *
+ * @param client  The CLIENT that wants to watch.
+ * @param what  SPEC_GAME_ID_PREFIX followed by the decimal ID of the game,
+ * or the username of a player whose most recent game is to be watched.
+ * @return the watch ID, if successful, otherwise -1.  In the latter case
+ * no packet has been sent to the client.
+ */
+int spec_watch(CLIENT *client, char *what);
+
+/*
+ * Stop watching a game.
+ *
+ * @param client  The CLIENT that is watching.
+ * @param id  The watch ID that was assigned by spec_watch().
+ * @return 0 if successful, otherwise -1.
+ */
+int spec_unwatch(CLIENT *client, int id);
+
+/*
+ * Stop all of a client's watches.  This must be called before the
+ * client's connection is closed.
+ *
+ * @param client  The CLIENT that is going away.
+ */
+void spec_client_gone(CLIENT *client);
+
+/*
+ * Publish a notification to the spectators of a game.  For a MOVED
+ * notification, the game state is encoded once in each of the board
+ * encodings into a shared message, and each spectator is sent the
+ * encoding it selected.  The call returns without waiting for any
+ * spectator.  Publishing an ENDED notification removes the game from
+ * the directory once it has been delivered.
+ *
+ * @param game  The GAME the notification is about.
+ * @param type  The packet type, either JEUX_MOVED_PKT or JEUX_ENDED_PKT.
+ * @param role  The role field of the notification header.
+ */
+void spec_publish(GAME *game, JEUX_PACKET_TYPE type, GAME_ROLE role);
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * The timer module runs callbacks after a delay, for any number of
+ * timers, from a single thread.
+ *
+ * Timers are kept in a hierarchical timing wheel with a resolution of
+ * one millisecond.  Each level of the wheel has TIMER_WHEEL_SLOTS slots,
+ * and each slot of a level spans as many milliseconds as the whole of the
+ * level below it.  A timer is placed in the slot of the lowest level that
+ * covers its deadline, and is moved down a level each time the level
+ * below wraps around, so arming and cancelling a timer are constant time
+ * regardless of the number of timers.  The thread only wakes up when a
+ * slot of the lowest level is due or when that level wraps around.
+ *
+ * A TIMER is embedded in the object that owns it and is never allocated
+ * or freed by this module.  Callbacks are run by the timer thread with no
+ * locks held, so they may arm or cancel timers, including their own.
+ * A callback may already be on its way to running when timer_cancel()
+ * is called, in which case timer_cancel() returns 0 and the callback
+ * runs anyway; the owner must keep the object alive (typically by holding
+ * a reference for as long as the timer is armed) and must be able to
+ * recognize a callback that has become stale.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 5
+
+/*
+ * The longest delay that the wheel covers directly, about 12 days.
+ * Longer timers are parked in the top level until they come into range.
+ */
+#define TIMER_MAX_DELAY ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+typedef struct timer {
+    struct timer *next;
+    struct timer **pprev;       //NULL when not armed
+    uint64_t expires;           //absolute, in timer_now_ms() time
+    int level;                  //level of the wheel the timer is in
+    void (*func)(void *);
+    void *arg;
+} TIMER;
+
+/*
+ * Start the timer thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int timer_init(void);
+
+/*
+ * Stop the timer thread.  Timers that are still armed never fire.
+ */
+void timer_fini(void);
+
+/*
+ * Initialize a TIMER before it is first armed.
+ *
+ * @param timer  The TIMER to be initialized.
+ * @param func  The function to be called when the timer expires.
+ * @param arg  The argument to be passed to the function.
+ */
+void timer_setup(TIMER *timer, void (*func)(void *), void *arg);
+
+/*
+ * Arm a TIMER to expire after a delay.  If the timer is already armed,
+ * its deadline is changed.
+ *
+ * @param timer  The TIMER to be armed.
+ * @param delay_ms  The delay, in milliseconds.
+ * @return 1 if the timer was already armed, 0 if it was not, or -1 if
+ * the timer thread is not running.
+ */
+int timer_arm(TIMER *timer, uint64_t delay_ms);
+
+/*
+ * Arm a TIMER to expire at an absolute time.
+ *
+ * @param timer  The TIMER to be armed.
+ * @param when_ms  The deadline, in timer_now_ms() time.
+ * @return 1 if the timer was already armed, 0 if it was not, or -1 if
+ * the timer thread is not running.
+ */
+int timer_arm_at(TIMER *timer, uint64_t when_ms);
+
+/*
+ * Disarm a TIMER.
+ *
+ * @param timer  The TIMER to be disarmed.
+ * @return 1 if the timer was armed and will now not fire, 0 if it was not
+ * armed (either it was never armed, or it has already fired).
+ */
+int timer_cancel(TIMER *timer);
+
+/*
+ * Read the monotonic clock used for timer deadlines.
+ *
+ * @return the current time in milliseconds.
+ */
+uint64_t timer_now_ms(void);
+
+/*
+ * Keep timers from firing until timer_release() is called.  If a callback
+ * is running, this waits for it to return, so once this returns no
+ * callback is running or will start.  Timers can still be armed and
+ * cancelled while the wheel is held, and those that fall due in the
+ * meantime fire as soon as it is released.
+ */
+void timer_hold(void);
+
+/*
+ * Let timers fire again after timer_hold().
+ */
+void timer_release(void);
+
+/*
+ * Get the deadline of a TIMER.  Since timer_now_ms() time is the
+ * system's monotonic clock, a deadline means the same thing to any
+ * process on the same machine.
+ *
+ * @param timer  The TIMER to be queried.
+ * @return the deadline, or 0 if the timer is not armed.
+ */
+uint64_t timer_deadline(TIMER *timer);
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * The uring module is a thin wrapper around the io_uring system calls,
+ * enough for the scheduler threads (see coro.h) to wait for their
+ * connections through io_uring instead of epoll.
+ *
+ * A URING is one submission and completion queue pair.  Requests are
+ * filled into submission entries got from uring_sqe(), and handed to the
+ * kernel all at once by the next uring_submit(), which can also wait for
+ * completions; completions are then taken off with uring_cqe() and
+ * uring_cqe_seen().  A URING may only be used by one thread at a time.
+ *
+ * A URING_BUFS is a ring of equal-sized buffers provided to the kernel,
+ * from which it picks one for each chunk of data received by a request
+ * made with IOSQE_BUFFER_SELECT.  The completion says which buffer was
+ * picked; once its data has been used, the buffer is given back with
+ * uring_buf_return(), which takes no system call.
+ */
+
+typedef struct uring {
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqFlags;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending;               //filled in but not yet submitted
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;                   //the same as sqRing if the kernel maps them together
+	size_t cqRingSize;
+	size_t sqesSize;
+} URING;
+
+typedef struct uring_bufs {
+	struct io_uring_buf_ring *ring;
+	size_t ringSize;
+	char *base;
+	unsigned count;
+	unsigned size;
+	unsigned short group;
+	unsigned short tail;
+} URING_BUFS;
+
+/*
+ * Set up a ring.
+ *
+ * @param ring  The ring to set up.
+ * @param entries  The number of submission entries, a power of 2.
+ * @return 0 if successful, otherwise -1, for example if the kernel does
+ * not have io_uring.
+ */
+int uring_init(URING *ring, unsigned entries);
+
+/*
+ * Tear down a ring.  Requests still outstanding are cancelled.
+ *
+ * @param ring  The ring.
+ */
+void uring_fini(URING *ring);
+
+/*
+ * Get a cleared submission entry to fill in.  If the submission queue is
+ * full, what is in it is submitted first.
+ *
+ * @param ring  The ring.
+ * @return the entry, or NULL if the queue could not be emptied.
+ */
+struct io_uring_sqe *uring_sqe(URING *ring);
+
+/*
+ * Submit the entries filled in since the last submission, and wait for
+ * completions.
+ *
+ * @param ring  The ring.
+ * @param wait  The number of completions to wait for, which may be 0.
+ * @return 0 if successful, otherwise -1 with errno set.
+ */
+int uring_submit(URING *ring, unsigned wait);
+
+/*
+ * Look at the oldest completion not yet seen.  Completions that did not
+ * fit in the completion queue are fetched from the kernel once it has
+ * been emptied.
+ *
+ * @param ring  The ring.
+ * @return the completion, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_cqe(URING *ring);
+
+/*
+ * Take the completion returned by uring_cqe() off the queue.
+ *
+ * @param ring  The ring.
+ */
+void uring_cqe_seen(URING *ring);
+
+/*
+ * Allocate buffers and provide them to the kernel as a buffer group.
+ *
+ * @param ring  The ring whose requests are to use the buffers.
+ * @param bufs  The buffer ring to set up.
+ * @param group  The buffer group ID to give the buffers.
+ * @param count  The number of buffers, a power of 2.
+ * @param size  The size of each buffer.
+ * @return 0 if successful, otherwise -1, for example if the kernel does
+ * not have provided buffer rings.
+ */
+int uring_bufs_init(URING *ring, URING_BUFS *bufs, unsigned short group, unsigned count, unsigned size);
+
+/*
+ * Free a buffer ring set up by uring_bufs_init().  The ring it was
+ * provided to must have been torn down first.
+ *
+ * @param bufs  The buffer ring.
+ */
+void uring_bufs_fini(URING_BUFS *bufs);
+
+/*
+ * Get the memory of a buffer.
+ *
+ * @param bufs  The buffer ring.
+ * @param bid  The buffer ID, from a completion's flags.
+ * @return the buffer.
+ */
+char *uring_buf(URING_BUFS *bufs, unsigned bid);
+
+/*
+ * Give a buffer back to the kernel, for it to receive into again.
+ *
+ * @param bufs  The buffer ring.
+ * @param bid  The buffer ID.
+ */
+void uring_buf_return(URING_BUFS *bufs, unsigned bid);
+
+/*
+ * Find out whether the kernel can receive through io_uring the way the
+ * scheduler threads do: with one multishot receive per connection, into
+ * provided buffers.
+ *
+ * @return 1 if it can, otherwise 0.
+ */
+int uring_usable(void);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "debug.h"
+#include "actor.h"
+
+//the actor whose messages the calling thread is handling, if any
+static __thread ACTOR *handling;
+
+void actor_init(ACTOR *actor){
+	actor -> mailbox = NULL;
+	actor -> running = 0;
+}
+
+/*
+ * Handle the messages in an actor's mailbox until it is empty.
+ * The caller must have set running.
+ */
+static void drain(ACTOR *actor){
+	ACTOR *outer = handling;
+	handling = actor;
+	while (1){
+		ACTOR_MSG *m = __atomic_exchange_n(&actor -> mailbox, NULL, __ATOMIC_ACQUIRE);
+		if (m == NULL){
+			__atomic_store_n(&actor -> running, 0, __ATOMIC_SEQ_CST);
+			//a message posted before running was cleared saw it set, and was left for us
+			if (__atomic_load_n(&actor -> mailbox, __ATOMIC_SEQ_CST) == NULL){
+				break;
+			}
+			int idle = 0;
+			if (!__atomic_compare_exchange_n(&actor -> running, &idle, 1, 0,
+			                                 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+				break;
+			}
+			continue;
+		}
+		//the mailbox is newest first
+		ACTOR_MSG *batch = NULL;
+		while (m != NULL){
+			ACTOR_MSG *next = m -> next;
+			m -> next = batch;
+			batch = m;
+			m = next;
+		}
+		while (batch != NULL){
+			//the poster may return as soon as it is told, taking the message with it
+			ACTOR_MSG *next = batch -> next;
+			batch -> handle(batch);
+			sem_post(&batch -> done);
+			batch = next;
+		}
+	}
+	handling = outer;
+}
+
+void actor_call(ACTOR *actor, ACTOR_MSG *msg, void (*handle)(ACTOR_MSG *)){
+	msg -> handle = handle;
+	if (handling == actor){
+		handle(msg);
+		return;
+	}
+	sem_init(&msg -> done, 0, 0);
+	ACTOR_MSG *head = __atomic_load_n(&actor -> mailbox, __ATOMIC_RELAXED);
+	do {
+		msg -> next = head;
+	} while (!__atomic_compare_exchange_n(&actor -> mailbox, &head, msg, 1,
+	                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	int idle = 0;
+	if (__atomic_compare_exchange_n(&actor -> running, &idle, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+		drain(actor);
+	}
+	sem_wait(&msg -> done);
+	sem_destroy(&msg -> done);
+}
@@ -0,0 +1,1019 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <math.h>
+
+#include "debug.h"
+#include "player.h"
+#include "game.h"
+#include "game_ext.h"
+#include "archive.h"
+
+/*
+ * A serialized record waiting for the writer thread.
+ */
+typedef struct archive_item {
+	struct archive_item *next;
+	uint64_t endTime;
+	uint32_t hash1;
+	uint32_t hash2;
+	size_t length;
+	unsigned char record[];
+} ARCHIVE_ITEM;
+
+static struct {
+	int open;
+	char *dir;
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stopping;
+	ARCHIVE_ITEM *pending;          //newest first
+	uint32_t segment;               //segment being appended to
+	int logfd;
+	int idxfd;
+	uint32_t logSize;
+	uint64_t lastTime;
+	uint32_t committed;             //index entries of the current segment that are complete
+	unsigned long lost;             //records that could not be written and were given up on
+} archive;
+
+static void put16(unsigned char *p, uint16_t v){
+	v = htons(v);
+	memcpy(p, &v, 2);
+}
+
+static void put32(unsigned char *p, uint32_t v){
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static void put64(unsigned char *p, uint64_t v){
+	put32(p, v >> 32);
+	put32(p + 4, v & 0xffffffff);
+}
+
+static uint16_t get16(const unsigned char *p){
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return ntohs(v);
+}
+
+static uint32_t get32(const unsigned char *p){
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+static uint64_t get64(const unsigned char *p){
+	return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static void segment_path(char *buf, size_t len, uint32_t segment, char *ext){
+	snprintf(buf, len, "%s/games-%06u.%s", archive.dir, segment, ext);
+}
+
+static void posting_path(char *buf, size_t len, uint32_t hash){
+	snprintf(buf, len, "%s/players/%08x.pst", archive.dir, hash);
+}
+
+/*
+ * Hash the name hashes of two players, in either order, to name the
+ * posting list of their games against each other.
+ */
+static uint32_t pair_hash(uint32_t a, uint32_t b){
+	unsigned char k[8];
+	put32(k, a < b ? a : b);
+	put32(k + 4, a < b ? b : a);
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 8; i++){
+		h ^= k[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void pair_path(char *buf, size_t len, char *sub, uint32_t a, uint32_t b){
+	snprintf(buf, len, "%s/%s/%08x.pst", archive.dir, sub, pair_hash(a, b));
+}
+
+static int write_all(int fd, const void *buf, size_t len){
+	const char *p = buf;
+	while (len > 0){
+		ssize_t n = write(fd, p, len);
+		if (n < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Open the log and index of a segment for appending.
+ * The mutex must be held, or the writer not yet started.
+ */
+static int open_segment(uint32_t segment){
+	char path[PATH_MAX];
+	segment_path(path, sizeof(path), segment, "log");
+	int logfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (logfd < 0){
+		return -1;
+	}
+	segment_path(path, sizeof(path), segment, "idx");
+	int idxfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (idxfd < 0){
+		close(logfd);
+		return -1;
+	}
+	off_t idxSize = lseek(idxfd, 0, SEEK_END);
+	if (idxSize % ARCHIVE_INDEX_ENTRY){
+		//drop an entry that was cut short by a crash
+		idxSize -= idxSize % ARCHIVE_INDEX_ENTRY;
+		if (ftruncate(idxfd, idxSize)){
+			close(logfd);
+			close(idxfd);
+			return -1;
+		}
+	}
+	archive.segment = segment;
+	archive.logfd = logfd;
+	archive.idxfd = idxfd;
+	archive.logSize = lseek(logfd, 0, SEEK_END);
+	archive.committed = idxSize / ARCHIVE_INDEX_ENTRY;
+	return 0;
+}
+
+/*
+ * The end time of the last record indexed in a segment.
+ *
+ * @return the end time, or 0 if the segment has no complete entries.
+ */
+static uint64_t segment_last_time(uint32_t segment){
+	char path[PATH_MAX];
+	segment_path(path, sizeof(path), segment, "idx");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0){
+		return 0;
+	}
+	uint64_t last = 0;
+	off_t size = lseek(fd, 0, SEEK_END);
+	unsigned char e[ARCHIVE_INDEX_ENTRY];
+	if (size >= ARCHIVE_INDEX_ENTRY &&
+	    pread(fd, e, sizeof(e), size - size % ARCHIVE_INDEX_ENTRY - ARCHIVE_INDEX_ENTRY) == sizeof(e)){
+		last = get64(e);
+	}
+	close(fd);
+	return last;
+}
+
+static void close_segment(void){
+	if (archive.logfd < 0){
+		return;
+	}
+	fdatasync(archive.logfd);
+	fdatasync(archive.idxfd);
+	close(archive.logfd);
+	close(archive.idxfd);
+	archive.logfd = archive.idxfd = -1;
+}
+
+/*
+ * Free a list of records that will not be written, counting them as lost.
+ */
+static void drop_items(ARCHIVE_ITEM *items, char *why){
+	unsigned long n = 0;
+	while (items != NULL){
+		ARCHIVE_ITEM *next = items -> next;
+		free(items);
+		items = next;
+		n += 1;
+	}
+	if (n > 0){
+		archive.lost += n;
+		fprintf(stderr, "archive: %lu records lost (%s), %lu in all\n", n, why, archive.lost);
+	}
+}
+
+/*
+ * Append an entry to the posting list at a path.
+ */
+static void append_entry(char *path, unsigned char *e){
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0){
+		perror("archive posting");
+		return;
+	}
+	if (write_all(fd, e, ARCHIVE_POSTING_ENTRY)){
+		perror("archive posting");
+	}
+	close(fd);
+}
+
+/*
+ * Append an entry for a game to a player's posting list.
+ */
+static void append_posting(uint32_t hash, uint32_t opponent, uint64_t endTime,
+                           uint32_t offset, uint32_t length){
+	char path[PATH_MAX];
+	posting_path(path, sizeof(path), hash);
+	unsigned char e[ARCHIVE_POSTING_ENTRY];
+	put64(e, endTime);
+	put32(e + 8, archive.segment);
+	put32(e + 12, offset);
+	put32(e + 16, length);
+	put32(e + 20, opponent);
+	append_entry(path, e);
+}
+
+/*
+ * Append an entry for a game to the posting list of its two players'
+ * games against each other.  The entry holds the higher of their name
+ * hashes, which together with the list's name rules out most other pairs.
+ */
+static void append_pair(uint32_t hash1, uint32_t hash2, uint64_t endTime,
+                        uint32_t offset, uint32_t length){
+	char path[PATH_MAX];
+	pair_path(path, sizeof(path), "pairs", hash1, hash2);
+	unsigned char e[ARCHIVE_POSTING_ENTRY];
+	put64(e, endTime);
+	put32(e + 8, archive.segment);
+	put32(e + 12, offset);
+	put32(e + 16, length);
+	put32(e + 20, hash1 < hash2 ? hash2 : hash1);
+	append_entry(path, e);
+}
+
+/*
+ * Build the pair posting lists of an archive written before they were
+ * kept, from the players' posting lists.  Each game is taken from the
+ * list of the player with the lower name hash, which is in the order the
+ * games ended.  The lists are built aside and moved into place when they
+ * are complete, so that an interrupted build is started over.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+static int build_pairs(void){
+	char path[PATH_MAX], tmp[PATH_MAX], file[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/pairs", archive.dir);
+	struct stat st;
+	if (stat(path, &st) == 0){
+		return 0;
+	}
+	snprintf(tmp, sizeof(tmp), "%s/pairs.new", archive.dir);
+	struct dirent *de;
+	DIR *d = opendir(tmp);
+	if (d != NULL){
+		while ((de = readdir(d)) != NULL){
+			if (de -> d_name[0] != '.'){
+				unlinkat(dirfd(d), de -> d_name, 0);
+			}
+		}
+		closedir(d);
+	}
+	else if (mkdir(tmp, 0755)){
+		return -1;
+	}
+	snprintf(file, sizeof(file), "%s/players", archive.dir);
+	if ((d = opendir(file)) == NULL){
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL){
+		unsigned int hash;
+		if (sscanf(de -> d_name, "%8x.pst", &hash) != 1){
+			continue;
+		}
+		posting_path(file, sizeof(file), hash);
+		int fd = open(file, O_RDONLY);
+		if (fd < 0){
+			continue;
+		}
+		unsigned char *map = NULL;
+		size_t entries = 0;
+		if (fstat(fd, &st) == 0 && (entries = st.st_size / ARCHIVE_POSTING_ENTRY) > 0){
+			map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+		close(fd);
+		if (map == NULL || map == MAP_FAILED){
+			continue;
+		}
+		for (size_t i = 0; i < entries; i++){
+			unsigned char *e = map + i * ARCHIVE_POSTING_ENTRY;
+			uint32_t opponent = get32(e + 20);
+			//the entry already holds the higher hash of the two
+			if (hash <= opponent){
+				pair_path(file, sizeof(file), "pairs.new", hash, opponent);
+				append_entry(file, e);
+			}
+		}
+		munmap(map, st.st_size);
+	}
+	closedir(d);
+	return rename(tmp, path);
+}
+
+/*
+ * Append a batch of records, oldest first, rotating to a new segment
+ * when the current one is full.
+ *
+ * @return the records that could not be written yet, oldest first, to be
+ * tried again later.
+ */
+static ARCHIVE_ITEM *write_batch(ARCHIVE_ITEM *items){
+	while (items != NULL){
+		if (archive.logfd < 0){
+			//a rotation failed, so try again to open the segment after the last
+			pthread_mutex_lock(&archive.mutex);
+			int failed = open_segment(archive.segment + 1);
+			pthread_mutex_unlock(&archive.mutex);
+			if (failed){
+				return items;
+			}
+		}
+		//gather as many records as fit in the current segment
+		size_t logLen = 0;
+		int count = 0;
+		ARCHIVE_ITEM *end = items;
+		while (end != NULL && (count == 0 || archive.logSize + logLen + end -> length <= ARCHIVE_SEGMENT_MAX)){
+			logLen += end -> length;
+			count += 1;
+			end = end -> next;
+		}
+		if (archive.logSize > 0 && archive.logSize + logLen > ARCHIVE_SEGMENT_MAX){
+			pthread_mutex_lock(&archive.mutex);
+			close_segment();
+			if (open_segment(archive.segment + 1)){
+				pthread_mutex_unlock(&archive.mutex);
+				fprintf(stderr, "archive: cannot open segment %u, will retry\n", archive.segment + 1);
+				return items;
+			}
+			pthread_mutex_unlock(&archive.mutex);
+			continue;
+		}
+		unsigned char *log = malloc(logLen);
+		unsigned char *idx = malloc(count * ARCHIVE_INDEX_ENTRY);
+		if (log == NULL || idx == NULL){
+			free(log);
+			free(idx);
+			return items;
+		}
+		size_t off = 0;
+		unsigned char *e = idx;
+		for (ARCHIVE_ITEM *it = items; it != end; it = it -> next){
+			//keep the index ordered even if games ended in a different order
+			if (it -> endTime < archive.lastTime){
+				it -> endTime = archive.lastTime;
+			}
+			archive.lastTime = it -> endTime;
+			memcpy(log + off, it -> record, it -> length);
+			put64(e, it -> endTime);
+			put32(e + 8, archive.logSize + off);
+			put32(e + 12, it -> length);
+			put32(e + 16, it -> hash1);
+			put32(e + 20, it -> hash2);
+			off += it -> length;
+			e += ARCHIVE_INDEX_ENTRY;
+		}
+		if (write_all(archive.logfd, log, logLen) || write_all(archive.idxfd, idx, count * ARCHIVE_INDEX_ENTRY)){
+			perror("archive write");
+			//what did get written is not indexed, so later records go after it
+			pthread_mutex_lock(&archive.mutex);
+			archive.logSize = lseek(archive.logfd, 0, SEEK_END);
+			if (ftruncate(archive.idxfd, (off_t)archive.committed * ARCHIVE_INDEX_ENTRY)){
+				perror("archive index");
+			}
+			pthread_mutex_unlock(&archive.mutex);
+			ARCHIVE_ITEM *last = items;
+			while (last -> next != end){
+				last = last -> next;
+			}
+			last -> next = NULL;
+			drop_items(items, "write failed");
+			items = end;
+			free(log);
+			free(idx);
+			continue;
+		}
+		else{
+			//the records are in place, so they can now be listed for their players
+			off = 0;
+			for (ARCHIVE_ITEM *it = items; it != end; it = it -> next){
+				append_posting(it -> hash1, it -> hash2, it -> endTime, archive.logSize + off, it -> length);
+				if (it -> hash2 != it -> hash1){
+					append_posting(it -> hash2, it -> hash1, it -> endTime, archive.logSize + off, it -> length);
+				}
+				append_pair(it -> hash1, it -> hash2, it -> endTime, archive.logSize + off, it -> length);
+				off += it -> length;
+			}
+			pthread_mutex_lock(&archive.mutex);
+			archive.logSize += logLen;
+			archive.committed += count;
+			pthread_mutex_unlock(&archive.mutex);
+		}
+		free(log);
+		free(idx);
+		while (items != end){
+			ARCHIVE_ITEM *n = items -> next;
+			free(items);
+			items = n;
+		}
+	}
+	return NULL;
+}
+
+static void *writer_thread(void *arg){
+	ARCHIVE_ITEM *retry = NULL;     //oldest first
+	pthread_mutex_lock(&archive.mutex);
+	while (1){
+		while (archive.pending == NULL && !archive.stopping){
+			if (retry == NULL){
+				pthread_cond_wait(&archive.cond, &archive.mutex);
+				continue;
+			}
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ARCHIVE_RETRY_MS / 1000;
+			ts.tv_nsec += (ARCHIVE_RETRY_MS % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000){
+				ts.tv_sec += 1;
+				ts.tv_nsec -= 1000000000;
+			}
+			if (pthread_cond_timedwait(&archive.cond, &archive.mutex, &ts) == ETIMEDOUT){
+				break;
+			}
+		}
+		if (archive.pending == NULL && retry == NULL){
+			break;
+		}
+		int stopping = archive.stopping;
+		ARCHIVE_ITEM *list = archive.pending;
+		archive.pending = NULL;
+		pthread_mutex_unlock(&archive.mutex);
+		//the new records go after those that are still waiting
+		ARCHIVE_ITEM *fifo = NULL;
+		while (list != NULL){
+			ARCHIVE_ITEM *n = list -> next;
+			list -> next = fifo;
+			fifo = list;
+			list = n;
+		}
+		ARCHIVE_ITEM **tail = &retry;
+		while (*tail != NULL){
+			tail = &(*tail) -> next;
+		}
+		*tail = fifo;
+		retry = write_batch(retry);
+		size_t retries = 0;
+		for (ARCHIVE_ITEM *it = retry; it != NULL; it = it -> next){
+			retries += 1;
+		}
+		if (stopping){
+			drop_items(retry, "archive closed");
+			retry = NULL;
+		}
+		else{
+			//give up on the oldest rather than hold on to ever more
+			ARCHIVE_ITEM *old = NULL;
+			for (; retries > ARCHIVE_RETRY_MAX; retries--){
+				ARCHIVE_ITEM *n = retry -> next;
+				retry -> next = old;
+				old = retry;
+				retry = n;
+			}
+			drop_items(old, "too many waiting");
+		}
+		pthread_mutex_lock(&archive.mutex);
+	}
+	pthread_mutex_unlock(&archive.mutex);
+	return NULL;
+}
+
+/*
+ * Open the archive in a directory, creating the directory if necessary,
+ * and start the writer thread.
+ *
+ * @param dir  The archive directory.
+ * @return 0 if successful, otherwise -1.
+ */
+int archive_init(char *dir){
+	if (dir == NULL || archive.open){
+		return -1;
+	}
+	if (mkdir(dir, 0755) && errno != EEXIST){
+		return -1;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/players", dir);
+	if (mkdir(path, 0755) && errno != EEXIST){
+		return -1;
+	}
+	DIR *d = opendir(dir);
+	if (d == NULL){
+		return -1;
+	}
+	uint32_t last = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL){
+		unsigned int n;
+		if (sscanf(de -> d_name, "games-%u.log", &n) == 1 && n > last){
+			last = n;
+		}
+	}
+	closedir(d);
+	archive.dir = strdup(dir);
+	archive.pending = NULL;
+	archive.stopping = 0;
+	archive.lastTime = 0;
+	archive.lost = 0;
+	pthread_mutex_init(&archive.mutex, NULL);
+	pthread_cond_init(&archive.cond, NULL);
+	if (open_segment(last)){
+		free(archive.dir);
+		return -1;
+	}
+	if (build_pairs()){
+		close_segment();
+		free(archive.dir);
+		return -1;
+	}
+	//end times carry on from the records already indexed, even if the clock has gone back
+	for (uint32_t s = last + 1; s-- > 0 && archive.lastTime == 0; ){
+		archive.lastTime = segment_last_time(s);
+	}
+	if (pthread_create(&archive.tid, NULL, writer_thread, NULL)){
+		close_segment();
+		free(archive.dir);
+		return -1;
+	}
+	archive.open = 1;
+	debug("%ld: archive open in %s at segment %u", pthread_self(), dir, last);
+	return 0;
+}
+
+/*
+ * Write out any records that are still queued, stop the writer thread
+ * and close the archive.
+ */
+void archive_fini(void){
+	if (!archive.open){
+		return;
+	}
+	pthread_mutex_lock(&archive.mutex);
+	archive.stopping = 1;
+	pthread_cond_signal(&archive.cond);
+	pthread_mutex_unlock(&archive.mutex);
+	pthread_join(archive.tid, NULL);
+	close_segment();
+	archive.open = 0;
+	pthread_mutex_destroy(&archive.mutex);
+	pthread_cond_destroy(&archive.cond);
+	free(archive.dir);
+}
+
+/*
+ * Hash a username as stored in the archive indexes (32-bit FNV-1a).
+ *
+ * @param name  The username.
+ * @return the 32-bit hash.
+ */
+uint32_t archive_name_hash(char *name){
+	uint32_t h = 2166136261u;
+	for (unsigned char *p = (unsigned char *)name; *p != '\0'; p++){
+		h ^= *p;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Record a completed GAME.
+ *
+ * @param game  The GAME that has ended.
+ * @param first  The PLAYER in the first player role.
+ * @param second  The PLAYER in the second player role.
+ * @param result  0 if drawn, 1 if the first player won, 2 if the second.
+ * @param reason  Why the game ended (ARCHIVE_END_*).
+ * @param before  The first and second players' ratings before the result
+ * was posted.
+ * @param after  Their ratings after the result was posted.
+ */
+void archive_game(GAME *game, PLAYER *first, PLAYER *second, int result,
+                  int reason, double before[2], double after[2]){
+	if (!archive.open || game == NULL || first == NULL || second == NULL){
+		return;
+	}
+	GAME_MOVE_RECORD moves[GAME_MAX_MOVES];
+	int n = game_get_moves(game, moves, GAME_MAX_MOVES);
+	char *name1 = player_get_name(first);
+	char *name2 = player_get_name(second);
+	size_t len1 = strnlen(name1, UINT16_MAX);
+	size_t len2 = strnlen(name2, UINT16_MAX);
+	size_t length = ARCHIVE_RECORD_FIXED + n * ARCHIVE_MOVE_SIZE + len1 + len2;
+	ARCHIVE_ITEM *it = malloc(sizeof(ARCHIVE_ITEM) + length);
+	if (it == NULL){
+		return;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t start = game_get_start_time(game);
+	it -> endTime = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	it -> hash1 = archive_name_hash(name1);
+	it -> hash2 = archive_name_hash(name2);
+	it -> length = length;
+	unsigned char *r = it -> record;
+	memset(r, 0, ARCHIVE_RECORD_FIXED);
+	put32(r, ARCHIVE_MAGIC);
+	put32(r + 4, length);
+	put32(r + 8, game_get_id(game));
+	put64(r + 12, start);
+	put64(r + 20, it -> endTime);
+	r[28] = result;
+	r[29] = reason;
+	r[30] = n;
+	put16(r + 31, len1);
+	put16(r + 33, len2);
+	put32(r + 36, (int32_t)lround(before[0] * 100));
+	put32(r + 40, (int32_t)lround(after[0] * 100));
+	put32(r + 44, (int32_t)lround(before[1] * 100));
+	put32(r + 48, (int32_t)lround(after[1] * 100));
+	unsigned char *m = r + ARCHIVE_RECORD_FIXED;
+	for (int i = 0; i < n; i++){
+		m[0] = moves[i].cell;
+		m[1] = moves[i].role;
+		put32(m + 2, moves[i].time_ms - start);
+		m += ARCHIVE_MOVE_SIZE;
+	}
+	memcpy(m, name1, len1);
+	memcpy(m + len1, name2, len2);
+
+	pthread_mutex_lock(&archive.mutex);
+	it -> next = archive.pending;
+	archive.pending = it;
+	pthread_cond_signal(&archive.cond);
+	pthread_mutex_unlock(&archive.mutex);
+}
+
+/*
+ * Find archived games by player and end time, newest first, using only
+ * the segment indexes.
+ *
+ * @param player  Username to match, or NULL to match every game.
+ * @param since_ms  Earliest end time to include.
+ * @param until_ms  Latest end time to include.
+ * @param refs  Caller-supplied array into which references are stored.
+ * @param max  Size of the refs array.
+ * @return the number of references stored, or -1 on error.
+ */
+int archive_lookup(char *player, uint64_t since_ms, uint64_t until_ms,
+                   ARCHIVE_REF *refs, int max){
+	if (!archive.open || refs == NULL || max <= 0){
+		return -1;
+	}
+	uint32_t hash = player == NULL ? 0 : archive_name_hash(player);
+	pthread_mutex_lock(&archive.mutex);
+	uint32_t current = archive.segment;
+	uint32_t committed = archive.committed;
+	pthread_mutex_unlock(&archive.mutex);
+	int found = 0;
+	int done = 0;
+	for (int64_t seg = current; seg >= 0 && !done && found < max; seg--){
+		char path[PATH_MAX];
+		segment_path(path, sizeof(path), seg, "idx");
+		int fd = open(path, O_RDONLY);
+		if (fd < 0){
+			continue;
+		}
+		struct stat st;
+		if (fstat(fd, &st) || st.st_size < ARCHIVE_INDEX_ENTRY){
+			close(fd);
+			continue;
+		}
+		size_t entries = st.st_size / ARCHIVE_INDEX_ENTRY;
+		if (seg == current && entries > committed){
+			entries = committed;
+		}
+		unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED){
+			continue;
+		}
+		//find the first entry that ended after until_ms
+		size_t lo = 0;
+		size_t hi = entries;
+		while (lo < hi){
+			size_t mid = lo + (hi - lo) / 2;
+			if (get64(map + mid * ARCHIVE_INDEX_ENTRY) <= until_ms){
+				lo = mid + 1;
+			}
+			else{
+				hi = mid;
+			}
+		}
+		for (size_t i = lo; i > 0 && found < max; i--){
+			unsigned char *e = map + (i - 1) * ARCHIVE_INDEX_ENTRY;
+			uint64_t end = get64(e);
+			if (end < since_ms){
+				done = 1;
+				break;
+			}
+			if (player != NULL && get32(e + 16) != hash && get32(e + 20) != hash){
+				continue;
+			}
+			refs[found].segment = seg;
+			refs[found].offset = get32(e + 8);
+			refs[found].length = get32(e + 12);
+			refs[found].end_ms = end;
+			found += 1;
+		}
+		munmap(map, st.st_size);
+	}
+	return found;
+}
+
+/*
+ * Read an archived record.
+ *
+ * @param ref  Reference to the record, as returned by archive_lookup().
+ * @param buf  Caller-supplied buffer of at least ref->length bytes.
+ * @return 0 if successful, otherwise -1.
+ */
+int archive_read(ARCHIVE_REF *ref, void *buf){
+	if (!archive.open || ref == NULL || buf == NULL){
+		return -1;
+	}
+	char path[PATH_MAX];
+	segment_path(path, sizeof(path), ref -> segment, "log");
+	int fd = open(path, O_RDONLY);
+	if (fd < 0){
+		return -1;
+	}
+	ssize_t n = pread(fd, buf, ref -> length, ref -> offset);
+	close(fd);
+	if (n != ref -> length || get32(buf) != ARCHIVE_MAGIC){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * A segment log kept open while the records a posting list refers to
+ * are checked, with a buffer for the record being read.
+ */
+typedef struct record_reader {
+	int fd;
+	uint32_t segment;
+	unsigned char *buf;
+	size_t size;
+} RECORD_READER;
+
+/*
+ * Check that a record a posting list refers to really is a game of a
+ * player, against an opponent if one is given, as different names can
+ * have the same hash.
+ *
+ * @return 1 if it is, otherwise 0.
+ */
+static int record_is_theirs(RECORD_READER *rd, ARCHIVE_REF *ref, char *player, char *opponent){
+	if (rd -> fd < 0 || rd -> segment != ref -> segment){
+		if (rd -> fd >= 0){
+			close(rd -> fd);
+		}
+		char path[PATH_MAX];
+		segment_path(path, sizeof(path), ref -> segment, "log");
+		rd -> fd = open(path, O_RDONLY);
+		rd -> segment = ref -> segment;
+		if (rd -> fd < 0){
+			return 0;
+		}
+	}
+	if (rd -> size < ref -> length){
+		unsigned char *b = realloc(rd -> buf, ref -> length);
+		if (b == NULL){
+			return 0;
+		}
+		rd -> buf = b;
+		rd -> size = ref -> length;
+	}
+	ARCHIVE_RECORD rec;
+	if (pread(rd -> fd, rd -> buf, ref -> length, ref -> offset) != ref -> length ||
+	    archive_decode(rd -> buf, ref -> length, &rec)){
+		return 0;
+	}
+	int who = archive_record_player(&rec, player);
+	return who != 0 && (opponent == NULL || archive_record_player(&rec, opponent) == 3 - who);
+}
+
+/*
+ * Find a player's most recent archived games, newest first, using only
+ * the player's posting list, or the posting list of the player's games
+ * against an opponent.  Each game found is read to check the names in
+ * it, and the list is walked until max games pass the check or it runs
+ * out.
+ *
+ * @param player  Username whose games are wanted.
+ * @param opponent  If not NULL, only games against this username.
+ * @param refs  Caller-supplied array into which references are stored.
+ * @param max  Size of the refs array.
+ * @return the number of references stored, or -1 on error.
+ */
+int archive_player_games(char *player, char *opponent, ARCHIVE_REF *refs, int max){
+	if (!archive.open || player == NULL || refs == NULL || max <= 0){
+		return -1;
+	}
+	uint32_t hash = archive_name_hash(player);
+	uint32_t opp = opponent == NULL ? 0 : archive_name_hash(opponent);
+	char path[PATH_MAX];
+	if (opponent == NULL){
+		posting_path(path, sizeof(path), hash);
+	}
+	else{
+		pair_path(path, sizeof(path), "pairs", hash, opp);
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0){
+		//no games yet
+		return errno == ENOENT ? 0 : -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st)){
+		close(fd);
+		return -1;
+	}
+	size_t entries = st.st_size / ARCHIVE_POSTING_ENTRY;
+	if (entries == 0){
+		close(fd);
+		return 0;
+	}
+	unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED){
+		return -1;
+	}
+	//pair list entries hold the higher of the two hashes
+	uint32_t higher = hash < opp ? opp : hash;
+	RECORD_READER rd = {-1, 0, NULL, 0};
+	int found = 0;
+	for (size_t i = entries; i > 0 && found < max; i--){
+		unsigned char *e = map + (i - 1) * ARCHIVE_POSTING_ENTRY;
+		if (opponent != NULL && get32(e + 20) != higher){
+			continue;
+		}
+		refs[found].end_ms = get64(e);
+		refs[found].segment = get32(e + 8);
+		refs[found].offset = get32(e + 12);
+		refs[found].length = get32(e + 16);
+		if (record_is_theirs(&rd, &refs[found], player, opponent)){
+			found += 1;
+		}
+	}
+	if (rd.fd >= 0){
+		close(rd.fd);
+	}
+	free(rd.buf);
+	munmap(map, st.st_size);
+	return found;
+}
+
+/*
+ * Decode a record that has been read with archive_read().
+ *
+ * @param buf  The record.
+ * @param len  The length of the record.
+ * @param rec  The ARCHIVE_RECORD to fill in.
+ * @return 0 if successful, -1 if the record is malformed.
+ */
+int archive_decode(void *buf, size_t len, ARCHIVE_RECORD *rec){
+	unsigned char *r = buf;
+	if (r == NULL || rec == NULL || len < ARCHIVE_RECORD_FIXED){
+		return -1;
+	}
+	if (get32(r) != ARCHIVE_MAGIC || get32(r + 4) != len){
+		return -1;
+	}
+	rec -> game_id = get32(r + 8);
+	rec -> start_ms = get64(r + 12);
+	rec -> end_ms = get64(r + 20);
+	rec -> result = r[28];
+	rec -> reason = r[29];
+	rec -> moves = r[30];
+	rec -> first_len = get16(r + 31);
+	rec -> second_len = get16(r + 33);
+	if (rec -> moves > GAME_MAX_MOVES || ARCHIVE_RECORD_FIXED + rec -> moves * ARCHIVE_MOVE_SIZE
+	    + rec -> first_len + rec -> second_len != len){
+		return -1;
+	}
+	for (int i = 0; i < 4; i++){
+		rec -> ratings[i] = (int32_t)get32(r + 36 + 4 * i);
+	}
+	unsigned char *m = r + ARCHIVE_RECORD_FIXED;
+	for (int i = 0; i < rec -> moves; i++){
+		rec -> cells[i] = m[0];
+		rec -> roles[i] = m[1];
+		rec -> times[i] = get32(m + 2);
+		m += ARCHIVE_MOVE_SIZE;
+	}
+	rec -> first = (char *)m;
+	rec -> second = (char *)m + rec -> first_len;
+	return 0;
+}
+
+/*
+ * Go through every archived game, oldest first.
+ *
+ * @param fn  Called with each decoded record.
+ * @param arg  Passed on to fn.
+ * @return the number of records, or -1 on error.
+ */
+long archive_scan(void (*fn)(ARCHIVE_RECORD *rec, void *arg), void *arg){
+	if (!archive.open || fn == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&archive.mutex);
+	uint32_t current = archive.segment;
+	uint32_t committed = archive.committed;
+	pthread_mutex_unlock(&archive.mutex);
+	long count = 0;
+	ARCHIVE_RECORD rec;
+	for (uint32_t seg = 0; seg <= current; seg++){
+		char path[PATH_MAX];
+		segment_path(path, sizeof(path), seg, "idx");
+		int ifd = open(path, O_RDONLY);
+		segment_path(path, sizeof(path), seg, "log");
+		int lfd = open(path, O_RDONLY);
+		struct stat ist, lst;
+		if (ifd < 0 || lfd < 0 || fstat(ifd, &ist) || fstat(lfd, &lst) ||
+		    ist.st_size < ARCHIVE_INDEX_ENTRY || lst.st_size == 0){
+			if (ifd >= 0){
+				close(ifd);
+			}
+			if (lfd >= 0){
+				close(lfd);
+			}
+			continue;
+		}
+		size_t entries = ist.st_size / ARCHIVE_INDEX_ENTRY;
+		if (seg == current && entries > committed){
+			entries = committed;
+		}
+		unsigned char *idx = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+		unsigned char *log = mmap(NULL, lst.st_size, PROT_READ, MAP_SHARED, lfd, 0);
+		close(ifd);
+		close(lfd);
+		if (idx == MAP_FAILED || log == MAP_FAILED){
+			if (idx != MAP_FAILED){
+				munmap(idx, ist.st_size);
+			}
+			if (log != MAP_FAILED){
+				munmap(log, lst.st_size);
+			}
+			continue;
+		}
+		madvise(log, lst.st_size, MADV_SEQUENTIAL);
+		for (size_t i = 0; i < entries; i++){
+			unsigned char *e = idx + i * ARCHIVE_INDEX_ENTRY;
+			uint32_t offset = get32(e + 8);
+			uint32_t length = get32(e + 12);
+			if ((off_t)offset + length > lst.st_size || archive_decode(log + offset, length, &rec)){
+				continue;
+			}
+			fn(&rec, arg);
+			count += 1;
+		}
+		munmap(idx, ist.st_size);
+		munmap(log, lst.st_size);
+	}
+	return count;
+}
+
+/*
+ * Check whether a username is one of the players of a decoded record.
+ *
+ * @param rec  The decoded record.
+ * @param name  The username.
+ * @return 1 if the first player, 2 if the second player, otherwise 0.
+ */
+int archive_record_player(ARCHIVE_RECORD *rec, char *name){
+	size_t len = strlen(name);
+	if (len == rec -> first_len && memcmp(name, rec -> first, len) == 0){
+		return 1;
+	}
+	if (len == rec -> second_len && memcmp(name, rec -> second, len) == 0){
+		return 2;
+	}
+	return 0;
+}
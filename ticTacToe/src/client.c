@@ -11,25 +11,62 @@
 #include <semaphore.h>
 #include <time.h>
 #include <stdint.h>
+#include <poll.h>
 
 #include "debug.h"
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
 #include "client.h"
+#include "client_ext.h"
 #include "player.h"
+#include "player_ext.h"
 #include "invitation.h"
+#include "invitation_ext.h"
 #include "jeux_globals.h"
 #include "game.h"
+#include "game_ext.h"
+#include "spectator.h"
+#include "archive.h"
+#include "timer.h"
+#include "ebr.h"
+#include "jio.h"
+#include "compress.h"
+#include "local.h"
+#include "coro.h"
 
 typedef struct client{
 	int fd;
-	int ref ;
+	int ref ;                       //atomic; changed without taking seph
 	PLAYER *playerRef;
 	INVITATION * listOfInv[MAX_CLIENTS];
 	sem_t seph;
+	struct spec_session *spec;
+	GAME_ENCODING boardEncoding;
+	TIMER heartbeat;
+	sem_t heartbeatSeph;            //orders the heartbeat against closing the connection
+	int heartbeatStopped;
+	uint64_t lastActivity;          //timer_now_ms() of the last packet received
+	uint32_t srtt;                  //smoothed round-trip time in microseconds, 0 if unknown
+	uint32_t rttvar;
+	uint32_t requestSeq;            //sequence number of the request being answered
+	int requestTagged;              //whether there is one
+	CLIENT_BATCH *batch;            //where responses are collected instead of sent, if anywhere
+	unsigned caps;                  //JEUX_CAPABILITY bits granted at LOGIN
+	int held;                       //whether packets are being held back by some thread
+	char *out;                      //the packets held back, or left for the service coroutine to write
+	size_t outLen;
+	size_t outSize;
+	void *service;                  //the coroutine serving the connection, if it is one
+	int partial;                    //a packet is part sent by client_try_send_packet()
+	EBR_NODE reclaim;               //freed through this once the last reference is gone
 
 } CLIENT;
 
+uint64_t client_invitation_ttl_ms = 0;
+uint64_t client_idle_timeout_ms = 0;
+
 /*
  * Create a new CLIENT object with a specified file descriptor with which
  * to communicate with the client.  The returned CLIENT has a reference
@@ -52,7 +89,24 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
 	for (int i = 0; i < MAX_CLIENTS; i++) {
 		c ->listOfInv[i] = NULL;  //Set all invitations to NULL empty
 	}
+	c -> spec = NULL;
+	c -> boardEncoding = GAME_ENC_ASCII;
 	sem_init(&c->seph, 0, 1);
+	sem_init(&c->heartbeatSeph, 0, 1);
+	c -> heartbeatStopped = 1;
+	c -> lastActivity = timer_now_ms();
+	c -> srtt = 0;
+	c -> rttvar = 0;
+	c -> requestSeq = 0;
+	c -> requestTagged = 0;
+	c -> batch = NULL;
+	c -> caps = 0;
+	c -> held = 0;
+	c -> out = NULL;
+	c -> outLen = 0;
+	c -> outSize = 0;
+	c -> service = NULL;
+	c -> partial = 0;
 	return c;
 }
 
@@ -66,14 +120,32 @@ CLIENT *client_create(CLIENT_REGISTRY *creg, int fd){
  * @return  The same CLIENT that was passed as a parameter.
  */
 CLIENT *client_ref(CLIENT *client, char *why){
-	sem_wait(&client -> seph);
 	if (client == NULL){
-		sem_post(&client -> seph);
 		return NULL;
 	}
 	debug("%ld: %p %s", pthread_self(), client, why);
-	client -> ref += 1;
-	sem_post(&client -> seph);
+	__atomic_add_fetch(&client -> ref, 1, __ATOMIC_RELAXED);
+	return client;
+}
+/*
+ * Increase the reference count on a CLIENT by one, unless it has already
+ * dropped to zero.  The caller must be in a critical section in which it
+ * found the CLIENT through a pointer that has since been discarded.
+ *
+ * @param client  The CLIENT whose reference count is to be increased.
+ * @param why  A string describing the reason why the reference count is
+ * being increased.
+ * @return  The same CLIENT, or NULL if it is on its way to being freed.
+ */
+CLIENT *client_ref_live(CLIENT *client, char *why){
+	//no lock, so that lookups from many threads do not queue on the client
+	int ref = __atomic_load_n(&client -> ref, __ATOMIC_RELAXED);
+	do {
+		if (ref == 0){
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&client -> ref, &ref, ref + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	debug("%ld: %p %s", pthread_self(), client, why);
 	return client;
 }
 /*
@@ -88,20 +160,11 @@ CLIENT *client_ref(CLIENT *client, char *why){
  */
 void client_unref(CLIENT *client, char *why){
 	if (client != NULL){
-		sem_wait(&client -> seph);
 		debug("%ld: %p %s", pthread_self(), client, why);
-		if (client != NULL){
-			client -> ref -= 1;
-			if (client -> ref == 0){
-				sem_post(&client -> seph);
-				free(client);
-			}
-			else{
-				sem_post(&client -> seph);
-			}
-		}
-		else{
-			sem_post(&client -> seph);
+		if (__atomic_sub_fetch(&client -> ref, 1, __ATOMIC_ACQ_REL) == 0){
+			//a thread may still be looking at the client without a reference
+			free(client -> out);
+			ebr_retire(&client -> reclaim, free, client);
 		}
 	}
 }
@@ -128,12 +191,11 @@ int client_login(CLIENT *client, PLAYER *player){
 		sem_post(&client -> seph);
 		return -1;
 	}
-	CLIENT*temp = creg_lookup(client_registry, player_get_name(player));
-	if (temp != NULL){
+	//fails if some other client is already logged in as this player
+	if (creg_index_add(client_registry, client, player)){
 		sem_post(&client -> seph);
 		return -1;
 	}
-	client_unref(temp, "dereferencing after look up for login checking");
 	client -> playerRef = player;
 	player_ref(player, "logging into a client");
 	sem_post(&client -> seph);
@@ -159,19 +221,28 @@ int client_logout(CLIENT *client){
 		sem_post(&client -> seph);
 		return -1;
 	}
+	//resigning and revoking take the semaphore themselves, so work from a copy
+	INVITATION *invs[MAX_CLIENTS];
+	memcpy(invs, client -> listOfInv, sizeof(invs));
+	sem_post(&client -> seph);
 	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (invs[i] == NULL || client -> listOfInv[i] != invs[i]){
+			continue;
+		}
 		/* Resign if a game is in progress */
-		if (client-> listOfInv[i] != NULL) {
-			GAME * g = inv_get_game(client-> listOfInv[i]);
-			if (g != NULL) {  
-				client_resign_game(client, i);
-			}
-			else{
-				client_revoke_invitation(client, i);
-			}
-			//client_remove_invitation(client, client-> listOfInv[i]);
+		if (inv_get_game(invs[i]) != NULL) {
+			client_resign_game(client, i);
+		}
+		else if (inv_get_source(invs[i]) == client){
+			client_revoke_invitation(client, i);
+		}
+		else{
+			client_decline_invitation(client, i);
 		}
 	}
+	creg_index_remove(client_registry, client);
+	spec_client_gone(client);
+	sem_wait(&client -> seph);
 	player_unref(client -> playerRef, "logging out of client");
 	client -> playerRef = NULL;
 	sem_post(&client -> seph);
@@ -216,6 +287,253 @@ int client_get_fd(CLIENT *client){
 }
 
 
+/*
+ * Add a response to the batch in which it is collected.
+ */
+static int batch_add(CLIENT_BATCH *batch, JEUX_PACKET_HEADER *pkt, void *data){
+	JEUX_PACKET_HEADER hdr = *pkt;
+	hdr.type &= ~JEUX_SEQ_FLAG;
+	size_t datasize = data == NULL ? 0 : ntohs(hdr.size);
+	if (batch -> len + sizeof(hdr) + datasize + batch -> reserve > batch -> size){
+		datasize = 0;
+		batch -> truncated = 1;
+	}
+	if (batch -> len + sizeof(hdr) > batch -> size){
+		return -1;
+	}
+	hdr.size = htons(datasize);
+	memcpy(batch -> buf + batch -> len, &hdr, sizeof(hdr));
+	if (datasize > 0){
+		memcpy(batch -> buf + batch -> len + sizeof(hdr), data, datasize);
+	}
+	batch -> len += sizeof(hdr) + datasize;
+	batch -> replies += 1;
+	return 0;
+}
+
+/*
+ * The clients whose packets this thread is holding back, between
+ * client_hold_sends() and client_release_sends().  A request is carried
+ * out without yielding, so the thread has these to itself.
+ */
+static __thread int holding;
+static __thread int heldCount;
+static __thread CLIENT *heldClients[MAX_CLIENTS];
+
+/*
+ * Say whether packets for a client, which the caller has locked, are to be
+ * held back rather than sent.  Once one thread holds a client's packets,
+ * those sent by any other thread are held back too, so that they do not
+ * overtake them.
+ */
+static int hold_locked(CLIENT *client){
+	if (client -> held){
+		return 1;
+	}
+	if (!holding || heldCount == MAX_CLIENTS){
+		return 0;
+	}
+	debug("%ld: %p holding packets", pthread_self(), client);
+	__atomic_add_fetch(&client -> ref, 1, __ATOMIC_RELAXED);
+	client -> held = 1;
+	heldClients[heldCount++] = client;
+	return 1;
+}
+
+/*
+ * Make room for more bytes after those held back for a client, which the
+ * caller has locked.
+ */
+static int out_reserve(CLIENT *client, size_t more){
+	size_t need = client -> outLen + more;
+	if (need > client -> outSize){
+		size_t size = client -> outSize == 0 ? 1024 : client -> outSize;
+		while (size < need){
+			size *= 2;
+		}
+		char *out = realloc(client -> out, size);
+		if (out == NULL){
+			return -1;
+		}
+		client -> out = out;
+		client -> outSize = size;
+	}
+	return 0;
+}
+
+/*
+ * Add a packet to those held back for a client, which the caller has locked.
+ */
+static int out_add(CLIENT *client, JEUX_PACKET_HEADER *pkt, uint32_t *seq, void *data){
+	if (out_reserve(client, proto_packed_size(pkt, seq))){
+		return -1;
+	}
+	client -> outLen += proto_pack_packet_seq(pkt, seq, data, client -> out + client -> outLen);
+	return 0;
+}
+
+/*
+ * Write to the connection of a client served by a coroutine, which the
+ * caller has locked, without waiting for it.  What the connection does
+ * not take, and everything after it, is kept for the service coroutine,
+ * which is woken to write it (see client_flush()).
+ *
+ * @return 0 if successful, -1 if the connection failed.
+ */
+static int write_or_keep(CLIENT *client, struct iovec *iov, int iovcnt){
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++){
+		total += iov[i].iov_len;
+	}
+	//nothing may overtake what was kept before
+	int kept = client -> outLen > 0;
+	size_t skip = 0;
+	if (!kept){
+		ssize_t w = jio_try_writev(client -> fd, iov, iovcnt);
+		if (w < 0){
+			return -1;
+		}
+		skip = w;
+	}
+	if (skip == total){
+		return 0;
+	}
+	if (out_reserve(client, total - skip)){
+		//what did go out cannot be followed by anything that makes sense
+		jio_shutdown(client -> fd, SHUT_RDWR);
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++){
+		size_t from = skip < iov[i].iov_len ? skip : iov[i].iov_len;
+		skip -= from;
+		memcpy(client -> out + client -> outLen, (char *)iov[i].iov_base + from, iov[i].iov_len - from);
+		client -> outLen += iov[i].iov_len - from;
+	}
+	if (!kept && client -> service != coro_self()){
+		coro_wake(client -> service);
+	}
+	return 0;
+}
+
+/*
+ * Write what is kept for a client, which the caller has locked, once no
+ * thread holds its packets back and no packet is part sent.  What the
+ * connection of a client served by a coroutine does not take is left for
+ * the coroutine.
+ */
+static void send_out(CLIENT *client){
+	//nothing goes out into the middle of a packet being sent
+	if (client -> outLen == 0 || client -> partial){
+		return;
+	}
+	if (client -> service != NULL && local_shm_fd(client -> fd) < 0){
+		struct iovec iov = {client -> out, client -> outLen};
+		ssize_t w = jio_try_writev(client -> fd, &iov, 1);
+		if (w < 0){
+			debug("%ld: %p failed to send held packets", pthread_self(), client);
+			w = client -> outLen;
+		}
+		memmove(client -> out, client -> out + w, client -> outLen - w);
+		client -> outLen -= w;
+		if (client -> outLen > 0 && client -> service != coro_self()){
+			coro_wake(client -> service);
+		}
+		return;
+	}
+	if (jio_write(client -> fd, client -> out, client -> outLen) < 0){
+		debug("%ld: %p failed to send held packets", pthread_self(), client);
+	}
+	client -> outLen = 0;
+}
+
+/*
+ * Send a packet on a client's connection, which the caller has locked.
+ * Responses are tagged with the sequence number of the request they
+ * answer, if it had one, or collected if the request is part of a batch.
+ */
+static int send_locked(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data){
+	int type = pkt -> type & ~(JEUX_SEQ_FLAG | JEUX_MORE_FLAG | JEUX_ZLIB_FLAG);
+	int response = type == JEUX_ACK_PKT || type == JEUX_NACK_PKT || type == JEUX_PONG_PKT;
+	if (response && client -> batch != NULL){
+		return batch_add(client -> batch, pkt, data);
+	}
+	uint32_t *seq = response && client -> requestTagged ? &client -> requestSeq : NULL;
+	//nothing may go into the middle of a packet being sent
+	if (client -> partial || hold_locked(client)){
+		return out_add(client, pkt, seq, data);
+	}
+	if (client -> service != NULL && local_shm_fd(client -> fd) < 0){
+		char head[sizeof(JEUX_PACKET_HEADER) + sizeof(uint32_t)];
+		size_t headsize = proto_pack_packet_seq(pkt, seq, NULL, head);
+		struct iovec iov[2] = {{head, headsize}, {data, data == NULL ? 0 : ntohs(pkt -> size)}};
+		return write_or_keep(client, iov, 2);
+	}
+	return proto_send_packet_seq(client -> fd, pkt, seq, data);
+}
+
+void client_hold_sends(void){
+	holding = 1;
+}
+
+void client_release_sends(void){
+	holding = 0;
+	for (int i = 0; i < heldCount; i++){
+		CLIENT *client = heldClients[i];
+		sem_wait(&client -> seph);
+		client -> held = 0;
+		send_out(client);
+		sem_post(&client -> seph);
+		client_unref(client, "released held packets");
+	}
+	heldCount = 0;
+}
+
+/*
+ * Send a packet with a payload of any length on a client's connection,
+ * which the caller has locked.  An ACK is compressed, if the client was
+ * granted JEUX_CAP_COMPRESS and the payload is large enough to be worth
+ * it, and a payload too large for one packet is sent in fragments, if the
+ * client was granted JEUX_CAP_LARGE_PAYLOAD.  Responses collected in a
+ * batch are neither, since the batch is sent as a whole.
+ *
+ * @param z  The payload already compressed, or NULL to compress it here.
+ * @param zlen  The length of the compressed payload.
+ */
+static int send_payload(CLIENT *client, JEUX_PACKET_HEADER *hdr, void *data, size_t datalen,
+	void *z, size_t zlen){
+	//the caller's header may be sent to others after this
+	JEUX_PACKET_HEADER pkt = *hdr;
+	int type = pkt.type;
+	void *zbuf = NULL;
+	int direct = client -> batch == NULL;
+	if (direct && (client -> caps & JEUX_CAP_COMPRESS) && type == JEUX_ACK_PKT &&
+	    datalen >= COMPRESS_THRESHOLD){
+		if (z == NULL){
+			z = zbuf = compress_payload(data, datalen, &zlen);
+		}
+		if (z != NULL){
+			data = z;
+			datalen = zlen;
+			type |= JEUX_ZLIB_FLAG;
+		}
+	}
+	int fragment = direct && datalen > UINT16_MAX && (client -> caps & JEUX_CAP_LARGE_PAYLOAD);
+	size_t off = 0;
+	int ret = 0;
+	do{
+		size_t len = datalen - off;
+		if (fragment && len > UINT16_MAX){
+			len = UINT16_MAX;
+		}
+		pkt.type = type | (fragment && off + len < datalen ? JEUX_MORE_FLAG : 0);
+		pkt.size = htons(len);
+		ret = send_locked(client, &pkt, data == NULL ? NULL : (char *)data + off);
+		off += len;
+	} while (ret == 0 && fragment && off < datalen);
+	free(zbuf);
+	return ret;
+}
+
 /*
  * Send a packet to a client.  Exclusive access to the network connection
  * is obtained for the duration of this operation, to prevent concurrent
@@ -238,7 +556,7 @@ int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data){
     clock_gettime(CLOCK_REALTIME, &current_time);
 	pkt -> timestamp_sec = htonl(current_time.tv_sec);
 	pkt -> timestamp_nsec = htonl(current_time.tv_nsec);
-	if (proto_send_packet(client_get_fd(player), pkt, data)) {
+	if (send_payload(player, pkt, data, data == NULL ? 0 : ntohs(pkt -> size), NULL, 0)) {
 		sem_post(&player -> seph);
 		return -1;
 	}
@@ -256,18 +574,32 @@ int client_send_packet(CLIENT *player, JEUX_PACKET_HEADER *pkt, void *data){
  * @return 0 if transmission succeeds, -1 otherwise.
  */
 int client_send_ack(CLIENT *client, void *data, size_t datalen){
+	return client_send_ack_compressed(client, data, datalen, NULL, 0);
+}
+
+/*
+ * Send an ACK packet to a client, like client_send_ack(), with the
+ * payload already compressed.
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param data  The payload, or NULL if there is none.
+ * @param datalen  Length of the payload.
+ * @param z  The payload compressed with compress_payload(), or NULL.
+ * @param zlen  Length of the compressed payload.
+ * @return 0 if transmission succeeds, -1 otherwise.
+ */
+int client_send_ack_compressed(CLIENT *client, void *data, size_t datalen, void *z, size_t zlen){
 	if (client == NULL){
 		return -1;
 	}
 	sem_wait(&client -> seph);
-	JEUX_PACKET_HEADER *hdr = calloc(1, sizeof(JEUX_PACKET_HEADER));
-	hdr -> type = JEUX_ACK_PKT;
-	hdr -> size = htons(datalen);
+	JEUX_PACKET_HEADER hdr = {0};
+	hdr.type = JEUX_ACK_PKT;
 	struct timespec current_time;
 	clock_gettime(CLOCK_REALTIME, &current_time);
-	hdr -> timestamp_sec = htonl(current_time.tv_sec);
-	hdr -> timestamp_nsec = htonl(current_time.tv_nsec);
-	if (proto_send_packet(client -> fd, hdr, data)){
+	hdr.timestamp_sec = htonl(current_time.tv_sec);
+	hdr.timestamp_nsec = htonl(current_time.tv_nsec);
+	if (send_payload(client, &hdr, data, datalen, z, zlen)){
 		sem_post(&client -> seph);
 		return -1;
 	}
@@ -295,7 +627,7 @@ int client_send_nack(CLIENT *client){
 	clock_gettime(CLOCK_REALTIME, &current_time);
 	hdr -> timestamp_sec = htonl(current_time.tv_sec);
 	hdr -> timestamp_nsec = htonl(current_time.tv_nsec);
-	if (proto_send_packet(client -> fd, hdr, NULL)){
+	if (send_locked(client, hdr, NULL)){
 		sem_post(&client -> seph);
 		return -1;
 	}
@@ -381,7 +713,64 @@ int client_remove_invitation(CLIENT *client, INVITATION *inv){
  */
 int client_make_invitation(CLIENT *source, CLIENT *target,
 	GAME_ROLE source_role, GAME_ROLE target_role){
+	CLIENT_INVITE_OPTS opts = {client_invitation_ttl_ms, 0, 0};
+	return client_make_invitation_opts(source, target, source_role, target_role, &opts);
+}
+
+/*
+ * Send a packet with no payload that notifies a CLIENT of something that
+ * happened to one of its invitations.
+ */
+static int send_notice(CLIENT *client, JEUX_PACKET_TYPE type, int id){
+	JEUX_PACKET_HEADER hdr = {0};
+	hdr.type = type;
+	hdr.id = id;
+	struct timespec current_time;
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	hdr.timestamp_sec = htonl(current_time.tv_sec);
+	hdr.timestamp_nsec = htonl(current_time.tv_nsec);
+	return client_send_packet(client, &hdr, NULL);
+}
+
+/*
+ * Called from the timer thread when an invitation's time to live has
+ * run out.  Nothing happens if the invitation was accepted or closed
+ * in the meantime, since then it can no longer be closed here.
+ */
+static void invitation_expired(INVITATION *inv){
+	if (inv_close(inv, NULL_ROLE)){
+		return;
+	}
+	debug("%ld: invitation %p expired", pthread_self(), inv);
+	CLIENT *source = inv_get_source(inv);
+	CLIENT *target = inv_get_target(inv);
+	int sourceId = client_remove_invitation(source, inv);
+	int targetId = client_remove_invitation(target, inv);
+	if (sourceId != -1){
+		send_notice(source, JEUX_DECLINED_PKT, sourceId);
+	}
+	if (targetId != -1){
+		send_notice(target, JEUX_REVOKED_PKT, targetId);
+	}
+}
+
+/*
+ * Make a new invitation, like client_make_invitation(), with options.
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param source_role  The GAME_ROLE to be played by the source of the INVITATION.
+ * @param target_role  The GAME_ROLE to be played by the target of the INVITATION.
+ * @param opts  The options for the invitation.
+ * @return the ID assigned by the source to the INVITATION, if the operation
+ * is successful, otherwise -1.
+ */
+int client_make_invitation_opts(CLIENT *source, CLIENT *target,
+	GAME_ROLE source_role, GAME_ROLE target_role, CLIENT_INVITE_OPTS *opts){
 	INVITATION *inv =  inv_create(source, target, source_role, target_role);
+	if (opts -> clock_ms > 0){
+		inv_set_time_control(inv, opts -> clock_ms, opts -> increment_ms);
+	}
 	int sourceId= client_add_invitation(source, inv);
 	int targetId = client_add_invitation(target, inv);
 	if (sourceId == -1){
@@ -390,6 +779,9 @@ int client_make_invitation(CLIENT *source, CLIENT *target,
 	else if (targetId == -1){
 		return -1;
 	}
+	if (opts -> ttl_ms > 0){
+		inv_set_expiry(inv, opts -> ttl_ms, invitation_expired);
+	}
 	//sending packet accepted packet to the target client
 	JEUX_PACKET_HEADER *hdr = calloc(1, sizeof(JEUX_PACKET_HEADER));
 	hdr -> type = JEUX_INVITED_PKT;
@@ -518,6 +910,60 @@ int client_decline_invitation(CLIENT *client, int id){
 	return 0;
 
 }
+/*
+ * Post the result of a finished GAME and record it in the archive
+ * together with the ratings from before and after the result was posted.
+ *
+ * @param game  The GAME that has ended.
+ * @param first  The PLAYER in the first player role.
+ * @param second  The PLAYER in the second player role.
+ * @param result  0 if drawn, 1 if the first player won, 2 if the second.
+ * @param reason  Why the game ended (ARCHIVE_END_*).
+ */
+static void post_result(GAME *game, PLAYER *first, PLAYER *second, int result, int reason){
+	double before[2], after[2];
+	player_post_result_ratings(first, second, result, before, after);
+	archive_game(game, first, second, result, reason, before, after);
+}
+
+/*
+ * Called from the timer thread when a player in a timed game has run
+ * out of time.  The game is already over at this point, so all that is
+ * left is what client_make_move() does when a move ends a game.
+ */
+static void flag_fell(GAME *game, GAME_ROLE loser, void *arg){
+	INVITATION *inv = arg;
+	GAME_ROLE winner = loser == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+	CLIENT *source = inv_get_source(inv);
+	CLIENT *target = inv_get_target(inv);
+	spec_publish(game, JEUX_ENDED_PKT, winner);
+	if (inv_get_source_role(inv) == FIRST_PLAYER_ROLE){
+		post_result(game, client_get_player(source), client_get_player(target), winner, ARCHIVE_END_TIME);
+	}
+	else{
+		post_result(game, client_get_player(target), client_get_player(source), winner, ARCHIVE_END_TIME);
+	}
+	CLIENT *clients[2] = {source, target};
+	for (int i = 0; i < 2; i++){
+		int id = client_remove_invitation(clients[i], inv);
+		if (id != -1){
+			JEUX_PACKET_HEADER hdr = {0};
+			hdr.type = JEUX_ENDED_PKT;
+			hdr.id = id;
+			hdr.role = winner;
+			struct timespec current_time;
+			clock_gettime(CLOCK_REALTIME, &current_time);
+			hdr.timestamp_sec = htonl(current_time.tv_sec);
+			hdr.timestamp_nsec = htonl(current_time.tv_nsec);
+			client_send_packet(clients[i], &hdr, NULL);
+		}
+	}
+}
+
+static void clock_stopped(void *arg){
+	inv_unref(arg, "game clock stopped");
+}
+
 /*
  * Accept an INVITATION previously made with the specified CLIENT as
  * the target.  A new GAME is created and a reference to it is saved
@@ -568,14 +1014,31 @@ int client_accept_invitation(CLIENT *client, int id, char **strp){
 	if (gid == -1){
 		return -1;
 	}
-	char * gs = game_unparse_state(inv_get_game(client -> listOfInv[id]));
-	debug("%ld: game state %s", pthread_self(), gs);
 	if (inv_get_source_role(client -> listOfInv[id]) == FIRST_PLAYER_ROLE){
+		spec_game_started(inv_get_game(client -> listOfInv[id]),
+			client_get_player(otherC), client_get_player(client));
+	}
+	else{
+		spec_game_started(inv_get_game(client -> listOfInv[id]),
+			client_get_player(client), client_get_player(otherC));
+	}
+	GAME *game = inv_get_game(client -> listOfInv[id]);
+	uint64_t clockBase, clockIncrement;
+	if (inv_get_time_control(client -> listOfInv[id], &clockBase, &clockIncrement)){
+		INVITATION *inv = inv_ref(client -> listOfInv[id], "held by game clock");
+		if (game_set_clock(game, clockBase, clockIncrement, flag_fell, clock_stopped, inv)){
+			inv_unref(inv, "game clock not started");
+		}
+	}
+	if (inv_get_source_role(client -> listOfInv[id]) == FIRST_PLAYER_ROLE){
+		char gs[GAME_ENC_MAX_SIZE];
+		size_t len = game_encode_state(game,
+			game_full_encoding(client_get_board_encoding(otherC)), gs, sizeof(gs));
 		JEUX_PACKET_HEADER *hdr = calloc(1, sizeof(JEUX_PACKET_HEADER));
 		hdr->type = JEUX_ACCEPTED_PKT;
 		hdr->id = gid;
-		hdr->size = htons(strlen(gs));
-		debug("%ld: statelength %ld", pthread_self(), strlen(gs));
+		hdr->size = htons(len);
+		debug("%ld: statelength %ld", pthread_self(), len);
 		struct timespec current_time;
 		clock_gettime(CLOCK_REALTIME, &current_time);
 		hdr -> timestamp_sec = htonl(current_time.tv_sec);
@@ -601,6 +1064,9 @@ int client_accept_invitation(CLIENT *client, int id, char **strp){
 		free(hdr);
 		return -1;
 	}
+	char *gs = calloc(1, GAME_ENC_MAX_SIZE + 1);
+	game_encode_state(game, game_full_encoding(client_get_board_encoding(client)),
+		gs, GAME_ENC_MAX_SIZE);
 	*strp = gs;
 	free(hdr);
 	debug("%ld: sending game state to self", pthread_self());
@@ -642,17 +1108,24 @@ int client_resign_game(CLIENT *client, int id){
 		role = inv_get_source_role(client -> listOfInv[id]);
 		otherC = inv_get_target(client -> listOfInv[id]);
 	}
+	INVITATION *inv = client -> listOfInv[id];
+	GAME *g = inv_get_game(inv);
+	//only a game still in progress can be resigned, and only once
+	if (g == NULL || game_is_over(g) || inv_close(inv, role)){
+		return -1;
+	}
 	if (role == FIRST_PLAYER_ROLE){
-		player_post_result(client_get_player(client), client_get_player(otherC), 2);
+		post_result(g, client_get_player(client), client_get_player(otherC), 2, ARCHIVE_END_RESIGN);
 	}
 	else{
-		player_post_result(client_get_player(otherC), client_get_player(client), 1);
+		post_result(g, client_get_player(otherC), client_get_player(client), 1, ARCHIVE_END_RESIGN);
 	}
-	inv_close(client -> listOfInv[id], role);
-	if (client_remove_invitation(client, client -> listOfInv[id]) == -1){
+	spec_publish(g, JEUX_ENDED_PKT,
+		role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE);
+	if (client_remove_invitation(client, inv) == -1){
 		return -1;
 	}
-	int otherId = client_remove_invitation(otherC, client -> listOfInv[id]);
+	int otherId = client_remove_invitation(otherC, inv);
 	if (otherId == -1){
 		return -1;
 	}
@@ -717,21 +1190,22 @@ int client_make_move(CLIENT *client, int id, char *move){
 		role = inv_get_source_role(client -> listOfInv[id]);
 		otherC = inv_get_target(client -> listOfInv[id]);
 	}
-	GAME_MOVE * m = game_parse_move(g, role, move);
-	if (game_apply_move(g, m)){
+	if (game_play_move(g, role, move)){
 		debug("%ld: fail apply move", pthread_self());
 		return -1;
 	}
 	if (game_is_over(g)){
 		GAME_ROLE winner = game_get_winner(g);
+		spec_publish(g, JEUX_MOVED_PKT, NULL_ROLE);
+		spec_publish(g, JEUX_ENDED_PKT, winner);
 		CLIENT *source = inv_get_source(client -> listOfInv[id]);
 		CLIENT *target= inv_get_target(client -> listOfInv[id]);
 		GAME_ROLE sR = inv_get_source_role(client -> listOfInv[id]);
 		if (sR == FIRST_PLAYER_ROLE){
-			player_post_result(client_get_player(source), client_get_player(target), winner);
+			post_result(g, client_get_player(source), client_get_player(target), winner, ARCHIVE_END_NORMAL);
 		}
 		else{
-			player_post_result(client_get_player(target), client_get_player(source), winner);
+			post_result(g, client_get_player(target), client_get_player(source), winner, ARCHIVE_END_NORMAL);
 		}
 		JEUX_PACKET_HEADER *hdr = calloc(1, sizeof(JEUX_PACKET_HEADER));
 		int temp = client_remove_invitation(source, client -> listOfInv[id]);
@@ -772,11 +1246,13 @@ int client_make_move(CLIENT *client, int id, char *move){
 		debug("%ld: fail get inv id", pthread_self());
 		return -1;
 	}
-	char * state = game_unparse_state(g);
+	spec_publish(g, JEUX_MOVED_PKT, NULL_ROLE);
+	char state[GAME_ENC_MAX_SIZE];
+	size_t len = game_encode_state(g, client_get_board_encoding(otherC), state, sizeof(state));
 	JEUX_PACKET_HEADER *hdr = calloc(1, sizeof(JEUX_PACKET_HEADER));
 	hdr->type = JEUX_MOVED_PKT;
 	hdr->id = gid;
-	hdr->size = htons(18);
+	hdr->size = htons(len);
 	struct timespec current_time;
 	clock_gettime(CLOCK_REALTIME, &current_time);
 	hdr -> timestamp_sec = htonl(current_time.tv_sec);
@@ -786,8 +1262,642 @@ int client_make_move(CLIENT *client, int id, char *move){
 		debug("%ld: fail send", pthread_self());
 		return -1;
 	}
-	client_send_ack(client, NULL, 0);
+	uint64_t first, second;
+	if (game_get_clock(g, &first, &second) == 0){
+		//in a timed game, the mover is told how much time each player has left
+		char clocks[48];
+		int l = snprintf(clocks, sizeof(clocks), "%llu\t%llu",
+			(unsigned long long)first, (unsigned long long)second);
+		client_send_ack(client, clocks, l);
+	}
+	else{
+		client_send_ack(client, NULL, 0);
+	}
 	free(hdr);
 	debug("%ld: send successfuly", pthread_self());
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Lay out the part of a packet that has yet to be sent, after skip bytes.
+ *
+ * @return the number of buffers used, at most two.
+ */
+static int packet_rest(JEUX_PACKET_HEADER *pkt, void *data, size_t skip, struct iovec *iov){
+	size_t datasize = data == NULL ? 0 : ntohs(pkt -> size);
+	int n = 0;
+	if (skip < sizeof(JEUX_PACKET_HEADER)){
+		iov[n].iov_base = (char *)pkt + skip;
+		iov[n++].iov_len = sizeof(JEUX_PACKET_HEADER) - skip;
+		skip = 0;
+	}
+	else{
+		skip -= sizeof(JEUX_PACKET_HEADER);
+	}
+	if (datasize > skip){
+		iov[n].iov_base = (char *)data + skip;
+		iov[n++].iov_len = datasize - skip;
+	}
+	return n;
+}
+
+/*
+ * Try to send a packet to a client without blocking.  If some other
+ * thread is currently sending to the client, or the socket cannot accept
+ * any more data right now, then nothing is sent and the caller may try
+ * again later.  A packet that the socket only partly accepts is left for
+ * the caller to finish by calling again with the same packet, while
+ * everything else sent to the client is kept back behind it, or to hand
+ * over with client_finish_packet().
+ *
+ * @param client  The CLIENT who should be sent the packet.
+ * @param pkt  The header of the packet to be sent.
+ * @param data  Data payload to be sent, or NULL if none.
+ * @param sent  How much of the packet went out in earlier calls, 0 for a
+ * new packet; updated with what goes out in this one.
+ * @return 1 if the packet was sent, 0 if it was not, or only partly, because
+ * the send would have blocked, -1 if the connection failed.
+ */
+int client_try_send_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data, size_t *sent){
+	if (client == NULL || pkt == NULL || sent == NULL){
+		return -1;
+	}
+	if (sem_trywait(&client -> seph)){
+		return 0;
+	}
+	if (*sent == 0){
+		struct timespec current_time;
+		clock_gettime(CLOCK_REALTIME, &current_time);
+		pkt -> timestamp_sec = htonl(current_time.tv_sec);
+		pkt -> timestamp_nsec = htonl(current_time.tv_nsec);
+		if (client -> partial || hold_locked(client) || local_shm_fd(client -> fd) >= 0){
+			//going behind what is held back, or through shared memory, never waits on the socket
+			int ret = client -> partial || hold_locked(client) ? out_add(client, pkt, NULL, data)
+			                                                   : proto_send_packet_seq(client -> fd, pkt, NULL, data);
+			sem_post(&client -> seph);
+			return ret ? -1 : 1;
+		}
+		if (client -> outLen > 0){
+			//the connection has yet to take what was sent to it before
+			sem_post(&client -> seph);
+			return 0;
+		}
+	}
+	struct iovec iov[2];
+	int n = packet_rest(pkt, data, *sent, iov);
+	ssize_t w = jio_try_writev(client -> fd, iov, n);
+	if (w < 0){
+		client -> partial = 0;
+		jio_shutdown(client -> fd, SHUT_RDWR);
+		sem_post(&client -> seph);
+		return -1;
+	}
+	*sent += w;
+	if (*sent < sizeof(JEUX_PACKET_HEADER) + (data == NULL ? 0 : ntohs(pkt -> size))){
+		client -> partial = *sent > 0;
+		sem_post(&client -> seph);
+		return 0;
+	}
+	//what was kept back behind the packet can go now
+	client -> partial = 0;
+	send_out(client);
+	sem_post(&client -> seph);
+	return 1;
+}
+
+/*
+ * Hand the rest of a packet that client_try_send_packet() only partly
+ * sent over to the client, to go out ahead of anything kept back behind
+ * it, for a caller that will not try it again.
+ *
+ * @param client  The CLIENT who was being sent the packet.
+ * @param pkt  The header of the packet.
+ * @param data  Data payload of the packet, or NULL if none.
+ * @param sent  How much of the packet went out.
+ */
+void client_finish_packet(CLIENT *client, JEUX_PACKET_HEADER *pkt, void *data, size_t sent){
+	struct iovec iov[2];
+	int n = packet_rest(pkt, data, sent, iov);
+	size_t rest = 0;
+	for (int i = 0; i < n; i++){
+		rest += iov[i].iov_len;
+	}
+	sem_wait(&client -> seph);
+	if (!client -> partial){
+		//the connection failed in the meantime
+		sem_post(&client -> seph);
+		return;
+	}
+	client -> partial = 0;
+	if (out_reserve(client, rest)){
+		jio_shutdown(client -> fd, SHUT_RDWR);
+		client -> outLen = 0;
+		sem_post(&client -> seph);
+		return;
+	}
+	memmove(client -> out + rest, client -> out, client -> outLen);
+	for (int i = 0, off = 0; i < n; off += iov[i].iov_len, i++){
+		memcpy(client -> out + off, iov[i].iov_base, iov[i].iov_len);
+	}
+	client -> outLen += rest;
+	send_out(client);
+	sem_post(&client -> seph);
+}
+
+/*
+ * Say which coroutine serves a client's connection.
+ *
+ * @param client  The CLIENT.
+ * @param service  The coroutine, as returned by coro_self(), or NULL.
+ */
+void client_set_service(CLIENT *client, void *service){
+	sem_wait(&client -> seph);
+	client -> service = service;
+	sem_post(&client -> seph);
+}
+
+/*
+ * Write what a client's connection did not take when it was sent, waiting
+ * for the connection to take more.  Only the coroutine serving the client
+ * calls this, and it lets the other coroutines of its thread run while it
+ * waits.
+ *
+ * @param client  The CLIENT.
+ * @return 0 once all of it is written, or -1 if the connection failed,
+ * in which case it is shut down.
+ */
+int client_flush(CLIENT *client){
+	while (1){
+		sem_wait(&client -> seph);
+		//a thread holding packets back writes them, and what was kept before them, itself,
+		//as does the caller of client_try_send_packet() that leaves a packet part sent
+		if (client -> held || client -> partial || client -> outLen == 0){
+			sem_post(&client -> seph);
+			return 0;
+		}
+		struct iovec iov = {client -> out, client -> outLen};
+		ssize_t w = jio_try_writev(client -> fd, &iov, 1);
+		if (w < 0){
+			debug("%ld: %p failed to send kept packets", pthread_self(), client);
+			client -> outLen = 0;
+			jio_shutdown(client -> fd, SHUT_RDWR);
+			sem_post(&client -> seph);
+			return -1;
+		}
+		memmove(client -> out, client -> out + w, client -> outLen - w);
+		client -> outLen -= w;
+		int more = client -> outLen > 0;
+		sem_post(&client -> seph);
+		if (!more){
+			return 0;
+		}
+		if (coro_wait_fd(client -> fd, POLLOUT) < 0){
+			return -1;
+		}
+	}
+}
+
+/*
+ * Get the spectator session of a CLIENT.
+ *
+ * @param client  The CLIENT to be queried.
+ * @return the spectator session, or NULL if the client is not watching.
+ */
+struct spec_session *client_get_spec_session(CLIENT *client){
+	if (client == NULL){
+		return NULL;
+	}
+	return client -> spec;
+}
+
+/*
+ * Set the spectator session of a CLIENT.
+ *
+ * @param client  The CLIENT to be updated.
+ * @param session  The new spectator session, or NULL.
+ */
+void client_set_spec_session(CLIENT *client, struct spec_session *session){
+	if (client != NULL){
+		client -> spec = session;
+	}
+}
+
+/*
+ * Get the encoding in which game states are sent to a CLIENT.
+ *
+ * @param client  The CLIENT to be queried.
+ * @return the GAME_ENCODING selected by the client, GAME_ENC_ASCII
+ * by default.
+ */
+GAME_ENCODING client_get_board_encoding(CLIENT *client){
+	if (client == NULL){
+		return GAME_ENC_ASCII;
+	}
+	return client -> boardEncoding;
+}
+
+/*
+ * Select the encoding in which game states are sent to a CLIENT.
+ *
+ * @param client  The CLIENT to be updated.
+ * @param enc  The encoding to use from now on.
+ * @return 0 if successful, -1 if enc is not a valid encoding.
+ */
+int client_set_board_encoding(CLIENT *client, int enc){
+	if (client == NULL || enc < 0 || enc >= GAME_ENC_COUNT){
+		return -1;
+	}
+	client -> boardEncoding = enc;
+	return 0;
+}
+
+/*
+ * Send a PING to a client, unless some other thread is sending to it at
+ * the moment, in which case the connection is evidently not idle on our
+ * side and the ping can wait.  The heartbeat semaphore must be held.
+ */
+static void send_ping(CLIENT *client){
+	if (sem_trywait(&client -> seph)){
+		return;
+	}
+	char rtt[32];
+	int len = 0;
+	if (client -> srtt != 0){
+		len = snprintf(rtt, sizeof(rtt), "%u\t%u", client -> srtt, client -> rttvar);
+	}
+	JEUX_PACKET_HEADER hdr = {0};
+	hdr.type = JEUX_PING_PKT;
+	hdr.size = htons(len);
+	struct timespec current_time;
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	hdr.timestamp_sec = htonl(current_time.tv_sec);
+	hdr.timestamp_nsec = htonl(current_time.tv_nsec);
+	//as in client_try_send_packet(), a ping goes behind what is held back or kept
+	if (client -> held || client -> partial || client -> outLen > 0){
+		out_add(client, &hdr, NULL, len ? rtt : NULL);
+		sem_post(&client -> seph);
+		return;
+	}
+	//the socket of a shared-memory client only carries wakeups
+	if (local_shm_fd(client -> fd) >= 0){
+		if (proto_send_packet_seq(client -> fd, &hdr, NULL, len ? rtt : NULL)){
+			jio_shutdown(client -> fd, SHUT_RDWR);
+		}
+		sem_post(&client -> seph);
+		return;
+	}
+	struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {rtt, len}};
+	struct msghdr msg = {0};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = len ? 2 : 1;
+	ssize_t n = sendmsg(client -> fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n >= 0 && n != sizeof(hdr) + len){
+		//half a packet can't be taken back, and the socket is clearly not draining
+		jio_shutdown(client -> fd, SHUT_RDWR);
+	}
+	sem_post(&client -> seph);
+}
+
+/*
+ * Called from the timer thread to check on a client's connection.
+ * A connection that has been idle for half the timeout is pinged, and
+ * one that has been idle for the whole timeout is shut down, which makes
+ * its service thread see EOF and log the client out as usual.
+ */
+static void heartbeat_expired(void *arg){
+	CLIENT *client = arg;
+	sem_wait(&client -> heartbeatSeph);
+	if (client -> heartbeatStopped){
+		sem_post(&client -> heartbeatSeph);
+		client_unref(client, "heartbeat stopped");
+		return;
+	}
+	uint64_t now = timer_now_ms();
+	uint64_t last = __atomic_load_n(&client -> lastActivity, __ATOMIC_RELAXED);
+	uint64_t idle = now - last;
+	uint64_t next;
+	if (idle >= client_idle_timeout_ms){
+		debug("%ld: reaping client %p idle for %lu ms", pthread_self(), client, idle);
+		jio_shutdown(client -> fd, SHUT_RDWR);
+		sem_post(&client -> heartbeatSeph);
+		client_unref(client, "heartbeat reaped");
+		return;
+	}
+	if (idle >= client_idle_timeout_ms / 2){
+		send_ping(client);
+		next = last + client_idle_timeout_ms;
+	}
+	else{
+		next = last + client_idle_timeout_ms / 2;
+	}
+	//the reference held for the expiry that just ran goes with the new one
+	timer_arm_at(&client -> heartbeat, next);
+	sem_post(&client -> heartbeatSeph);
+}
+
+/*
+ * Start watching a client's connection for idleness, if an idle timeout
+ * has been configured.
+ *
+ * @param client  The CLIENT whose connection is to be watched.
+ */
+void client_start_heartbeat(CLIENT *client){
+	if (client == NULL || client_idle_timeout_ms == 0){
+		return;
+	}
+	sem_wait(&client -> heartbeatSeph);
+	client -> heartbeatStopped = 0;
+	__atomic_store_n(&client -> lastActivity, timer_now_ms(), __ATOMIC_RELAXED);
+	timer_setup(&client -> heartbeat, heartbeat_expired, client);
+	client_ref(client, "heartbeat armed");
+	if (timer_arm(&client -> heartbeat, client_idle_timeout_ms / 2) < 0){
+		client -> heartbeatStopped = 1;
+		sem_post(&client -> heartbeatSeph);
+		client_unref(client, "heartbeat not armed");
+		return;
+	}
+	sem_post(&client -> heartbeatSeph);
+}
+
+/*
+ * Stop watching a client's connection.  Once this returns, the heartbeat
+ * will not touch the connection again, so it may be closed.
+ *
+ * @param client  The CLIENT whose connection was being watched.
+ */
+void client_stop_heartbeat(CLIENT *client){
+	if (client == NULL){
+		return;
+	}
+	sem_wait(&client -> heartbeatSeph);
+	int wasRunning = !client -> heartbeatStopped;
+	client -> heartbeatStopped = 1;
+	int cancelled = wasRunning && timer_cancel(&client -> heartbeat);
+	sem_post(&client -> heartbeatSeph);
+	if (cancelled){
+		client_unref(client, "heartbeat cancelled");
+	}
+}
+
+/*
+ * Record that a packet has been received from a client.
+ *
+ * @param client  The CLIENT from which the packet was received.
+ */
+void client_note_activity(CLIENT *client){
+	if (client == NULL){
+		return;
+	}
+	//the heartbeat catches up lazily, so the timer is not touched here
+	__atomic_store_n(&client -> lastActivity, timer_now_ms(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Set the sequence number with which the responses to a client's current
+ * request are tagged.
+ *
+ * @param client  The CLIENT that sent the request.
+ * @param seq  The request's sequence number, or NULL if it is untagged.
+ */
+void client_set_request_seq(CLIENT *client, uint32_t *seq){
+	if (client == NULL){
+		return;
+	}
+	client -> requestTagged = seq != NULL;
+	client -> requestSeq = seq != NULL ? *seq : 0;
+}
+
+/*
+ * Collect the responses sent to a client in a batch, or stop doing so.
+ *
+ * @param client  The CLIENT.
+ * @param batch  The batch, or NULL.
+ */
+void client_set_batch(CLIENT *client, CLIENT_BATCH *batch){
+	if (client == NULL){
+		return;
+	}
+	client -> batch = batch;
+}
+
+/*
+ * Get the capabilities granted to a client.
+ *
+ * @param client  The CLIENT to be queried.
+ * @return the mask of JEUX_CAPABILITY bits, 0 for a client that made no
+ * offer.
+ */
+unsigned client_get_caps(CLIENT *client){
+	if (client == NULL){
+		return 0;
+	}
+	return client -> caps;
+}
+
+/*
+ * Set the capabilities granted to a client.
+ *
+ * @param client  The CLIENT to be updated.
+ * @param caps  The mask of JEUX_CAPABILITY bits.
+ */
+void client_set_caps(CLIENT *client, unsigned caps){
+	if (client == NULL){
+		return;
+	}
+	client -> caps = caps;
+}
+
+/*
+ * Update a client's round-trip time estimate from a PONG packet.
+ *
+ * @param client  The CLIENT that sent the PONG.
+ * @param hdr  The header of the PONG packet, which echoes the timestamp
+ * of the PING it answers.
+ */
+void client_note_pong(CLIENT *client, JEUX_PACKET_HEADER *hdr){
+	if (client == NULL || hdr == NULL){
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t sent = (int64_t)ntohl(hdr -> timestamp_sec) * 1000000 + ntohl(hdr -> timestamp_nsec) / 1000;
+	int64_t sample = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - sent;
+	if (sample <= 0 || sample > 60 * 1000000){
+		//not an echo of one of our pings
+		return;
+	}
+	sem_wait(&client -> heartbeatSeph);
+	if (client -> srtt == 0){
+		client -> srtt = sample;
+		client -> rttvar = sample / 2;
+	}
+	else{
+		//the usual smoothing, as TCP does (RFC 6298)
+		int64_t err = sample - (int64_t)client -> srtt;
+		client -> rttvar = (3 * (int64_t)client -> rttvar + (err < 0 ? -err : err)) / 4;
+		client -> srtt = (7 * (int64_t)client -> srtt + sample) / 8;
+	}
+	debug("%ld: client %p rtt sample %ld us, srtt %u us", pthread_self(), client, (long)sample, client -> srtt);
+	sem_post(&client -> heartbeatSeph);
+}
+
+/*
+ * Get a client's round-trip time estimate.
+ *
+ * @param client  The CLIENT to be queried.
+ * @param srtt_us  Variable into which the smoothed round-trip time is stored.
+ * @param rttvar_us  Variable into which its variation is stored.
+ * @return 0 if there is an estimate, -1 if no PONG has been received yet.
+ */
+int client_get_rtt(CLIENT *client, uint32_t *srtt_us, uint32_t *rttvar_us){
+	if (client == NULL){
+		return -1;
+	}
+	sem_wait(&client -> heartbeatSeph);
+	*srtt_us = client -> srtt;
+	*rttvar_us = client -> rttvar;
+	sem_post(&client -> heartbeatSeph);
+	return *srtt_us == 0 ? -1 : 0;
+}
+
+/*
+ * Find the ID a CLIENT has for an INVITATION.
+ */
+static int invitation_id(CLIENT *client, INVITATION *inv){
+	int id = -1;
+	sem_wait(&client -> seph);
+	for (int i = 0; i < MAX_CLIENTS; i++){
+		if (client -> listOfInv[i] == inv){
+			id = i;
+			break;
+		}
+	}
+	sem_post(&client -> seph);
+	return id;
+}
+
+/*
+ * Take snapshots of the invitations of which a CLIENT is the source.
+ *
+ * @param client  The CLIENT.
+ * @param snaps  Caller-supplied array into which the snapshots are stored.
+ * @param max  Size of the snaps array.
+ * @return the number of snapshots stored.
+ */
+int client_snapshot_invitations(CLIENT *client, CLIENT_INV_SNAPSHOT *snaps, int max){
+	if (client == NULL || snaps == NULL){
+		return 0;
+	}
+	INVITATION *invs[MAX_CLIENTS];
+	sem_wait(&client -> seph);
+	memcpy(invs, client -> listOfInv, sizeof(invs));
+	sem_post(&client -> seph);
+	int n = 0;
+	for (int i = 0; i < MAX_CLIENTS && n < max; i++){
+		if (invs[i] == NULL || inv_get_source(invs[i]) != client){
+			continue;
+		}
+		CLIENT_INV_SNAPSHOT *snap = &snaps[n];
+		memset(snap, 0, sizeof(*snap));
+		snap -> source = client;
+		snap -> target = inv_get_target(invs[i]);
+		snap -> source_id = i;
+		snap -> target_id = invitation_id(snap -> target, invs[i]);
+		if (snap -> target_id == -1){
+			continue;
+		}
+		snap -> source_role = inv_get_source_role(invs[i]);
+		snap -> target_role = inv_get_target_role(invs[i]);
+		inv_get_time_control(invs[i], &snap -> clock_ms, &snap -> increment_ms);
+		GAME *game = inv_get_game(invs[i]);
+		if (game != NULL){
+			if (game_snapshot(game, &snap -> game)){
+				continue;
+			}
+			snap -> accepted = 1;
+		}
+		else{
+			snap -> expires_ms = inv_get_expiry(invs[i]);
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Put an INVITATION into a particular slot of a CLIENT's list.
+ */
+static int put_invitation(CLIENT *client, int id, INVITATION *inv){
+	if (id < 0 || id >= MAX_CLIENTS){
+		return -1;
+	}
+	sem_wait(&client -> seph);
+	if (client -> listOfInv[id] != NULL){
+		sem_post(&client -> seph);
+		return -1;
+	}
+	client -> listOfInv[id] = inv_ref(inv, "restored to client inv list");
+	sem_post(&client -> seph);
+	return 0;
+}
+
+/*
+ * Rebuild an INVITATION from a snapshot.
+ *
+ * @param source  The CLIENT that is the source of the INVITATION.
+ * @param target  The CLIENT that is the target of the INVITATION.
+ * @param snap  The snapshot.
+ * @return 0 if successful, otherwise -1.
+ */
+int client_restore_invitation(CLIENT *source, CLIENT *target, CLIENT_INV_SNAPSHOT *snap){
+	if (source == NULL || target == NULL || snap == NULL){
+		return -1;
+	}
+	INVITATION *inv = inv_create(source, target, snap -> source_role, snap -> target_role);
+	if (inv == NULL){
+		return -1;
+	}
+	if (snap -> clock_ms > 0){
+		inv_set_time_control(inv, snap -> clock_ms, snap -> increment_ms);
+	}
+	GAME *game = NULL;
+	if (snap -> accepted){
+		game = game_restore(&snap -> game);
+		if (game == NULL || inv_adopt_game(inv, game)){
+			if (game != NULL){
+				game_unref(game, "restored game not adopted");
+			}
+			inv_unref(inv, "restore failed");
+			return -1;
+		}
+	}
+	if (put_invitation(source, snap -> source_id, inv)){
+		inv_unref(inv, "restore failed");
+		return -1;
+	}
+	if (put_invitation(target, snap -> target_id, inv)){
+		client_remove_invitation(source, inv);
+		inv_unref(inv, "restore failed");
+		return -1;
+	}
+	if (game != NULL){
+		if (snap -> source_role == FIRST_PLAYER_ROLE){
+			spec_game_started(game, client_get_player(source), client_get_player(target));
+		}
+		else{
+			spec_game_started(game, client_get_player(target), client_get_player(source));
+		}
+		if (snap -> game.clocked){
+			inv_ref(inv, "held by game clock");
+			if (game_restore_clock(game, &snap -> game, flag_fell, clock_stopped, inv)){
+				inv_unref(inv, "game clock not restarted");
+			}
+		}
+	}
+	else if (snap -> expires_ms != 0){
+		inv_set_expiry_at(inv, snap -> expires_ms, invitation_expired);
+	}
+	//the two lists hold the invitation from here on
+	inv_unref(inv, "restored");
+	return 0;
+}
@@ -9,12 +9,18 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <semaphore.h>
+#include <stdint.h>
 
 #include "debug.h"
 #include "protocol.h"
 #include "client_registry.h"
 #include "client.h"
 #include "player.h"
+#include "player_ext.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "ebr.h"
+#include "jio.h"
 
 /*
  * The CLIENT_REGISTRY type is a structure that defines the state of a
@@ -32,15 +38,144 @@
  * @return  the newly initialized client registry, or NULL if initialization
  * fails.
  */
+typedef struct creg_entry{
+    char *name;
+    CLIENT *client;
+    PLAYER *player;
+} CREG_ENTRY;
+
+/*
+ * A published copy of a shard's part of the username index.  A view is
+ * never changed once it has been published; a change to the index
+ * publishes a new view, and the old one is freed once no reader can
+ * still be looking at it.
+ */
+typedef struct creg_view{
+    EBR_NODE reclaim;
+    int indexed;
+    CREG_ENTRY index[];             //sorted by username
+} CREG_VIEW;
+
+/*
+ * Clients are spread over the shards by file descriptor, and index
+ * entries by username, so that mutations of different shards do not
+ * contend.  Each shard's mutex only orders the mutations of that shard;
+ * readers of the index never take it.
+ */
+typedef struct creg_shard{
+    pthread_mutex_t mutex;
+    CLIENT *clients[MAX_CLIENTS];
+    CREG_VIEW *view;
+    uint64_t version;               //views published so far
+    char pad[64];                   //keep shards' mutexes off each other's cache lines
+} CREG_SHARD;
+
 typedef struct client_registry{
     int clientsAmount;
-    CLIENT *clients[MAX_CLIENTS];
-    pthread_mutex_t mutex;
+    pthread_mutex_t mutex;          //orders changes of clientsAmount
     sem_t semaphore;
+    CREG_SHARD shards[CREG_SHARDS];
 
 } CLIENT_REGISTRY;
+
+static CREG_VIEW *view_alloc(int indexed){
+    CREG_VIEW *v = malloc(sizeof(CREG_VIEW) + indexed * sizeof(CREG_ENTRY));
+    if (v != NULL){
+        v -> indexed = indexed;
+    }
+    return v;
+}
+
+static CREG_VIEW *view_get(CREG_SHARD *shard){
+    return __atomic_load_n(&shard -> view, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Publish a new view of a shard, and retire the old one.
+ * The shard mutex must be held, and is released.
+ */
+static void view_publish(CREG_SHARD *shard, CREG_VIEW *view){
+    CREG_VIEW *old = __atomic_exchange_n(&shard -> view, view, __ATOMIC_SEQ_CST);
+    //only once the view is there to be read
+    __atomic_add_fetch(&shard -> version, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&shard -> mutex);
+    ebr_retire(&old -> reclaim, free, old);
+}
+
+/*
+ * Find the position of the first index entry whose username is not
+ * less than the given name.
+ */
+static int index_lower_bound(CREG_VIEW *view, char *name){
+    int lo = 0;
+    int hi = view -> indexed;
+    while (lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(view -> index[mid].name, name) < 0){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static CREG_SHARD *name_shard(CLIENT_REGISTRY *cr, char *name){
+    //FNV-1a
+    uint32_t h = 2166136261u;
+    for (unsigned char *p = (unsigned char *)name; *p != '\0'; p++){
+        h = (h ^ *p) * 16777619u;
+    }
+    return &cr -> shards[h % CREG_SHARDS];
+}
+
+static CREG_SHARD *fd_shard(CLIENT_REGISTRY *cr, int fd){
+    return &cr -> shards[(unsigned)fd % CREG_SHARDS];
+}
+
+/*
+ * Remove the index entry for a client from a shard, if it has one there.
+ *
+ * @return 0 if an entry was removed, otherwise -1.
+ */
+static int index_remove_from(CREG_SHARD *shard, CLIENT *client){
+    pthread_mutex_lock(&shard -> mutex);
+    CREG_VIEW *old = shard -> view;
+    for (int i = 0; i < old -> indexed; i++){
+        if (old -> index[i].client == client){
+            CREG_VIEW *v = view_alloc(old -> indexed - 1);
+            if (v == NULL){
+                break;
+            }
+            memcpy(v -> index, old -> index, i * sizeof(CREG_ENTRY));
+            memcpy(&v -> index[i], &old -> index[i + 1], (old -> indexed - i - 1) * sizeof(CREG_ENTRY));
+            view_publish(shard, v);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&shard -> mutex);
+    return -1;
+}
+
+/*
+ * Remove the index entry for a client, if it has one.
+ */
+static int index_remove(CLIENT_REGISTRY *cr, CLIENT *client){
+    PLAYER *player = client_get_player(client);
+    if (player != NULL){
+        return index_remove_from(name_shard(cr, player_get_name(player)), client);
+    }
+    for (int s = 0; s < CREG_SHARDS; s++){
+        if (index_remove_from(&cr -> shards[s], client) == 0){
+            return 0;
+        }
+    }
+    return -1;
+}
+
 CLIENT_REGISTRY *creg_init(){
-	CLIENT_REGISTRY *clientReg = malloc(sizeof(CLIENT_REGISTRY));
+	CLIENT_REGISTRY *clientReg = calloc(1, sizeof(CLIENT_REGISTRY));
     if (clientReg == NULL) {
         return NULL;
     }
@@ -54,14 +189,25 @@ CLIENT_REGISTRY *creg_init(){
         free(clientReg);
         return NULL;
     }
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        clientReg->clients[i] = NULL;
+    for (int s = 0; s < CREG_SHARDS; s++) {
+        CREG_SHARD *shard = &clientReg -> shards[s];
+        pthread_mutex_init(&shard -> mutex, NULL);
+        shard -> view = view_alloc(0);
+        shard -> version = 0;
+        if (shard -> view == NULL){
+            creg_fini(clientReg);
+            return NULL;
+        }
     }
     return clientReg;
 }
 
-void creg_fini(CLIENT_REGISTRY *cr){    
+void creg_fini(CLIENT_REGISTRY *cr){
     pthread_mutex_destroy(&cr ->mutex);
+    for (int s = 0; s < CREG_SHARDS; s++){
+        pthread_mutex_destroy(&cr -> shards[s].mutex);
+        free(cr -> shards[s].view);
+    }
 	free(cr);
 }
 /*
@@ -78,24 +224,32 @@ CLIENT *creg_register(CLIENT_REGISTRY *cr, int fd){
     if (cr == NULL){
         return NULL;
     }
-	pthread_mutex_lock(&cr->mutex);
+    pthread_mutex_lock(&cr->mutex);
+    if (cr -> clientsAmount == MAX_CLIENTS){
+        debug("%ld: registry is full", pthread_self());
+        pthread_mutex_unlock(&cr->mutex);
+        return NULL;
+    }
+    cr -> clientsAmount += 1;
+    if (cr -> clientsAmount == 1){
+        debug("%ld: decreasing semaphore", pthread_self());
+        sem_wait(&cr->semaphore);
+    }
+    pthread_mutex_unlock(&cr->mutex);
 	CLIENT *c = client_create(cr, fd);
     if (c == NULL){
          debug("%ld: error when creating client", pthread_self());
         return NULL;
     }
+    CREG_SHARD *shard = fd_shard(cr, fd);
+    pthread_mutex_lock(&shard -> mutex);
 	for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (cr ->clients[i] == NULL){
-        	cr -> clients[i] = c;
+        if (shard ->clients[i] == NULL){
+        	shard -> clients[i] = c;
             break;
         }
     }
-    cr -> clientsAmount += 1;
-    if (cr -> clientsAmount == 1){
-        debug("%ld: decreasing semaphore", pthread_self());
-        sem_wait(&cr->semaphore);
-    }
-    pthread_mutex_unlock(&cr->mutex);
+    pthread_mutex_unlock(&shard -> mutex);
 	return c;
 }
 /*
@@ -115,21 +269,23 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
     if (cr == NULL){
         return -1;
     }
-    pthread_mutex_lock(&cr->mutex);
     if (client == NULL){
         debug("%ld: Null Client", pthread_self());
-
-        pthread_mutex_unlock(&cr->mutex);
         return -1;
     }
     debug("%ld: unregister", pthread_self());
+    int fd = client_get_fd(client);
+    CREG_SHARD *shard = fd_shard(cr, fd);
+    pthread_mutex_lock(&shard -> mutex);
 	for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (cr -> clients[i] == client){
-            int fd = client_get_fd(client);
-            close(fd);
+        if (shard -> clients[i] == client){
+        	shard -> clients[i] = NULL;
+            pthread_mutex_unlock(&shard -> mutex);
+            jio_close(fd);
+            index_remove(cr, client);
+        	client_unref(client, "removing client from registry");
+            pthread_mutex_lock(&cr->mutex);
         	cr -> clientsAmount -= 1;
-        	client_unref(cr -> clients[i], "removing client from registry");
-        	cr -> clients[i] = NULL;
         	if (cr -> clientsAmount == 0){
                 debug("%ld: increasing semaphore to 1", pthread_self());
         		sem_post(&cr->semaphore);
@@ -139,7 +295,7 @@ int creg_unregister(CLIENT_REGISTRY *cr, CLIENT *client){
 
         }
     }
-    pthread_mutex_unlock(&cr->mutex);
+    pthread_mutex_unlock(&shard -> mutex);
     return -1;
 }
 
@@ -157,22 +313,19 @@ CLIENT *creg_lookup(CLIENT_REGISTRY *cr, char *user){
     if (cr == NULL){
         return NULL;
     }
-	pthread_mutex_lock(&cr->mutex);
-	for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (cr ->clients[i] != NULL){
-        	PLAYER *p = client_get_player(cr -> clients[i]);
-        	if (p != NULL){
-                debug("%ld: playername: %s, name: %s", pthread_self(), player_get_name(p), user);
-        		if (strcmp(player_get_name(p), user) == 0){
-        			pthread_mutex_unlock(&cr->mutex);
-        			return client_ref(cr -> clients[i] , "creg_lookup username");
-        		}
-        	}
-
-        }
+    if (user == NULL){
+        return NULL;
     }
-    pthread_mutex_unlock(&cr->mutex);
-	return NULL;
+    CLIENT *c = NULL;
+    ebr_enter();
+    CREG_VIEW *view = view_get(name_shard(cr, user));
+    int i = index_lower_bound(view, user);
+    if (i < view -> indexed && strcmp(view -> index[i].name, user) == 0){
+        debug("%ld: found %s in index", pthread_self(), user);
+        c = client_ref_live(view -> index[i].client, "creg_lookup username");
+    }
+    ebr_exit();
+	return c;
 }
 
 /*
@@ -190,24 +343,23 @@ PLAYER **creg_all_players(CLIENT_REGISTRY *cr){
     if (cr == NULL) {
         return NULL;
     }
-	pthread_mutex_lock(&cr->mutex);
-    PLAYER **players =malloc(sizeof(PLAYER*)*MAX_CLIENTS);
+    PLAYER **players = malloc(sizeof(PLAYER*) * (MAX_CLIENTS + 1));
+    if (players == NULL){
+        return NULL;
+    }
     int num_players = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-    	if (cr ->clients[i] != NULL){
-            PLAYER *p = client_get_player(cr -> clients[i]);
-    		if (p != NULL){
-    			players[num_players] = p;
-    			num_players ++;
-
-    		}
-
+    ebr_enter();
+    for (int s = 0; s < CREG_SHARDS; s++) {
+        CREG_VIEW *view = view_get(&cr -> shards[s]);
+        for (int i = 0; i < view -> indexed && num_players < MAX_CLIENTS; i++){
+            players[num_players] = view -> index[i].player;
+            num_players ++;
         }
     }
-    for (int i = num_players; i < MAX_CLIENTS; i++){
+    ebr_exit();
+    for (int i = num_players; i <= MAX_CLIENTS; i++){
         players[i] = NULL;
     }
-    pthread_mutex_unlock(&cr->mutex);
     return players;
 }
 
@@ -226,6 +378,24 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr){
     debug("%ld: wait complete", pthread_self());
 
 }
+
+/*
+ * Apply shutdown(2) to the sockets of all registered clients.
+ */
+static void shutdown_all(CLIENT_REGISTRY *cr, int how){
+    for (int s = 0; s < CREG_SHARDS; s++){
+        CREG_SHARD *shard = &cr -> shards[s];
+        pthread_mutex_lock(&shard -> mutex);
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            CLIENT *client = shard -> clients[i];
+            if (client != NULL) {
+                jio_shutdown(client_get_fd(client), how);
+            }
+        }
+        pthread_mutex_unlock(&shard -> mutex);
+    }
+}
+
 /*
  * Shut down (using shutdown(2)) all the sockets for connections
  * to currently registered clients.  The clients are not unregistered
@@ -238,14 +408,214 @@ void creg_wait_for_empty(CLIENT_REGISTRY *cr){
  */
 void creg_shutdown_all(CLIENT_REGISTRY *cr){
     debug("%ld: shutting down all", pthread_self());
-    pthread_mutex_lock(&cr->mutex);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        CLIENT *client = cr->clients[i];
-        if (client != NULL) {
-            int fd = client_get_fd(client);
-            shutdown(fd, SHUT_RD);
+    shutdown_all(cr, SHUT_RD);
+}
+
+/*
+ * Add a logged-in CLIENT to the username index.
+ * This fails if some other CLIENT is already indexed under the same
+ * username, so it also serves as the atomic check that a player is
+ * not logged in twice.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT being logged in.
+ * @param player  The PLAYER that the CLIENT is being logged in as.
+ * @return 0 if the CLIENT was added to the index, otherwise -1.
+ */
+int creg_index_add(CLIENT_REGISTRY *cr, CLIENT *client, PLAYER *player){
+    if (cr == NULL || client == NULL || player == NULL){
+        return -1;
+    }
+    char *name = player_get_name(player);
+    CREG_SHARD *shard = name_shard(cr, name);
+    pthread_mutex_lock(&shard -> mutex);
+    CREG_VIEW *old = shard -> view;
+    int i = index_lower_bound(old, name);
+    if (i < old -> indexed && strcmp(old -> index[i].name, name) == 0){
+        debug("%ld: %s already logged in", pthread_self(), name);
+        pthread_mutex_unlock(&shard -> mutex);
+        return -1;
+    }
+    CREG_VIEW *v = old -> indexed == MAX_CLIENTS ? NULL : view_alloc(old -> indexed + 1);
+    if (v == NULL){
+        pthread_mutex_unlock(&shard -> mutex);
+        return -1;
+    }
+    memcpy(v -> index, old -> index, i * sizeof(CREG_ENTRY));
+    v -> index[i].name = name;
+    v -> index[i].client = client;
+    v -> index[i].player = player;
+    memcpy(&v -> index[i + 1], &old -> index[i], (old -> indexed - i) * sizeof(CREG_ENTRY));
+    view_publish(shard, v);
+    return 0;
+}
+
+/*
+ * Remove a CLIENT from the username index.
+ *
+ * @param cr  The client registry.
+ * @param client  The CLIENT being logged out.
+ * @return 0 if the CLIENT was found and removed, otherwise -1.
+ */
+int creg_index_remove(CLIENT_REGISTRY *cr, CLIENT *client){
+    if (cr == NULL || client == NULL){
+        return -1;
+    }
+    return index_remove(cr, client);
+}
+
+/*
+ * Return one page of the logged-in players matching a query, in
+ * username order.  The reference count of each returned PLAYER is
+ * incremented, and it is the caller's responsibility to decrement it.
+ *
+ * @param cr  The client registry.
+ * @param q  The query to be performed.
+ * @param players  Caller-supplied array of at least q->limit entries,
+ * into which the matching players are stored.
+ * @param next  Caller-supplied buffer into which the username from which
+ * the next page should be requested is stored, or an empty string if no
+ * further players match.
+ * @param nextlen  Size of the next buffer.
+ * @return the number of players stored, or -1 on error.
+ */
+int creg_query_players(CLIENT_REGISTRY *cr, CREG_QUERY *q, PLAYER **players,
+                       char *next, size_t nextlen){
+    if (cr == NULL || q == NULL || q -> limit <= 0 || players == NULL || next == NULL || nextlen == 0){
+        return -1;
+    }
+    size_t prefixlen = q -> prefix == NULL ? 0 : strlen(q -> prefix);
+    int found = 0;
+    int scanned = 0;
+    next[0] = '\0';
+    ebr_enter();
+    //the shards' views are each sorted, so the page is a merge of them
+    CREG_VIEW *views[CREG_SHARDS];
+    int pos[CREG_SHARDS];
+    for (int s = 0; s < CREG_SHARDS; s++){
+        CREG_VIEW *view = views[s] = view_get(&cr -> shards[s]);
+        pos[s] = 0;
+        if (prefixlen > 0){
+            pos[s] = index_lower_bound(view, q -> prefix);
+        }
+        if (q -> cursor != NULL && q -> cursor[0] != '\0'){
+            int c = index_lower_bound(view, q -> cursor);
+            if (c < view -> indexed && strcmp(view -> index[c].name, q -> cursor) == 0){
+                c += 1;
+            }
+            if (c > pos[s]){
+                pos[s] = c;
+            }
         }
     }
-    pthread_mutex_unlock(&cr->mutex);
-    
-}
\ No newline at end of file
+    char *last = NULL;
+    while (1){
+        CREG_ENTRY *e = NULL;
+        int from = -1;
+        for (int s = 0; s < CREG_SHARDS; s++){
+            if (pos[s] < views[s] -> indexed &&
+                (e == NULL || strcmp(views[s] -> index[pos[s]].name, e -> name) < 0)){
+                e = &views[s] -> index[pos[s]];
+                from = s;
+            }
+        }
+        if (e == NULL){
+            break;
+        }
+        if (prefixlen > 0 && strncmp(e -> name, q -> prefix, prefixlen) != 0){
+            //entries are sorted, so nothing after this can match the prefix
+            break;
+        }
+        if (found == q -> limit || scanned == CREG_QUERY_SCAN_MAX){
+            //more entries remain, resume after the last one examined
+            snprintf(next, nextlen, "%s", last);
+            break;
+        }
+        pos[from] += 1;
+        last = e -> name;
+        scanned += 1;
+        int rating = player_get_rating(e -> player);
+        if (rating < q -> min_rating || rating > q -> max_rating){
+            continue;
+        }
+        double deviation = player_get_deviation(e -> player);
+        if (deviation < q -> min_deviation || deviation > q -> max_deviation){
+            continue;
+        }
+        players[found] = player_ref(e -> player, "returned by creg_query_players");
+        found += 1;
+    }
+    ebr_exit();
+    return found;
+}
+
+/*
+ * Wait, for at most a bounded time, for the number of registered clients
+ * to reach zero.
+ *
+ * @param cr  The client registry.
+ * @param deadline  The absolute CLOCK_REALTIME time at which to give up.
+ * @return 0 if the registry became empty, -1 if the deadline passed first.
+ */
+int creg_wait_for_empty_until(CLIENT_REGISTRY *cr, const struct timespec *deadline){
+    debug("%ld: Waiting with deadline", pthread_self());
+    while (sem_timedwait(&cr->semaphore, deadline)){
+        if (errno != EINTR){
+            debug("%ld: wait timed out", pthread_self());
+            return -1;
+        }
+    }
+    debug("%ld: wait complete", pthread_self());
+    return 0;
+}
+
+/*
+ * Shut down both directions of all the sockets for connections to
+ * currently registered clients.
+ *
+ * @param cr  The client registry.
+ */
+void creg_force_shutdown_all(CLIENT_REGISTRY *cr){
+    debug("%ld: forcing down all", pthread_self());
+    shutdown_all(cr, SHUT_RDWR);
+}
+
+/*
+ * Get a number that changes whenever a client logs in or out: the sum of
+ * the number of views each shard has published.
+ *
+ * @param cr  The client registry.
+ * @return the number of changes to the username index so far.
+ */
+uint64_t creg_version(CLIENT_REGISTRY *cr){
+    uint64_t version = 0;
+    for (int s = 0; s < CREG_SHARDS; s++){
+        version += __atomic_load_n(&cr -> shards[s].version, __ATOMIC_SEQ_CST);
+    }
+    return version;
+}
+
+/*
+ * Get all registered clients, logged in or not.
+ *
+ * @param cr  The client registry.
+ * @param clients  Caller-supplied array of MAX_CLIENTS entries.
+ * @return the number of clients stored.
+ */
+int creg_snapshot(CLIENT_REGISTRY *cr, CLIENT **clients){
+    if (cr == NULL || clients == NULL){
+        return 0;
+    }
+    int n = 0;
+    for (int s = 0; s < CREG_SHARDS; s++){
+        CREG_SHARD *shard = &cr -> shards[s];
+        pthread_mutex_lock(&shard -> mutex);
+        for (int i = 0; i < MAX_CLIENTS && n < MAX_CLIENTS; i++){
+            if (shard -> clients[i] != NULL){
+                clients[n++] = client_ref(shard -> clients[i], "returned by creg_snapshot");
+            }
+        }
+        pthread_mutex_unlock(&shard -> mutex);
+    }
+    return n;
+}
@@ -0,0 +1,60 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "debug.h"
+#include "protocol_ext.h"
+#include "compress.h"
+
+static __thread z_stream *stream;
+
+/*
+ * Get this thread's deflate stream, ready for a new payload.
+ */
+static z_stream *get_stream(void){
+	if (stream == NULL){
+		z_stream *z = calloc(1, sizeof(z_stream));
+		if (z == NULL){
+			return NULL;
+		}
+		if (deflateInit(z, Z_DEFAULT_COMPRESSION) != Z_OK){
+			free(z);
+			return NULL;
+		}
+		stream = z;
+	}
+	else if (deflateReset(stream) != Z_OK){
+		return NULL;
+	}
+	//the dictionary has to be set again after each reset
+	if (deflateSetDictionary(stream, (const Bytef *)JEUX_COMPRESS_DICTIONARY,
+	                         sizeof(JEUX_COMPRESS_DICTIONARY) - 1) != Z_OK){
+		return NULL;
+	}
+	return stream;
+}
+
+void *compress_payload(const void *data, size_t len, size_t *zlen){
+	z_stream *z = get_stream();
+	if (z == NULL){
+		return NULL;
+	}
+	uLong bound = deflateBound(z, len);
+	unsigned char *out = malloc(bound);
+	if (out == NULL){
+		return NULL;
+	}
+	z -> next_in = (Bytef *)data;
+	z -> avail_in = len;
+	z -> next_out = out;
+	z -> avail_out = bound;
+	if (deflate(z, Z_FINISH) != Z_STREAM_END || z -> total_out >= len){
+		free(out);
+		return NULL;
+	}
+	*zlen = z -> total_out;
+	debug("%ld: compressed %lu bytes to %lu", pthread_self(), (unsigned long)len, (unsigned long)*zlen);
+	return out;
+}
@@ -0,0 +1,987 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "uring.h"
+#include "coro.h"
+
+/*
+ * Stacks of finished coroutines are kept for reuse, up to this many per
+ * scheduler thread.
+ */
+#define CORO_STACK_CACHE 64
+
+#define CORO_EVENTS 64
+
+/*
+ * With io_uring, the size of each scheduler thread's submission queue, and
+ * the buffers it provides for receiving into.
+ */
+#define CORO_RING_ENTRIES 256
+#define CORO_RX_BUFS 128
+#define CORO_RX_BUF_SIZE 2048
+#define CORO_RX_GROUP 0
+#define CORO_ACCEPT_ENTRIES 32
+
+/*
+ * Completions that are not for a coroutine's receive are told apart by
+ * their user data, which is otherwise the coroutine.
+ */
+#define CORO_KICK 0                     //the eventfd is readable
+#define CORO_IGNORE 1                   //a cancellation
+#define CORO_ACCEPT 2                   //a listening socket's multishot accept, plus its index
+#define CORO_POLL_OUT 1                 //or'd into a coroutine to wait for its connection to be writable
+
+typedef enum coro_state {
+	CORO_READY,
+	CORO_WAITING,                   //in coro_wait_fd()
+	CORO_SUSPENDED,                 //in coro_suspend()
+	CORO_DONE
+} CORO_STATE;
+
+typedef struct coro {
+	ucontext_t ctx;
+	void *stack;                    //the mapping, with a guard page at the bottom
+	void *(*func)(void *);
+	void *arg;
+	struct sched *sched;
+	CORO_STATE state;
+	int queued;                     //on the run queue
+	int woken;                      //what coro_wait_fd() returns
+	int fd;                         //registered with the epoll set, or receiving through the ring, or -1
+	struct coro *next;              //all coroutines of the scheduler
+	struct coro *prev;
+	struct coro *runNext;
+	//with io_uring only
+	int armed;                      //a multishot receive is outstanding on fd
+	int starved;                    //it ran out of buffers, and is on the scheduler's starved list
+	int holding;                    //in coro_hold_fd(), waiting for the receive to end
+	int polling;                    //a poll for POLLOUT is outstanding on fd
+	int waitingOut;                 //in coro_wait_fd() for POLLOUT on fd
+	int rxHead;                     //buffers received into and not yet read, by buffer ID, or -1
+	int rxTail;
+	int rxEnd;                      //once they are read: 1 at end of file, -errno on error, otherwise 0
+	struct coro *starvedNext;
+	int wakePending;                //on the scheduler's wake list
+	struct coro *wakeNext;
+} CORO;
+
+typedef struct rx_chunk {
+	unsigned short len;
+	unsigned short off;             //how much of it has been read
+	int next;
+} RX_CHUNK;
+
+typedef struct spawn_req {
+	void *(*func)(void *);
+	void *arg;
+	struct spawn_req *next;
+} SPAWN_REQ;
+
+typedef struct sched {
+	pthread_t tid;
+	int epfd;
+	int evfd;                       //makes the thread look at its inbox
+	ucontext_t ctx;
+	CORO *current;
+	CORO *all;
+	CORO *runHead;
+	CORO *runTail;
+	void *stacks[CORO_STACK_CACHE];
+	int cachedStacks;
+	long count;                     //coroutines, for picking a thread to spawn on
+	pthread_mutex_t mutex;          //orders inbox and wakeups
+	SPAWN_REQ *inbox;
+	unsigned wakeups;               //bumped by coro_wake_all()
+	unsigned seenWakeups;
+	CORO *wake;                     //woken by coro_wake()
+	int uring;                      //waits through ring rather than epfd
+	URING ring;
+	URING_BUFS bufs;
+	RX_CHUNK *chunks;               //by buffer ID
+	CORO *starved;                  //waiting for a buffer to be given back
+} SCHED;
+
+static struct {
+	int threads;
+	size_t pageSize;
+	CORO_BACKEND backend;
+	SCHED scheds[CORO_MAX_THREADS];
+} coro = {0};
+
+typedef struct listener {
+	int fd;
+	void *(*func)(void *);
+	int uring;                      //accepted through the ring
+	int armed;                      //its multishot accept is outstanding
+} LISTENER;
+
+/*
+ * The listening sockets, and with io_uring the ring their connections are
+ * accepted through.  Only used by the thread that calls coro_listen().
+ */
+static struct {
+	LISTENER listeners[CORO_MAX_LISTENERS];
+	int count;
+	int uring;
+	URING ring;
+	int paused;
+} acceptor = {0};
+
+static __thread SCHED *self;
+
+static void *stack_alloc(SCHED *s){
+	if (s -> cachedStacks > 0){
+		return s -> stacks[--s -> cachedStacks];
+	}
+	size_t len = CORO_STACK_SIZE + coro.pageSize;
+	void *stack = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED){
+		return NULL;
+	}
+	//an overflow faults instead of running into whatever is below
+	mprotect(stack, coro.pageSize, PROT_NONE);
+	return stack;
+}
+
+static void stack_free(SCHED *s, void *stack){
+	if (s -> cachedStacks < CORO_STACK_CACHE){
+		s -> stacks[s -> cachedStacks++] = stack;
+	}
+	else{
+		munmap(stack, CORO_STACK_SIZE + coro.pageSize);
+	}
+}
+
+static void make_ready(SCHED *s, CORO *co, int woken){
+	co -> woken = woken;
+	co -> state = CORO_READY;
+	if (co -> queued){
+		return;
+	}
+	co -> queued = 1;
+	co -> runNext = NULL;
+	if (s -> runTail == NULL){
+		s -> runHead = co;
+	}
+	else{
+		s -> runTail -> runNext = co;
+	}
+	s -> runTail = co;
+}
+
+static int arm_recv(SCHED *s, CORO *co){
+	struct io_uring_sqe *sqe = uring_sqe(&s -> ring);
+	if (sqe == NULL){
+		return -1;
+	}
+	//goes on receiving into whichever buffers are free until it fails or is cancelled
+	sqe -> opcode = IORING_OP_RECV;
+	sqe -> fd = co -> fd;
+	sqe -> ioprio = IORING_RECV_MULTISHOT;
+	sqe -> flags = IOSQE_BUFFER_SELECT;
+	sqe -> buf_group = CORO_RX_GROUP;
+	sqe -> user_data = (uintptr_t)co;
+	co -> armed = 1;
+	return 0;
+}
+
+static int cancel(URING *ring, uint64_t userData){
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	if (sqe == NULL){
+		return -1;
+	}
+	sqe -> opcode = IORING_OP_ASYNC_CANCEL;
+	sqe -> addr = userData;
+	sqe -> user_data = CORO_IGNORE;
+	return 0;
+}
+
+static int arm_kick(SCHED *s){
+	struct io_uring_sqe *sqe = uring_sqe(&s -> ring);
+	if (sqe == NULL){
+		return -1;
+	}
+	sqe -> opcode = IORING_OP_POLL_ADD;
+	sqe -> fd = s -> evfd;
+	sqe -> len = IORING_POLL_ADD_MULTI;
+	sqe -> poll32_events = POLLIN;
+	sqe -> user_data = CORO_KICK;
+	return 0;
+}
+
+static void unstarve(SCHED *s, CORO *co){
+	if (!co -> starved){
+		return;
+	}
+	for (CORO **p = &s -> starved; *p != NULL; p = &(*p) -> starvedNext){
+		if (*p == co){
+			*p = co -> starvedNext;
+			break;
+		}
+	}
+	co -> starved = 0;
+}
+
+/*
+ * Give a buffer back to the kernel, and with it let a receive that ran out
+ * of buffers start again.
+ */
+static void give_back(SCHED *s, unsigned bid){
+	uring_buf_return(&s -> bufs, bid);
+	CORO *co = s -> starved;
+	if (co != NULL){
+		s -> starved = co -> starvedNext;
+		co -> starved = 0;
+		if (!co -> armed){
+			arm_recv(s, co);
+		}
+	}
+}
+
+static void rx_push(SCHED *s, CORO *co, unsigned bid, unsigned len){
+	RX_CHUNK *chunk = &s -> chunks[bid];
+	chunk -> len = len;
+	chunk -> off = 0;
+	chunk -> next = -1;
+	if (co -> rxTail < 0){
+		co -> rxHead = bid;
+	}
+	else{
+		s -> chunks[co -> rxTail].next = bid;
+	}
+	co -> rxTail = bid;
+}
+
+static void rx_drop(SCHED *s, CORO *co){
+	while (co -> rxHead >= 0){
+		int bid = co -> rxHead;
+		co -> rxHead = s -> chunks[bid].next;
+		give_back(s, bid);
+	}
+	co -> rxTail = -1;
+}
+
+/*
+ * Take in a completion of a coroutine's receive.
+ */
+static void received(SCHED *s, CORO *co, int res, unsigned flags){
+	if (!(flags & IORING_CQE_F_MORE)){
+		co -> armed = 0;
+	}
+	if (res > 0){
+		unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (co -> state == CORO_DONE){
+			give_back(s, bid);
+		}
+		else{
+			rx_push(s, co, bid, res);
+		}
+	}
+	else if (res == -ENOBUFS){
+		//started again when another coroutine has read what it was holding up
+		if (co -> state != CORO_DONE && !co -> holding && !co -> starved){
+			co -> starved = 1;
+			co -> starvedNext = s -> starved;
+			s -> starved = co;
+		}
+	}
+	else if (res != -ECANCELED && co -> state != CORO_DONE){
+		co -> rxEnd = res == 0 ? 1 : res;
+	}
+	if (co -> state == CORO_DONE){
+		if (!co -> armed && !co -> polling){
+			free(co);
+		}
+		return;
+	}
+	if (co -> waitingOut){
+		return;
+	}
+	//cancelled while waiting for POLLOUT, and now waiting for something to read
+	if (res == -ECANCELED && !co -> armed && !co -> holding && !co -> starved && co -> state == CORO_WAITING &&
+	    co -> rxHead < 0 && co -> rxEnd == 0){
+		arm_recv(s, co);
+		return;
+	}
+	if (co -> state == CORO_WAITING && (co -> rxHead >= 0 || co -> rxEnd != 0 || (co -> holding && !co -> armed))){
+		make_ready(s, co, 1);
+	}
+}
+
+/*
+ * Take in the completion of a coroutine's poll for its connection to be
+ * writable.
+ */
+static void polled(SCHED *s, CORO *co){
+	co -> polling = 0;
+	if (co -> state == CORO_DONE){
+		if (!co -> armed){
+			free(co);
+		}
+		return;
+	}
+	if (co -> state == CORO_WAITING && co -> waitingOut){
+		make_ready(s, co, 1);
+	}
+}
+
+static void trampoline(void){
+	CORO *co = self -> current;
+	co -> func(co -> arg);
+	co -> state = CORO_DONE;
+	//uc_link returns to the scheduler
+}
+
+static void start(SCHED *s, SPAWN_REQ *req){
+	CORO *co = calloc(1, sizeof(CORO));
+	void *stack = co == NULL ? NULL : stack_alloc(s);
+	if (stack == NULL){
+		//the function is never run, so whatever it was to take care of is dropped
+		debug("%ld: cannot start coroutine", pthread_self());
+		free(co);
+		__atomic_sub_fetch(&s -> count, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	co -> stack = stack;
+	co -> func = req -> func;
+	co -> arg = req -> arg;
+	co -> sched = s;
+	co -> fd = -1;
+	co -> rxHead = -1;
+	co -> rxTail = -1;
+	getcontext(&co -> ctx);
+	co -> ctx.uc_stack.ss_sp = (char *)stack + coro.pageSize;
+	co -> ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+	co -> ctx.uc_link = &s -> ctx;
+	makecontext(&co -> ctx, trampoline, 0);
+	co -> next = s -> all;
+	if (s -> all != NULL){
+		s -> all -> prev = co;
+	}
+	s -> all = co;
+	make_ready(s, co, 1);
+}
+
+static void finish(SCHED *s, CORO *co){
+	if (co -> prev != NULL){
+		co -> prev -> next = co -> next;
+	}
+	else{
+		s -> all = co -> next;
+	}
+	if (co -> next != NULL){
+		co -> next -> prev = co -> prev;
+	}
+	//the descriptor was closed by the coroutine, which took it out of the epoll set
+	stack_free(s, co -> stack);
+	__atomic_sub_fetch(&s -> count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&s -> mutex);
+	for (CORO **p = &s -> wake; co -> wakePending && *p != NULL; p = &(*p) -> wakeNext){
+		if (*p == co){
+			*p = co -> wakeNext;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s -> mutex);
+	if (s -> uring){
+		unstarve(s, co);
+		rx_drop(s, co);
+		//the ring holds the connection open until its receive and poll are cancelled
+		int outstanding = 0;
+		if (co -> armed && cancel(&s -> ring, (uintptr_t)co) == 0){
+			outstanding = 1;
+		}
+		if (co -> polling && cancel(&s -> ring, (uintptr_t)co | CORO_POLL_OUT) == 0){
+			outstanding = 1;
+		}
+		if (outstanding){
+			//freed by received() or polled() when the last of them ends
+			return;
+		}
+	}
+	free(co);
+}
+
+/*
+ * Take in what other threads have asked of this one.
+ */
+static void check_inbox(SCHED *s){
+	uint64_t n;
+	while (read(s -> evfd, &n, sizeof(n)) < 0 && errno == EINTR){
+	}
+	pthread_mutex_lock(&s -> mutex);
+	SPAWN_REQ *req = s -> inbox;
+	s -> inbox = NULL;
+	int wake = s -> wakeups != s -> seenWakeups;
+	s -> seenWakeups = s -> wakeups;
+	//made ready under the mutex, since coro_wake() may put them on the list again
+	for (CORO *co = s -> wake; co != NULL; co = co -> wakeNext){
+		co -> wakePending = 0;
+		if (co -> state == CORO_WAITING || co -> state == CORO_SUSPENDED){
+			make_ready(s, co, 0);
+		}
+	}
+	s -> wake = NULL;
+	pthread_mutex_unlock(&s -> mutex);
+	if (wake){
+		for (CORO *co = s -> all; co != NULL; co = co -> next){
+			if (co -> state == CORO_WAITING || co -> state == CORO_SUSPENDED){
+				make_ready(s, co, 0);
+			}
+		}
+	}
+	//oldest first
+	SPAWN_REQ *list = NULL;
+	while (req != NULL){
+		SPAWN_REQ *next = req -> next;
+		req -> next = list;
+		list = req;
+		req = next;
+	}
+	while (list != NULL){
+		SPAWN_REQ *next = list -> next;
+		start(s, list);
+		free(list);
+		list = next;
+	}
+}
+
+static void wait_epoll(SCHED *s){
+	struct epoll_event events[CORO_EVENTS];
+	int n = epoll_wait(s -> epfd, events, CORO_EVENTS, -1);
+	if (n < 0){
+		if (errno != EINTR){
+			perror("epoll_wait");
+		}
+		return;
+	}
+	for (int i = 0; i < n; i++){
+		CORO *co = events[i].data.ptr;
+		if (co == NULL){
+			check_inbox(s);
+		}
+		else if (co -> state == CORO_WAITING){
+			make_ready(s, co, 1);
+		}
+	}
+}
+
+/*
+ * Submit what the coroutines have asked for since the last time, and wait
+ * for completions, in one system call.
+ */
+static void wait_ring(SCHED *s){
+	if (uring_submit(&s -> ring, 1) && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+		perror("io_uring_enter");
+		return;
+	}
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_cqe(&s -> ring)) != NULL){
+		uint64_t userData = cqe -> user_data;
+		int res = cqe -> res;
+		unsigned flags = cqe -> flags;
+		uring_cqe_seen(&s -> ring);
+		if (userData == CORO_KICK){
+			if (!(flags & IORING_CQE_F_MORE)){
+				arm_kick(s);
+			}
+			check_inbox(s);
+		}
+		else if (userData != CORO_IGNORE && (userData & CORO_POLL_OUT)){
+			polled(s, (CORO *)(uintptr_t)(userData & ~(uint64_t)CORO_POLL_OUT));
+		}
+		else if (userData != CORO_IGNORE){
+			received(s, (CORO *)(uintptr_t)userData, res, flags);
+		}
+	}
+}
+
+static void *sched_thread(void *arg){
+	SCHED *s = arg;
+	self = s;
+	while (1){
+		while (s -> runHead != NULL){
+			CORO *co = s -> runHead;
+			s -> runHead = co -> runNext;
+			if (s -> runHead == NULL){
+				s -> runTail = NULL;
+			}
+			co -> queued = 0;
+			s -> current = co;
+			swapcontext(&s -> ctx, &co -> ctx);
+			s -> current = NULL;
+			if (co -> state == CORO_DONE){
+				finish(s, co);
+			}
+		}
+		if (s -> uring){
+			wait_ring(s);
+		}
+		else{
+			wait_epoll(s);
+		}
+	}
+	return NULL;
+}
+
+static int ring_init(SCHED *s){
+	if (uring_init(&s -> ring, CORO_RING_ENTRIES)){
+		return -1;
+	}
+	s -> chunks = calloc(CORO_RX_BUFS, sizeof(RX_CHUNK));
+	if (s -> chunks == NULL || uring_bufs_init(&s -> ring, &s -> bufs, CORO_RX_GROUP, CORO_RX_BUFS, CORO_RX_BUF_SIZE)){
+		free(s -> chunks);
+		uring_fini(&s -> ring);
+		return -1;
+	}
+	if (arm_kick(s) || uring_submit(&s -> ring, 0)){
+		uring_fini(&s -> ring);
+		uring_bufs_fini(&s -> bufs);
+		free(s -> chunks);
+		return -1;
+	}
+	s -> uring = 1;
+	return 0;
+}
+
+int coro_init(int threads, CORO_BACKEND backend){
+	if (threads <= 0){
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads <= 0){
+		threads = 1;
+	}
+	if (threads > CORO_MAX_THREADS){
+		threads = CORO_MAX_THREADS;
+	}
+	coro.pageSize = sysconf(_SC_PAGESIZE);
+	if (backend == CORO_URING && !uring_usable()){
+		debug("%ld: io_uring cannot be used, falling back to epoll", pthread_self());
+		backend = CORO_EPOLL;
+	}
+	coro.backend = backend;
+	for (int i = 0; i < threads; i++){
+		SCHED *s = &coro.scheds[i];
+		pthread_mutex_init(&s -> mutex, NULL);
+		s -> epfd = epoll_create1(EPOLL_CLOEXEC);
+		s -> evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (s -> epfd < 0 || s -> evfd < 0){
+			return -1;
+		}
+		if (backend == CORO_URING && ring_init(s)){
+			//this thread makes do with epoll, and the others carry on with io_uring
+			debug("%ld: scheduler thread %d falls back to epoll", pthread_self(), i);
+		}
+		struct epoll_event ev = {EPOLLIN, {.ptr = NULL}};
+		if (!s -> uring && epoll_ctl(s -> epfd, EPOLL_CTL_ADD, s -> evfd, &ev)){
+			return -1;
+		}
+		if (pthread_create(&s -> tid, NULL, sched_thread, s)){
+			return -1;
+		}
+		pthread_detach(s -> tid);
+		coro.threads = i + 1;
+	}
+	debug("%ld: %d scheduler threads, using %s", pthread_self(), coro.threads,
+	      backend == CORO_URING ? "io_uring" : "epoll");
+	return 0;
+}
+
+CORO_BACKEND coro_backend(void){
+	return coro.backend;
+}
+
+static void kick(SCHED *s){
+	uint64_t one = 1;
+	while (write(s -> evfd, &one, sizeof(one)) < 0 && errno == EINTR){
+	}
+}
+
+int coro_spawn(void *(*func)(void *), void *arg){
+	if (coro.threads == 0 || func == NULL){
+		return -1;
+	}
+	SPAWN_REQ *req = malloc(sizeof(SPAWN_REQ));
+	if (req == NULL){
+		return -1;
+	}
+	req -> func = func;
+	req -> arg = arg;
+	SCHED *s = &coro.scheds[0];
+	for (int i = 1; i < coro.threads; i++){
+		if (__atomic_load_n(&coro.scheds[i].count, __ATOMIC_RELAXED) < __atomic_load_n(&s -> count, __ATOMIC_RELAXED)){
+			s = &coro.scheds[i];
+		}
+	}
+	__atomic_add_fetch(&s -> count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&s -> mutex);
+	req -> next = s -> inbox;
+	s -> inbox = req;
+	pthread_mutex_unlock(&s -> mutex);
+	kick(s);
+	return 0;
+}
+
+int coro_running(void){
+	return self != NULL && self -> current != NULL;
+}
+
+/*
+ * Give the thread back to the scheduler until the coroutine is resumed.
+ */
+static void yield(SCHED *s, CORO *co){
+	swapcontext(&co -> ctx, &s -> ctx);
+}
+
+static int poll_fd(int fd, int events){
+	struct pollfd pfd = {fd, events, 0};
+	while (poll(&pfd, 1, -1) < 0){
+		if (errno != EINTR){
+			return -1;
+		}
+	}
+	return 1;
+}
+
+static int arm_poll_out(SCHED *s, CORO *co){
+	struct io_uring_sqe *sqe = uring_sqe(&s -> ring);
+	if (sqe == NULL){
+		return -1;
+	}
+	sqe -> opcode = IORING_OP_POLL_ADD;
+	sqe -> fd = co -> fd;
+	sqe -> poll32_events = POLLOUT;
+	sqe -> user_data = (uintptr_t)co | CORO_POLL_OUT;
+	co -> polling = 1;
+	return 0;
+}
+
+/*
+ * With io_uring, the connection is ready to read when something has been
+ * received on it, and ready to write when a poll for POLLOUT says so.
+ * Nothing else is waited for through the ring.
+ */
+static int wait_ring_fd(SCHED *s, CORO *co, int fd, int events){
+	if (co -> fd < 0){
+		co -> fd = fd;
+	}
+	if (fd == co -> fd && events == POLLOUT){
+		//what comes in meanwhile stays in the socket, not in buffers the thread's other coroutines need
+		if (co -> armed && !co -> holding){
+			cancel(&s -> ring, (uintptr_t)co);
+		}
+		unstarve(s, co);
+		//a poll left outstanding by an earlier wait is as good as a new one
+		if (!co -> polling && arm_poll_out(s, co)){
+			return -1;
+		}
+		co -> waitingOut = 1;
+		co -> state = CORO_WAITING;
+		yield(s, co);
+		co -> waitingOut = 0;
+		return co -> woken;
+	}
+	if (fd != co -> fd || events != POLLIN){
+		return poll_fd(fd, events);
+	}
+	if (co -> rxHead >= 0 || co -> rxEnd != 0){
+		return 1;
+	}
+	if (!co -> armed && !co -> starved && arm_recv(s, co)){
+		return -1;
+	}
+	co -> state = CORO_WAITING;
+	yield(s, co);
+	return co -> woken;
+}
+
+int coro_wait_fd(int fd, int events){
+	if (!coro_running()){
+		return poll_fd(fd, events);
+	}
+	SCHED *s = self;
+	CORO *co = s -> current;
+	if (s -> uring){
+		return wait_ring_fd(s, co, fd, events);
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT | ((events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = co;
+	//the descriptor stays in the set, disarmed, between waits
+	int op = co -> fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(s -> epfd, op, fd, &ev)){
+		if (op == EPOLL_CTL_ADD && errno == EEXIST){
+			op = EPOLL_CTL_MOD;
+		}
+		else if (op == EPOLL_CTL_MOD && errno == ENOENT){
+			op = EPOLL_CTL_ADD;
+		}
+		else{
+			return -1;
+		}
+		if (epoll_ctl(s -> epfd, op, fd, &ev)){
+			return -1;
+		}
+	}
+	if (co -> fd >= 0 && co -> fd != fd){
+		epoll_ctl(s -> epfd, EPOLL_CTL_DEL, co -> fd, NULL);
+	}
+	co -> fd = fd;
+	co -> state = CORO_WAITING;
+	yield(s, co);
+	return co -> woken;
+}
+
+ssize_t coro_recv(int fd, void *buf, size_t n){
+	if (!coro_running() || !self -> uring){
+		return recv(fd, buf, n, MSG_DONTWAIT);
+	}
+	SCHED *s = self;
+	CORO *co = s -> current;
+	if (co -> fd < 0){
+		co -> fd = fd;
+	}
+	if (fd != co -> fd){
+		return recv(fd, buf, n, MSG_DONTWAIT);
+	}
+	size_t done = 0;
+	while (done < n && co -> rxHead >= 0){
+		int bid = co -> rxHead;
+		RX_CHUNK *chunk = &s -> chunks[bid];
+		size_t len = chunk -> len - chunk -> off;
+		if (len > n - done){
+			len = n - done;
+		}
+		memcpy((char *)buf + done, uring_buf(&s -> bufs, bid) + chunk -> off, len);
+		chunk -> off += len;
+		done += len;
+		if (chunk -> off == chunk -> len){
+			co -> rxHead = chunk -> next;
+			if (co -> rxHead < 0){
+				co -> rxTail = -1;
+			}
+			give_back(s, bid);
+		}
+	}
+	if (done > 0){
+		return done;
+	}
+	if (co -> rxEnd > 0){
+		return 0;
+	}
+	errno = co -> rxEnd < 0 ? -co -> rxEnd : EAGAIN;
+	return -1;
+}
+
+int coro_hold_fd(int fd){
+	if (!coro_running() || !self -> uring){
+		return 0;
+	}
+	SCHED *s = self;
+	CORO *co = s -> current;
+	if (fd != co -> fd){
+		return 0;
+	}
+	unstarve(s, co);
+	if (co -> armed){
+		if (cancel(&s -> ring, (uintptr_t)co)){
+			//it may still be receiving, so it must be read from as usual
+			return 1;
+		}
+		co -> holding = 1;
+		while (co -> armed){
+			co -> state = CORO_WAITING;
+			yield(s, co);
+		}
+		co -> holding = 0;
+	}
+	return co -> rxHead >= 0 || co -> rxEnd != 0;
+}
+
+void coro_suspend(void){
+	if (!coro_running()){
+		return;
+	}
+	SCHED *s = self;
+	CORO *co = s -> current;
+	co -> state = CORO_SUSPENDED;
+	yield(s, co);
+}
+
+void *coro_self(void){
+	return coro_running() ? self -> current : NULL;
+}
+
+void coro_wake(void *handle){
+	CORO *co = handle;
+	if (co == NULL){
+		return;
+	}
+	SCHED *s = co -> sched;
+	pthread_mutex_lock(&s -> mutex);
+	if (!co -> wakePending){
+		co -> wakePending = 1;
+		co -> wakeNext = s -> wake;
+		s -> wake = co;
+	}
+	pthread_mutex_unlock(&s -> mutex);
+	kick(s);
+}
+
+void coro_wake_all(void){
+	for (int i = 0; i < coro.threads; i++){
+		SCHED *s = &coro.scheds[i];
+		pthread_mutex_lock(&s -> mutex);
+		s -> wakeups += 1;
+		pthread_mutex_unlock(&s -> mutex);
+		kick(s);
+	}
+}
+
+static void serve_connection(LISTENER *l, int connfd){
+	int *arg = malloc(sizeof(int));
+	if (arg == NULL){
+		close(connfd);
+		return;
+	}
+	*arg = connfd;
+	if (coro_spawn(l -> func, arg)){
+		close(connfd);
+		free(arg);
+	}
+}
+
+static int arm_accept(int i){
+	struct io_uring_sqe *sqe = uring_sqe(&acceptor.ring);
+	if (sqe == NULL){
+		return -1;
+	}
+	sqe -> opcode = IORING_OP_ACCEPT;
+	sqe -> fd = acceptor.listeners[i].fd;
+	sqe -> ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe -> user_data = CORO_ACCEPT + i;
+	acceptor.listeners[i].armed = 1;
+	return uring_submit(&acceptor.ring, 0);
+}
+
+static int any_armed(void){
+	for (int i = 0; i < acceptor.count; i++){
+		if (acceptor.listeners[i].armed){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start a coroutine for each connection the ring has accepted.
+ */
+static void reap_accepted(void){
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_cqe(&acceptor.ring)) != NULL){
+		uint64_t userData = cqe -> user_data;
+		int res = cqe -> res;
+		unsigned flags = cqe -> flags;
+		uring_cqe_seen(&acceptor.ring);
+		if (userData < CORO_ACCEPT || userData >= CORO_ACCEPT + acceptor.count){
+			continue;
+		}
+		LISTENER *l = &acceptor.listeners[userData - CORO_ACCEPT];
+		if (!(flags & IORING_CQE_F_MORE)){
+			l -> armed = 0;
+		}
+		if (res >= 0){
+			debug("%ld: making an connection..", pthread_self());
+			serve_connection(l, res);
+		}
+	}
+}
+
+int coro_listen(int listenfd, void *(*func)(void *)){
+	if (acceptor.count == CORO_MAX_LISTENERS){
+		return -1;
+	}
+	int i = acceptor.count++;
+	LISTENER *l = &acceptor.listeners[i];
+	l -> fd = listenfd;
+	l -> func = func;
+	if (coro.backend != CORO_URING){
+		return listenfd;
+	}
+	if (!acceptor.uring){
+		if (i > 0 || uring_init(&acceptor.ring, CORO_ACCEPT_ENTRIES)){
+			return listenfd;
+		}
+		acceptor.uring = 1;
+	}
+	l -> uring = 1;
+	if (arm_accept(i)){
+		l -> uring = 0;
+		return listenfd;
+	}
+	//readable whenever there are completions, for any listening socket
+	return acceptor.ring.fd;
+}
+
+void coro_accept(int fd){
+	for (int i = 0; i < acceptor.count; i++){
+		LISTENER *l = &acceptor.listeners[i];
+		if (!l -> uring && l -> fd == fd){
+			debug("%ld: making an connection..", pthread_self());
+			int connfd = accept(fd, NULL, NULL);
+			if (connfd >= 0){
+				serve_connection(l, connfd);
+			}
+			return;
+		}
+	}
+	if (!acceptor.uring || fd != acceptor.ring.fd){
+		return;
+	}
+	reap_accepted();
+	for (int i = 0; i < acceptor.count; i++){
+		if (acceptor.listeners[i].uring && !acceptor.listeners[i].armed && !acceptor.paused){
+			arm_accept(i);
+		}
+	}
+}
+
+void coro_listen_pause(void){
+	acceptor.paused = 1;
+	if (!acceptor.uring){
+		return;
+	}
+	for (int i = 0; i < acceptor.count; i++){
+		if (acceptor.listeners[i].armed && cancel(&acceptor.ring, CORO_ACCEPT + i)){
+			return;
+		}
+	}
+	while (any_armed()){
+		if (uring_submit(&acceptor.ring, 1) && errno != EINTR){
+			perror("io_uring_enter");
+			return;
+		}
+		reap_accepted();
+	}
+}
+
+void coro_listen_resume(void){
+	acceptor.paused = 0;
+	for (int i = 0; i < acceptor.count; i++){
+		if (acceptor.listeners[i].uring && !acceptor.listeners[i].armed){
+			arm_accept(i);
+		}
+	}
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "debug.h"
+#include "client_registry.h"
+#include "ebr.h"
+
+/*
+ * Every thread that enters critical sections has a record, which it keeps
+ * until it exits.  There is room for a record per client service thread
+ * and a few more for the threads that are not.
+ */
+#define EBR_MAX_THREADS (MAX_CLIENTS + 16)
+
+/*
+ * An object retired in some epoch is freed when the epoch has advanced
+ * twice more, so there are three lists of retired objects in use.
+ */
+#define EBR_LISTS 3
+
+typedef struct ebr_thread {
+	unsigned long state;            //(epoch << 1) | 1 while in a critical section, otherwise 0
+	int nest;
+	int inUse;
+	char pad[64 - sizeof(unsigned long) - 2 * sizeof(int)];    //one record per cache line
+} EBR_THREAD;
+
+static struct {
+	unsigned long epoch;
+	int used;                       //records ever handed out; the rest were never touched
+	long pending;                   //retired objects not yet freed
+	pthread_mutex_t mutex;          //orders retiring and advancing the epoch
+	pthread_once_t once;
+	pthread_key_t key;
+	EBR_NODE *limbo[EBR_LISTS];
+	EBR_THREAD threads[EBR_MAX_THREADS];
+} ebr = {1, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT};
+
+static __thread EBR_THREAD *self;
+
+/*
+ * Give the record of an exiting thread back.
+ */
+static void release_record(void *arg){
+	EBR_THREAD *t = arg;
+	__atomic_store_n(&t -> state, 0, __ATOMIC_RELEASE);
+	t -> nest = 0;
+	__atomic_store_n(&t -> inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void){
+	pthread_key_create(&ebr.key, release_record);
+}
+
+/*
+ * Find a free record for the calling thread, waiting for some thread to
+ * exit if there is none.
+ */
+static EBR_THREAD *claim_record(void){
+	pthread_once(&ebr.once, make_key);
+	while (1){
+		for (int i = 0; i < EBR_MAX_THREADS; i++){
+			EBR_THREAD *t = &ebr.threads[i];
+			int expected = 0;
+			if (__atomic_compare_exchange_n(&t -> inUse, &expected, 1, 0,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+				int used = __atomic_load_n(&ebr.used, __ATOMIC_RELAXED);
+				while (used <= i && !__atomic_compare_exchange_n(&ebr.used, &used, i + 1, 0,
+				                                                 __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+				pthread_setspecific(ebr.key, t);
+				return t;
+			}
+		}
+		debug("%ld: out of reclamation records, waiting", pthread_self());
+		sched_yield();
+	}
+}
+
+/*
+ * Advance the epoch if every thread in a critical section has seen the
+ * current one, and detach the objects that this makes free.
+ * The mutex must be held.
+ *
+ * @return the list of objects to be freed, or NULL.
+ */
+static EBR_NODE *try_advance(void){
+	unsigned long epoch = ebr.epoch;
+	int used = __atomic_load_n(&ebr.used, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < used; i++){
+		unsigned long state = __atomic_load_n(&ebr.threads[i].state, __ATOMIC_ACQUIRE);
+		if ((state & 1) && (state >> 1) != epoch){
+			return NULL;
+		}
+	}
+	__atomic_store_n(&ebr.epoch, epoch + 1, __ATOMIC_SEQ_CST);
+	//what was retired in the epoch before the one just left is now unreachable
+	EBR_NODE **list = &ebr.limbo[(epoch + 2) % EBR_LISTS];
+	EBR_NODE *free = *list;
+	*list = NULL;
+	return free;
+}
+
+/*
+ * Free a detached list of retired objects.  No lock may be held, since the
+ * objects' reclaim functions may retire further objects.
+ */
+static void reclaim(EBR_NODE *n){
+	long count = 0;
+	while (n != NULL){
+		EBR_NODE *next = n -> next;
+		n -> reclaim(n -> arg);
+		n = next;
+		count++;
+	}
+	if (count > 0){
+		__atomic_sub_fetch(&ebr.pending, count, __ATOMIC_RELAXED);
+	}
+}
+
+void ebr_enter(void){
+	EBR_THREAD *t = self;
+	if (t == NULL){
+		t = self = claim_record();
+	}
+	if (t -> nest++ == 0){
+		unsigned long epoch = __atomic_load_n(&ebr.epoch, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&t -> state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+		//the state must be visible before anything shared is read
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void ebr_exit(void){
+	EBR_THREAD *t = self;
+	if (t == NULL || t -> nest == 0){
+		return;
+	}
+	if (--t -> nest > 0){
+		return;
+	}
+	__atomic_store_n(&t -> state, 0, __ATOMIC_RELEASE);
+	//a quiescent point: help the epoch along if anything is waiting for it,
+	//but never wait for the mutex here
+	if (__atomic_load_n(&ebr.pending, __ATOMIC_RELAXED) > 0 && pthread_mutex_trylock(&ebr.mutex) == 0){
+		EBR_NODE *free = try_advance();
+		pthread_mutex_unlock(&ebr.mutex);
+		reclaim(free);
+	}
+}
+
+void ebr_retire(EBR_NODE *node, void (*reclaim_fn)(void *), void *arg){
+	node -> reclaim = reclaim_fn;
+	node -> arg = arg;
+	__atomic_add_fetch(&ebr.pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&ebr.mutex);
+	EBR_NODE **list = &ebr.limbo[ebr.epoch % EBR_LISTS];
+	node -> next = *list;
+	*list = node;
+	EBR_NODE *free = try_advance();
+	pthread_mutex_unlock(&ebr.mutex);
+	reclaim(free);
+}
+
+void ebr_fini(void){
+	pthread_mutex_lock(&ebr.mutex);
+	EBR_NODE *lists[EBR_LISTS];
+	for (int i = 0; i < EBR_LISTS; i++){
+		lists[i] = ebr.limbo[i];
+		ebr.limbo[i] = NULL;
+	}
+	pthread_mutex_unlock(&ebr.mutex);
+	for (int i = 0; i < EBR_LISTS; i++){
+		reclaim(lists[i]);
+	}
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+
+#include "debug.h"
+#include "player.h"
+#include "player_ext.h"
+#include "player_registry.h"
+#include "archive.h"
+#include "elo.h"
+
+//expected[i] is the expected score at a difference of i - ELO_TABLE_SPAN
+static double expected[2 * ELO_TABLE_SPAN + 1];
+static pthread_once_t expectedOnce = PTHREAD_ONCE_INIT;
+
+static void fill_expected(void){
+	for (int i = 0; i <= 2 * ELO_TABLE_SPAN; i++){
+		expected[i] = 1 / (1 + pow(10, (i - ELO_TABLE_SPAN) / ELO_SCALE));
+	}
+}
+
+/*
+ * The expected score, once the table is filled.
+ */
+static inline double lookup(double diff){
+	double x = diff + ELO_TABLE_SPAN;
+	if (!(x >= 0 && x < 2 * ELO_TABLE_SPAN)){
+		return 1 / (1 + pow(10, diff / ELO_SCALE));
+	}
+	int i = (int)x;
+	double f = x - i;
+	return expected[i] + f * (expected[i + 1] - expected[i]);
+}
+
+//the first player's score, by result
+static const double score[3] = {0.5, 1, 0};
+
+double elo_expected(double diff){
+	pthread_once(&expectedOnce, fill_expected);
+	return lookup(diff);
+}
+
+void elo_update(double *r1, double *r2, int result){
+	if (result < 0 || result > 2){
+		return;
+	}
+	double delta = ELO_K * (score[result] - elo_expected(*r2 - *r1));
+	*r1 += delta;
+	*r2 -= delta;
+}
+
+void elo_rate(ELO_GAME *games, size_t n, double *ratings){
+	pthread_once(&expectedOnce, fill_expected);
+	for (size_t i = 0; i < n; i++){
+		double *r1 = &ratings[games[i].first];
+		double *r2 = &ratings[games[i].second];
+		double delta = ELO_K * (score[games[i].result] - lookup(*r2 - *r1));
+		*r1 += delta;
+		*r2 -= delta;
+	}
+}
+
+/*
+ * The players and games found in the archive, the players numbered in
+ * the order they first appear and found through an open-addressed table
+ * of their names.
+ */
+typedef struct rerate {
+	char **names;
+	uint32_t *slots;                //player number plus one, or 0 if free
+	size_t slotCount;               //a power of two
+	uint32_t players;
+	ELO_GAME *games;
+	size_t gameCount;
+	size_t gameSize;
+	int failed;
+} RERATE;
+
+static uint32_t name_hash(char *name, size_t len){
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Double the table of names, placing the players again.
+ */
+static int grow_slots(RERATE *rr){
+	size_t count = rr -> slotCount == 0 ? 1024 : rr -> slotCount * 2;
+	uint32_t *slots = calloc(count, sizeof(uint32_t));
+	char **names = realloc(rr -> names, count / 2 * sizeof(char *));
+	if (slots == NULL || names == NULL){
+		free(slots);
+		if (names != NULL){
+			rr -> names = names;
+		}
+		return -1;
+	}
+	for (uint32_t p = 0; p < rr -> players; p++){
+		size_t i = name_hash(names[p], strlen(names[p])) & (count - 1);
+		while (slots[i] != 0){
+			i = (i + 1) & (count - 1);
+		}
+		slots[i] = p + 1;
+	}
+	free(rr -> slots);
+	rr -> slots = slots;
+	rr -> names = names;
+	rr -> slotCount = count;
+	return 0;
+}
+
+/*
+ * Find the number of a player, numbering it if it is new.
+ *
+ * @return the number, or -1 on error.
+ */
+static int64_t player_number(RERATE *rr, char *name, size_t len){
+	//kept at most half full
+	if (rr -> players >= rr -> slotCount / 2 && grow_slots(rr)){
+		return -1;
+	}
+	size_t i = name_hash(name, len) & (rr -> slotCount - 1);
+	while (rr -> slots[i] != 0){
+		char *other = rr -> names[rr -> slots[i] - 1];
+		if (strncmp(other, name, len) == 0 && other[len] == '\0'){
+			return rr -> slots[i] - 1;
+		}
+		i = (i + 1) & (rr -> slotCount - 1);
+	}
+	char *copy = strndup(name, len);
+	if (copy == NULL){
+		return -1;
+	}
+	rr -> names[rr -> players] = copy;
+	rr -> slots[i] = rr -> players + 1;
+	return rr -> players++;
+}
+
+static void add_game(ARCHIVE_RECORD *rec, void *arg){
+	RERATE *rr = arg;
+	if (rr -> failed || rec -> result < 0 || rec -> result > 2){
+		return;
+	}
+	if (rr -> gameCount == rr -> gameSize){
+		size_t size = rr -> gameSize == 0 ? 4096 : rr -> gameSize * 2;
+		ELO_GAME *games = realloc(rr -> games, size * sizeof(ELO_GAME));
+		if (games == NULL){
+			rr -> failed = 1;
+			return;
+		}
+		rr -> games = games;
+		rr -> gameSize = size;
+	}
+	int64_t first = player_number(rr, rec -> first, rec -> first_len);
+	int64_t second = player_number(rr, rec -> second, rec -> second_len);
+	if (first < 0 || second < 0){
+		rr -> failed = 1;
+		return;
+	}
+	ELO_GAME *g = &rr -> games[rr -> gameCount++];
+	g -> first = first;
+	g -> second = second;
+	g -> result = rec -> result;
+}
+
+int elo_rerate_archive(PLAYER_REGISTRY *preg){
+	if (preg == NULL){
+		return -1;
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	RERATE rr = {0};
+	int ret = -1;
+	if (archive_scan(add_game, &rr) < 0 || rr.failed){
+		goto out;
+	}
+	double *ratings = malloc((rr.players + 1) * sizeof(double));
+	if (ratings == NULL){
+		goto out;
+	}
+	for (uint32_t p = 0; p < rr.players; p++){
+		ratings[p] = PLAYER_INITIAL_RATING;
+	}
+	elo_rate(rr.games, rr.gameCount, ratings);
+	ret = 0;
+	for (uint32_t p = 0; p < rr.players; p++){
+		PLAYER *player = preg_register(preg, rr.names[p]);
+		if (player == NULL){
+			continue;
+		}
+		player_set_rating_exact(player, ratings[p]);
+		player_unref(player, "re-rated from the archive");
+		ret += 1;
+	}
+	free(ratings);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	debug("%ld: re-rated %d players from %lu games in %.3fs", pthread_self(), ret,
+		(unsigned long)rr.gameCount, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+out:
+	for (uint32_t p = 0; p < rr.players; p++){
+		free(rr.names[p]);
+	}
+	free(rr.names);
+	free(rr.slots);
+	free(rr.games);
+	return ret;
+}
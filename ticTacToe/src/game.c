@@ -20,16 +20,33 @@
 #include "invitation.h"
 #include "jeux_globals.h"
 #include "game.h"
+#include "game_ext.h"
+#include "timer.h"
+#include "actor.h"
 
 typedef struct game {
 	int ref;
+	uint32_t id;
+	int watchers;                   //atomic; spectators, counted by the spectator module
 	int gameboard[3][3];
-	sem_t seph;
+	ACTOR actor;                    //everything below is only touched by the game's handlers
 	GAME_ROLE expectedTurn;
 	char player1Sym;
 	char player2Sym;
 	int gameover;
 	GAME_ROLE winner;
+	int moves;
+	int lastCell;
+	uint64_t startTime;
+	GAME_MOVE_RECORD history[GAME_MAX_MOVES];
+	int clocked;
+	uint64_t remaining[2];          //time left for each role, as of turnStart for the one on the move
+	uint64_t increment;
+	uint64_t turnStart;
+	TIMER clock;
+	void (*flag)(GAME *, GAME_ROLE, void *);
+	void (*release)(void *);
+	void *clockArg;
 } GAME;
 
 /*
@@ -56,10 +73,165 @@ typedef struct game_move{
  * The precise contents are up to you.  Be sure that all the operations
  * that might be called concurrently are thread-safe.
  */
+static uint32_t nextGameId = 0;
+
+/*
+ * Each GAME is an actor (see actor.h): the operations that look at or
+ * change more than its reference count and immutable fields are carried
+ * out by game_receive() as messages, one at a time, so the game needs no
+ * lock.  Anything that must not be done while handling a message, such
+ * as dropping references or calling back into other modules, is left in
+ * the message for the caller to do afterwards.
+ */
+typedef enum game_op {
+	GAME_OP_PARSE,
+	GAME_OP_APPLY,
+	GAME_OP_PLAY,
+	GAME_OP_RESIGN,
+	GAME_OP_EXPIRE,
+	GAME_OP_ENCODE,
+	GAME_OP_MOVES,
+	GAME_OP_START_CLOCK,
+	GAME_OP_GET_CLOCK,
+	GAME_OP_SNAPSHOT
+} GAME_OP;
+
+typedef struct game_msg {
+	ACTOR_MSG msg;                  //first, so that the handler can get at the rest
+	GAME_OP op;
+	GAME *game;
+	int result;
+	GAME_ROLE role;
+	char *str;
+	GAME_MOVE *move;
+	GAME_ENCODING enc;
+	void *buf;
+	int max;
+	GAME_MOVE_RECORD *moves;
+	GAME_SNAPSHOT *snap;
+	uint64_t times[2];
+	uint64_t increment;
+	uint64_t turnStart;
+	void (*flag)(GAME *, GAME_ROLE, void *);
+	void (*release)(void *);
+	void *arg;
+	//left for the caller once the clock has stopped
+	int timerRef;
+	void (*released)(void *);
+	void *releasedArg;
+} GAME_MSG;
+
+static uint64_t now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Stop the clock of a game that has ended.  What has to be released is
+ * left in the message, along with whether the timer's reference to the
+ * game has to be dropped.
+ */
+static void stop_clock(GAME *game, GAME_MSG *m){
+	if (!game -> clocked){
+		return;
+	}
+	game -> clocked = 0;
+	m -> released = game -> release;
+	m -> releasedArg = game -> clockArg;
+	game -> release = NULL;
+	m -> timerRef = timer_cancel(&game -> clock);
+}
+
+/*
+ * Do what stop_clock() left for the caller of a message.
+ */
+static void clock_released(GAME *game, GAME_MSG *m){
+	if (m -> released != NULL){
+		m -> released(m -> releasedArg);
+	}
+	if (m -> timerRef){
+		game_unref(game, "clock stopped");
+	}
+}
+
+/*
+ * Arm the clock timer for the player on the move.
+ * The armed timer holds a reference to the game.
+ */
+static void arm_clock(GAME *game){
+	uint64_t deadline = game -> turnStart + game -> remaining[game -> expectedTurn - 1];
+	if (timer_arm_at(&game -> clock, deadline) == 0){
+		__atomic_add_fetch(&game -> ref, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * See whether the player on the move has run out of time.
+ *
+ * @return 0 if the clock had already stopped, 1 if the player still has
+ * time, or 2 if the flag has fallen and the game is over.
+ */
+static int expire(GAME *game, GAME_MSG *m){
+	if (!game -> clocked || game -> gameover){
+		return 0;
+	}
+	GAME_ROLE role = game -> expectedTurn;
+	uint64_t now = timer_now_ms();
+	if (now - game -> turnStart < game -> remaining[role - 1]){
+		//a move was made after this expiry was taken off the wheel; the reference goes with the new deadline
+		if (timer_arm_at(&game -> clock, game -> turnStart + game -> remaining[role - 1]) == 1){
+			__atomic_sub_fetch(&game -> ref, 1, __ATOMIC_RELAXED);
+		}
+		return 1;
+	}
+	debug("%ld: flag fell for role %d in game %u", pthread_self(), role, game -> id);
+	game -> remaining[role - 1] = 0;
+	__atomic_store_n(&game -> winner, role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE, __ATOMIC_RELAXED);
+	__atomic_store_n(&game -> gameover, 1, __ATOMIC_RELEASE);
+	m -> role = role;
+	m -> flag = game -> flag;
+	stop_clock(game, m);
+	return 2;
+}
+
+static void game_receive(ACTOR_MSG *msg);
+
+/*
+ * Have a message handled by a game.
+ */
+static int call(GAME *game, GAME_MSG *m, GAME_OP op){
+	m -> op = op;
+	m -> game = game;
+	actor_call(&game -> actor, &m -> msg, game_receive);
+	return m -> result;
+}
+
+/*
+ * Called from the timer thread when the player on the move may have run
+ * out of time.
+ */
+static void clock_expired(void *arg){
+	GAME *game = arg;
+	GAME_MSG m = {0};
+	int r = call(game, &m, GAME_OP_EXPIRE);
+	if (r == 0){
+		game_unref(game, "clock expired after stop");
+	}
+	else if (r == 2){
+		m.flag(game, m.role, m.releasedArg);
+		//the timer's reference is the one this callback holds
+		m.timerRef = 1;
+		clock_released(game, &m);
+	}
+}
+
 GAME *game_create(){
 	GAME * g = malloc(sizeof(GAME));
 	g -> ref = 1;
-	sem_init(&g->seph, 0, 1);
+	g -> id = __atomic_add_fetch(&nextGameId, 1, __ATOMIC_RELAXED);
+	g -> watchers = 0;
+	actor_init(&g -> actor);
 	for (int i = 0; i < 3; i++){
 		for (int j = 0; j < 3; j++){
 			g -> gameboard[i][j] = 0;
@@ -70,13 +242,16 @@ GAME *game_create(){
 	g -> winner = NULL_ROLE;
 	g -> player1Sym = ' ';
 	g-> player2Sym = ' ';
+	g -> moves = 0;
+	g -> lastCell = -1;
+	g -> startTime = now_ms();
+	g -> clocked = 0;
+	g -> release = NULL;
 	return g;
 }
 GAME *game_ref(GAME *game, char *why){
-	sem_wait(&game -> seph);
 	debug("%ld: %p %s", pthread_self(), game, why);
-	game -> ref += 1;
-	sem_post(&game-> seph);
+	__atomic_add_fetch(&game -> ref, 1, __ATOMIC_RELAXED);
 	return game;
 }
 /*
@@ -90,48 +265,42 @@ GAME *game_ref(GAME *game, char *why){
  * the reference counting.
  */
 void game_unref(GAME *game, char *why){
-	sem_wait(&game -> seph);
 	debug("%ld: %p %s", pthread_self(), game, why);
-	game -> ref -= 1;
-	if (game -> ref == 0){
-		sem_post(&game-> seph);
+	if (__atomic_sub_fetch(&game -> ref, 1, __ATOMIC_ACQ_REL) == 0){
+		if (game -> release != NULL){
+			game -> release(game -> clockArg);
+		}
 		free(game);
 	}
-	else{
-		sem_post(&game-> seph);
-	}
-
 }
 /*
- * Apply a GAME_MOVE to a GAME.
- * If the move is illegal in the current GAME state, then it is an error.
- *
- * @param game  The GAME to which the move is to be applied.
- * @param move  The GAME_MOVE to be applied to the game.
- * @return 0 if application of the move was successful, otherwise -1.
+ * Apply a GAME_MOVE to a GAME, for game_apply_move().
  */
-int game_apply_move(GAME *game, GAME_MOVE *move){
-
-	if (game == NULL || move == NULL){
+static int apply_move(GAME *game, GAME_MOVE *move, GAME_MSG *m){
+	if (move == NULL){
 		return -1;
 	}
-	sem_wait(&game -> seph);
 
 	int cord = move -> cord;
 	char turn = move -> turn;
-	if (turn != game -> expectedTurn){
-		sem_post(&game-> seph);
+	if (game -> gameover || turn != game -> expectedTurn){
 		return -1;
 	}
+	uint64_t now = 0;
+	if (game -> clocked){
+		now = timer_now_ms();
+		if (now - game -> turnStart >= game -> remaining[turn - 1]){
+			//the flag has fallen, and the timer will end the game
+			return -1;
+		}
+	}
 	if (turn == FIRST_PLAYER_ROLE){
 		if (game -> player1Sym != move-> sym){
-			sem_post(&game-> seph);
 			return -1;
 		}
 	}
 	else{
 		if (game -> player2Sym != move-> sym){
-			sem_post(&game-> seph);
 			return -1;
 		}
 	}
@@ -144,6 +313,11 @@ int game_apply_move(GAME *game, GAME_MOVE *move){
 					return -1;
 				}
 				game -> gameboard[i][j] = turn;
+				game -> lastCell = i * 3 + j;
+				game -> history[game -> moves].cell = game -> lastCell;
+				game -> history[game -> moves].role = turn;
+				game -> history[game -> moves].time_ms = now_ms();
+				game -> moves += 1;
 				if (game -> expectedTurn == 1){
 					game -> expectedTurn = SECOND_PLAYER_ROLE;
 				}
@@ -215,10 +389,39 @@ int game_apply_move(GAME *game, GAME_MOVE *move){
 		debug("%ld: game ended after move", pthread_self());
 		debug("%ld: winner %d", pthread_self(), game -> winner);
 	}
-	sem_post(&game-> seph);
+	if (game -> clocked){
+		game -> remaining[turn - 1] -= now - game -> turnStart;
+		game -> remaining[turn - 1] += game -> increment;
+		game -> turnStart = now;
+		if (game -> gameover){
+			stop_clock(game, m);
+		}
+		else{
+			arm_clock(game);
+		}
+	}
 	return 0;
 
 }
+/*
+ * Apply a GAME_MOVE to a GAME.
+ * If the move is illegal in the current GAME state, then it is an error.
+ *
+ * @param game  The GAME to which the move is to be applied.
+ * @param move  The GAME_MOVE to be applied to the game.
+ * @return 0 if application of the move was successful, otherwise -1.
+ */
+int game_apply_move(GAME *game, GAME_MOVE *move){
+	if (game == NULL || move == NULL){
+		return -1;
+	}
+	GAME_MSG m = {0};
+	m.move = move;
+	int r = call(game, &m, GAME_OP_APPLY);
+	clock_released(game, &m);
+	return r;
+}
+
 /*
  * Submit the resignation of the GAME by the player in a specified
  * GAME_ROLE.  It is an error if the game has already terminated.
@@ -228,14 +431,17 @@ int game_apply_move(GAME *game, GAME_MOVE *move){
  * @return 0 if resignation was successful, otherwise -1.
  */
 int game_resign(GAME *game, GAME_ROLE role){
-	if (game == NULL){
-		return -1;
-	}
-	sem_wait(&game -> seph);
-	if (role == NULL_ROLE){
-		sem_post(&game-> seph);
+	if (game == NULL || role == NULL_ROLE){
 		return -1;
 	}
+	GAME_MSG m = {0};
+	m.role = role;
+	int r = call(game, &m, GAME_OP_RESIGN);
+	clock_released(game, &m);
+	return r;
+}
+
+static int resign(GAME *game, GAME_ROLE role, GAME_MSG *m){
 	if (role == FIRST_PLAYER_ROLE){
 		game -> winner = SECOND_PLAYER_ROLE;
 	}
@@ -243,9 +449,8 @@ int game_resign(GAME *game, GAME_ROLE role){
 		game -> winner = SECOND_PLAYER_ROLE;
 	}
 	game -> gameover = 1;
-	sem_post(&game-> seph);
+	stop_clock(game, m);
 	return 0;
-
 }
 
 /*
@@ -260,34 +465,8 @@ int game_resign(GAME *game, GAME_ROLE role){
  */
 char *game_unparse_state(GAME *game){
 	debug("%ld: getting gamestate", pthread_self());
-	sem_wait(&game -> seph);
 	char* gamestate = calloc(1, sizeof(char)*19);
-	char * pointer = gamestate;
-	for (int i = 0; i < 3; i++){
-		for (int j = 0; j < 3; j++){
-			if (game -> gameboard[i][j] == 0){
-				*pointer = ' ';
-				 pointer += 1;
-
-			}
-			else if (game -> gameboard[i][j] == 1){
-				*pointer = game -> player1Sym;
-				pointer += 1;
-			}
-			else{
-				*pointer = game -> player2Sym;
-				pointer += 1;
-			}
-			if (j != 2){
-				*pointer = '|';
-				pointer += 1;
-			}
-		}
-		*pointer = '\n';
-		pointer += 1;
-	}
-	pointer = '\0';
-	sem_post(&game-> seph);
+	game_encode_state(game, GAME_ENC_ASCII, gamestate, 18);
 	return gamestate;
 }
 
@@ -301,7 +480,7 @@ int game_is_over(GAME *game){
 	if (game == NULL){
 		return 0;
 	}
-	if (game -> gameover){
+	if (__atomic_load_n(&game -> gameover, __ATOMIC_ACQUIRE)){
 		return 1;
 	}
 	return 0;
@@ -319,7 +498,7 @@ GAME_ROLE game_get_winner(GAME *game){
 	if (game == NULL){
 		return NULL_ROLE;
 	}
-	return game -> winner;
+	return __atomic_load_n(&game -> winner, __ATOMIC_ACQUIRE);
 }
 
 /*
@@ -345,7 +524,14 @@ GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str){
 	if (game == NULL){
 		return NULL;
 	}
-	sem_wait(&game -> seph);
+	GAME_MSG m = {0};
+	m.role = role;
+	m.str = str;
+	call(game, &m, GAME_OP_PARSE);
+	return m.move;
+}
+
+static GAME_MOVE *parse_move(GAME *game, GAME_ROLE role, char *str){
 	GAME_MOVE *move = malloc(sizeof(GAME_MOVE));
 	debug("%ld: paring move  %s", pthread_self(), str);
 	int length = strlen(str);
@@ -383,31 +569,49 @@ GAME_MOVE *game_parse_move(GAME *game, GAME_ROLE role, char *str){
 		move -> turn = role;
 
 		debug("%ld: parse success", pthread_self());
-		sem_post(&game-> seph);
 		return move;
 
 
 	}
 	else if (length == 4){
 		if (str[length - 1] != 'X' || str[length - 1] != 'O'){
-			sem_post(&game-> seph);
+			free(move);
 			return NULL;
 		}
 		move -> cord = str[0] - '0';
 		move -> sym = str[length - 1];
 		move -> turn = role;
-		sem_post(&game-> seph);
 		return move;
 
 	}
 	else{
-		sem_post(&game-> seph);
+		free(move);
 		debug("%ld: fail parse move", pthread_self());
 		return NULL;
 	}
 
 }
 
+/*
+ * Parse a move and apply it to a GAME, as one operation.
+ *
+ * @param game  The GAME to which the move is to be applied.
+ * @param role  The GAME_ROLE of the player making the move.
+ * @param str  The string that is to be interpreted as a move.
+ * @return 0 if the move was parsed and applied, otherwise -1.
+ */
+int game_play_move(GAME *game, GAME_ROLE role, char *str){
+	if (game == NULL || role == NULL_ROLE || str == NULL){
+		return -1;
+	}
+	GAME_MSG m = {0};
+	m.role = role;
+	m.str = str;
+	int r = call(game, &m, GAME_OP_PLAY);
+	clock_released(game, &m);
+	return r;
+}
+
 /*
  * Get a string that describes a specified GAME_MOVE, in a format
  * appropriate to be shown to human users.  The returned string should
@@ -427,4 +631,432 @@ char *game_unparse_move(GAME_MOVE *move){
 	m[3] = move -> sym;
 	return m;
 
-}
\ No newline at end of file
+}
+
+/*
+ * Get the server-wide ID of a GAME.
+ *
+ * @param game  The GAME to be queried.
+ * @return the ID of the GAME, or 0 if game is NULL.
+ */
+uint32_t game_get_id(GAME *game){
+	if (game == NULL){
+		return 0;
+	}
+	return game -> id;
+}
+
+/*
+ * Count a spectator starting or stopping to watch a GAME.
+ *
+ * @param game  The GAME being watched.
+ * @param delta  1 for a spectator that starts watching, -1 for one that
+ * stops.
+ */
+void game_add_watchers(GAME *game, int delta){
+	__atomic_add_fetch(&game -> watchers, delta, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Get the number of spectators watching a GAME.
+ *
+ * @param game  The GAME to be queried.
+ * @return the number of spectators.
+ */
+int game_get_watchers(GAME *game){
+	return __atomic_load_n(&game -> watchers, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Symbol of the first player, defaulting to the one that
+ * game_parse_move() would pick for the first move.
+ */
+static int first_is_o(GAME *game){
+	return game -> player1Sym == 'O' || (game -> player1Sym == ' ' && game -> player2Sym == 'X');
+}
+
+static size_t encode_ascii(GAME *game, char *pointer){
+	for (int i = 0; i < 3; i++){
+		for (int j = 0; j < 3; j++){
+			if (game -> gameboard[i][j] == 0){
+				*pointer++ = ' ';
+			}
+			else if (game -> gameboard[i][j] == 1){
+				*pointer++ = game -> player1Sym;
+			}
+			else{
+				*pointer++ = game -> player2Sym;
+			}
+			if (j != 2){
+				*pointer++ = '|';
+			}
+		}
+		*pointer++ = '\n';
+	}
+	return 18;
+}
+
+static size_t encode_packed(GAME *game, unsigned char *buf){
+	uint32_t v = 0;
+	for (int i = 0; i < 9; i++){
+		v |= (uint32_t)(game -> gameboard[i / 3][i % 3] & 3) << (2 * i);
+	}
+	if (first_is_o(game)){
+		v |= 1 << 18;
+	}
+	if (!game -> gameover){
+		v |= (uint32_t)(game -> expectedTurn & 3) << 19;
+	}
+	v |= (uint32_t)(game -> moves & 0xf) << 21;
+	v = htonl(v);
+	memcpy(buf, &v, sizeof(v));
+	return 4;
+}
+
+static size_t encode_delta(GAME *game, unsigned char *buf){
+	if (game -> lastCell < 0){
+		buf[0] = 0xff;
+		buf[1] = 0;
+		return 2;
+	}
+	int role = game -> gameboard[game -> lastCell / 3][game -> lastCell % 3];
+	int o = role == FIRST_PLAYER_ROLE ? first_is_o(game) : !first_is_o(game);
+	buf[0] = game -> lastCell;
+	buf[1] = (role & 3) | (o << 2) | ((game -> moves & 0xf) << 4);
+	return 2;
+}
+
+/*
+ * Get the encoding used to send a full GAME state to a client that
+ * has selected the given encoding.
+ *
+ * @param enc  The encoding selected by the client.
+ * @return enc, or GAME_ENC_PACKED if enc is GAME_ENC_DELTA.
+ */
+GAME_ENCODING game_full_encoding(GAME_ENCODING enc){
+	if (enc == GAME_ENC_DELTA){
+		return GAME_ENC_PACKED;
+	}
+	return enc;
+}
+
+/*
+ * Get the size of a GAME state in a given encoding.
+ *
+ * @param enc  The encoding.
+ * @return the number of bytes, or 0 if enc is not a valid encoding.
+ */
+size_t game_encoding_size(GAME_ENCODING enc){
+	switch (enc){
+		case GAME_ENC_ASCII:
+			return 18;
+		case GAME_ENC_PACKED:
+			return 4;
+		case GAME_ENC_DELTA:
+			return 2;
+	}
+	return 0;
+}
+
+/*
+ * Encode the current state of a GAME into a caller-supplied buffer.
+ *
+ * @param game  The GAME whose state is to be encoded.
+ * @param enc  The encoding to use.
+ * @param buf  The buffer into which to encode.
+ * @param len  The size of the buffer.
+ * @return the number of bytes stored, or 0 if the encoding is invalid
+ * or the buffer is too small.
+ */
+size_t game_encode_state(GAME *game, GAME_ENCODING enc, void *buf, size_t len){
+	size_t size = game_encoding_size(enc);
+	if (game == NULL || buf == NULL || size == 0 || len < size){
+		return 0;
+	}
+	GAME_MSG m = {0};
+	m.enc = enc;
+	m.buf = buf;
+	call(game, &m, GAME_OP_ENCODE);
+	return size;
+}
+
+static void encode_state(GAME *game, GAME_ENCODING enc, void *buf){
+	if (enc == GAME_ENC_ASCII){
+		encode_ascii(game, buf);
+	}
+	else if (enc == GAME_ENC_PACKED){
+		encode_packed(game, buf);
+	}
+	else{
+		encode_delta(game, buf);
+	}
+}
+
+/*
+ * Get the time at which a GAME was created.
+ *
+ * @param game  The GAME to be queried.
+ * @return the creation time in milliseconds since the epoch.
+ */
+uint64_t game_get_start_time(GAME *game){
+	if (game == NULL){
+		return 0;
+	}
+	return game -> startTime;
+}
+
+/*
+ * Get the history of moves made in a GAME, oldest first.
+ *
+ * @param game  The GAME to be queried.
+ * @param moves  Caller-supplied array into which the moves are stored.
+ * @param max  Size of the moves array.
+ * @return the number of moves stored.
+ */
+int game_get_moves(GAME *game, GAME_MOVE_RECORD *moves, int max){
+	if (game == NULL || moves == NULL){
+		return 0;
+	}
+	GAME_MSG m = {0};
+	m.moves = moves;
+	m.max = max;
+	return call(game, &m, GAME_OP_MOVES);
+}
+
+static int get_moves(GAME *game, GAME_MOVE_RECORD *moves, int max){
+	int n = game -> moves < max ? game -> moves : max;
+	memcpy(moves, game -> history, n * sizeof(GAME_MOVE_RECORD));
+	return n;
+}
+
+/*
+ * Start the clock of a GAME with the given times.
+ */
+static int start_clock(GAME *game, uint64_t remaining[2], uint64_t increment_ms, uint64_t turnStart,
+                       void (*flag)(GAME *, GAME_ROLE, void *),
+                       void (*release)(void *), void *arg){
+	if (game == NULL || flag == NULL){
+		return -1;
+	}
+	GAME_MSG m = {0};
+	m.times[0] = remaining[0];
+	m.times[1] = remaining[1];
+	m.increment = increment_ms;
+	m.turnStart = turnStart;
+	m.flag = flag;
+	m.release = release;
+	m.arg = arg;
+	return call(game, &m, GAME_OP_START_CLOCK);
+}
+
+static int set_clock(GAME *game, GAME_MSG *m){
+	if (game -> clocked || game -> gameover){
+		return -1;
+	}
+	game -> clocked = 1;
+	game -> remaining[0] = m -> times[0];
+	game -> remaining[1] = m -> times[1];
+	game -> increment = m -> increment;
+	game -> turnStart = m -> turnStart;
+	game -> flag = m -> flag;
+	game -> release = m -> release;
+	game -> clockArg = m -> arg;
+	timer_setup(&game -> clock, clock_expired, game);
+	arm_clock(game);
+	return 0;
+}
+
+/*
+ * Put a GAME under time control, like a chess clock.
+ *
+ * @param game  The GAME to be put under time control.
+ * @param base_ms  Each player's initial time, in milliseconds.
+ * @param increment_ms  The time added after each move, in milliseconds.
+ * @param flag  The function called when a player's time runs out.
+ * @param release  The function called with arg once the clock has
+ * stopped, or NULL.
+ * @param arg  An argument for the flag and release functions.
+ * @return 0 if successful, otherwise -1.
+ */
+int game_set_clock(GAME *game, uint64_t base_ms, uint64_t increment_ms,
+                   void (*flag)(GAME *, GAME_ROLE, void *),
+                   void (*release)(void *), void *arg){
+	if (base_ms == 0){
+		return -1;
+	}
+	uint64_t remaining[2] = {base_ms, base_ms};
+	return start_clock(game, remaining, increment_ms, timer_now_ms(), flag, release, arg);
+}
+
+/*
+ * Get the time that each player has left.
+ *
+ * @param game  The GAME to be queried.
+ * @param first_ms  Variable into which the first player's time is stored.
+ * @param second_ms  Variable into which the second player's time is stored.
+ * @return 0 if the game is under time control, otherwise -1.
+ */
+int game_get_clock(GAME *game, uint64_t *first_ms, uint64_t *second_ms){
+	if (game == NULL){
+		return -1;
+	}
+	GAME_MSG m = {0};
+	if (call(game, &m, GAME_OP_GET_CLOCK)){
+		return -1;
+	}
+	*first_ms = m.times[0];
+	*second_ms = m.times[1];
+	return 0;
+}
+
+static int get_clock(GAME *game, uint64_t left[2]){
+	if (!game -> clocked){
+		return -1;
+	}
+	left[0] = game -> remaining[0];
+	left[1] = game -> remaining[1];
+	if (!game -> gameover){
+		uint64_t elapsed = timer_now_ms() - game -> turnStart;
+		int i = game -> expectedTurn - 1;
+		left[i] = elapsed >= left[i] ? 0 : left[i] - elapsed;
+	}
+	return 0;
+}
+
+/*
+ * Take a snapshot of a GAME.
+ *
+ * @param game  The GAME.
+ * @param snap  The snapshot to be filled in.
+ * @return 0 if successful, or -1 if the game is over.
+ */
+int game_snapshot(GAME *game, GAME_SNAPSHOT *snap){
+	if (game == NULL || snap == NULL){
+		return -1;
+	}
+	GAME_MSG m = {0};
+	m.snap = snap;
+	return call(game, &m, GAME_OP_SNAPSHOT);
+}
+
+static int snapshot(GAME *game, GAME_SNAPSHOT *snap){
+	if (game -> gameover){
+		return -1;
+	}
+	snap -> id = game -> id;
+	snap -> start_ms = game -> startTime;
+	snap -> first_sym = game -> player1Sym;
+	snap -> second_sym = game -> player2Sym;
+	snap -> moves = game -> moves;
+	memcpy(snap -> history, game -> history, sizeof(snap -> history));
+	snap -> clocked = game -> clocked;
+	snap -> remaining_ms[0] = game -> remaining[0];
+	snap -> remaining_ms[1] = game -> remaining[1];
+	snap -> increment_ms = game -> increment;
+	snap -> turn_start_ms = game -> turnStart;
+	return 0;
+}
+
+/*
+ * Rebuild a GAME from a snapshot.
+ *
+ * @param snap  The snapshot.
+ * @return the GAME, with a reference count of one, or NULL if the
+ * snapshot does not describe a game in progress.
+ */
+GAME *game_restore(GAME_SNAPSHOT *snap){
+	if (snap == NULL || snap -> id == 0 || snap -> moves < 0 || snap -> moves >= GAME_MAX_MOVES){
+		return NULL;
+	}
+	GAME *g = game_create();
+	if (g == NULL){
+		return NULL;
+	}
+	g -> id = snap -> id;
+	uint32_t next = __atomic_load_n(&nextGameId, __ATOMIC_RELAXED);
+	while (next < snap -> id &&
+	       !__atomic_compare_exchange_n(&nextGameId, &next, snap -> id, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+	}
+	g -> startTime = snap -> start_ms;
+	g -> player1Sym = snap -> first_sym;
+	g -> player2Sym = snap -> second_sym;
+	//the players take turns, first player first, so the history says everything else
+	for (int i = 0; i < snap -> moves; i++){
+		GAME_MOVE_RECORD *m = &snap -> history[i];
+		GAME_ROLE expected = i % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+		if (m -> cell > 8 || m -> role != expected || g -> gameboard[m -> cell / 3][m -> cell % 3] != 0){
+			free(g);
+			return NULL;
+		}
+		g -> gameboard[m -> cell / 3][m -> cell % 3] = m -> role;
+		g -> history[i] = *m;
+		g -> lastCell = m -> cell;
+	}
+	g -> moves = snap -> moves;
+	g -> expectedTurn = snap -> moves % 2 == 0 ? FIRST_PLAYER_ROLE : SECOND_PLAYER_ROLE;
+	return g;
+}
+
+/*
+ * Restart the clock of a GAME rebuilt by game_restore().
+ *
+ * @param game  The GAME.
+ * @param snap  The snapshot it was rebuilt from.
+ * @param flag  The function called when a player's time runs out.
+ * @param release  The function called with arg once the clock has
+ * stopped, or NULL.
+ * @param arg  An argument for the flag and release functions.
+ * @return 0 if successful, otherwise -1.
+ */
+int game_restore_clock(GAME *game, GAME_SNAPSHOT *snap,
+                       void (*flag)(GAME *, GAME_ROLE, void *),
+                       void (*release)(void *), void *arg){
+	if (snap == NULL || !snap -> clocked){
+		return -1;
+	}
+	return start_clock(game, snap -> remaining_ms, snap -> increment_ms, snap -> turn_start_ms,
+	                   flag, release, arg);
+}
+
+/*
+ * Handle a message sent to a GAME.
+ */
+static void game_receive(ACTOR_MSG *msg){
+	GAME_MSG *m = (GAME_MSG *)msg;
+	GAME *game = m -> game;
+	switch (m -> op){
+		case GAME_OP_PARSE:
+			m -> move = parse_move(game, m -> role, m -> str);
+			break;
+		case GAME_OP_APPLY:
+			m -> result = apply_move(game, m -> move, m);
+			break;
+		case GAME_OP_PLAY:
+			m -> move = parse_move(game, m -> role, m -> str);
+			m -> result = apply_move(game, m -> move, m);
+			free(m -> move);
+			m -> move = NULL;
+			break;
+		case GAME_OP_RESIGN:
+			m -> result = resign(game, m -> role, m);
+			break;
+		case GAME_OP_EXPIRE:
+			m -> result = expire(game, m);
+			break;
+		case GAME_OP_ENCODE:
+			encode_state(game, m -> enc, m -> buf);
+			break;
+		case GAME_OP_MOVES:
+			m -> result = get_moves(game, m -> moves, m -> max);
+			break;
+		case GAME_OP_START_CLOCK:
+			m -> result = set_clock(game, m);
+			break;
+		case GAME_OP_GET_CLOCK:
+			m -> result = get_clock(game, m -> times);
+			break;
+		case GAME_OP_SNAPSHOT:
+			m -> result = snapshot(game, m -> snap);
+			break;
+	}
+}
@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "debug.h"
+#include "player.h"
+#include "player_ext.h"
+#include "player_registry.h"
+#include "player_registry_ext.h"
+#include "glicko.h"
+#include "rating_history.h"
+
+//how closely the new volatility is found
+#define GLICKO_EPSILON 0.000001
+
+static double g(double phi){
+	return 1 / sqrt(1 + 3 * phi * phi / (M_PI * M_PI));
+}
+
+/*
+ * The function whose root is the logarithm of the squared new volatility.
+ */
+static double f(double x, double delta2, double phi2, double v, double a){
+	double ex = exp(x);
+	double d = phi2 + v + ex;
+	return ex * (delta2 - phi2 - v - ex) / (2 * d * d) - (x - a) / (GLICKO_TAU * GLICKO_TAU);
+}
+
+void glicko_update(GLICKO_RATING *r, GLICKO_GAME *games, int n){
+	double mu = (r -> rating - PLAYER_INITIAL_RATING) / GLICKO_SCALE;
+	double phi = r -> deviation / GLICKO_SCALE;
+	double sigma = r -> volatility;
+	if (n == 0){
+		//only the uncertainty grows
+		phi = sqrt(phi * phi + sigma * sigma);
+		r -> deviation = fmin(phi * GLICKO_SCALE, GLICKO_INITIAL_DEVIATION);
+		return;
+	}
+	double vinv = 0;
+	double sum = 0;
+	for (int i = 0; i < n; i++){
+		double muj = (games[i].opponent.rating - PLAYER_INITIAL_RATING) / GLICKO_SCALE;
+		double gj = g(games[i].opponent.deviation / GLICKO_SCALE);
+		double e = 1 / (1 + exp(-gj * (mu - muj)));
+		vinv += gj * gj * e * (1 - e);
+		sum += gj * (games[i].score - e);
+	}
+	double v = 1 / vinv;
+	double delta = v * sum;
+	//the new volatility, by the Illinois algorithm
+	double delta2 = delta * delta;
+	double phi2 = phi * phi;
+	double a = log(sigma * sigma);
+	double A = a;
+	double B;
+	if (delta2 > phi2 + v){
+		B = log(delta2 - phi2 - v);
+	}
+	else{
+		int k = 1;
+		while (f(a - k * GLICKO_TAU, delta2, phi2, v, a) < 0){
+			k++;
+		}
+		B = a - k * GLICKO_TAU;
+	}
+	double fA = f(A, delta2, phi2, v, a);
+	double fB = f(B, delta2, phi2, v, a);
+	while (fabs(B - A) > GLICKO_EPSILON){
+		double C = A + (A - B) * fA / (fB - fA);
+		double fC = f(C, delta2, phi2, v, a);
+		if (fC * fB <= 0){
+			A = B;
+			fA = fB;
+		}
+		else{
+			fA /= 2;
+		}
+		B = C;
+		fB = fC;
+	}
+	sigma = exp(A / 2);
+	double phistar = sqrt(phi2 + sigma * sigma);
+	phi = 1 / sqrt(1 / (phistar * phistar) + 1 / v);
+	mu += phi * phi * sum;
+	r -> rating = mu * GLICKO_SCALE + PLAYER_INITIAL_RATING;
+	r -> deviation = phi * GLICKO_SCALE;
+	r -> volatility = sigma;
+}
+
+/*
+ * A result waiting for the end of its rating period.
+ */
+typedef struct glicko_result {
+	PLAYER *first;
+	PLAYER *second;
+	int result;
+} GLICKO_RESULT;
+
+static struct {
+	int running;
+	PLAYER_REGISTRY *preg;
+	uint64_t periodMs;
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stopping;
+	GLICKO_RESULT *results;         //of the current period
+	size_t count;
+	size_t size;
+	pthread_mutex_t rateMutex;      //held while a period is being rated
+} glicko = {0, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+            .rateMutex = PTHREAD_MUTEX_INITIALIZER};
+
+void glicko_post_result(PLAYER *player1, PLAYER *player2, int result){
+	if (player1 == NULL || player2 == NULL || result < 0 || result > 2){
+		return;
+	}
+	pthread_mutex_lock(&glicko.mutex);
+	if (glicko.count == glicko.size){
+		size_t size = glicko.size == 0 ? 256 : glicko.size * 2;
+		GLICKO_RESULT *results = realloc(glicko.results, size * sizeof(GLICKO_RESULT));
+		if (results == NULL){
+			pthread_mutex_unlock(&glicko.mutex);
+			return;
+		}
+		glicko.results = results;
+		glicko.size = size;
+	}
+	GLICKO_RESULT *r = &glicko.results[glicko.count++];
+	r -> first = player_ref(player1, "waiting for the rating period");
+	r -> second = player_ref(player2, "waiting for the rating period");
+	r -> result = result;
+	pthread_mutex_unlock(&glicko.mutex);
+}
+
+/*
+ * The players of a period, in order of address so that they can be
+ * found by bsearch(), with the games each played: those of player i are
+ * games[offsets[i]] to games[offsets[i + 1] - 1].
+ */
+typedef struct glicko_period {
+	PLAYER **players;
+	GLICKO_RATING *ratings;         //at the start of the period, then at the end
+	size_t *offsets;
+	GLICKO_GAME *games;
+	int count;
+} GLICKO_PERIOD;
+
+/*
+ * The players that one thread rates.
+ */
+typedef struct glicko_share {
+	GLICKO_PERIOD *period;
+	GLICKO_RATING *before;
+	int from;
+	int to;
+} GLICKO_SHARE;
+
+static int compare_players(const void *a, const void *b){
+	PLAYER *p = *(PLAYER **)a;
+	PLAYER *q = *(PLAYER **)b;
+	return p < q ? -1 : p > q;
+}
+
+static int find_player(GLICKO_PERIOD *period, PLAYER *p){
+	PLAYER **found = bsearch(&p, period -> players, period -> count, sizeof(PLAYER *), compare_players);
+	return found == NULL ? -1 : found - period -> players;
+}
+
+static void *rate_share(void *arg){
+	GLICKO_SHARE *s = arg;
+	GLICKO_PERIOD *period = s -> period;
+	for (int i = s -> from; i < s -> to; i++){
+		size_t off = period -> offsets[i];
+		glicko_update(&period -> ratings[i], period -> games + off, period -> offsets[i + 1] - off);
+	}
+	return NULL;
+}
+
+/*
+ * Rate the players of a period, split between as many threads as there
+ * are cores and as are worth it.
+ */
+static void rate_period(GLICKO_PERIOD *period){
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = (period -> count + GLICKO_MIN_PLAYERS_PER_THREAD - 1) / GLICKO_MIN_PLAYERS_PER_THREAD;
+	if (threads > cores){
+		threads = cores;
+	}
+	if (threads < 1){
+		threads = 1;
+	}
+	GLICKO_SHARE shares[threads];
+	pthread_t tids[threads];
+	int started[threads];
+	for (int t = 0; t < threads; t++){
+		shares[t].period = period;
+		shares[t].from = (int)((long)period -> count * t / threads);
+		shares[t].to = (int)((long)period -> count * (t + 1) / threads);
+		//this thread takes the first share itself
+		started[t] = t > 0 && pthread_create(&tids[t], NULL, rate_share, &shares[t]) == 0;
+	}
+	for (int t = 0; t < threads; t++){
+		if (!started[t]){
+			rate_share(&shares[t]);
+		}
+	}
+	for (int t = 1; t < threads; t++){
+		if (started[t]){
+			pthread_join(tids[t], NULL);
+		}
+	}
+}
+
+void glicko_end_period(void){
+	if (!glicko.running){
+		return;
+	}
+	pthread_mutex_lock(&glicko.rateMutex);
+	pthread_mutex_lock(&glicko.mutex);
+	GLICKO_RESULT *results = glicko.results;
+	size_t count = glicko.count;
+	glicko.results = NULL;
+	glicko.count = glicko.size = 0;
+	pthread_mutex_unlock(&glicko.mutex);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	GLICKO_PERIOD period = {0};
+	period.players = malloc(PREG_MAX_PLAYERS * sizeof(PLAYER *));
+	period.count = period.players == NULL ? 0 : preg_snapshot(glicko.preg, period.players, PREG_MAX_PLAYERS);
+	period.ratings = malloc((period.count + 1) * sizeof(GLICKO_RATING));
+	period.offsets = calloc(period.count + 2, sizeof(size_t));
+	period.games = malloc((2 * count + 1) * sizeof(GLICKO_GAME));
+	if (period.ratings != NULL && period.offsets != NULL && period.games != NULL){
+		qsort(period.players, period.count, sizeof(PLAYER *), compare_players);
+		for (int i = 0; i < period.count; i++){
+			GLICKO_RATING *r = &period.ratings[i];
+			player_get_glicko(period.players[i], &r -> rating, &r -> deviation, &r -> volatility);
+		}
+		//count each player's games, then place them
+		int (*index)[2] = malloc((count + 1) * sizeof(*index));
+		for (size_t k = 0; index != NULL && k < count; k++){
+			index[k][0] = find_player(&period, results[k].first);
+			index[k][1] = find_player(&period, results[k].second);
+			if (index[k][0] >= 0 && index[k][1] >= 0){
+				period.offsets[index[k][0] + 2] += 1;
+				period.offsets[index[k][1] + 2] += 1;
+			}
+		}
+		for (int i = 0; i < period.count; i++){
+			period.offsets[i + 2] += period.offsets[i + 1];
+		}
+		for (size_t k = 0; index != NULL && k < count; k++){
+			int p = index[k][0];
+			int q = index[k][1];
+			if (p < 0 || q < 0){
+				continue;
+			}
+			double s = results[k].result == 0 ? 0.5 : results[k].result == 1 ? 1 : 0;
+			GLICKO_GAME *gp = &period.games[period.offsets[p + 1]++];
+			gp -> opponent = period.ratings[q];
+			gp -> score = s;
+			GLICKO_GAME *gq = &period.games[period.offsets[q + 1]++];
+			gq -> opponent = period.ratings[p];
+			gq -> score = 1 - s;
+		}
+		free(index);
+		rate_period(&period);
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		uint64_t ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+		for (int i = 0; i < period.count; i++){
+			GLICKO_RATING *r = &period.ratings[i];
+			player_set_glicko(period.players[i], r -> rating, r -> deviation, r -> volatility);
+			//only those who played have a new point; the rest only grew less certain
+			if (period.offsets[i + 1] > period.offsets[i]){
+				rhist_record(player_get_name(period.players[i]), ms, r -> rating);
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	debug("%ld: rated %d players on %lu games in %.3fs", pthread_self(), period.count, (unsigned long)count,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	for (int i = 0; i < period.count; i++){
+		player_unref(period.players[i], "rating period over");
+	}
+	for (size_t k = 0; k < count; k++){
+		player_unref(results[k].first, "rating period over");
+		player_unref(results[k].second, "rating period over");
+	}
+	free(results);
+	free(period.players);
+	free(period.ratings);
+	free(period.offsets);
+	free(period.games);
+	pthread_mutex_unlock(&glicko.rateMutex);
+}
+
+static void *period_thread(void *arg){
+	pthread_mutex_lock(&glicko.mutex);
+	while (!glicko.stopping){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += glicko.periodMs / 1000;
+		ts.tv_nsec += (glicko.periodMs % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000){
+			ts.tv_sec += 1;
+			ts.tv_nsec -= 1000000000;
+		}
+		int r = 0;
+		while (!glicko.stopping && r != ETIMEDOUT){
+			r = pthread_cond_timedwait(&glicko.cond, &glicko.mutex, &ts);
+		}
+		if (glicko.stopping){
+			break;
+		}
+		pthread_mutex_unlock(&glicko.mutex);
+		glicko_end_period();
+		pthread_mutex_lock(&glicko.mutex);
+	}
+	pthread_mutex_unlock(&glicko.mutex);
+	return NULL;
+}
+
+int glicko_init(PLAYER_REGISTRY *preg, uint64_t period_ms){
+	if (preg == NULL || period_ms == 0 || glicko.running){
+		return -1;
+	}
+	glicko.preg = preg;
+	glicko.periodMs = period_ms;
+	glicko.stopping = 0;
+	glicko.running = 1;
+	if (pthread_create(&glicko.tid, NULL, period_thread, NULL)){
+		glicko.running = 0;
+		return -1;
+	}
+	debug("%ld: Glicko-2 rating periods of %lums", pthread_self(), (unsigned long)period_ms);
+	return 0;
+}
+
+void glicko_fini(void){
+	if (!glicko.running){
+		return;
+	}
+	pthread_mutex_lock(&glicko.mutex);
+	glicko.stopping = 1;
+	pthread_cond_signal(&glicko.cond);
+	pthread_mutex_unlock(&glicko.mutex);
+	pthread_join(glicko.tid, NULL);
+	//the results of the period cut short are not lost
+	glicko_end_period();
+	glicko.running = 0;
+}
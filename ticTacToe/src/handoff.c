@@ -0,0 +1,504 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "debug.h"
+#include "handoff.h"
+#include "server_ext.h"
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "player.h"
+#include "player_ext.h"
+#include "player_registry.h"
+#include "player_registry_ext.h"
+#include "archive.h"
+#include "timer.h"
+#include "jeux_globals.h"
+#include "coro.h"
+#include "local.h"
+#include "glicko.h"
+#include "rating_history.h"
+
+#define HANDOFF_MAGIC "JEUX-HANDOFF"
+#define HANDOFF_VERSION 4
+
+/*
+ * Large enough for a record with the longest username a client can send.
+ */
+#define HANDOFF_MAX_RECORD (UINT16_MAX + 256)
+
+/*
+ * The most fields in a record: an invitation with a game of GAME_MAX_MOVES
+ * moves.
+ */
+#define HANDOFF_MAX_FIELDS (21 + GAME_MAX_MOVES)
+
+//clients taken over, in the order in which they were received
+static CLIENT *sessions[MAX_CLIENTS];
+static int sessionCount = 0;
+
+static int unix_address(char *path, struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr -> sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr -> sun_path)){
+		return -1;
+	}
+	strcpy(addr -> sun_path, path);
+	return 0;
+}
+
+/*
+ * Open the upgrade socket, replacing any that is left over at the path.
+ *
+ * @param path  The path of the upgrade socket.
+ * @return the listening socket, or -1 on error.
+ */
+int handoff_listen(char *path){
+	struct sockaddr_un addr;
+	if (path == NULL || unix_address(path, &addr)){
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0){
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 1)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Connect to the upgrade socket of a running server.
+ *
+ * @param path  The path of the upgrade socket.
+ * @return the connected socket, or -1 if there is no server to take
+ * over from.
+ */
+int handoff_connect(char *path){
+	struct sockaddr_un addr;
+	if (path == NULL || unix_address(path, &addr)){
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0){
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))){
+		//nothing there, or a socket left behind by a server that is gone
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Send a record, with a descriptor attached if fd is not -1.
+ */
+static int send_record(int sock, int fd, char *fmt, ...){
+	char *buf = malloc(HANDOFF_MAX_RECORD);
+	if (buf == NULL){
+		return -1;
+	}
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, HANDOFF_MAX_RECORD, fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= HANDOFF_MAX_RECORD){
+		free(buf);
+		return -1;
+	}
+	struct iovec iov = {buf, len};
+	struct msghdr msg = {0};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0){
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg -> cmsg_level = SOL_SOCKET;
+		cmsg -> cmsg_type = SCM_RIGHTS;
+		cmsg -> cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	ssize_t n;
+	while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR){
+	}
+	free(buf);
+	return n == len ? 0 : -1;
+}
+
+/*
+ * Receive a record into a buffer of HANDOFF_MAX_RECORD bytes, which is
+ * NUL-terminated.  The descriptor attached to it, if any, is stored in *fd,
+ * otherwise *fd is set to -1.
+ */
+static int recv_record(int sock, char *buf, int *fd){
+	struct iovec iov = {buf, HANDOFF_MAX_RECORD - 1};
+	struct msghdr msg = {0};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR){
+	}
+	*fd = -1;
+	if (n <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))){
+		return -1;
+	}
+	buf[n] = '\0';
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg -> cmsg_level == SOL_SOCKET && cmsg -> cmsg_type == SCM_RIGHTS){
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return 0;
+}
+
+/*
+ * Split a record into its tab-separated fields.  The last field takes
+ * whatever is left, so that a username at the end may contain tabs.
+ *
+ * @return the number of fields.
+ */
+static int split(char *rec, char **fields, int max){
+	int n = 0;
+	while (rec != NULL && n < max - 1){
+		fields[n++] = strsep(&rec, "\t");
+	}
+	if (rec != NULL){
+		fields[n++] = rec;
+	}
+	return n;
+}
+
+static uint64_t field_u64(char *s){
+	return strtoull(s, NULL, 10);
+}
+
+/*
+ * Send an invitation record.  The clients are referred to by their
+ * position in the order in which their records were sent.
+ */
+static int send_invitation(int sock, CLIENT_INV_SNAPSHOT *snap, int source, int target){
+	char *buf = malloc(HANDOFF_MAX_RECORD);
+	if (buf == NULL){
+		return -1;
+	}
+	int len = sprintf(buf, "I\t%d\t%d\t%d\t%d\t%d\t%d\t%llu\t%llu\t%llu\t%d",
+		source, target, snap -> source_role, snap -> target_role,
+		snap -> source_id, snap -> target_id, (unsigned long long)snap -> expires_ms,
+		(unsigned long long)snap -> clock_ms, (unsigned long long)snap -> increment_ms,
+		snap -> accepted);
+	if (snap -> accepted){
+		GAME_SNAPSHOT *g = &snap -> game;
+		//an unset symbol is sent as '-', since a space would not survive splitting
+		len += sprintf(buf + len, "\t%u\t%llu\t%c%c\t%d\t%llu\t%llu\t%llu\t%llu\t%d",
+			g -> id, (unsigned long long)g -> start_ms,
+			g -> first_sym == ' ' ? '-' : g -> first_sym,
+			g -> second_sym == ' ' ? '-' : g -> second_sym,
+			g -> clocked, (unsigned long long)g -> remaining_ms[0],
+			(unsigned long long)g -> remaining_ms[1], (unsigned long long)g -> increment_ms,
+			(unsigned long long)g -> turn_start_ms, g -> moves);
+		for (int i = 0; i < g -> moves; i++){
+			len += sprintf(buf + len, "\t%u:%u:%llu", g -> history[i].cell, g -> history[i].role,
+				(unsigned long long)g -> history[i].time_ms);
+		}
+	}
+	int ret = send_record(sock, -1, "%s", buf);
+	free(buf);
+	return ret;
+}
+
+static int parse_invitation(char **f, int n, CLIENT_INV_SNAPSHOT *snap, int *source, int *target){
+	if (n < 11){
+		return -1;
+	}
+	memset(snap, 0, sizeof(*snap));
+	*source = atoi(f[1]);
+	*target = atoi(f[2]);
+	snap -> source_role = atoi(f[3]);
+	snap -> target_role = atoi(f[4]);
+	snap -> source_id = atoi(f[5]);
+	snap -> target_id = atoi(f[6]);
+	snap -> expires_ms = field_u64(f[7]);
+	snap -> clock_ms = field_u64(f[8]);
+	snap -> increment_ms = field_u64(f[9]);
+	snap -> accepted = atoi(f[10]);
+	if (!snap -> accepted){
+		return 0;
+	}
+	if (n < 20 || strlen(f[13]) != 2){
+		return -1;
+	}
+	GAME_SNAPSHOT *g = &snap -> game;
+	g -> id = strtoul(f[11], NULL, 10);
+	g -> start_ms = field_u64(f[12]);
+	g -> first_sym = f[13][0] == '-' ? ' ' : f[13][0];
+	g -> second_sym = f[13][1] == '-' ? ' ' : f[13][1];
+	g -> clocked = atoi(f[14]);
+	g -> remaining_ms[0] = field_u64(f[15]);
+	g -> remaining_ms[1] = field_u64(f[16]);
+	g -> increment_ms = field_u64(f[17]);
+	g -> turn_start_ms = field_u64(f[18]);
+	g -> moves = atoi(f[19]);
+	if (g -> moves < 0 || g -> moves > GAME_MAX_MOVES || n < 20 + g -> moves){
+		return -1;
+	}
+	for (int i = 0; i < g -> moves; i++){
+		unsigned cell, role;
+		unsigned long long time;
+		if (sscanf(f[20 + i], "%u:%u:%llu", &cell, &role, &time) != 3){
+			return -1;
+		}
+		g -> history[i].cell = cell;
+		g -> history[i].role = role;
+		g -> history[i].time_ms = time;
+	}
+	return 0;
+}
+
+/*
+ * Send everything the new server needs, while the service threads are
+ * parked and the timers are held.
+ */
+static int send_state(int sock, HANDOFF_LISTENERS *listeners){
+	if (send_record(sock, -1, "H\t%s\t%d", HANDOFF_MAGIC, HANDOFF_VERSION) ||
+	    send_record(sock, listeners -> tcp, "L") ||
+	    (listeners -> local >= 0 && send_record(sock, listeners -> local, "L\tlocal")) ||
+	    (listeners -> shm >= 0 && send_record(sock, listeners -> shm, "L\tshm"))){
+		return -1;
+	}
+	int ret = 0;
+	PLAYER **players = malloc(PREG_MAX_PLAYERS * sizeof(PLAYER *));
+	int np = players == NULL ? 0 : preg_snapshot(player_registry, players, PREG_MAX_PLAYERS);
+	if (players == NULL){
+		ret = -1;
+	}
+	for (int i = 0; i < np; i++){
+		if (ret == 0){
+			double r, rd, vol;
+			player_get_glicko(players[i], &r, &rd, &vol);
+			ret = send_record(sock, -1, "P\t%.17g\t%.17g\t%.17g\t%s", r, rd, vol, player_get_name(players[i]));
+		}
+		player_unref(players[i], "sent to new server");
+	}
+	free(players);
+	CLIENT *clients[MAX_CLIENTS];
+	int nc = creg_snapshot(client_registry, clients);
+	for (int i = 0; i < nc && ret == 0; i++){
+		PLAYER *p = client_get_player(clients[i]);
+		ret = send_record(sock, client_get_fd(clients[i]), "C\t%d\t%u\t%s",
+			client_get_board_encoding(clients[i]), client_get_caps(clients[i]),
+			p == NULL ? "" : player_get_name(p));
+		int memfd = local_shm_fd(client_get_fd(clients[i]));
+		if (ret == 0 && memfd >= 0){
+			ret = send_record(sock, memfd, "M");
+		}
+	}
+	CLIENT_INV_SNAPSHOT *snaps = malloc(MAX_CLIENTS * sizeof(CLIENT_INV_SNAPSHOT));
+	if (snaps == NULL){
+		ret = -1;
+	}
+	for (int i = 0; i < nc && ret == 0; i++){
+		int ns = client_snapshot_invitations(clients[i], snaps, MAX_CLIENTS);
+		for (int j = 0; j < ns && ret == 0; j++){
+			int target = -1;
+			for (int k = 0; k < nc; k++){
+				if (clients[k] == snaps[j].target){
+					target = k;
+					break;
+				}
+			}
+			if (target != -1){
+				ret = send_invitation(sock, &snaps[j], i, target);
+			}
+		}
+	}
+	free(snaps);
+	for (int i = 0; i < nc; i++){
+		client_unref(clients[i], "sent to new server");
+	}
+	if (ret == 0){
+		ret = send_record(sock, -1, "E");
+	}
+	return ret;
+}
+
+/*
+ * Hand this server over to the new server that has connected to the
+ * upgrade socket.
+ *
+ * @param sock  The connection from the new server.
+ * @param listeners  The listening sockets for client connections.
+ * @return 0 if the new server has taken over, or -1 if the handoff
+ * failed and this server is to carry on.
+ */
+int handoff_send(int sock, HANDOFF_LISTENERS *listeners){
+	debug("%ld: Handing over to a new server", pthread_self());
+	if (server_quiesce(HANDOFF_QUIESCE_MS)){
+		debug("%ld: Service threads did not park, handoff abandoned", pthread_self());
+		return -1;
+	}
+	//nothing changes from here on unless the handoff is abandoned
+	timer_hold();
+	//the results of the rating period cut short go over as ratings
+	glicko_end_period();
+	char *buf = malloc(HANDOFF_MAX_RECORD);
+	int fd;
+	if (buf != NULL && send_state(sock, listeners) == 0 &&
+	    recv_record(sock, buf, &fd) == 0 && strcmp(buf, "READY") == 0){
+		//the new server opens the archive once this one has written everything out
+		rhist_spill();
+		archive_fini();
+		send_record(sock, -1, "DONE");
+		free(buf);
+		debug("%ld: New server has taken over", pthread_self());
+		return 0;
+	}
+	free(buf);
+	debug("%ld: Handoff failed, carrying on", pthread_self());
+	timer_release();
+	server_resume();
+	return -1;
+}
+
+/*
+ * Rebuild a player, client or invitation from its record.
+ */
+static int restore_record(char **f, int n, int fd){
+	if (f[0][0] == 'P' && n == 5){
+		PLAYER *p = preg_register(player_registry, f[4]);
+		if (p == NULL){
+			return -1;
+		}
+		player_set_glicko(p, strtod(f[1], NULL), strtod(f[2], NULL), strtod(f[3], NULL));
+		player_unref(p, "taken over from old server");
+		return 0;
+	}
+	if (f[0][0] == 'C' && n == 4 && fd >= 0 && sessionCount < MAX_CLIENTS){
+		CLIENT *c = creg_register(client_registry, fd);
+		if (c == NULL){
+			close(fd);
+			return -1;
+		}
+		sessions[sessionCount++] = c;
+		client_set_board_encoding(c, atoi(f[1]));
+		client_set_caps(c, strtoul(f[2], NULL, 10));
+		if (f[3][0] != '\0'){
+			PLAYER *p = preg_register(player_registry, f[3]);
+			int err = p == NULL || client_login(c, p);
+			if (p != NULL){
+				player_unref(p, "taken over from old server");
+			}
+			return err ? -1 : 0;
+		}
+		return 0;
+	}
+	if (f[0][0] == 'M' && n == 1 && fd >= 0 && sessionCount > 0){
+		//the rings of the client just before it
+		return local_shm_adopt(client_get_fd(sessions[sessionCount - 1]), fd);
+	}
+	if (f[0][0] == 'I'){
+		CLIENT_INV_SNAPSHOT snap;
+		int source, target;
+		if (parse_invitation(f, n, &snap, &source, &target) ||
+		    source < 0 || source >= sessionCount || target < 0 || target >= sessionCount){
+			return -1;
+		}
+		return client_restore_invitation(sessions[source], sessions[target], &snap);
+	}
+	if (fd >= 0){
+		close(fd);
+	}
+	return -1;
+}
+
+/*
+ * Take over from the server at the other end of the upgrade socket.
+ *
+ * @param sock  The connection to the old server.
+ * @param listeners  Set to the listening sockets of the old server.
+ * @return 0 if successful, or -1 if the handoff failed.
+ */
+int handoff_receive(int sock, HANDOFF_LISTENERS *listeners){
+	listeners -> tcp = listeners -> local = listeners -> shm = -1;
+	char *buf = malloc(HANDOFF_MAX_RECORD);
+	if (buf == NULL){
+		return -1;
+	}
+	char *f[HANDOFF_MAX_FIELDS];
+	int fd;
+	int ok = recv_record(sock, buf, &fd) == 0 && split(buf, f, HANDOFF_MAX_FIELDS) == 3 &&
+		strcmp(f[0], "H") == 0 && strcmp(f[1], HANDOFF_MAGIC) == 0 && atoi(f[2]) == HANDOFF_VERSION;
+	while (ok){
+		if (recv_record(sock, buf, &fd)){
+			ok = 0;
+			break;
+		}
+		//players and clients end with a username, which is left whole
+		int n = split(buf, f, buf[0] == 'P' ? 5 : buf[0] == 'C' ? 4 : HANDOFF_MAX_FIELDS);
+		if (strcmp(f[0], "E") == 0){
+			break;
+		}
+		int *listenfd = NULL;
+		if (strcmp(f[0], "L") == 0){
+			listenfd = n == 1 ? &listeners -> tcp : strcmp(f[1], "local") == 0 ? &listeners -> local :
+			           strcmp(f[1], "shm") == 0 ? &listeners -> shm : NULL;
+		}
+		if (listenfd != NULL && fd >= 0 && *listenfd < 0){
+			*listenfd = fd;
+		}
+		else if (restore_record(f, n, fd)){
+			debug("%ld: Bad handoff record %s", pthread_self(), f[0]);
+			ok = 0;
+		}
+	}
+	ok = ok && listeners -> tcp >= 0 && send_record(sock, -1, "READY") == 0 &&
+		recv_record(sock, buf, &fd) == 0 && strcmp(buf, "DONE") == 0;
+	free(buf);
+	if (!ok){
+		int *fds[] = {&listeners -> tcp, &listeners -> local, &listeners -> shm};
+		for (int i = 0; i < 3; i++){
+			if (*fds[i] >= 0){
+				close(*fds[i]);
+				*fds[i] = -1;
+			}
+		}
+		return -1;
+	}
+	debug("%ld: Took over %d clients", pthread_self(), sessionCount);
+	return 0;
+}
+
+/*
+ * Start a service thread for each client taken over by handoff_receive().
+ */
+void handoff_start_sessions(void){
+	for (int i = 0; i < sessionCount; i++){
+		if (coro_spawn(jeux_client_resume, sessions[i])){
+			pthread_t tid;
+			pthread_create(&tid, NULL, jeux_client_resume, sessions[i]);
+		}
+	}
+	sessionCount = 0;
+}
@@ -17,6 +17,9 @@
 #include "client.h"
 #include "player.h"
 #include "invitation.h"
+#include "invitation_ext.h"
+#include "timer.h"
+#include "ebr.h"
 #include "jeux_globals.h"
 /*
  * Create an INVITATION in the OPEN state, containing reference to
@@ -41,7 +44,27 @@ typedef struct invitation {
 	GAME_ROLE targetR;
 	GAME *gameRef;
 	sem_t seph;
+	TIMER expiry;
+	void (*expired)(INVITATION *);
+	uint64_t clockBase;             //0 if the game is not timed
+	uint64_t clockIncrement;
+	EBR_NODE reclaim;               //freed through this once the last reference is gone
 } INVITATION;
+
+static void expiry_fired(void *arg){
+	INVITATION *inv = arg;
+	inv -> expired(inv);
+	inv_unref(inv, "expiry ran");
+}
+
+/*
+ * Disarm the expiry timer once the invitation has left the OPEN state.
+ */
+static void cancel_expiry(INVITATION *inv){
+	if (timer_cancel(&inv -> expiry)){
+		inv_unref(inv, "expiry cancelled");
+	}
+}
 INVITATION *inv_create(CLIENT *source, CLIENT *target,
 	GAME_ROLE source_role, GAME_ROLE target_role){
 	if  (source == target){
@@ -57,6 +80,10 @@ INVITATION *inv_create(CLIENT *source, CLIENT *target,
 	inv -> targetR = target_role;
 	inv -> gameRef = NULL;
 	inv -> state = INV_OPEN_STATE;
+	inv -> expired = NULL;
+	inv -> clockBase = 0;
+	inv -> clockIncrement = 0;
+	timer_setup(&inv -> expiry, expiry_fired, inv);
 	sem_init(&inv->seph, 0, 1);
 	return inv;
 
@@ -101,7 +128,7 @@ void inv_unref(INVITATION *inv, char *why){
 			client_unref(inv->source, "freeing invitation");
 			client_unref(inv->target, "freeing invitation");
 			sem_post(&inv->seph);
-			free(inv);
+			ebr_retire(&inv -> reclaim, free, inv);
 		}
 		else{
 			sem_post(&inv->seph);
@@ -218,6 +245,7 @@ int inv_accept(INVITATION *inv){
 	inv -> state = INV_ACCEPTED_STATE;
 	inv -> gameRef = game_create();
 	sem_post(&inv->seph);
+	cancel_expiry(inv);
 	return 0;
 }
 
@@ -257,5 +285,127 @@ int inv_close(INVITATION *inv, GAME_ROLE role){
 	}
 	inv -> state = INV_CLOSED_STATE;
 	sem_post(&inv->seph);
+	cancel_expiry(inv);
+	return 0;
+}
+
+/*
+ * Give an open INVITATION a time to live.
+ *
+ * @param inv  The INVITATION that is to expire.
+ * @param ttl_ms  The time to live, in milliseconds.
+ * @param expired  The function to be called when the invitation expires.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_set_expiry(INVITATION *inv, uint64_t ttl_ms, void (*expired)(INVITATION *)){
+	return inv_set_expiry_at(inv, timer_now_ms() + ttl_ms, expired);
+}
+
+/*
+ * Give an open INVITATION an absolute expiry time.
+ *
+ * @param inv  The INVITATION that is to expire.
+ * @param when_ms  When it expires, in timer_now_ms() time.
+ * @param expired  The function to be called when the invitation expires.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_set_expiry_at(INVITATION *inv, uint64_t when_ms, void (*expired)(INVITATION *)){
+	if (inv == NULL || expired == NULL){
+		return -1;
+	}
+	sem_wait(&inv->seph);
+	if (inv -> state != INV_OPEN_STATE){
+		sem_post(&inv->seph);
+		return -1;
+	}
+	inv -> expired = expired;
+	sem_post(&inv->seph);
+	inv_ref(inv, "expiry armed");
+	int was = timer_arm_at(&inv -> expiry, when_ms);
+	if (was != 0){
+		//either it was already armed and holds a reference, or there is no timer thread
+		inv_unref(inv, "expiry re-armed");
+	}
+	return was < 0 ? -1 : 0;
+}
+
+/*
+ * Record the time control under which the GAME of an INVITATION is to be
+ * played, if it is accepted.
+ *
+ * @param inv  The INVITATION.
+ * @param base_ms  Each player's initial time, in milliseconds.
+ * @param increment_ms  The time added after each move, in milliseconds.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_set_time_control(INVITATION *inv, uint64_t base_ms, uint64_t increment_ms){
+	if (inv == NULL){
+		return -1;
+	}
+	sem_wait(&inv->seph);
+	if (inv -> state != INV_OPEN_STATE){
+		sem_post(&inv->seph);
+		return -1;
+	}
+	inv -> clockBase = base_ms;
+	inv -> clockIncrement = increment_ms;
+	sem_post(&inv->seph);
+	return 0;
+}
+
+/*
+ * Get the time control of an INVITATION.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @param base_ms  Variable into which the initial time is stored.
+ * @param increment_ms  Variable into which the increment is stored.
+ * @return 1 if the invitation has a time control, otherwise 0.
+ */
+int inv_get_time_control(INVITATION *inv, uint64_t *base_ms, uint64_t *increment_ms){
+	if (inv == NULL){
+		return 0;
+	}
+	sem_wait(&inv->seph);
+	*base_ms = inv -> clockBase;
+	*increment_ms = inv -> clockIncrement;
+	sem_post(&inv->seph);
+	return *base_ms != 0;
+}
+
+/*
+ * Get the time at which an open INVITATION expires.
+ *
+ * @param inv  The INVITATION to be queried.
+ * @return the expiry time in timer_now_ms() time, or 0 if it does not
+ * expire.
+ */
+uint64_t inv_get_expiry(INVITATION *inv){
+	if (inv == NULL){
+		return 0;
+	}
+	return timer_deadline(&inv -> expiry);
+}
+
+/*
+ * Put a newly created INVITATION straight into the ACCEPTED state with
+ * an existing GAME.
+ *
+ * @param inv  The INVITATION, which must be in the OPEN state.
+ * @param game  The GAME in progress.
+ * @return 0 if successful, otherwise -1.
+ */
+int inv_adopt_game(INVITATION *inv, GAME *game){
+	if (inv == NULL || game == NULL){
+		return -1;
+	}
+	sem_wait(&inv->seph);
+	if (inv -> state != INV_OPEN_STATE){
+		sem_post(&inv->seph);
+		return -1;
+	}
+	inv -> state = INV_ACCEPTED_STATE;
+	inv -> gameRef = game;
+	sem_post(&inv->seph);
+	cancel_expiry(inv);
 	return 0;
-}
\ No newline at end of file
+}
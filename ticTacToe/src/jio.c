@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "debug.h"
+#include "coro.h"
+#include "local.h"
+#include "jio.h"
+
+/*
+ * Data read from a socket ahead of the protocol code asking for it, so
+ * that a packet, or several pipelined ones, take one system call rather
+ * than one for the header and another for the payload.  Only the service
+ * thread of a connection reads from it, so the buffers need no locking.
+ */
+#define JIO_MAX_FD 1024
+#define JIO_READ_BUFFER 4096
+
+typedef struct jio_rbuf {
+	char *data;                     //allocated on first use
+	size_t start;
+	size_t end;
+} JIO_RBUF;
+
+static JIO_RBUF rbufs[JIO_MAX_FD];
+
+static JIO_RBUF *rbuf(int fd){
+	return fd >= 0 && fd < JIO_MAX_FD ? &rbufs[fd] : NULL;
+}
+
+/*
+ * Read from a connection's socket, without buffering.
+ */
+static ssize_t read_socket(int fd, void *buf, size_t n){
+	int coroutine = coro_running();
+	while (1){
+		ssize_t r = coroutine ? coro_recv(fd, buf, n) : read(fd, buf, n);
+		if (r >= 0){
+			return r;
+		}
+		if (errno == EINTR){
+			continue;
+		}
+		if (coroutine && errno == ENOTSOCK){
+			coroutine = 0;
+			continue;
+		}
+		if (!coroutine || (errno != EAGAIN && errno != EWOULDBLOCK)){
+			return -1;
+		}
+		if (coro_wait_fd(fd, POLLIN) < 0){
+			return -1;
+		}
+	}
+}
+
+ssize_t jio_read(int fd, void *buf, size_t n){
+	ssize_t shm = local_read(fd, buf, n);
+	if (shm != LOCAL_NOT_SHM){
+		return shm;
+	}
+	JIO_RBUF *rb = rbuf(fd);
+	if (rb == NULL){
+		return read_socket(fd, buf, n);
+	}
+	if (rb -> start == rb -> end){
+		if (n >= JIO_READ_BUFFER){
+			return read_socket(fd, buf, n);
+		}
+		if (rb -> data == NULL && (rb -> data = malloc(JIO_READ_BUFFER)) == NULL){
+			return read_socket(fd, buf, n);
+		}
+		ssize_t r = read_socket(fd, rb -> data, JIO_READ_BUFFER);
+		if (r <= 0){
+			return r;
+		}
+		rb -> start = 0;
+		rb -> end = r;
+	}
+	size_t len = rb -> end - rb -> start;
+	if (len > n){
+		len = n;
+	}
+	memcpy(buf, rb -> data + rb -> start, len);
+	rb -> start += len;
+	return len;
+}
+
+ssize_t jio_write(int fd, const void *buf, size_t n){
+	struct iovec iov = {(void *)buf, n};
+	return jio_writev(fd, &iov, 1);
+}
+
+/*
+ * Write several buffers to a connection's socket.  Unless wait is set,
+ * only what the socket takes at once is written.
+ *
+ * @return the number of bytes written, or -1 if the connection failed.
+ */
+static ssize_t write_socket(int fd, const struct iovec *iov, int iovcnt, size_t n, int wait){
+	struct iovec left[JIO_MAX_IOV];
+	memcpy(left, iov, iovcnt * sizeof(struct iovec));
+	int first = 0;
+	size_t done = 0;
+	while (done < n){
+		struct msghdr msg = {0};
+		msg.msg_iov = left + first;
+		msg.msg_iovlen = iovcnt - first;
+		ssize_t w = wait ? writev(fd, left + first, iovcnt - first)
+		                 : sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (w > 0){
+			done += w;
+			//skip what went out
+			while (first < iovcnt && (size_t)w >= left[first].iov_len){
+				w -= left[first].iov_len;
+				first++;
+			}
+			if (first < iovcnt){
+				left[first].iov_base = (char *)left[first].iov_base + w;
+				left[first].iov_len -= w;
+			}
+			continue;
+		}
+		if (w < 0 && errno == EINTR){
+			continue;
+		}
+		if (w < 0 && !wait && errno == ENOTSOCK){
+			wait = 1;
+			continue;
+		}
+		if (w < 0 && !wait && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			break;
+		}
+		return -1;
+	}
+	return done;
+}
+
+/*
+ * Write several buffers to a connection that goes through shared memory.
+ */
+static ssize_t write_shm(int fd, const struct iovec *iov, int iovcnt, size_t n){
+	ssize_t shm = local_write(fd, iovcnt > 0 ? iov[0].iov_base : NULL, iovcnt > 0 ? iov[0].iov_len : 0);
+	//going through shared memory costs no system calls, so there is nothing to gather
+	for (int i = 1; i < iovcnt && shm >= 0; i++){
+		shm = local_write(fd, iov[i].iov_base, iov[i].iov_len);
+	}
+	return shm == LOCAL_NOT_SHM ? LOCAL_NOT_SHM : shm < 0 ? -1 : (ssize_t)n;
+}
+
+ssize_t jio_writev(int fd, const struct iovec *iov, int iovcnt){
+	size_t n = 0;
+	for (int i = 0; i < iovcnt; i++){
+		n += iov[i].iov_len;
+	}
+	if (iovcnt > JIO_MAX_IOV){
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t shm = write_shm(fd, iov, iovcnt, n);
+	if (shm != LOCAL_NOT_SHM){
+		return shm;
+	}
+	ssize_t w = write_socket(fd, iov, iovcnt, n, !coro_running());
+	if (w < 0 || (size_t)w == n){
+		return w;
+	}
+	if (w > 0){
+		//what follows would not make sense of the rest
+		debug("%ld: connection %d took part of a write, shutting it down", pthread_self(), fd);
+		shutdown(fd, SHUT_RDWR);
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+ssize_t jio_try_writev(int fd, const struct iovec *iov, int iovcnt){
+	size_t n = 0;
+	for (int i = 0; i < iovcnt; i++){
+		n += iov[i].iov_len;
+	}
+	if (iovcnt > JIO_MAX_IOV){
+		errno = EINVAL;
+		return -1;
+	}
+	ssize_t shm = write_shm(fd, iov, iovcnt, n);
+	if (shm != LOCAL_NOT_SHM){
+		return shm;
+	}
+	return write_socket(fd, iov, iovcnt, n, 0);
+}
+
+int jio_readable(int fd){
+	int r = local_readable(fd);
+	if (r != LOCAL_NOT_SHM){
+		return r;
+	}
+	JIO_RBUF *rb = rbuf(fd);
+	return rb != NULL && rb -> start < rb -> end ? 1 : -1;
+}
+
+int jio_shutdown(int fd, int how){
+	local_shutdown(fd, how);
+	return shutdown(fd, how);
+}
+
+int jio_close(int fd){
+	local_detach(fd);
+	JIO_RBUF *rb = rbuf(fd);
+	if (rb != NULL){
+		free(rb -> data);
+		rb -> data = NULL;
+		rb -> start = rb -> end = 0;
+	}
+	return close(fd);
+}
@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/memfd.h>
+
+#include "debug.h"
+#include "csapp.h"
+#include "ebr.h"
+#include "coro.h"
+#include "jio.h"
+#include "server.h"
+#include "local.h"
+
+/*
+ * Connections with descriptors from this on cannot use shared memory.
+ */
+#define LOCAL_MAX_FD 1024
+
+/*
+ * The longest a writer sleeps at a time while a client's ring is full.
+ */
+#define LOCAL_BACKOFF_MAX_US 1000
+
+/*
+ * The longest, in milliseconds, that a writer waits for room in a
+ * client's ring before it shuts the connection down.  A trusted client
+ * that stops reading is the only one held up by this for long.
+ */
+#define LOCAL_WRITE_STALL_MS 2000
+
+typedef struct local_chan {
+	LOCAL_SHM *shm;
+	int memfd;
+	int refs;                       //the table's, and one for each reader or writer
+	int stopRd;                     //set by local_shutdown()
+	int stopWr;
+	EBR_NODE reclaim;
+} LOCAL_CHAN;
+
+//by connection
+static LOCAL_CHAN *channels[LOCAL_MAX_FD];
+
+static void chan_free(void *arg){
+	LOCAL_CHAN *ch = arg;
+	munmap(ch -> shm, sizeof(LOCAL_SHM));
+	close(ch -> memfd);
+	free(ch);
+}
+
+/*
+ * Get a reference to a connection's rings, if it has any.
+ */
+static LOCAL_CHAN *get(int fd){
+	if (fd < 0 || fd >= LOCAL_MAX_FD || __atomic_load_n(&channels[fd], __ATOMIC_RELAXED) == NULL){
+		return NULL;
+	}
+	ebr_enter();
+	LOCAL_CHAN *ch = __atomic_load_n(&channels[fd], __ATOMIC_ACQUIRE);
+	if (ch != NULL){
+		int refs = __atomic_load_n(&ch -> refs, __ATOMIC_RELAXED);
+		do {
+			if (refs == 0){
+				ch = NULL;
+				break;
+			}
+		} while (!__atomic_compare_exchange_n(&ch -> refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	}
+	ebr_exit();
+	return ch;
+}
+
+static void put(LOCAL_CHAN *ch){
+	if (__atomic_sub_fetch(&ch -> refs, 1, __ATOMIC_ACQ_REL) == 0){
+		//a thread that has only just found it in the table may still look at refs
+		ebr_retire(&ch -> reclaim, chan_free, ch);
+	}
+}
+
+static int attach(int fd, int memfd, int create){
+	if (fd < 0 || fd >= LOCAL_MAX_FD){
+		return -1;
+	}
+	LOCAL_CHAN *ch = calloc(1, sizeof(LOCAL_CHAN));
+	if (ch == NULL){
+		return -1;
+	}
+	ch -> shm = mmap(NULL, sizeof(LOCAL_SHM), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (ch -> shm == MAP_FAILED){
+		free(ch);
+		return -1;
+	}
+	if (create){
+		memcpy(ch -> shm -> magic, LOCAL_SHM_MAGIC, sizeof(ch -> shm -> magic));
+		ch -> shm -> ringSize = LOCAL_RING_SIZE;
+	}
+	else if (memcmp(ch -> shm -> magic, LOCAL_SHM_MAGIC, sizeof(ch -> shm -> magic)) ||
+	         ch -> shm -> ringSize != LOCAL_RING_SIZE){
+		munmap(ch -> shm, sizeof(LOCAL_SHM));
+		free(ch);
+		return -1;
+	}
+	ch -> memfd = memfd;
+	ch -> refs = 1;
+	LOCAL_CHAN *old = __atomic_exchange_n(&channels[fd], ch, __ATOMIC_RELEASE);
+	if (old != NULL){
+		put(old);
+	}
+	return 0;
+}
+
+int local_listen(char *path, int shm){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)){
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0){
+		return -1;
+	}
+	unlink(path);
+	//a shared-memory client could scribble on the server's rings, so it must be trusted
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || (shm && chmod(path, S_IRUSR | S_IWUSR)) ||
+	    listen(fd, LISTENQ)){
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void *local_shm_service(void *arg){
+	int fd = *(int *)arg;
+	int memfd = syscall(SYS_memfd_create, "jeux-shm", MFD_CLOEXEC);
+	if (memfd < 0 || ftruncate(memfd, sizeof(LOCAL_SHM)) || attach(fd, memfd, 1)){
+		debug("%ld: cannot set up shared memory for connection %d", pthread_self(), fd);
+		if (memfd >= 0){
+			close(memfd);
+		}
+		close(fd);
+		free(arg);
+		return NULL;
+	}
+	char byte = 'M';
+	struct iovec iov = {&byte, 1};
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg -> cmsg_level = SOL_SOCKET;
+	cmsg -> cmsg_type = SCM_RIGHTS;
+	cmsg -> cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1){
+		local_detach(fd);
+		close(fd);
+		free(arg);
+		return NULL;
+	}
+	debug("%ld: connection %d uses shared memory", pthread_self(), fd);
+	return jeux_client_service(arg);
+}
+
+int local_shm_fd(int fd){
+	LOCAL_CHAN *ch = get(fd);
+	if (ch == NULL){
+		return -1;
+	}
+	int memfd = ch -> memfd;
+	put(ch);
+	return memfd;
+}
+
+int local_shm_adopt(int fd, int memfd){
+	if (attach(fd, memfd, 0)){
+		close(memfd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Wake the consumer of a ring, if it is waiting for the producer.
+ */
+static void ring_bell(int fd, LOCAL_RING *r){
+	if (__atomic_exchange_n(&r -> sleeping, 0, __ATOMIC_SEQ_CST)){
+		send(fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+}
+
+ssize_t local_read(int fd, void *buf, size_t n){
+	LOCAL_CHAN *ch = get(fd);
+	if (ch == NULL){
+		return LOCAL_NOT_SHM;
+	}
+	LOCAL_RING *r = &ch -> shm -> toServer;
+	ssize_t ret;
+	while (1){
+		if (__atomic_load_n(&ch -> stopRd, __ATOMIC_RELAXED)){
+			ret = 0;
+			break;
+		}
+		uint32_t head = __atomic_load_n(&r -> head, __ATOMIC_SEQ_CST);
+		uint32_t avail = __atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST) - head;
+		if (avail > LOCAL_RING_SIZE){
+			debug("%ld: connection %d has corrupted its ring", pthread_self(), fd);
+			errno = EPROTO;
+			ret = -1;
+			break;
+		}
+		if (avail > 0){
+			size_t k = avail < n ? avail : n;
+			size_t off = head % LOCAL_RING_SIZE;
+			size_t first = k < LOCAL_RING_SIZE - off ? k : LOCAL_RING_SIZE - off;
+			memcpy(buf, r -> data + off, first);
+			memcpy((char *)buf + first, r -> data, k - first);
+			__atomic_store_n(&r -> head, head + k, __ATOMIC_SEQ_CST);
+			ret = k;
+			break;
+		}
+		//nothing in the ring: the client may have rung, or gone away
+		char bell[64];
+		ssize_t d = coro_recv(fd, bell, sizeof(bell));
+		if (d > 0 || (d < 0 && errno == EINTR)){
+			continue;
+		}
+		if (d == 0){
+			ret = 0;
+			break;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK){
+			ret = -1;
+			break;
+		}
+		__atomic_store_n(&r -> sleeping, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST) != head){
+			__atomic_store_n(&r -> sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (coro_wait_fd(fd, POLLIN) < 0){
+			ret = -1;
+			break;
+		}
+	}
+	put(ch);
+	return ret;
+}
+
+ssize_t local_write(int fd, const void *buf, size_t n){
+	LOCAL_CHAN *ch = get(fd);
+	if (ch == NULL){
+		return LOCAL_NOT_SHM;
+	}
+	LOCAL_RING *r = &ch -> shm -> toClient;
+	size_t done = 0;
+	long stalledUs = 0;
+	long backoffUs = 10;
+	ssize_t ret = n;
+	while (done < n){
+		if (__atomic_load_n(&ch -> stopWr, __ATOMIC_RELAXED)){
+			errno = EPIPE;
+			ret = -1;
+			break;
+		}
+		uint32_t tail = __atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST);
+		uint32_t used = tail - __atomic_load_n(&r -> head, __ATOMIC_SEQ_CST);
+		if (used >= LOCAL_RING_SIZE){
+			//the client only reads when it is told there is something to read
+			ring_bell(fd, r);
+			struct pollfd pfd = {fd, 0, 0};
+			if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR))){
+				errno = EPIPE;
+				ret = -1;
+				break;
+			}
+			if (stalledUs >= LOCAL_WRITE_STALL_MS * 1000L){
+				debug("%ld: connection %d stalled, shutting it down", pthread_self(), fd);
+				local_shutdown(fd, SHUT_RDWR);
+				shutdown(fd, SHUT_RDWR);
+				errno = ETIMEDOUT;
+				ret = -1;
+				break;
+			}
+			usleep(backoffUs);
+			stalledUs += backoffUs;
+			backoffUs = backoffUs * 2 < LOCAL_BACKOFF_MAX_US ? backoffUs * 2 : LOCAL_BACKOFF_MAX_US;
+			continue;
+		}
+		size_t space = LOCAL_RING_SIZE - used;
+		size_t k = n - done < space ? n - done : space;
+		size_t off = tail % LOCAL_RING_SIZE;
+		size_t first = k < LOCAL_RING_SIZE - off ? k : LOCAL_RING_SIZE - off;
+		memcpy(r -> data + off, (char *)buf + done, first);
+		memcpy(r -> data, (char *)buf + done + first, k - first);
+		__atomic_store_n(&r -> tail, tail + k, __ATOMIC_SEQ_CST);
+		done += k;
+	}
+	ring_bell(fd, r);
+	put(ch);
+	return ret;
+}
+
+int local_readable(int fd){
+	LOCAL_CHAN *ch = get(fd);
+	if (ch == NULL){
+		return LOCAL_NOT_SHM;
+	}
+	LOCAL_RING *r = &ch -> shm -> toServer;
+	int ready = 1;
+	if (!__atomic_load_n(&ch -> stopRd, __ATOMIC_RELAXED) &&
+	    __atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST) == __atomic_load_n(&r -> head, __ATOMIC_SEQ_CST)){
+		//rings for what has been read already would wake the caller for nothing
+		char bell[64];
+		ssize_t d;
+		while ((d = coro_recv(fd, bell, sizeof(bell))) > 0 || (d < 0 && errno == EINTR)){
+		}
+		if (d == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+			//end of file or an error, for the reader to find
+			put(ch);
+			return 1;
+		}
+		__atomic_store_n(&r -> sleeping, 1, __ATOMIC_SEQ_CST);
+		ready = __atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST) != __atomic_load_n(&r -> head, __ATOMIC_SEQ_CST);
+		if (ready){
+			__atomic_store_n(&r -> sleeping, 0, __ATOMIC_SEQ_CST);
+		}
+	}
+	put(ch);
+	return ready;
+}
+
+int local_shutdown(int fd, int how){
+	LOCAL_CHAN *ch = get(fd);
+	if (ch == NULL){
+		return LOCAL_NOT_SHM;
+	}
+	if (how != SHUT_WR){
+		__atomic_store_n(&ch -> stopRd, 1, __ATOMIC_RELAXED);
+	}
+	if (how != SHUT_RD){
+		__atomic_store_n(&ch -> stopWr, 1, __ATOMIC_RELAXED);
+	}
+	put(ch);
+	return 0;
+}
+
+int local_detach(int fd){
+	if (fd < 0 || fd >= LOCAL_MAX_FD){
+		return LOCAL_NOT_SHM;
+	}
+	LOCAL_CHAN *ch = __atomic_exchange_n(&channels[fd], NULL, __ATOMIC_ACQ_REL);
+	if (ch == NULL){
+		return LOCAL_NOT_SHM;
+	}
+	put(ch);
+	return 0;
+}
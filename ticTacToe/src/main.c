@@ -9,43 +9,95 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/signalfd.h>
 #include "csapp.h"
 #include "debug.h"
 #include "protocol.h"
 #include "server.h"
 #include "client_registry.h"
 #include "player_registry.h"
+#include "spectator.h"
+#include "archive.h"
+#include "elo.h"
+#include "glicko.h"
+#include "rating_history.h"
+#include "player_ext.h"
+#include "timer.h"
+#include "handoff.h"
+#include "ebr.h"
+#include "coro.h"
+#include "local.h"
+#include "client_ext.h"
+#include "client_registry_ext.h"
+#include "player_registry_ext.h"
 #include "jeux_globals.h"
 
 #ifdef DEBUG
 int _debug_packets_ = 1;
 #endif
 int debug = 0;
-int exitFlag = 1;
 
 typedef struct sockaddr SA;
 
-static void terminate(int status);
+/*
+ * How long to give clients to finish up at shutdown before their
+ * connections are forced closed, and how long to wait after that.
+ */
+#define DEFAULT_DRAIN_SECONDS 5
+#define FORCE_CLOSE_SECONDS 1
 
-void sighup_handler(int signum){
-    if (signum == SIGHUP){
-        exitFlag = 0;
-        terminate(EXIT_SUCCESS);
-    }
-}
+static char *ratingsFile = NULL;
+static char *upgradePath = NULL;
+static char *localPath = NULL;
+static char *shmPath = NULL;
+static int drainSeconds = DEFAULT_DRAIN_SECONDS;
+static int rerate = 0;
+static uint64_t ratingPeriodMs = GLICKO_DEFAULT_PERIOD_MS;
+
+static void terminate(int status);
 
 /*
  * "Jeux" game server.
  *
- * Usage: jeux <port>
+ * Usage: jeux -p <port> [-a <archive directory>] [-i <invitation ttl seconds>] [-k <idle timeout seconds>]
+ *             [-r <ratings file>] [-d <drain seconds>] [-u <upgrade socket>] [-b epoll|uring]
+ *             [-l <local socket>] [-m <shared-memory socket>] [-R] [-g elo|glicko2[:<period seconds>]]
+ *
+ * With -u, a server that is already running with the same upgrade socket
+ * hands its listening socket, clients and games over to this one and
+ * exits; otherwise this server starts afresh, and will in turn hand over
+ * to the next one started with the same upgrade socket.
+ *
+ * With -b uring, connections are accepted and read through io_uring rather
+ * than epoll, if the kernel allows it (see coro.h).
+ *
+ * With -l and -m, clients on the same host may also connect through Unix
+ * domain sockets, the latter carrying their packets through shared memory
+ * (see local.h).
+ *
+ * With -R, every player's rating is recomputed at startup by replaying
+ * the games in the archive given with -a (see elo.h), replacing what was
+ * read from the ratings file.
+ *
+ * With -g glicko2, players are rated with Glicko-2 rather than Elo, in
+ * rating periods of the given length (see glicko.h).
+ *
+ * Every player's ratings over time are kept for RATING_HISTORY requests
+ * (see rating_history.h), in the "ratings" directory of the archive given
+ * with -a, or only in memory without one.
  */
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     char* port = NULL;
+    char* archiveDir = NULL;
     //char *host = "localhost";
+    CORO_BACKEND backend = CORO_EPOLL;
     int opt;
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:a:i:k:r:d:u:b:l:m:Rg:")) != -1) {
         switch (opt) {
             case 'p':
                 port = optarg;
@@ -54,8 +106,65 @@ int main(int argc, char* argv[]){
                     exit(1);
                 }
                 break;
+            case 'a':
+                archiveDir = optarg;
+                break;
+            case 'i':
+                client_invitation_ttl_ms = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'k':
+                client_idle_timeout_ms = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'r':
+                ratingsFile = optarg;
+                break;
+            case 'd':
+                drainSeconds = atoi(optarg);
+                break;
+            case 'u':
+                upgradePath = optarg;
+                break;
+            case 'l':
+                localPath = optarg;
+                break;
+            case 'm':
+                shmPath = optarg;
+                break;
+            case 'R':
+                rerate = 1;
+                break;
+            case 'g':
+                if (strcmp(optarg, "elo") == 0) {
+                    player_rating_system = PLAYER_RATING_ELO;
+                }
+                else if (strncmp(optarg, "glicko2", 7) == 0 && (optarg[7] == '\0' || optarg[7] == ':')) {
+                    player_rating_system = PLAYER_RATING_GLICKO2;
+                    if (optarg[7] == ':' && (ratingPeriodMs = strtod(optarg + 8, NULL) * 1000) == 0) {
+                        fprintf(stderr, "Error: invalid rating period %s\n", optarg + 8);
+                        exit(1);
+                    }
+                }
+                else {
+                    fprintf(stderr, "Error: unknown rating system %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                if (strcmp(optarg, "uring") == 0 || strcmp(optarg, "io_uring") == 0) {
+                    backend = CORO_URING;
+                }
+                else if (strcmp(optarg, "epoll") == 0) {
+                    backend = CORO_EPOLL;
+                }
+                else {
+                    fprintf(stderr, "Error: unknown I/O backend %s\n", optarg);
+                    exit(1);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s -p <port>\n", argv[0]);
+                fprintf(stderr, "Usage: %s -p <port> [-a <archive directory>] [-i <invitation ttl seconds>] "
+                    "[-k <idle timeout seconds>] [-r <ratings file>] [-d <drain seconds>] [-u <upgrade socket>] "
+                    "[-b epoll|uring] [-l <local socket>] [-m <shared-memory socket>] [-R] [-g elo|glicko2[:<period seconds>]]\n", argv[0]);
                 exit(1);
         }
     }
@@ -63,60 +172,240 @@ int main(int argc, char* argv[]){
         fprintf(stderr, "Error: port number must be specified\n");
         exit(EXIT_FAILURE);
     }
+    if (rerate && archiveDir == NULL){
+        fprintf(stderr, "Error: -R needs a game archive (-a)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (rerate && player_rating_system != PLAYER_RATING_ELO){
+        fprintf(stderr, "Error: -R re-rates with Elo only\n");
+        exit(EXIT_FAILURE);
+    }
 
     // on which the server should listen.
     // Perform required initializations of the client_registry and
     // player_registry.
+    // Shutdown signals are received through a signalfd polled by the main
+    // loop rather than by a handler, so they must be blocked in every thread.
+    // This is done before any thread is started, so that they all inherit it.
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGHUP);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    int sigfd = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+    if (sigfd < 0){
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+
+    if (timer_init()){
+        fprintf(stderr, "Error: failed to start timer thread\n");
+        exit(EXIT_FAILURE);
+    }
+    if (coro_init(0, backend)){
+        fprintf(stderr, "Error: failed to start scheduler threads\n");
+        exit(EXIT_FAILURE);
+    }
+    if (backend == CORO_URING && coro_backend() != CORO_URING){
+        fprintf(stderr, "Warning: io_uring is not available, using epoll\n");
+    }
     client_registry = creg_init();
     player_registry = preg_init();
+    if (ratingsFile != NULL && preg_load(player_registry, ratingsFile) < 0){
+        fprintf(stderr, "Error: cannot read ratings from %s\n", ratingsFile);
+        exit(EXIT_FAILURE);
+    }
+    if (spec_init()){
+        fprintf(stderr, "Error: failed to start spectator fan-out\n");
+        exit(EXIT_FAILURE);
+    }
+    HANDOFF_LISTENERS listeners = {-1, -1, -1};
+    if (upgradePath != NULL){
+        int sock = handoff_connect(upgradePath);
+        if (sock >= 0){
+            int err = handoff_receive(sock, &listeners);
+            close(sock);
+            if (err){
+                fprintf(stderr, "Error: cannot take over from the server at %s\n", upgradePath);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    // The old server, if there was one, has closed the archive by now.
+    if (archiveDir != NULL && archive_init(archiveDir)){
+        fprintf(stderr, "Error: cannot open game archive in %s\n", archiveDir);
+        exit(EXIT_FAILURE);
+    }
+    char ratingsDir[PATH_MAX];
+    if (archiveDir != NULL){
+        snprintf(ratingsDir, sizeof(ratingsDir), "%s/ratings", archiveDir);
+    }
+    if (rhist_init(archiveDir != NULL ? ratingsDir : NULL)){
+        fprintf(stderr, "Error: cannot keep rating histories in %s\n", ratingsDir);
+        exit(EXIT_FAILURE);
+    }
+    if (rerate && elo_rerate_archive(player_registry) < 0){
+        fprintf(stderr, "Error: cannot re-rate players from the archive in %s\n", archiveDir);
+        exit(EXIT_FAILURE);
+    }
+    if (player_rating_system == PLAYER_RATING_GLICKO2 && glicko_init(player_registry, ratingPeriodMs)){
+        fprintf(stderr, "Error: failed to start rating periods\n");
+        exit(EXIT_FAILURE);
+    }
     // TODO: Set up the server socket and enter a loop to accept connections
-    // on this socket.  For each connection, a thread should be started to
+    // on this socket.  For each connection, a coroutine is started to
     // run function jeux_client_service().  In addition, you should install
     // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
     // shutdown of the server.
 
-    int listenfd, *connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    listenfd = Open_listenfd(port);
-    struct sigaction signUpAction;
-    sigemptyset(&signUpAction.sa_mask);
-    signUpAction.sa_flags = SA_RESTART;
-    signUpAction.sa_handler = sighup_handler;
-    sigaction(SIGHUP, &signUpAction, NULL);
-
-    while (exitFlag){
-        debug("%ld: making an connection..", pthread_self());
-        clientlen = sizeof(struct sockaddr_storage);
-        connfd = malloc(sizeof(int));
-        if (connfd != NULL){
-            *connfd = accept(listenfd, (SA*)&clientaddr, &clientlen);
-            pthread_t tid;
-            pthread_create(&tid, NULL, jeux_client_service, connfd);
+    if (listeners.tcp < 0){
+        listeners.tcp = Open_listenfd(port);
+    }
+    // Local sockets taken over from the old server are already at their
+    // paths; any it had that are no longer wanted are dropped.
+    if (localPath == NULL && listeners.local >= 0){
+        close(listeners.local);
+        listeners.local = -1;
+    }
+    if (localPath != NULL && listeners.local < 0 && (listeners.local = local_listen(localPath, 0)) < 0){
+        fprintf(stderr, "Error: cannot open local socket %s\n", localPath);
+        exit(EXIT_FAILURE);
+    }
+    if (shmPath == NULL && listeners.shm >= 0){
+        close(listeners.shm);
+        listeners.shm = -1;
+    }
+    if (shmPath != NULL && listeners.shm < 0 && (listeners.shm = local_listen(shmPath, 1)) < 0){
+        fprintf(stderr, "Error: cannot open shared-memory socket %s\n", shmPath);
+        exit(EXIT_FAILURE);
+    }
+    handoff_start_sessions();
+    int upgradefd = -1;
+    if (upgradePath != NULL && (upgradefd = handoff_listen(upgradePath)) < 0){
+        fprintf(stderr, "Error: cannot open upgrade socket %s\n", upgradePath);
+        exit(EXIT_FAILURE);
+    }
+    struct pollfd fds[2 + CORO_MAX_LISTENERS] = {{sigfd, POLLIN, 0}, {upgradefd, POLLIN, 0}};
+    int nfds = 2;
+    int acceptfds[] = {
+        coro_listen(listeners.tcp, jeux_client_service),
+        listeners.local < 0 ? -1 : coro_listen(listeners.local, jeux_client_service),
+        listeners.shm < 0 ? -1 : coro_listen(listeners.shm, local_shm_service)
+    };
+    for (int i = 0; i < 3; i++){
+        // With io_uring, all the listening sockets share one descriptor.
+        int seen = acceptfds[i] < 0;
+        for (int j = 2; j < nfds; j++){
+            seen = seen || fds[j].fd == acceptfds[i];
+        }
+        if (!seen){
+            fds[nfds].fd = acceptfds[i];
+            fds[nfds].events = POLLIN;
+            nfds++;
         }
     }
 
-    fprintf(stderr, "You have to finish implementing main() "
-	    "before the Jeux server will function.\n");
-
-    terminate(EXIT_FAILURE);
+    while (1){
+        if (poll(fds, nfds, -1) < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        if (fds[0].revents & POLLIN){
+            struct signalfd_siginfo si;
+            if (read(sigfd, &si, sizeof(si)) == sizeof(si)){
+                debug("%ld: got signal %d, shutting down", pthread_self(), si.ssi_signo);
+            }
+            break;
+        }
+        if (fds[1].revents & POLLIN){
+            int sock = accept(upgradefd, NULL, NULL);
+            if (sock >= 0){
+                // Connections that come in meanwhile wait in the backlog,
+                // which goes along with the listening socket.
+                coro_listen_pause();
+                int done = handoff_send(sock, &listeners) == 0;
+                close(sock);
+                if (done){
+                    // The connections now belong to the new server, so
+                    // nothing may be shut down on the way out.
+                    debug("%ld: Jeux server handed over", pthread_self());
+                    exit(EXIT_SUCCESS);
+                }
+                coro_listen_resume();
+            }
+        }
+        for (int i = 2; i < nfds; i++){
+            if (fds[i].revents & POLLIN){
+                coro_accept(fds[i].fd);
+            }
+        }
+    }
+    // Stop taking new connections before draining the existing ones.
+    coro_listen_pause();
+    close(listeners.tcp);
+    if (listeners.local >= 0){
+        close(listeners.local);
+        unlink(localPath);
+    }
+    if (listeners.shm >= 0){
+        close(listeners.shm);
+        unlink(shmPath);
+    }
+    close(sigfd);
+    if (upgradefd >= 0){
+        close(upgradefd);
+        unlink(upgradePath);
+    }
+    terminate(EXIT_SUCCESS);
 }
 
 /*
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
-    // Shutdown all client connections.
-    // This will trigger the eventual termination of service threads.
+    // Shutdown all client connections for reading.
+    // This makes every service thread see EOF and log its client out,
+    // which resigns its games and notifies the opponents.  The threads
+    // do this in parallel, and can still send while they do.
     creg_shutdown_all(client_registry);
-    
+
     debug("%ld: Waiting for service threads to terminate...", pthread_self());
-    creg_wait_for_empty(client_registry);
-    debug("%ld: All service threads terminated.", pthread_self());
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drainSeconds;
+    int empty = creg_wait_for_empty_until(client_registry, &deadline) == 0;
+    if (!empty){
+        // Some client is not reading what it is sent, so its service thread
+        // is stuck in a send.  Closing the sockets completely unsticks it.
+        debug("%ld: Drain deadline passed, forcing connections closed", pthread_self());
+        creg_force_shutdown_all(client_registry);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FORCE_CLOSE_SECONDS;
+        empty = creg_wait_for_empty_until(client_registry, &deadline) == 0;
+    }
+    debug("%ld: Service threads %s.", pthread_self(), empty ? "all terminated" : "still running");
+    glicko_fini();
+    rhist_fini();
+
+    if (ratingsFile != NULL && preg_save(player_registry, ratingsFile)){
+        fprintf(stderr, "Error: cannot save ratings to %s\n", ratingsFile);
+        status = EXIT_FAILURE;
+    }
 
     // Finalize modules.
-    creg_fini(client_registry);
-    preg_fini(player_registry);
+    spec_fini();
+    timer_fini();
+    archive_fini();
+    if (empty){
+        // Otherwise a thread that is still running may be using them.
+        creg_fini(client_registry);
+        preg_fini(player_registry);
+        ebr_fini();
+    }
 
     debug("%ld: Jeux server terminating", pthread_self());
     exit(status);
@@ -10,13 +10,19 @@
 #include <sys/socket.h>
 #include <semaphore.h>
 #include <math.h>
+#include <stdint.h>
+#include <time.h>
 #include "debug.h"
 #include "protocol.h"
 #include "client_registry.h"
 #include "client.h"
 #include "player.h"
+#include "player_ext.h"
 #include "invitation.h"
 #include "jeux_globals.h"
+#include "elo.h"
+#include "glicko.h"
+#include "rating_history.h"
 
 /*
  * A PLAYER represents a user of the system.  A player has a username,
@@ -37,14 +43,26 @@
  * The precise contents are up to you.  Be sure that all the operations
  * that might be called concurrently are thread-safe.
  */
+/*
+ * The rating is only changed with seph held, and stored atomically, so that
+ * it can be read without the lock.  A game's two ratings are changed
+ * together with both locks held, taken in order of address.
+ */
 typedef struct player {
 	char* username;
-	int rating;
+	double rating;
+	double deviation;               //for Glicko-2 only
+	double volatility;
 	int reference;
     long int nameLength;
     sem_t seph;
 } PLAYER;
 
+PLAYER_RATING_SYSTEM player_rating_system = PLAYER_RATING_ELO;
+
+//bumped after every rating change, for those who cache what they built from ratings
+static uint64_t rating_version = 0;
+
 /*
  * Create a new PLAYER with a specified username.  A private copy is
  * made of the username that is passed.  The newly created PLAYER has
@@ -60,6 +78,8 @@ PLAYER *player_create(char *name){
     p->username = calloc(strlen(name) + 1, sizeof(char)); // allocate memory for username
     strcpy(p->username, name);
 	p -> rating = PLAYER_INITIAL_RATING;
+	p -> deviation = GLICKO_INITIAL_DEVIATION;
+	p -> volatility = GLICKO_INITIAL_VOLATILITY;
 	p -> reference = 1;
     sem_init(&p->seph, 0, 1);
 	return p;
@@ -120,13 +140,28 @@ char *player_get_name(PLAYER *player){
  * Get the rating of a player.
  *
  * @param player  The PLAYER that is to be queried.
- * @return the rating of the player.
+ * @return the rating of the player, rounded to the nearest whole point.
  */
 int player_get_rating(PLAYER *player){
 	if (player == NULL){
 		return -1;
 	}
-	return player->rating;
+	return (int)lround(player_get_rating_exact(player));
+}
+
+/*
+ * Get the rating of a player, unrounded.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the rating of the player.
+ */
+double player_get_rating_exact(PLAYER *player){
+	if (player == NULL){
+		return -1;
+	}
+	double rating;
+	__atomic_load(&player -> rating, &rating, __ATOMIC_ACQUIRE);
+	return rating;
 }
 
 /*
@@ -143,37 +178,141 @@ int player_get_rating(PLAYER *player){
  * Update the players ratings to R1' and R2' using the formula:
  *     R1' = R1 + 32*(S1-E1)
  *     R2' = R2 + 32*(S2-E2)
+ * The ratings are kept unrounded, and computed by the elo module.
+ * Under Glicko-2, the result is rated at the end of the rating period
+ * instead (see glicko.h).
  *
  * @param player1  One of the PLAYERs that is to be updated.
  * @param player2  The other PLAYER that is to be updated.
  * @param result   0 if draw, 1 if player1 won, 2 if player2 won.
  */
 void player_post_result(PLAYER *player1, PLAYER *player2, int result){
-    if (player1 != NULL && player2 != NULL && result <= 2){
-        double s1, s2, e1, e2;
-        int r1, r2;
-        if (result == 0){
-            s1 = 0.5;
-            s2 = 0.5;
-        }
-        else if (result == 1){
-            s1 = 1;
-            s2 = 0;
-        }
-        else{
-            s1 = 0;
-            s2 = 1;
+    player_post_result_ratings(player1, player2, result, NULL, NULL);
+}
+
+void player_post_result_ratings(PLAYER *player1, PLAYER *player2, int result,
+                                double before[2], double after[2]){
+    double r[2] = {player_get_rating_exact(player1), player_get_rating_exact(player2)};
+    if (player_rating_system == PLAYER_RATING_GLICKO2){
+        glicko_post_result(player1, player2, result);
+    }
+    //invitations to oneself are refused, and both locks would be the same
+    else if (player1 != NULL && player2 != NULL && player1 != player2 && result >= 0 && result <= 2){
+        PLAYER *first = player1 < player2 ? player1 : player2;
+        PLAYER *second = player1 < player2 ? player2 : player1;
+        sem_wait(&first->seph);
+        sem_wait(&second->seph);
+        r[0] = player1 -> rating;
+        r[1] = player2 -> rating;
+        if (before != NULL){
+            memcpy(before, r, sizeof(r));
+            before = NULL;
         }
-        r1 = player_get_rating(player1);
-        r2 = player_get_rating(player2);
-        e1 = 1/(1+ pow(10,((r2-r1)/400)));
-        e2 = 1/(1+ pow(10,((r1-r2)/400)));
-        sem_wait(&player1->seph);
-        player1 -> rating = r1 + (int)(32*(s1 - e1));
-        sem_post(&player1->seph);
-        sem_wait(&player2->seph);
-        player2 -> rating = r2 + (int)(32*(s2 - e2));
-        sem_post(&player2->seph);
+        elo_update(&r[0], &r[1], result);
+        __atomic_store(&player1 -> rating, &r[0], __ATOMIC_RELEASE);
+        __atomic_store(&player2 -> rating, &r[1], __ATOMIC_RELEASE);
+        //recorded in the order applied; rhist only takes a lock of its own
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        rhist_record(player_get_name(player1), ms, r[0]);
+        rhist_record(player_get_name(player2), ms, r[1]);
+        sem_post(&second->seph);
+        sem_post(&first->seph);
+        __atomic_add_fetch(&rating_version, 1, __ATOMIC_SEQ_CST);
+    }
+    //nothing was changed unless before has been filled in
+    if (before != NULL){
+        memcpy(before, r, sizeof(r));
     }
+    if (after != NULL){
+        memcpy(after, r, sizeof(r));
+    }
+}
 
-}
\ No newline at end of file
+/*
+ * Set the rating of a PLAYER, as when restoring saved ratings.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ */
+void player_set_rating(PLAYER *player, int rating){
+    player_set_rating_exact(player, rating);
+}
+
+/*
+ * Set the rating of a PLAYER to an unrounded value.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ */
+void player_set_rating_exact(PLAYER *player, double rating){
+    if (player == NULL){
+        return;
+    }
+    sem_wait(&player->seph);
+    __atomic_store(&player -> rating, &rating, __ATOMIC_RELEASE);
+    sem_post(&player->seph);
+    __atomic_add_fetch(&rating_version, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Get the rating deviation of a player.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @return the rating deviation of the player.
+ */
+double player_get_deviation(PLAYER *player){
+    if (player == NULL){
+        return -1;
+    }
+    double deviation;
+    __atomic_load(&player -> deviation, &deviation, __ATOMIC_ACQUIRE);
+    return deviation;
+}
+
+/*
+ * Get the rating, rating deviation and volatility of a player, all as of
+ * the same moment.
+ *
+ * @param player  The PLAYER that is to be queried.
+ * @param rating  Set to the rating.
+ * @param deviation  Set to the rating deviation.
+ * @param volatility  Set to the volatility.
+ */
+void player_get_glicko(PLAYER *player, double *rating, double *deviation, double *volatility){
+    sem_wait(&player->seph);
+    *rating = player -> rating;
+    *deviation = player -> deviation;
+    *volatility = player -> volatility;
+    sem_post(&player->seph);
+}
+
+/*
+ * Set the rating, rating deviation and volatility of a player.
+ *
+ * @param player  The PLAYER whose rating is to be set.
+ * @param rating  The new rating.
+ * @param deviation  The new rating deviation.
+ * @param volatility  The new volatility.
+ */
+void player_set_glicko(PLAYER *player, double rating, double deviation, double volatility){
+    if (player == NULL){
+        return;
+    }
+    sem_wait(&player->seph);
+    __atomic_store(&player -> rating, &rating, __ATOMIC_RELEASE);
+    __atomic_store(&player -> deviation, &deviation, __ATOMIC_RELEASE);
+    player -> volatility = volatility;
+    sem_post(&player->seph);
+    __atomic_add_fetch(&rating_version, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Get a number that changes whenever the rating of some PLAYER changes.
+ *
+ * @return the number of rating changes so far.
+ */
+uint64_t player_rating_version(void){
+    return __atomic_load_n(&rating_version, __ATOMIC_SEQ_CST);
+}
@@ -9,6 +9,8 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <semaphore.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "debug.h"
 #include "protocol.h"
@@ -18,6 +20,8 @@
 #include "invitation.h"
 #include "jeux_globals.h"
 #include "player_registry.h"
+#include "player_registry_ext.h"
+#include "player_ext.h"
 
 /*
  * A player registry maintains a mapping from usernames to PLAYER objects.
@@ -107,4 +111,109 @@ PLAYER *preg_register(PLAYER_REGISTRY *preg, char *name){
 	}
 	sem_post(&preg->seph);
 	return NULL;
-}
\ No newline at end of file
+}
+
+/*
+ * Save the ratings of all registered players.
+ *
+ * @param preg  The player registry.
+ * @param path  The file to be written.
+ * @return 0 if successful, otherwise -1.
+ */
+int preg_save(PLAYER_REGISTRY *preg, char *path){
+    if (preg == NULL || path == NULL){
+        return -1;
+    }
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL){
+        return -1;
+    }
+    sem_wait(&preg->seph);
+    for (int i = 0; i < 1000; i++){
+        PLAYER *p = preg -> players[i];
+        if (p != NULL && strpbrk(player_get_name(p), "\t\n") == NULL){
+            double r, rd, vol;
+            player_get_glicko(p, &r, &rd, &vol);
+            fprintf(f, "%s\t%.17g\t%.17g\t%.17g\n", player_get_name(p), r, rd, vol);
+        }
+    }
+    sem_post(&preg->seph);
+    int err = fflush(f) || fsync(fileno(f));
+    if (fclose(f) || err || rename(tmp, path)){
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Register every player listed in a ratings file with the rating saved
+ * for it.
+ *
+ * @param preg  The player registry.
+ * @param path  The file to be read.
+ * @return the number of players loaded, or -1 on error.
+ */
+int preg_load(PLAYER_REGISTRY *preg, char *path){
+    if (preg == NULL || path == NULL){
+        return -1;
+    }
+    FILE *f = fopen(path, "r");
+    if (f == NULL){
+        return errno == ENOENT ? 0 : -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    int n = 0;
+    while (getline(&line, &cap, f) > 0){
+        char *tab = strchr(line, '\t');
+        if (tab == NULL || tab == line){
+            continue;
+        }
+        *tab = '\0';
+        PLAYER *p = preg_register(preg, line);
+        if (p == NULL){
+            break;
+        }
+        char *end;
+        double rating = strtod(tab + 1, &end);
+        if (*end == '\t'){
+            char *vol;
+            double deviation = strtod(end + 1, &vol);
+            player_set_glicko(p, rating, deviation, strtod(vol, NULL));
+        }
+        else{
+            player_set_rating_exact(p, rating);
+        }
+        player_unref(p, "loaded from ratings file");
+        n += 1;
+    }
+    free(line);
+    fclose(f);
+    return n;
+}
+
+/*
+ * Get all registered players.
+ *
+ * @param preg  The player registry.
+ * @param players  Caller-supplied array into which the players are stored.
+ * @param max  Size of the players array.
+ * @return the number of players stored.
+ */
+int preg_snapshot(PLAYER_REGISTRY *preg, PLAYER **players, int max){
+    if (preg == NULL || players == NULL){
+        return 0;
+    }
+    int n = 0;
+    sem_wait(&preg->seph);
+    for (int i = 0; i < 1000 && n < max; i++){
+        if (preg -> players[i] != NULL){
+            players[n++] = player_ref(preg -> players[i], "returned by preg_snapshot");
+        }
+    }
+    sem_post(&preg->seph);
+    return n;
+}
@@ -8,46 +8,97 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "debug.h"
 #include "protocol.h"
+#include "protocol_ext.h"
+#include "jio.h"
 
 int proto_send_packet(int fd, JEUX_PACKET_HEADER *hdr, void *data){
+    return proto_send_packet_seq(fd, hdr, NULL, data);
+}
+
+/*
+ * Set the sequence flag in a header as a sequence number is given or not,
+ * and lay out the header, followed by the sequence number if there is one.
+ *
+ * @return the length of what was laid out.
+ */
+static size_t pack_head(JEUX_PACKET_HEADER *hdr, uint32_t *seq, char *head){
+	if (seq != NULL){
+		hdr -> type |= JEUX_SEQ_FLAG;
+	}
+	else{
+		hdr -> type &= ~JEUX_SEQ_FLAG;
+	}
+	size_t headsize = sizeof(JEUX_PACKET_HEADER);
+	memcpy(head, hdr, sizeof(JEUX_PACKET_HEADER));
+	if (seq != NULL){
+		uint32_t nseq = htonl(*seq);
+		memcpy(head + headsize, &nseq, sizeof(nseq));
+		headsize += sizeof(nseq);
+	}
+	return headsize;
+}
+
+int proto_send_packet_seq(int fd, JEUX_PACKET_HEADER *hdr, uint32_t *seq, void *data){
     if (hdr == NULL){
         return -1;
     }
 	uint16_t datasize = ntohs(hdr->size);
-    int bytes_sent = 0;
-    // Send header
-    while (bytes_sent < sizeof(JEUX_PACKET_HEADER)) {
-        int num_bytes = write(fd, hdr + bytes_sent, sizeof(JEUX_PACKET_HEADER));
-        if (num_bytes == -1) {
-                perror("fail write");
-                return -1;
+	char head[sizeof(JEUX_PACKET_HEADER) + sizeof(uint32_t)];
+	size_t headsize = pack_head(hdr, seq, head);
+	//the header and payload go out together, in one system call
+	struct iovec iov[2] = {{head, headsize}, {data, datasize}};
+	debug("%ld: writing payload size of %d", pthread_self(), datasize);
+	if (jio_writev(fd, iov, datasize > 0 ? 2 : 1) < 0) {
+		perror("fail write");
+		return -1;
+	}
+	return 0;
+}
+
+size_t proto_packed_size(JEUX_PACKET_HEADER *hdr, uint32_t *seq){
+	return sizeof(JEUX_PACKET_HEADER) + (seq != NULL ? sizeof(uint32_t) : 0) + ntohs(hdr -> size);
+}
+
+size_t proto_pack_packet_seq(JEUX_PACKET_HEADER *hdr, uint32_t *seq, void *data, void *buf){
+	uint16_t datasize = data == NULL ? 0 : ntohs(hdr -> size);
+	size_t headsize = pack_head(hdr, seq, buf);
+	if (datasize > 0){
+		memcpy((char *)buf + headsize, data, datasize);
+	}
+	return headsize + datasize;
+}
+/*
+ * Read exactly n bytes, unless the connection ends or fails first.
+ *
+ * @return the number of bytes read, or -1 on error.
+ */
+static int read_fully(int fd, void *buf, int n){
+    int num_bytes = 0;
+    while (num_bytes < n){
+        int byte = jio_read(fd, (char *)buf + num_bytes, n - num_bytes);
+        if (byte == -1){
+            return -1;
         }
-        if (num_bytes == 0){
+        else if (byte == 0){
             break;
         }
-        bytes_sent += num_bytes;
+        num_bytes += byte;
     }
-    if (datasize > 0){
-        debug("%ld: writing payload size of %d", pthread_self(), datasize);
-		bytes_sent = 0;
-		while (bytes_sent < datasize) {
-		    int num_bytes = write(fd, (char*)data + bytes_sent, datasize);
-		    if (num_bytes == -1) {
-		        perror("fail write");
-		        return -1;
-		    }
-		    if (num_bytes == 0){
-		    	break;
-		    }
-		    bytes_sent += num_bytes;
-		}
-	}
-	return 0;
+    return num_bytes;
 }
+
 int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
+    return proto_recv_packet_seq(fd, hdr, NULL, NULL, payloadp);
+}
+
+int proto_recv_packet_seq(int fd, JEUX_PACKET_HEADER *hdr, uint32_t *seq, int *tagged, void **payloadp){
+    if (tagged != NULL){
+        *tagged = 0;
+    }
     if (hdr == NULL){
         return -1;
     }
@@ -55,7 +106,7 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
     int num_bytes = 0;
     int size = sizeof(JEUX_PACKET_HEADER);
     while(num_bytes < size){
-        int byte = read(fd, (char*)hdr + num_bytes, size - num_bytes);
+        int byte = jio_read(fd, (char*)hdr + num_bytes, size - num_bytes);
         debug("%ld: size  %d %d", pthread_self(), byte, size);
         if (byte == -1) {
             fprintf(stderr, "failed to read payload");
@@ -68,6 +119,19 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
     if (num_bytes != size){
         return -1;
     }
+    if (hdr -> type & JEUX_SEQ_FLAG){
+        uint32_t nseq;
+        if (read_fully(fd, &nseq, sizeof(nseq)) != sizeof(nseq)){
+            return -1;
+        }
+        hdr -> type &= ~JEUX_SEQ_FLAG;
+        if (seq != NULL){
+            *seq = ntohl(nseq);
+        }
+        if (tagged != NULL){
+            *tagged = 1;
+        }
+    }
     uint16_t datasize  = ntohs(hdr->size);
 
     if (datasize > 0) {
@@ -79,7 +143,7 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
         }
         uint16_t bytes_read = 0;
         while (bytes_read < datasize) {
-            int num_bytes = read(fd, (payload + bytes_read), datasize - bytes_read);
+            int num_bytes = jio_read(fd, (payload + bytes_read), datasize - bytes_read);
             if (num_bytes == -1) {
                 fprintf(stderr, "failed to read payload");
                 return -1;
@@ -100,4 +164,50 @@ int proto_recv_packet(int fd, JEUX_PACKET_HEADER *hdr, void **payloadp){
     return 0;
 
 
-}
\ No newline at end of file
+}
+
+/*
+ * The names of the capabilities, in the order of their bits.
+ */
+static const char *cap_names[JEUX_CAP_COUNT] = {
+	"binary-board", "pipeline", "batch", "large-payload", "compress", "notify-batch"
+};
+
+unsigned proto_parse_caps(const char *list, int *version){
+	unsigned caps = 0;
+	*version = 0;
+	const char *p = list;
+	int first = 1;
+	while (*p != '\0'){
+		while (*p == ' '){
+			p++;
+		}
+		size_t len = strcspn(p, " ");
+		if (len == 0){
+			break;
+		}
+		if (first){
+			*version = atoi(p);
+			first = 0;
+		}
+		else{
+			for (int i = 0; i < JEUX_CAP_COUNT; i++){
+				if (strlen(cap_names[i]) == len && strncmp(p, cap_names[i], len) == 0){
+					caps |= 1u << i;
+				}
+			}
+		}
+		p += len;
+	}
+	return caps;
+}
+
+size_t proto_format_caps(unsigned caps, char *buf){
+	size_t len = sprintf(buf, "%d", JEUX_PROTOCOL_VERSION);
+	for (int i = 0; i < JEUX_CAP_COUNT; i++){
+		if (caps & (1u << i)){
+			len += sprintf(buf + len, " %s", cap_names[i]);
+		}
+	}
+	return len;
+}
@@ -0,0 +1,455 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "archive.h"
+#include "rating_history.h"
+
+#define RHIST_BUCKETS 1024
+
+typedef struct rhist_column {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} RHIST_COLUMN;
+
+/*
+ * The points of a player's history that are in memory.
+ */
+typedef struct rhist_series {
+	struct rhist_series *next;      //in its bucket
+	char *name;
+	uint32_t hash;
+	uint32_t count;
+	uint64_t firstTime;
+	int32_t firstRating;
+	uint64_t lastTime;
+	int64_t lastDelta;              //between the last two points
+	int32_t lastRating;
+	RHIST_COLUMN times;
+	RHIST_COLUMN ratings;
+} RHIST_SERIES;
+
+static struct {
+	int open;
+	char *dir;                      //NULL if the histories are only kept in memory
+	pthread_mutex_t mutex;          //guards the series
+	RHIST_SERIES *buckets[RHIST_BUCKETS];
+	pthread_rwlock_t spillLock;     //held for writing while series go to disk
+	pthread_t tid;
+	pthread_cond_t cond;
+	int stopping;
+} rhist = {0, .mutex = PTHREAD_MUTEX_INITIALIZER, .spillLock = PTHREAD_RWLOCK_INITIALIZER,
+           .cond = PTHREAD_COND_INITIALIZER};
+
+static void put16(unsigned char *p, uint16_t v){
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put32(unsigned char *p, uint32_t v){
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void put64(unsigned char *p, uint64_t v){
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t get16(const unsigned char *p){
+	return (uint16_t)p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const unsigned char *p){
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get64(const unsigned char *p){
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static uint64_t zigzag(int64_t v){
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v){
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int put_varint(RHIST_COLUMN *col, int64_t value){
+	if (col -> len + 10 > col -> size){
+		size_t size = col -> size == 0 ? 16 : col -> size * 2;
+		unsigned char *data = realloc(col -> data, size);
+		if (data == NULL){
+			return -1;
+		}
+		col -> data = data;
+		col -> size = size;
+	}
+	uint64_t v = zigzag(value);
+	while (v >= 0x80){
+		col -> data[col -> len++] = v | 0x80;
+		v >>= 7;
+	}
+	col -> data[col -> len++] = v;
+	return 0;
+}
+
+/*
+ * Read a varint.
+ *
+ * @return the number of bytes it took, or 0 if it runs past the end.
+ */
+static size_t get_varint(const unsigned char *p, const unsigned char *end, int64_t *value){
+	uint64_t v = 0;
+	for (size_t i = 0; p + i < end && i < 10; i++){
+		v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)){
+			*value = unzigzag(v);
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The points found by a query, in the order they were recorded.
+ */
+typedef struct rhist_found {
+	RHIST_POINT *points;
+	size_t count;
+	size_t size;
+	uint64_t since;
+} RHIST_FOUND;
+
+/*
+ * Decode the columns of a series, adding the points from since onwards.
+ *
+ * @return 0 if successful, -1 if the columns are malformed.
+ */
+static int decode(RHIST_FOUND *found, uint32_t count, uint64_t time, int32_t rating,
+	const unsigned char *times, size_t tlen, const unsigned char *ratings, size_t rlen){
+	const unsigned char *tend = times + tlen;
+	const unsigned char *rend = ratings + rlen;
+	int64_t delta = 0;
+	for (uint32_t i = 0; i < count; i++){
+		if (i > 0){
+			int64_t dod, dr;
+			size_t n = get_varint(times, tend, &dod);
+			size_t m = n == 0 ? 0 : get_varint(ratings, rend, &dr);
+			if (m == 0){
+				return -1;
+			}
+			times += n;
+			ratings += m;
+			delta += dod;
+			time += delta;
+			rating += dr;
+		}
+		if (time < found -> since){
+			continue;
+		}
+		if (found -> count == found -> size){
+			size_t size = found -> size == 0 ? 256 : found -> size * 2;
+			RHIST_POINT *points = realloc(found -> points, size * sizeof(RHIST_POINT));
+			if (points == NULL){
+				return -1;
+			}
+			found -> points = points;
+			found -> size = size;
+		}
+		found -> points[found -> count].time_ms = time;
+		found -> points[found -> count].rating = rating;
+		found -> count += 1;
+	}
+	return 0;
+}
+
+static void history_path(char *buf, size_t len, uint32_t hash){
+	snprintf(buf, len, "%s/%08x.rts", rhist.dir, hash);
+}
+
+static RHIST_SERIES *find_series(char *name, uint32_t hash){
+	for (RHIST_SERIES *s = rhist.buckets[hash % RHIST_BUCKETS]; s != NULL; s = s -> next){
+		if (s -> hash == hash && strcmp(s -> name, name) == 0){
+			return s;
+		}
+	}
+	return NULL;
+}
+
+void rhist_record(char *name, uint64_t time_ms, double rating){
+	if (!rhist.open || name == NULL){
+		return;
+	}
+	uint32_t hash = archive_name_hash(name);
+	int32_t r = (int32_t)lround(rating * 100);
+	pthread_mutex_lock(&rhist.mutex);
+	RHIST_SERIES *s = find_series(name, hash);
+	if (s == NULL){
+		s = calloc(1, sizeof(RHIST_SERIES));
+		if (s == NULL || (s -> name = strdup(name)) == NULL){
+			free(s);
+			pthread_mutex_unlock(&rhist.mutex);
+			return;
+		}
+		s -> hash = hash;
+		s -> next = rhist.buckets[hash % RHIST_BUCKETS];
+		rhist.buckets[hash % RHIST_BUCKETS] = s;
+	}
+	if (s -> count == 0){
+		s -> firstTime = time_ms;
+		s -> firstRating = r;
+		s -> lastDelta = 0;
+	}
+	else{
+		int64_t delta = (int64_t)(time_ms - s -> lastTime);
+		//both go in, or neither
+		size_t tlen = s -> times.len;
+		if (put_varint(&s -> times, delta - s -> lastDelta) || put_varint(&s -> ratings, (int64_t)r - s -> lastRating)){
+			s -> times.len = tlen;
+			pthread_mutex_unlock(&rhist.mutex);
+			return;
+		}
+		s -> lastDelta = delta;
+	}
+	s -> lastTime = time_ms;
+	s -> lastRating = r;
+	s -> count += 1;
+	pthread_mutex_unlock(&rhist.mutex);
+}
+
+/*
+ * A series on its way to disk, laid out as a block.
+ */
+typedef struct rhist_block {
+	struct rhist_block *next;
+	uint32_t hash;
+	size_t length;
+	unsigned char data[];
+} RHIST_BLOCK;
+
+int rhist_spill(void){
+	if (!rhist.open || rhist.dir == NULL){
+		return 0;
+	}
+	pthread_rwlock_wrlock(&rhist.spillLock);
+	RHIST_BLOCK *blocks = NULL;
+	int ret = 0;
+	pthread_mutex_lock(&rhist.mutex);
+	for (int i = 0; i < RHIST_BUCKETS; i++){
+		for (RHIST_SERIES *s = rhist.buckets[i]; s != NULL; s = s -> next){
+			if (s -> count == 0){
+				continue;
+			}
+			size_t namelen = strnlen(s -> name, UINT16_MAX);
+			size_t length = RHIST_BLOCK_FIXED + namelen + s -> times.len + s -> ratings.len;
+			RHIST_BLOCK *b = malloc(sizeof(RHIST_BLOCK) + length);
+			if (b == NULL){
+				ret = -1;
+				continue;
+			}
+			unsigned char *p = b -> data;
+			put32(p, RHIST_MAGIC);
+			put16(p + 4, namelen);
+			put32(p + 6, s -> count);
+			put32(p + 10, s -> times.len);
+			put32(p + 14, s -> ratings.len);
+			put64(p + 18, s -> firstTime);
+			put32(p + 26, s -> firstRating);
+			p += RHIST_BLOCK_FIXED;
+			memcpy(p, s -> name, namelen);
+			memcpy(p + namelen, s -> times.data, s -> times.len);
+			memcpy(p + namelen + s -> times.len, s -> ratings.data, s -> ratings.len);
+			b -> hash = s -> hash;
+			b -> length = length;
+			b -> next = blocks;
+			blocks = b;
+			//the memory goes, not just the points
+			free(s -> times.data);
+			free(s -> ratings.data);
+			memset(&s -> times, 0, sizeof(RHIST_COLUMN));
+			memset(&s -> ratings, 0, sizeof(RHIST_COLUMN));
+			s -> count = 0;
+		}
+	}
+	pthread_mutex_unlock(&rhist.mutex);
+	int spilled = 0;
+	while (blocks != NULL){
+		RHIST_BLOCK *b = blocks;
+		blocks = b -> next;
+		char path[PATH_MAX];
+		history_path(path, sizeof(path), b -> hash);
+		int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd < 0 || write(fd, b -> data, b -> length) != (ssize_t)b -> length){
+			debug("%ld: cannot spill rating history to %s: %s", pthread_self(), path, strerror(errno));
+			ret = -1;
+		}
+		if (fd >= 0){
+			close(fd);
+		}
+		free(b);
+		spilled += 1;
+	}
+	pthread_rwlock_unlock(&rhist.spillLock);
+	debug("%ld: spilled %d rating histories", pthread_self(), spilled);
+	return ret;
+}
+
+/*
+ * Add the points of a player's history file.
+ */
+static int read_file(RHIST_FOUND *found, char *name, uint32_t hash){
+	char path[PATH_MAX];
+	history_path(path, sizeof(path), hash);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0){
+		return errno == ENOENT ? 0 : -1;
+	}
+	struct stat st;
+	unsigned char *buf = NULL;
+	if (fstat(fd, &st) || (buf = malloc(st.st_size + 1)) == NULL ||
+	    pread(fd, buf, st.st_size, 0) != st.st_size){
+		free(buf);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	size_t namelen = strlen(name);
+	size_t off = 0;
+	while (off + RHIST_BLOCK_FIXED <= (size_t)st.st_size){
+		unsigned char *p = buf + off;
+		size_t n = get16(p + 4);
+		size_t tlen = get32(p + 10);
+		size_t rlen = get32(p + 14);
+		size_t length = RHIST_BLOCK_FIXED + n + tlen + rlen;
+		if (get32(p) != RHIST_MAGIC || off + length > (size_t)st.st_size){
+			//a block cut short by a crash ends the file
+			break;
+		}
+		unsigned char *names = p + RHIST_BLOCK_FIXED;
+		if (n == namelen && memcmp(names, name, n) == 0 &&
+		    decode(found, get32(p + 6), get64(p + 18), (int32_t)get32(p + 26),
+		           names + n, tlen, names + n + tlen, rlen)){
+			free(buf);
+			return -1;
+		}
+		off += length;
+	}
+	free(buf);
+	return 0;
+}
+
+int rhist_query(char *name, uint64_t since_ms, RHIST_POINT *points, int max){
+	if (!rhist.open || name == NULL || points == NULL || max <= 0){
+		return -1;
+	}
+	uint32_t hash = archive_name_hash(name);
+	RHIST_FOUND found = {NULL, 0, 0, since_ms};
+	int ret = 0;
+	pthread_rwlock_rdlock(&rhist.spillLock);
+	if (rhist.dir != NULL && read_file(&found, name, hash)){
+		ret = -1;
+	}
+	pthread_mutex_lock(&rhist.mutex);
+	RHIST_SERIES *s = find_series(name, hash);
+	if (ret == 0 && s != NULL && s -> count > 0 &&
+	    decode(&found, s -> count, s -> firstTime, s -> firstRating,
+	           s -> times.data, s -> times.len, s -> ratings.data, s -> ratings.len)){
+		ret = -1;
+	}
+	pthread_mutex_unlock(&rhist.mutex);
+	pthread_rwlock_unlock(&rhist.spillLock);
+	if (ret == 0){
+		size_t first = found.count > (size_t)max ? found.count - max : 0;
+		memcpy(points, found.points + first, (found.count - first) * sizeof(RHIST_POINT));
+		ret = found.count - first;
+	}
+	free(found.points);
+	return ret;
+}
+
+static void *spill_thread(void *arg){
+	pthread_mutex_lock(&rhist.mutex);
+	while (!rhist.stopping){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += RHIST_SPILL_MS / 1000;
+		int r = 0;
+		while (!rhist.stopping && r != ETIMEDOUT){
+			r = pthread_cond_timedwait(&rhist.cond, &rhist.mutex, &ts);
+		}
+		if (rhist.stopping){
+			break;
+		}
+		pthread_mutex_unlock(&rhist.mutex);
+		rhist_spill();
+		pthread_mutex_lock(&rhist.mutex);
+	}
+	pthread_mutex_unlock(&rhist.mutex);
+	return NULL;
+}
+
+int rhist_init(char *dir){
+	if (rhist.open){
+		return -1;
+	}
+	if (dir != NULL){
+		if (mkdir(dir, 0755) && errno != EEXIST){
+			return -1;
+		}
+		if ((rhist.dir = strdup(dir)) == NULL){
+			return -1;
+		}
+	}
+	rhist.stopping = 0;
+	rhist.open = 1;
+	if (rhist.dir != NULL && pthread_create(&rhist.tid, NULL, spill_thread, NULL)){
+		rhist.open = 0;
+		free(rhist.dir);
+		rhist.dir = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void rhist_fini(void){
+	if (!rhist.open){
+		return;
+	}
+	if (rhist.dir != NULL){
+		pthread_mutex_lock(&rhist.mutex);
+		rhist.stopping = 1;
+		pthread_cond_signal(&rhist.cond);
+		pthread_mutex_unlock(&rhist.mutex);
+		pthread_join(rhist.tid, NULL);
+		rhist_spill();
+	}
+	rhist.open = 0;
+	pthread_mutex_lock(&rhist.mutex);
+	for (int i = 0; i < RHIST_BUCKETS; i++){
+		while (rhist.buckets[i] != NULL){
+			RHIST_SERIES *s = rhist.buckets[i];
+			rhist.buckets[i] = s -> next;
+			free(s -> name);
+			free(s -> times.data);
+			free(s -> ratings.data);
+			free(s);
+		}
+	}
+	pthread_mutex_unlock(&rhist.mutex);
+	free(rhist.dir);
+	rhist.dir = NULL;
+}
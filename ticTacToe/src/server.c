@@ -6,16 +6,34 @@
 #include <errno.h>
 #include <signal.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <limits.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
 #include "csapp.h"
 #include "debug.h"
 #include "protocol.h"
+#include "protocol_ext.h"
 #include "server.h"
+#include "server_ext.h"
 #include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "game_ext.h"
 #include "player_registry.h"
+#include "spectator.h"
+#include "archive.h"
+#include "rating_history.h"
 #include "jeux_globals.h"
+#include "ebr.h"
+#include "coro.h"
+#include "jio.h"
+#include "compress.h"
+#include "player_ext.h"
 
 
 /*
@@ -37,179 +55,888 @@
  * explicitly closing the connection, a timeout in the network causing
  * the connection to be closed, or the main thread of the server shutting
  * down the connection as part of graceful termination.
+ *
+ * The server runs this as a coroutine (see coro.h) rather than in a
+ * thread of its own, but it works either way.
  */
 
 
 
-void *jeux_client_service(void *arg){
-	int signedIN = 0;
-	int fd = *(int *)arg;
-   	free(arg);
-   	pthread_detach(pthread_self());
+/*
+ * The capabilities that the server grants to clients that offer them.
+ */
+#define SERVER_CAPS (JEUX_CAP_BINARY_BOARD | JEUX_CAP_PIPELINE | JEUX_CAP_BATCH | JEUX_CAP_LARGE_PAYLOAD | \
+                     JEUX_CAP_COMPRESS)
+
+/*
+ * The USERS listing, built once for each state of the logged-in users and
+ * their ratings, along with its compressed form, so that the clients that
+ * ask for it in the meantime share the work.  The listing is replaced
+ * when it is found to be out of date, and the old one is freed through
+ * EBR, since the requests that send it run in critical sections.
+ */
+typedef struct users_listing {
+	EBR_NODE reclaim;
+	uint64_t version;               //creg_version() + player_rating_version() when it was built
+	char *text;
+	size_t len;
+	void *z;                        //compressed, or NULL if it does not compress
+	size_t zlen;
+} USERS_LISTING;
+
+static USERS_LISTING *users_listing;
+static pthread_mutex_t users_listing_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void users_listing_free(void *arg){
+	USERS_LISTING *l = arg;
+	free(l -> text);
+	free(l -> z);
+	free(l);
+}
+
+/*
+ * Build the USERS listing for the logged-in users as they are now.
+ */
+static USERS_LISTING *users_listing_build(uint64_t version){
+	USERS_LISTING *l = calloc(1, sizeof(USERS_LISTING));
+	PLAYER **players = creg_all_players(client_registry);
+	size_t total_len = 0;
+	for (int i = 0; players != NULL && players[i] != NULL; i++){
+		//a rating takes at most 11 characters, and there is a tab and a newline
+		total_len += strlen(player_get_name(players[i])) + 13;
+	}
+	char *text = malloc(total_len + 1);
+	if (l == NULL || players == NULL || text == NULL){
+		free(l);
+		free(players);
+		free(text);
+		return NULL;
+	}
+	size_t len = 0;
+	for (int i = 0; players[i] != NULL; i++){
+		len += sprintf(text + len, "%s\t%d\n", player_get_name(players[i]), player_get_rating(players[i]));
+	}
+	free(players);
+	l -> version = version;
+	l -> text = text;
+	l -> len = len;
+	if (len >= COMPRESS_THRESHOLD){
+		l -> z = compress_payload(text, len, &l -> zlen);
+	}
+	return l;
+}
+
+/*
+ * Answer a USERS request from the current listing, building it first if
+ * the logged-in users or their ratings have changed since it was built.
+ * The caller must be in a critical section.
+ */
+static int send_users(CLIENT *c){
+	uint64_t version = creg_version(client_registry) + player_rating_version();
+	USERS_LISTING *l = __atomic_load_n(&users_listing, __ATOMIC_ACQUIRE);
+	if (l == NULL || l -> version != version){
+		pthread_mutex_lock(&users_listing_mutex);
+		l = users_listing;
+		if (l == NULL || l -> version != version){
+			USERS_LISTING *fresh = users_listing_build(version);
+			if (fresh == NULL){
+				pthread_mutex_unlock(&users_listing_mutex);
+				return client_send_nack(c);
+			}
+			__atomic_store_n(&users_listing, fresh, __ATOMIC_RELEASE);
+			if (l != NULL){
+				ebr_retire(&l -> reclaim, users_listing_free, l);
+			}
+			l = fresh;
+		}
+		pthread_mutex_unlock(&users_listing_mutex);
+	}
+	return client_send_ack_compressed(c, l -> len ? l -> text : NULL, l -> len, l -> z, l -> zlen);
+}
+
+/*
+ * Parse a USERS_PAGE query string into a CREG_QUERY.  The query string
+ * is modified in place and the fields of the query point into it.
+ */
+static void parse_users_query(char *str, CREG_QUERY *q){
+	q -> cursor = NULL;
+	q -> prefix = NULL;
+	q -> limit = JEUX_USERS_PAGE_DEFAULT_LIMIT;
+	q -> min_rating = INT_MIN;
+	q -> max_rating = INT_MAX;
+	q -> min_deviation = INT_MIN;
+	q -> max_deviation = INT_MAX;
+	char *field;
+	int n = 0;
+	while (str != NULL && (field = strsep(&str, "\t")) != NULL){
+		if (field[0] != '\0'){
+			if (n == 0){
+				q -> cursor = field;
+			}
+			else if (n == 1){
+				q -> limit = atoi(field);
+			}
+			else if (n == 2){
+				q -> prefix = field;
+			}
+			else if (n == 3){
+				q -> min_rating = atoi(field);
+			}
+			else if (n == 4){
+				q -> max_rating = atoi(field);
+			}
+			else if (n == 5){
+				q -> min_deviation = atoi(field);
+			}
+			else if (n == 6){
+				q -> max_deviation = atoi(field);
+			}
+		}
+		n++;
+	}
+	if (q -> limit <= 0 || q -> limit > JEUX_USERS_PAGE_MAX_LIMIT){
+		q -> limit = JEUX_USERS_PAGE_MAX_LIMIT;
+	}
+}
+
+/*
+ * Answer a USERS_PAGE request from the client registry's username index.
+ * The page is cut short if it would not fit in a single packet payload,
+ * in which case the cursor is set to the last user that was included.
+ */
+static int send_users_page(CLIENT *c, char *query){
+	CREG_QUERY q;
+	parse_users_query(query, &q);
+	PLAYER **players = calloc(q.limit, sizeof(PLAYER *));
+	char *body = malloc(UINT16_MAX);
+	//sessions run on small stacks
+	char *next = malloc(UINT16_MAX);
+	if (players == NULL || body == NULL || next == NULL){
+		free(players);
+		free(body);
+		free(next);
+		return client_send_nack(c);
+	}
+	int n = creg_query_players(client_registry, &q, players, next, UINT16_MAX);
+	char *cursor = next;
+	int truncated = 0;
+	size_t len = 0;
+	for (int i = 0; i < n; i++){
+		char *name = player_get_name(players[i]);
+		char rating_str[15];
+		snprintf(rating_str, sizeof(rating_str), "%d", player_get_rating(players[i]));
+		size_t l = strlen(name) + strlen(rating_str) + 2;
+		//leave room for the cursor line, which becomes this name if we stop here
+		if (len + l + strlen(name) + 1 > UINT16_MAX){
+			truncated = 1;
+			cursor = i > 0 ? player_get_name(players[i - 1]) : name;
+			break;
+		}
+		len += sprintf(body + len, "%s\t%s\n", name, rating_str);
+	}
+	int ret;
+	size_t total = strlen(cursor) + 1 + len;
+	char *page = n < 0 || total > UINT16_MAX ? NULL : malloc(total);
+	if (page == NULL){
+		ret = client_send_nack(c);
+	}
+	else{
+		size_t cl = strlen(cursor);
+		memcpy(page, cursor, cl);
+		page[cl] = '\n';
+		memcpy(page + cl + 1, body, len);
+		JEUX_PACKET_HEADER hdr = {0};
+		hdr.type = JEUX_ACK_PKT;
+		hdr.role = truncated || next[0] != '\0';
+		hdr.size = htons(total);
+		ret = client_send_packet(c, &hdr, page);
+		free(page);
+	}
+	for (int i = 0; i < n; i++){
+		player_unref(players[i], "users page sent");
+	}
+	free(players);
+	free(body);
+	free(next);
+	return ret;
+}
+
+/*
+ * Answer a HISTORY request from the game archive.  Only the posting list
+ * of the requested player, or of the player and opponent, and the records
+ * it refers to are read.
+ */
+static int send_history(CLIENT *c, char *query){
+	char *player = NULL;
+	char *opponent = NULL;
+	int limit = JEUX_HISTORY_DEFAULT_LIMIT;
+	char *field;
+	int n = 0;
+	while (query != NULL && (field = strsep(&query, "\t")) != NULL){
+		if (field[0] != '\0'){
+			if (n == 0){
+				player = field;
+			}
+			else if (n == 1){
+				limit = atoi(field);
+			}
+			else if (n == 2){
+				opponent = field;
+			}
+		}
+		n++;
+	}
+	if (limit <= 0 || limit > JEUX_HISTORY_MAX_LIMIT){
+		limit = JEUX_HISTORY_MAX_LIMIT;
+	}
+	if (player == NULL){
+		PLAYER *self = client_get_player(c);
+		if (self == NULL){
+			return client_send_nack(c);
+		}
+		player = player_get_name(self);
+	}
+	ARCHIVE_REF refs[JEUX_HISTORY_MAX_LIMIT];
+	int found = archive_player_games(player, opponent, refs, limit);
+	char *body = malloc(UINT16_MAX);
+	if (found < 0 || body == NULL){
+		free(body);
+		return client_send_nack(c);
+	}
+	size_t len = 0;
+	for (int i = 0; i < found; i++){
+		void *buf = malloc(refs[i].length);
+		ARCHIVE_RECORD rec;
+		if (buf == NULL || archive_read(&refs[i], buf) || archive_decode(buf, refs[i].length, &rec)){
+			free(buf);
+			continue;
+		}
+		char cells[GAME_MAX_MOVES + 1];
+		for (int j = 0; j < rec.moves; j++){
+			cells[j] = '1' + rec.cells[j];
+		}
+		cells[rec.moves] = '\0';
+		char line[128];
+		int l = snprintf(line, sizeof(line), "%u\t%llu\t", rec.game_id, (unsigned long long)rec.end_ms);
+		size_t need = l + rec.first_len + rec.second_len + strlen(cells) + 16;
+		if (len + need > UINT16_MAX){
+			free(buf);
+			break;
+		}
+		len += sprintf(body + len, "%s%.*s\t%.*s\t%d\t%d\t%s\n", line,
+			(int)rec.first_len, rec.first, (int)rec.second_len, rec.second,
+			rec.result, rec.reason, cells);
+		free(buf);
+	}
+	int ret = client_send_ack(c, len ? body : NULL, len);
+	free(body);
+	return ret;
+}
+
+/*
+ * Answer a RATING_HISTORY request.
+ */
+static int send_rating_history(CLIENT *c, char *query){
+	char *player = NULL;
+	int limit = JEUX_RATING_HISTORY_DEFAULT_LIMIT;
+	uint64_t since = 0;
+	char *field;
+	int n = 0;
+	while (query != NULL && (field = strsep(&query, "\t")) != NULL){
+		if (field[0] != '\0'){
+			if (n == 0){
+				player = field;
+			}
+			else if (n == 1){
+				limit = atoi(field);
+			}
+			else if (n == 2){
+				since = strtoull(field, NULL, 10);
+			}
+		}
+		n++;
+	}
+	if (limit <= 0 || limit > JEUX_RATING_HISTORY_MAX_LIMIT){
+		limit = JEUX_RATING_HISTORY_MAX_LIMIT;
+	}
+	if (player == NULL){
+		PLAYER *self = client_get_player(c);
+		if (self == NULL){
+			return client_send_nack(c);
+		}
+		player = player_get_name(self);
+	}
+	RHIST_POINT *points = malloc(limit * sizeof(RHIST_POINT));
+	//a rating line is at most 20 digits, a tab, 12 characters and a newline
+	char *body = malloc((size_t)limit * 34 + 1);
+	int found = points == NULL || body == NULL ? -1 : rhist_query(player, since, points, limit);
+	if (found < 0){
+		free(points);
+		free(body);
+		return client_send_nack(c);
+	}
+	size_t len = 0;
+	for (int i = 0; i < found; i++){
+		len += sprintf(body + len, "%llu\t%.2f\n", (unsigned long long)points[i].time_ms,
+			points[i].rating / 100.0);
+	}
+	int ret = client_send_ack(c, len ? body : NULL, len);
+	free(points);
+	free(body);
+	return ret;
+}
+
+/*
+ * Service threads are parked while the server's state is handed over to
+ * another process.  A thread only parks between packets, so a request is
+ * never left half done.  Sessions running as coroutines are woken from
+ * their wait for a packet with coro_wake_all(), and park by suspending
+ * themselves; a session running in a thread of its own is asked to park
+ * by making a pipe readable, which it polls along with its client's socket.
+ */
+static struct {
+	pthread_once_t once;
+	int pipe[2];
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quiescing;
+	int active;                     //service threads running
+	int parked;                     //of which are parked
+} park = {PTHREAD_ONCE_INIT, {-1, -1}, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0};
+
+static void make_park_pipe(void){
+	if (pipe(park.pipe)){
+		park.pipe[0] = park.pipe[1] = -1;
+	}
+}
+
+/*
+ * Wait until either a packet starts to arrive or the thread is to park.
+ * A coroutine first writes out what the client's connection did not take
+ * when it was sent; a send that leaves more of that wakes it.
+ *
+ * @return 1 if the thread is to park, otherwise 0.
+ */
+static int await_packet(CLIENT *c, int fd){
+	if (coro_running()){
+		while (1){
+			//what is left to write would not go along with the connection in a handoff either
+			if (client_flush(c)){
+				return 0;
+			}
+			int ready = jio_readable(fd);
+			if (ready > 0){
+				return 0;
+			}
+			if (__atomic_load_n(&park.quiescing, __ATOMIC_ACQUIRE)){
+				//what was taken off the connection would not go along with it in a handoff,
+				//unless all there was to it were wakeups for data already read out of shared memory
+				return coro_hold_fd(fd) && (ready < 0 || jio_readable(fd) != 0) ? 0 : 1;
+			}
+			//cut short by server_quiesce() or a send that left something to write, or the connection is ready
+			int r = coro_wait_fd(fd, POLLIN);
+			if (r < 0 || (r > 0 && ready < 0)){
+				return 0;
+			}
+		}
+	}
+	pthread_once(&park.once, make_park_pipe);
+	struct pollfd fds[2] = {{fd, POLLIN, 0}, {park.pipe[0], POLLIN, 0}};
+	while (1){
+		int ready = jio_readable(fd);
+		if (ready > 0){
+			return 0;
+		}
+		while (poll(fds, park.pipe[0] < 0 ? 1 : 2, -1) < 0){
+			if (errno != EINTR){
+				return 0;
+			}
+		}
+		if (fds[1].revents & POLLIN){
+			return 1;
+		}
+		if (ready < 0){
+			return 0;
+		}
+	}
+}
+
+static void park_thread(void){
+	pthread_mutex_lock(&park.mutex);
+	park.parked += 1;
+	pthread_cond_broadcast(&park.cond);
+	while (park.quiescing){
+		if (coro_running()){
+			//server_resume() wakes it, even if it does so before this suspends
+			pthread_mutex_unlock(&park.mutex);
+			coro_suspend();
+			pthread_mutex_lock(&park.mutex);
+		}
+		else{
+			pthread_cond_wait(&park.cond, &park.mutex);
+		}
+	}
+	park.parked -= 1;
+	pthread_mutex_unlock(&park.mutex);
+}
+
+static void service_started(void){
 	struct sigaction sigpipe;
 	sigpipe.sa_handler = SIG_IGN;
 	sigpipe.sa_flags = 0;
 	sigemptyset(&sigpipe.sa_mask);
 	sigaction(SIGPIPE, &sigpipe, NULL);
+	pthread_mutex_lock(&park.mutex);
+	park.active += 1;
+	pthread_mutex_unlock(&park.mutex);
+}
+
+/*
+ * Park every service thread.
+ *
+ * @param timeout_ms  How long to wait for the threads to park.
+ * @return 0 if every service thread is parked, otherwise -1.
+ */
+int server_quiesce(int timeout_ms){
+	pthread_once(&park.once, make_park_pipe);
+	if (park.pipe[1] < 0){
+		return -1;
+	}
+	pthread_mutex_lock(&park.mutex);
+	__atomic_store_n(&park.quiescing, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&park.mutex);
+	char b = 0;
+	if (write(park.pipe[1], &b, 1) != 1){
+		server_resume();
+		return -1;
+	}
+	coro_wake_all();
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L){
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	int ret = 0;
+	pthread_mutex_lock(&park.mutex);
+	while (park.parked < park.active){
+		if (pthread_cond_timedwait(&park.cond, &park.mutex, &deadline) == ETIMEDOUT){
+			ret = park.parked < park.active ? -1 : 0;
+			break;
+		}
+	}
+	debug("%ld: %d of %d service threads parked", pthread_self(), park.parked, park.active);
+	pthread_mutex_unlock(&park.mutex);
+	if (ret){
+		server_resume();
+	}
+	return ret;
+}
+
+/*
+ * Let the service threads parked by server_quiesce() carry on.
+ */
+void server_resume(void){
+	char b;
+	pthread_mutex_lock(&park.mutex);
+	while (read(park.pipe[0], &b, 1) < 0 && errno == EINTR){
+	}
+	__atomic_store_n(&park.quiescing, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&park.cond);
+	pthread_mutex_unlock(&park.mutex);
+	coro_wake_all();
+}
+
+static void serve(CLIENT *c, PLAYER *player);
+
+void *jeux_client_service(void *arg){
+	int fd = *(int *)arg;
+   	free(arg);
+   	if (!coro_running()){
+   		pthread_detach(pthread_self());
+   	}
+   	service_started();
    	CLIENT *c = creg_register(client_registry,fd);
-   	JEUX_PACKET_HEADER *hdr =  calloc(1, sizeof(JEUX_PACKET_HEADER));
-    void *payload = NULL;
-    PLAYER *player = NULL;
-    while (1) {
-    	if (proto_recv_packet(fd, hdr, &payload) == 0){
-	    	if (hdr -> type == JEUX_LOGIN_PKT){
-	    		if (payload == NULL){
-	    			client_send_nack(c);
-	    		}
-	    		char* username = (char*) payload;
-	    		debug("%ld: name %s", pthread_self(), username);
-	    		player = preg_register(player_registry, username);
-				if (player == NULL){
-					fprintf(stderr, "registering player error in jeux_client");
-					client_send_nack(c);
+   	if (c == NULL){
+   		jio_close(fd);
+		pthread_mutex_lock(&park.mutex);
+		park.active -= 1;
+		pthread_cond_broadcast(&park.cond);
+		pthread_mutex_unlock(&park.mutex);
+   		return NULL;
+   	}
+   	serve(c, NULL);
+   	return NULL;
+}
+
+/*
+ * Thread function for a thread that takes over the service of a client
+ * whose connection was handed over by another server process.
+ *
+ * @param arg  The registered CLIENT, which may already be logged in.
+ * @return  NULL
+ */
+void *jeux_client_resume(void *arg){
+	CLIENT *c = arg;
+   	if (!coro_running()){
+   		pthread_detach(pthread_self());
+   	}
+   	service_started();
+	PLAYER *player = client_get_player(c);
+	if (player != NULL){
+		player_ref(player, "resumed session");
+	}
+	serve(c, player);
+	return NULL;
+}
+
+/*
+ * Whether a request is meaningless without a payload.
+ */
+static int needs_payload(uint8_t type){
+	return type == JEUX_LOGIN_PKT || type == JEUX_INVITE_PKT || type == JEUX_MOVE_PKT;
+}
+
+/*
+ * Carry out one request from a client, sending it the response.
+ *
+ * @param c  The client.
+ * @param player  The reference that the service loop holds to the PLAYER
+ * the client is logged in as, which a LOGIN request sets.
+ * @param signedIN  Whether the client is logged in, which a LOGIN request
+ * sets.
+ * @param hdr  The header of the request, which may be overwritten.
+ * @param payloadp  The request's payload, in malloc'd storage, which may
+ * be replaced by a reallocated copy.
+ */
+static void dispatch(CLIENT *c, PLAYER **player, int *signedIN, JEUX_PACKET_HEADER *hdr, void **payloadp){
+	void *payload = *payloadp;
+	//on its own or in a BATCH, a request may come without the payload it needs
+	if (payload == NULL && needs_payload(hdr -> type)){
+		client_send_nack(c);
+		return;
+	}
+	if (hdr -> type == JEUX_PING_PKT){
+		hdr -> type = JEUX_PONG_PKT;
+		hdr -> id = 0;
+		hdr -> role = 0;
+		hdr -> size = 0;
+		client_send_packet(c, hdr, NULL);
+	}
+	else if (hdr -> type == JEUX_PONG_PKT){
+		client_note_pong(c, hdr);
+	}
+	else if (hdr -> type == JEUX_LOGIN_PKT){
+		char* username = (char*) payload;
+		debug("%ld: name %s", pthread_self(), username);
+		*player = preg_register(player_registry, username);
+			if (*player == NULL){
+				fprintf(stderr, "registering player error in jeux_client");
+				client_send_nack(c);
+			}
+			if (client_login(c, *player)){
+				client_send_nack(c);
+			}
+			else{
+				*signedIN = 1;
+				//a capability offer may follow the username, after a null character
+				size_t namelen = strlen(username) + 1;
+				if (namelen < ntohs(hdr -> size)){
+					int version;
+					unsigned caps = proto_parse_caps(username + namelen, &version) & SERVER_CAPS;
+					client_set_caps(c, caps);
+					if (caps & JEUX_CAP_BINARY_BOARD){
+						client_set_board_encoding(c, GAME_ENC_DELTA);
+					}
+					char granted[JEUX_CAP_MAX_LIST];
+					client_send_ack(c, granted, proto_format_caps(caps, granted));
+				}
+				else{
+					client_send_ack(c, NULL, 0);
+				}
+			}
+	}
+	else if (*signedIN){
+		if (hdr -> type == JEUX_USERS_PKT){
+			send_users(c);
+		}
+		else if (hdr -> type == JEUX_USERS_PAGE_PKT){
+			send_users_page(c, (char *)payload);
+		}
+		else if (hdr -> type == JEUX_HISTORY_PKT){
+			send_history(c, (char *)payload);
+		}
+		else if (hdr -> type == JEUX_RATING_HISTORY_PKT){
+			send_rating_history(c, (char *)payload);
+		}
+		else if (hdr -> type == JEUX_WATCH_PKT){
+			if (spec_watch(c, (char *)payload) == -1){
+				client_send_nack(c);
+			}
+		}
+		else if (hdr -> type == JEUX_UNWATCH_PKT){
+			if (spec_unwatch(c, hdr -> id)){
+				client_send_nack(c);
+			}
+			else{
+				client_send_ack(c, NULL, 0);
+			}
+		}
+		else if (hdr -> type == JEUX_BOARD_FORMAT_PKT){
+			if (client_set_board_encoding(c, hdr -> role)){
+				client_send_nack(c);
+			}
+			else{
+				client_send_ack(c, NULL, 0);
+			}
+		}
+		else if (hdr -> type == JEUX_INVITE_PKT){
+			int sRole;
+			if (hdr -> role == 1){
+				sRole = 2;
+			}
+			else{
+				sRole = 1;
+			}
+			uint16_t datasize  = ntohs(hdr->size);
+			char* username = (char*) payload;
+			username[datasize] = '\0';
+			//optional fields may follow the username: time to live, then time control
+			CLIENT_INVITE_OPTS opts = {client_invitation_ttl_ms, 0, 0};
+			char *opt = strchr(username, '\t');
+			if (opt != NULL){
+				*opt++ = '\0';
+				char *ttlstr = strsep(&opt, "\t");
+				if (ttlstr[0] != '\0'){
+					opts.ttl_ms = strtoull(ttlstr, NULL, 10) * 1000;
+				}
+				if (opt != NULL){
+					char *inc = NULL;
+					opts.clock_ms = strtoull(opt, &inc, 10);
+					if (*inc == '+'){
+						opts.increment_ms = strtoull(inc + 1, NULL, 10);
+					}
 				}
-				if (client_login(c, player)){
+			}
+			CLIENT *targetC = creg_lookup(client_registry,username);
+			if (targetC == NULL){
+				debug("%ld: fail invite", pthread_self());
+				client_send_nack(c);
+			}
+			else{
+				debug("%ld: targetfound", pthread_self());
+				int id = client_make_invitation_opts(c, targetC, sRole, hdr -> role, &opts);
+				if (id == -1){
 					client_send_nack(c);
 				}
 				else{
-					signedIN = 1;
+					hdr -> type = JEUX_ACK_PKT;
+					hdr -> id = id;
+						hdr -> size = 0;
+						client_send_packet(c, hdr, NULL);
+				}
+
+			}
+		}
+		else if (hdr -> type == JEUX_REVOKE_PKT){
+			if (client_revoke_invitation(c, hdr -> id)){
+				client_send_nack(c);
+			}
+			else{
 					client_send_ack(c, NULL, 0);
+			}
+		}
+		else if (hdr -> type == JEUX_ACCEPT_PKT){
+			char * gamestate = NULL;
+			if (client_accept_invitation(c, hdr->id, &gamestate)){
+				client_send_nack(c);
+			}
+			else{
+				if (gamestate == NULL){
+					debug("%ld: sending ack game state NULL", pthread_self());
+					client_send_ack(c, NULL, 0);
+
 				}
-	    	}
-	    	else if (signedIN){
-	    		if (hdr -> type == JEUX_USERS_PKT){
-	    			PLAYER ** players = creg_all_players(client_registry);
-	    			int total_len = 0;
-				    for (int i = 0; players[i] != NULL; i++) {
-				        total_len += strlen(player_get_name(players[i]));
-				        total_len += strlen("\t");
-				        int rating = player_get_rating(players[i]);
-						char rating_str[15];
-						snprintf(rating_str, sizeof(rating_str), "%d", rating);
-				        total_len += strlen(rating_str);
-				        total_len += strlen("\n");
-				    }
-
-				    // Allocate memory for the concatenated username string
-				    char *usernames = calloc(total_len + 1, sizeof(char));
-				    if (usernames == NULL) {
-				        client_send_nack(c);
-				    }
-				    for (int i = 0; players[i] != NULL; i++) {
-					    strcat(usernames, player_get_name(players[i]));
-					    strcat(usernames, "\t");
-					    int rating = player_get_rating(players[i]);
-					    char rating_str[15];
-					    snprintf(rating_str, sizeof(rating_str), "%d", rating);
-					    strcat(usernames, rating_str);
-					    strcat(usernames, "\n");
+				else{
+					debug("%ld: sending ack game state", pthread_self());
+					client_send_ack(c, gamestate,
+						game_encoding_size(game_full_encoding(client_get_board_encoding(c))));
+					free(gamestate);
+				}
+			}
+		}
+		else if (hdr -> type == JEUX_DECLINE_PKT){
+			if (client_decline_invitation(c, hdr -> id)){
+				client_send_nack(c);
+			}
+			else{
+					client_send_ack(c, NULL, 0);
+			}
+		}
+		else if (hdr -> type == JEUX_MOVE_PKT){
+			debug("%ld: got moved %s", pthread_self(), (char *)payload);
+			uint16_t datasize  = ntohs(hdr->size);
+			char *payloadstr = realloc(payload, datasize + 1);
+			payloadstr[datasize] = '\0';
+			payload = payloadstr;
+			if (client_make_move(c, hdr -> id,payloadstr)){
+				client_send_nack(c);
+			}
 
-					}
-					client_send_ack(c, usernames, total_len);
-
-	    		}
-	    		else if (hdr -> type == JEUX_INVITE_PKT){
-	    			int sRole;
-	    			if (hdr -> role == 1){
-	    				sRole = 2;
-	    			}
-	    			else{
-	    				sRole = 1;
-	    			}
-	    			uint16_t datasize  = ntohs(hdr->size);
-		    		char* username = (char*) payload;
-		    		username[datasize] = '\0';
-		    		CLIENT *targetC = creg_lookup(client_registry,username);
-		    		if (targetC == NULL){
-		    			debug("%ld: fail invite", pthread_self());
-		    			client_send_nack(c);
-		    		}
-		    		else{
-		    			debug("%ld: targetfound", pthread_self());
-		    			int id = client_make_invitation(c, targetC, sRole, hdr -> role);
-		    			if (id == -1){
-		    				client_send_nack(c);
-		    			}
-		    			else{
-		    				hdr -> type = JEUX_ACK_PKT;
-		    				hdr -> id = id;
-							hdr -> size = 0;
-							client_send_packet(c, hdr, NULL);
-		    			}
-
-		    		}
-		    	}
-		    	else if (hdr -> type == JEUX_REVOKE_PKT){
-		    		if (client_revoke_invitation(c, hdr -> id)){
-		    			client_send_nack(c);
-		    		}
-		    		else{
-						client_send_ack(c, NULL, 0);
-		    		}
-		    	}
-		    	else if (hdr -> type == JEUX_ACCEPT_PKT){
-		    		char * gamestate = NULL;
-		    		if (client_accept_invitation(c, hdr->id, &gamestate)){
-		    			client_send_nack(c);
-		    		}
-		    		else{
-		    			if (gamestate == NULL){
-		    				debug("%ld: sending ack game state NULL", pthread_self());
-		    				client_send_ack(c, NULL, 0);
-
-		    			}
-		    			else{
-		    				debug("%ld: sending ack game state %s", pthread_self(), gamestate);
-		    				client_send_ack(c, gamestate, 18);
-		    			}
-		    		}
-		    	}
-		    	else if (hdr -> type == JEUX_DECLINE_PKT){
-		    		if (client_decline_invitation(c, hdr -> id)){
-		    			client_send_nack(c);
-		    		}
-		    		else{
-						client_send_ack(c, NULL, 0);
-		    		}
-		    	}
-		    	else if (hdr -> type == JEUX_MOVE_PKT){
-		    		debug("%ld: got moved %s", pthread_self(), (char *)payload);
-		    		uint16_t datasize  = ntohs(hdr->size);
-	    			char *payloadstr = realloc(payload, datasize + 1);
-	    			payloadstr[datasize] = '\0';
-	    			payload = payloadstr;
-		    		if (client_make_move(c, hdr -> id,payloadstr)){
-		    			client_send_nack(c);
-		    		}
-
-		    	}
-		    	else if (hdr -> type == JEUX_RESIGN_PKT){
-		    		if (client_resign_game(c, hdr -> id)){
-		    			client_send_nack(c);
-		    		}
-		    		else{
-		    			client_send_ack(c, NULL, 0);
-		    		}
-		    	}
-	    		else{
-	    			client_send_nack(c);
-	    		}
+		}
+		else if (hdr -> type == JEUX_RESIGN_PKT){
+			if (client_resign_game(c, hdr -> id)){
+				client_send_nack(c);
+			}
+			else{
+				client_send_ack(c, NULL, 0);
+			}
+		}
+		else{
+			client_send_nack(c);
+		}
+	}
+	else{
+		client_send_nack(c);
+	}
+	*payloadp = payload;
+}
+
+/*
+ * Carry out the requests of a BATCH packet in order, collecting their
+ * responses into a single ACK, so that the whole batch takes one read and
+ * one write however many requests it holds.
+ *
+ * @param c  The client.
+ * @param player  As for dispatch().
+ * @param signedIN  As for dispatch().
+ * @param hdr  The header of the BATCH packet.
+ * @param payload  Its payload.
+ */
+static void dispatch_batch(CLIENT *c, PLAYER **player, int *signedIN, JEUX_PACKET_HEADER *hdr, void *payload){
+	char *items = payload;
+	size_t size = ntohs(hdr -> size);
+	JEUX_PACKET_HEADER item;
+	//the batch is checked before any of it is done
+	int n = 0;
+	size_t off = 0;
+	while (off < size){
+		if (size - off < sizeof(item)){
+			n = -1;
+			break;
+		}
+		memcpy(&item, items + off, sizeof(item));
+		off += sizeof(item);
+		if ((item.type & JEUX_SEQ_FLAG) || item.type == JEUX_BATCH_PKT || size - off < ntohs(item.size)){
+			n = -1;
+			break;
+		}
+		off += ntohs(item.size);
+		n++;
+	}
+	CLIENT_BATCH batch = {0};
+	if (n <= 0 || n > JEUX_BATCH_MAX_ITEMS || (batch.buf = malloc(UINT16_MAX)) == NULL){
+		client_send_nack(c);
+		return;
+	}
+	batch.size = UINT16_MAX;
+	client_set_batch(c, &batch);
+	off = 0;
+	for (int i = 0; i < n; i++){
+		memcpy(&item, items + off, sizeof(item));
+		off += sizeof(item);
+		uint16_t datasize = ntohs(item.size);
+		void *data = NULL;
+		//each request gets a payload of its own, as if it had been received alone
+		if (datasize > 0 && (data = calloc(datasize + 1, sizeof(char))) != NULL){
+			memcpy(data, items + off, datasize);
+		}
+		off += datasize;
+		batch.reserve = (n - i - 1) * sizeof(JEUX_PACKET_HEADER);
+		int replies = batch.replies;
+		if (datasize > 0 && data == NULL){
+			client_send_nack(c);
+		}
+		else{
+			dispatch(c, player, signedIN, &item, &data);
+		}
+		if (batch.replies == replies){
+			client_send_ack(c, NULL, 0);
+		}
+		free(data);
+	}
+	client_set_batch(c, NULL);
+	JEUX_PACKET_HEADER ack = {0};
+	ack.type = JEUX_ACK_PKT;
+	ack.id = n;
+	ack.role = batch.truncated;
+	ack.size = htons(batch.len);
+	client_send_packet(c, &ack, batch.len ? batch.buf : NULL);
+	free(batch.buf);
+}
+
+/*
+ * The service loop proper, for a registered CLIENT.  The player is the
+ * reference that the loop holds to the PLAYER the client is logged in
+ * as, if it is.
+ */
+static void serve(CLIENT *c, PLAYER *player){
+	int fd = client_get_fd(c);
+	int signedIN = player != NULL;
+	//what a request sends each client is written at once, so there is nothing to wait for
+	int one = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) && errno != EOPNOTSUPP){
+		debug("%ld: cannot disable Nagle on %d: %s", pthread_self(), fd, strerror(errno));
+	}
+   	client_start_heartbeat(c);
+   	client_set_service(c, coro_self());
+   	JEUX_PACKET_HEADER *hdr =  calloc(1, sizeof(JEUX_PACKET_HEADER));
+    void *payload = NULL;
+    uint32_t seq;
+    int tagged;
+    while (1) {
+    	if (await_packet(c, fd)){
+    		park_thread();
+    		continue;
+    	}
+    	if (proto_recv_packet_seq(fd, hdr, &seq, &tagged, &payload) == 0){
+    		//whatever the request reaches stays allocated until it is done
+    		ebr_enter();
+	    	client_note_activity(c);
+	    	client_set_request_seq(c, tagged ? &seq : NULL);
+	    	client_hold_sends();
+	    	if (hdr -> type == JEUX_BATCH_PKT){
+	    		dispatch_batch(c, &player, &signedIN, hdr, payload);
 	    	}
 	    	else{
-	    		client_send_nack(c);
+	    		dispatch(c, &player, &signedIN, hdr, &payload);
 	    	}
+	    	client_release_sends();
+	    	ebr_exit();
 	    	if (payload != NULL){
 	    		free(payload);
 	    	}
 	    }
 	    else{
+	    	client_stop_heartbeat(c);
+	    	ebr_enter();
+	    	client_hold_sends();
 	    	client_logout(c);
+	    	client_release_sends();
+	    	ebr_exit();
 	    	if (player != NULL){
 				player_unref(player, "logging out player");
 	    	}
+	    	client_set_service(c, NULL);
 			creg_unregister(client_registry, c);
 			free(hdr);
-			pthread_exit(NULL);
+			pthread_mutex_lock(&park.mutex);
+			park.active -= 1;
+			pthread_cond_broadcast(&park.cond);
+			pthread_mutex_unlock(&park.mutex);
+			return;
 
 	    }
 	}
@@ -0,0 +1,596 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "client_registry.h"
+#include "client.h"
+#include "client_ext.h"
+#include "player.h"
+#include "game.h"
+#include "game_ext.h"
+#include "spectator.h"
+
+#define SPEC_BUCKETS 1024
+
+/*
+ * A notification, encoded once and shared by every spectator queue
+ * that it is placed on.
+ */
+typedef struct spec_msg {
+	int ref;
+	uint32_t gameid;
+	uint8_t type;
+	uint8_t role;
+	int hasState;
+	struct spec_msg *next;
+	char state[GAME_ENC_COUNT][GAME_ENC_MAX_SIZE];
+} SPEC_MSG;
+
+struct spec_game;
+
+/*
+ * One client watching one game.
+ */
+typedef struct watcher {
+	CLIENT *client;
+	struct spec_game *game;
+	int slot;
+	int index;                      //position in the game's watcher array
+	int active;                     //ACK has been sent, notifications may follow
+	int dead;                       //client has gone, free when off the dirty list
+	int dirty;
+	int resync;                     //states were dropped, next one must be full
+	JEUX_PACKET_HEADER sending;     //the packet made of the head of the queue
+	char *sendingData;
+	size_t sent;                    //how much of it has gone out, 0 if none
+	int sendingFull;                //it carries a full state
+	struct watcher *nextDirty;
+	int head;
+	int count;
+	SPEC_MSG *queue[SPEC_QUEUE_DEPTH];
+} WATCHER;
+
+typedef struct spec_game {
+	uint32_t id;
+	GAME *game;
+	char *first;
+	char *second;
+	int ended;
+	int watchersAmount;
+	int capacity;
+	WATCHER **watchers;
+	struct spec_game *next;
+} SPEC_GAME;
+
+struct spec_session {
+	WATCHER *watches[SPEC_MAX_WATCHES];
+};
+
+static struct {
+	int running;
+	pthread_t tid;
+	pthread_mutex_t queueMutex;     //protects the publish queue only
+	pthread_cond_t queueCond;
+	SPEC_MSG *pending;              //published messages, newest first
+	pthread_mutex_t mutex;          //protects everything else
+	SPEC_GAME *games[SPEC_BUCKETS];
+	WATCHER *dirty;                 //watchers with queued notifications
+} spec;
+
+static void msg_unref(SPEC_MSG *m){
+	if (__atomic_sub_fetch(&m -> ref, 1, __ATOMIC_ACQ_REL) == 0){
+		free(m);
+	}
+}
+
+/*
+ * Find a game in the directory, or NULL.  The mutex must be held.
+ */
+static SPEC_GAME *find_game(uint32_t id){
+	for (SPEC_GAME *g = spec.games[id % SPEC_BUCKETS]; g != NULL; g = g -> next){
+		if (g -> id == id){
+			return g;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the most recent game in progress for a player, or NULL.
+ * The mutex must be held.
+ */
+static SPEC_GAME *find_game_by_player(char *name){
+	SPEC_GAME *best = NULL;
+	for (int i = 0; i < SPEC_BUCKETS; i++){
+		for (SPEC_GAME *g = spec.games[i]; g != NULL; g = g -> next){
+			if (!g -> ended && (best == NULL || g -> id > best -> id) &&
+				(strcmp(g -> first, name) == 0 || strcmp(g -> second, name) == 0)){
+				best = g;
+			}
+		}
+	}
+	return best;
+}
+
+static void unlink_game(SPEC_GAME *sg){
+	SPEC_GAME **gp = &spec.games[sg -> id % SPEC_BUCKETS];
+	while (*gp != NULL){
+		if (*gp == sg){
+			*gp = sg -> next;
+			return;
+		}
+		gp = &(*gp) -> next;
+	}
+}
+
+static void free_game(SPEC_GAME *sg){
+	debug("%ld: spectator directory dropping game %u", pthread_self(), sg -> id);
+	game_unref(sg -> game, "game removed from spectator directory");
+	free(sg -> first);
+	free(sg -> second);
+	free(sg -> watchers);
+	free(sg);
+}
+
+/*
+ * Detach a watcher from its game and its client.  The watcher itself
+ * is freed unless it is on the dirty list, in which case the fan-out
+ * thread frees it when it next gets to it.  The mutex must be held.
+ */
+static void drop_watcher(WATCHER *w){
+	SPEC_GAME *sg = w -> game;
+	game_add_watchers(sg -> game, -1);
+	sg -> watchersAmount -= 1;
+	sg -> watchers[w -> index] = sg -> watchers[sg -> watchersAmount];
+	sg -> watchers[w -> index] -> index = w -> index;
+	if (sg -> ended && sg -> watchersAmount == 0){
+		free_game(sg);
+	}
+	struct spec_session *s = client_get_spec_session(w -> client);
+	if (s != NULL){
+		s -> watches[w -> slot] = NULL;
+	}
+	if (w -> sent > 0){
+		//the client still gets the rest, or its stream would be broken
+		client_finish_packet(w -> client, &w -> sending, w -> sendingData, w -> sent);
+	}
+	while (w -> count > 0){
+		msg_unref(w -> queue[w -> head]);
+		w -> head = (w -> head + 1) % SPEC_QUEUE_DEPTH;
+		w -> count -= 1;
+	}
+	client_unref(w -> client, "spectator stopped watching");
+	w -> client = NULL;
+	w -> game = NULL;
+	w -> dead = 1;
+	if (!w -> dirty){
+		free(w);
+	}
+}
+
+/*
+ * Queue a message for a watcher, dropping the oldest queued state
+ * if the spectator has fallen too far behind.  A message that is part
+ * sent is kept, and the one after it dropped.  The mutex must be held.
+ */
+static void enqueue(WATCHER *w, SPEC_MSG *m){
+	if (w -> count == SPEC_QUEUE_DEPTH){
+		int drop = w -> sent > 0 ? (w -> head + 1) % SPEC_QUEUE_DEPTH : w -> head;
+		msg_unref(w -> queue[drop]);
+		w -> queue[drop] = w -> queue[w -> head];
+		w -> head = (w -> head + 1) % SPEC_QUEUE_DEPTH;
+		w -> count -= 1;
+		w -> resync = 1;
+		w -> sendingFull = 0;
+	}
+	__atomic_add_fetch(&m -> ref, 1, __ATOMIC_RELAXED);
+	w -> queue[(w -> head + w -> count) % SPEC_QUEUE_DEPTH] = m;
+	w -> count += 1;
+	if (!w -> dirty){
+		w -> dirty = 1;
+		w -> nextDirty = spec.dirty;
+		spec.dirty = w;
+	}
+}
+
+/*
+ * Hand a published message to every spectator of its game.
+ * The mutex must be held.
+ */
+static void deliver(SPEC_MSG *m){
+	SPEC_GAME *sg = find_game(m -> gameid);
+	if (sg == NULL){
+		return;
+	}
+	for (int i = 0; i < sg -> watchersAmount; i++){
+		enqueue(sg -> watchers[i], m);
+	}
+	if (m -> type == JEUX_ENDED_PKT){
+		sg -> ended = 1;
+		unlink_game(sg);
+		if (sg -> watchersAmount == 0){
+			free_game(sg);
+		}
+	}
+}
+
+/*
+ * Send as much of a watcher's queue as can be sent without blocking.
+ * What the connection takes of a packet is remembered, and the rest is
+ * sent on a later pass.  Returns nonzero if the watcher still has
+ * notifications queued.  The mutex must be held.
+ */
+static int flush(WATCHER *w){
+	if (!w -> active){
+		return 1;
+	}
+	while (w -> count > 0){
+		SPEC_MSG *m = w -> queue[w -> head];
+		if (w -> sent == 0){
+			GAME_ENCODING enc = client_get_board_encoding(w -> client);
+			if (w -> resync){
+				enc = game_full_encoding(enc);
+			}
+			memset(&w -> sending, 0, sizeof(w -> sending));
+			w -> sending.type = m -> type;
+			w -> sending.id = JEUX_WATCH_ID_BASE + w -> slot;
+			w -> sending.role = m -> role;
+			w -> sending.size = htons(m -> hasState ? game_encoding_size(enc) : 0);
+			w -> sendingData = m -> hasState ? m -> state[enc] : NULL;
+			w -> sendingFull = w -> resync;
+		}
+		int ret = client_try_send_packet(w -> client, &w -> sending, w -> sendingData, &w -> sent);
+		if (ret == 0){
+			return 1;
+		}
+		w -> sent = 0;
+		if (ret < 0){
+			debug("%ld: dropping spectator %p", pthread_self(), w -> client);
+			drop_watcher(w);
+			return 0;
+		}
+		w -> head = (w -> head + 1) % SPEC_QUEUE_DEPTH;
+		w -> count -= 1;
+		//states dropped while it was going out are still owed a full one
+		if (m -> hasState && w -> sendingFull){
+			w -> resync = 0;
+		}
+		int ended = m -> type == JEUX_ENDED_PKT;
+		msg_unref(m);
+		if (ended){
+			drop_watcher(w);
+			return 0;
+		}
+	}
+	return 0;
+}
+
+static void *fanout_thread(void *arg){
+	//whether spec.dirty was left non-empty, as seen under the mutex that guards it
+	int lagging = 0;
+	pthread_mutex_lock(&spec.queueMutex);
+	while (spec.running){
+		if (spec.pending == NULL){
+			if (!lagging){
+				pthread_cond_wait(&spec.queueCond, &spec.queueMutex);
+			}
+			else{
+				//some spectators could not keep up, try them again shortly
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_nsec += 10 * 1000000;
+				if (ts.tv_nsec >= 1000000000){
+					ts.tv_sec += 1;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&spec.queueCond, &spec.queueMutex, &ts);
+			}
+		}
+		SPEC_MSG *list = spec.pending;
+		spec.pending = NULL;
+		pthread_mutex_unlock(&spec.queueMutex);
+
+		//the queue is newest first, reverse it to deliver in order
+		SPEC_MSG *fifo = NULL;
+		while (list != NULL){
+			SPEC_MSG *n = list -> next;
+			list -> next = fifo;
+			fifo = list;
+			list = n;
+		}
+		pthread_mutex_lock(&spec.mutex);
+		while (fifo != NULL){
+			SPEC_MSG *n = fifo -> next;
+			deliver(fifo);
+			msg_unref(fifo);
+			fifo = n;
+		}
+		WATCHER **wp = &spec.dirty;
+		while (*wp != NULL){
+			WATCHER *w = *wp;
+			if (!w -> dead && flush(w)){
+				wp = &w -> nextDirty;
+			}
+			else{
+				*wp = w -> nextDirty;
+				w -> dirty = 0;
+				if (w -> dead){
+					free(w);
+				}
+			}
+		}
+		lagging = spec.dirty != NULL;
+		pthread_mutex_unlock(&spec.mutex);
+		pthread_mutex_lock(&spec.queueMutex);
+	}
+	pthread_mutex_unlock(&spec.queueMutex);
+	return NULL;
+}
+
+/*
+ * Start the spectator module and its fan-out thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int spec_init(void){
+	memset(&spec, 0, sizeof(spec));
+	pthread_mutex_init(&spec.queueMutex, NULL);
+	pthread_cond_init(&spec.queueCond, NULL);
+	pthread_mutex_init(&spec.mutex, NULL);
+	spec.running = 1;
+	if (pthread_create(&spec.tid, NULL, fanout_thread, NULL)){
+		spec.running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop the fan-out thread and free the spectator directory.
+ * This should not be called while there are registered clients.
+ */
+void spec_fini(void){
+	if (!spec.running){
+		return;
+	}
+	pthread_mutex_lock(&spec.queueMutex);
+	spec.running = 0;
+	pthread_cond_signal(&spec.queueCond);
+	pthread_mutex_unlock(&spec.queueMutex);
+	pthread_join(spec.tid, NULL);
+	while (spec.pending != NULL){
+		SPEC_MSG *n = spec.pending -> next;
+		msg_unref(spec.pending);
+		spec.pending = n;
+	}
+	for (int i = 0; i < SPEC_BUCKETS; i++){
+		while (spec.games[i] != NULL){
+			SPEC_GAME *sg = spec.games[i];
+			spec.games[i] = sg -> next;
+			free_game(sg);
+		}
+	}
+	pthread_mutex_destroy(&spec.mutex);
+	pthread_mutex_destroy(&spec.queueMutex);
+	pthread_cond_destroy(&spec.queueCond);
+}
+
+/*
+ * Add a newly started GAME to the directory of games that can be watched.
+ *
+ * @param game  The GAME that has started.
+ * @param first  The PLAYER in the first player role.
+ * @param second  The PLAYER in the second player role.
+ * @return 0 if successful, otherwise -1.
+ */
+int spec_game_started(GAME *game, PLAYER *first, PLAYER *second){
+	if (!spec.running || game == NULL || first == NULL || second == NULL){
+		return -1;
+	}
+	SPEC_GAME *sg = calloc(1, sizeof(SPEC_GAME));
+	if (sg == NULL){
+		return -1;
+	}
+	sg -> id = game_get_id(game);
+	sg -> game = game_ref(game, "added to spectator directory");
+	sg -> first = strdup(player_get_name(first));
+	sg -> second = strdup(player_get_name(second));
+	pthread_mutex_lock(&spec.mutex);
+	sg -> next = spec.games[sg -> id % SPEC_BUCKETS];
+	spec.games[sg -> id % SPEC_BUCKETS] = sg;
+	pthread_mutex_unlock(&spec.mutex);
+	return 0;
+}
+
+/*
+ * Start watching a game.
+ *
+ * @param client  The CLIENT that wants to watch.
+ * @param what  '#' followed by the decimal ID of the game, or the username
+ * of a player whose most recent game is to be watched.
+ * @return the watch ID, if successful, otherwise -1.
+ */
+int spec_watch(CLIENT *client, char *what){
+	if (!spec.running || client == NULL || what == NULL || what[0] == '\0'){
+		return -1;
+	}
+	//a username may be all digits, so game IDs are marked
+	int numeric = what[0] == SPEC_GAME_ID_PREFIX && what[1] != '\0';
+	for (char *p = what + 1; numeric && *p != '\0'; p++){
+		if (!isdigit((unsigned char)*p)){
+			numeric = 0;
+		}
+	}
+	pthread_mutex_lock(&spec.mutex);
+	SPEC_GAME *sg = numeric ? find_game(strtoul(what + 1, NULL, 10)) : find_game_by_player(what);
+	if (sg == NULL || sg -> ended){
+		pthread_mutex_unlock(&spec.mutex);
+		return -1;
+	}
+	struct spec_session *s = client_get_spec_session(client);
+	if (s == NULL){
+		s = calloc(1, sizeof(struct spec_session));
+		if (s == NULL){
+			pthread_mutex_unlock(&spec.mutex);
+			return -1;
+		}
+		client_set_spec_session(client, s);
+	}
+	int slot = -1;
+	for (int i = 0; i < SPEC_MAX_WATCHES; i++){
+		if (s -> watches[i] == NULL){
+			slot = i;
+			break;
+		}
+		if (s -> watches[i] -> game == sg){
+			//already watching this game
+			pthread_mutex_unlock(&spec.mutex);
+			return -1;
+		}
+	}
+	if (slot == -1){
+		pthread_mutex_unlock(&spec.mutex);
+		return -1;
+	}
+	if (sg -> watchersAmount == sg -> capacity){
+		int cap = sg -> capacity ? sg -> capacity * 2 : 8;
+		WATCHER **ws = realloc(sg -> watchers, cap * sizeof(WATCHER *));
+		if (ws == NULL){
+			pthread_mutex_unlock(&spec.mutex);
+			return -1;
+		}
+		sg -> watchers = ws;
+		sg -> capacity = cap;
+	}
+	WATCHER *w = calloc(1, sizeof(WATCHER));
+	if (w == NULL){
+		pthread_mutex_unlock(&spec.mutex);
+		return -1;
+	}
+	w -> client = client_ref(client, "watching a game");
+	w -> game = sg;
+	w -> slot = slot;
+	w -> index = sg -> watchersAmount;
+	sg -> watchers[sg -> watchersAmount++] = w;
+	s -> watches[slot] = w;
+	//counted before the state is taken for the ACK, so no move made after that goes unpublished
+	game_add_watchers(sg -> game, 1);
+	char ack[12 + GAME_ENC_MAX_SIZE];
+	int len = sprintf(ack, "%u\n", sg -> id);
+	len += game_encode_state(sg -> game, game_full_encoding(client_get_board_encoding(client)),
+		ack + len, GAME_ENC_MAX_SIZE);
+	pthread_mutex_unlock(&spec.mutex);
+
+	//notifications are queued but not sent until the ACK has gone out
+	JEUX_PACKET_HEADER hdr = {0};
+	hdr.type = JEUX_ACK_PKT;
+	hdr.id = JEUX_WATCH_ID_BASE + slot;
+	hdr.size = htons(len);
+	client_send_packet(client, &hdr, ack);
+	pthread_mutex_lock(&spec.mutex);
+	if (!w -> dead){
+		w -> active = 1;
+	}
+	pthread_mutex_unlock(&spec.mutex);
+	pthread_mutex_lock(&spec.queueMutex);
+	pthread_cond_signal(&spec.queueCond);
+	pthread_mutex_unlock(&spec.queueMutex);
+	debug("%ld: %p watching as %d", pthread_self(), client, JEUX_WATCH_ID_BASE + slot);
+	return JEUX_WATCH_ID_BASE + slot;
+}
+
+/*
+ * Stop watching a game.
+ *
+ * @param client  The CLIENT that is watching.
+ * @param id  The watch ID that was assigned by spec_watch().
+ * @return 0 if successful, otherwise -1.
+ */
+int spec_unwatch(CLIENT *client, int id){
+	int slot = id - JEUX_WATCH_ID_BASE;
+	if (!spec.running || client == NULL || slot < 0 || slot >= SPEC_MAX_WATCHES){
+		return -1;
+	}
+	pthread_mutex_lock(&spec.mutex);
+	struct spec_session *s = client_get_spec_session(client);
+	if (s == NULL || s -> watches[slot] == NULL){
+		pthread_mutex_unlock(&spec.mutex);
+		return -1;
+	}
+	drop_watcher(s -> watches[slot]);
+	pthread_mutex_unlock(&spec.mutex);
+	return 0;
+}
+
+/*
+ * Stop all of a client's watches.
+ *
+ * @param client  The CLIENT that is going away.
+ */
+void spec_client_gone(CLIENT *client){
+	if (!spec.running || client == NULL){
+		return;
+	}
+	pthread_mutex_lock(&spec.mutex);
+	struct spec_session *s = client_get_spec_session(client);
+	if (s != NULL){
+		for (int i = 0; i < SPEC_MAX_WATCHES; i++){
+			if (s -> watches[i] != NULL){
+				drop_watcher(s -> watches[i]);
+			}
+		}
+		client_set_spec_session(client, NULL);
+		free(s);
+	}
+	pthread_mutex_unlock(&spec.mutex);
+}
+
+/*
+ * Publish a notification to the spectators of a game.  A move in a game
+ * that nobody is watching is not published at all, and the end of such a
+ * game only takes it out of the directory, so no states are encoded.
+ *
+ * @param game  The GAME the notification is about.
+ * @param type  The packet type, either JEUX_MOVED_PKT or JEUX_ENDED_PKT.
+ * @param role  The role field of the notification header.
+ */
+void spec_publish(GAME *game, JEUX_PACKET_TYPE type, GAME_ROLE role){
+	if (!spec.running || game == NULL){
+		return;
+	}
+	int hasState = type == JEUX_MOVED_PKT;
+	if (hasState && game_get_watchers(game) == 0){
+		return;
+	}
+	SPEC_MSG *m = malloc(hasState ? sizeof(SPEC_MSG) : offsetof(SPEC_MSG, state));
+	if (m == NULL){
+		return;
+	}
+	m -> ref = 1;
+	m -> gameid = game_get_id(game);
+	m -> type = type;
+	m -> role = role;
+	m -> hasState = hasState;
+	if (m -> hasState){
+		for (int enc = 0; enc < GAME_ENC_COUNT; enc++){
+			game_encode_state(game, enc, m -> state[enc], GAME_ENC_MAX_SIZE);
+		}
+	}
+	pthread_mutex_lock(&spec.queueMutex);
+	m -> next = spec.pending;
+	spec.pending = m;
+	pthread_cond_signal(&spec.queueCond);
+	pthread_mutex_unlock(&spec.queueMutex);
+}
@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "debug.h"
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static struct {
+	int running;
+	int stopping;
+	int held;                       //set while timer_hold() keeps callbacks from running
+	int inCallback;                 //set while a callback runs
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t idle;            //signalled when a callback returns
+	uint64_t current;               //last tick that has been processed
+	uint64_t wakeup;                //when the thread intends to wake up
+	long armed;                     //timers in the wheel
+	long levelCount[TIMER_WHEEL_LEVELS];
+	TIMER *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} wheel;
+
+uint64_t timer_now_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Link a timer into the slot that covers its deadline.
+ * The mutex must be held.
+ */
+static void enqueue(TIMER *t){
+	uint64_t expires = t -> expires;
+	if (expires <= wheel.current){
+		expires = wheel.current + 1;
+	}
+	uint64_t delta = expires - wheel.current;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))){
+		level++;
+	}
+	if (delta >= TIMER_MAX_DELAY){
+		//park it as far out as the top level reaches; it is placed again when that slot comes around
+		expires = wheel.current + TIMER_MAX_DELAY - 1;
+	}
+	TIMER **head = &wheel.slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+	t -> next = *head;
+	if (*head != NULL){
+		(*head) -> pprev = &t -> next;
+	}
+	*head = t;
+	t -> pprev = head;
+	t -> level = level;
+	wheel.levelCount[level] += 1;
+	wheel.armed += 1;
+}
+
+/*
+ * Unlink an armed timer.  The mutex must be held.
+ */
+static void unlink_timer(TIMER *t){
+	TIMER **pp = t -> pprev;
+	TIMER *n = t -> next;
+	*pp = n;
+	if (n != NULL){
+		n -> pprev = pp;
+	}
+	t -> next = NULL;
+	t -> pprev = NULL;
+	wheel.levelCount[t -> level] -= 1;
+	wheel.armed -= 1;
+}
+
+/*
+ * Move the timers of a slot down to the levels below.
+ * The mutex must be held.
+ */
+static void cascade(int level, int index){
+	TIMER *t = wheel.slots[level][index];
+	wheel.slots[level][index] = NULL;
+	while (t != NULL){
+		TIMER *n = t -> next;
+		wheel.levelCount[level] -= 1;
+		wheel.armed -= 1;
+		enqueue(t);
+		t = n;
+	}
+}
+
+/*
+ * Advance the wheel to a given time, running every timer that falls due.
+ * The mutex is held on entry and on return, but released while callbacks
+ * run.
+ */
+static void advance(uint64_t now){
+	while (wheel.current < now && !wheel.stopping && !wheel.held){
+		if (wheel.armed == 0){
+			wheel.current = now;
+			break;
+		}
+		uint64_t tick = wheel.current + 1;
+		if (wheel.levelCount[0] == 0 && (tick & SLOT_MASK) != 0){
+			//nothing can fall due before the lowest level wraps
+			uint64_t wrap = (wheel.current | SLOT_MASK) + 1;
+			if (wrap > now){
+				wheel.current = now;
+				break;
+			}
+			tick = wrap;
+		}
+		wheel.current = tick;
+		for (int level = 1; level < TIMER_WHEEL_LEVELS; level++){
+			if (((tick >> (TIMER_WHEEL_BITS * (level - 1))) & SLOT_MASK) != 0){
+				break;
+			}
+			cascade(level, (tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+		}
+		TIMER **head = &wheel.slots[0][tick & SLOT_MASK];
+		while (*head != NULL){
+			TIMER *t = *head;
+			unlink_timer(t);
+			void (*func)(void *) = t -> func;
+			void *arg = t -> arg;
+			wheel.inCallback = 1;
+			pthread_mutex_unlock(&wheel.mutex);
+			func(arg);
+			pthread_mutex_lock(&wheel.mutex);
+			wheel.inCallback = 0;
+			pthread_cond_broadcast(&wheel.idle);
+			if (wheel.held){
+				//what is left of this tick moves on to the next one, which runs once the hold is released
+				while (*head != NULL){
+					t = *head;
+					unlink_timer(t);
+					enqueue(t);
+				}
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * Work out when the thread next has to wake up.  The mutex must be held.
+ */
+static uint64_t next_wakeup(void){
+	if (wheel.armed == 0){
+		return UINT64_MAX;
+	}
+	uint64_t tick = wheel.current + 1;
+	if (wheel.levelCount[0] > 0){
+		do{
+			if (wheel.slots[0][tick & SLOT_MASK] != NULL){
+				return tick;
+			}
+			tick++;
+		} while ((tick & SLOT_MASK) != 0);
+	}
+	//the next wrap of the lowest level, when timers cascade down
+	return (wheel.current | SLOT_MASK) + 1;
+}
+
+static void *timer_thread(void *arg){
+	pthread_mutex_lock(&wheel.mutex);
+	while (!wheel.stopping){
+		advance(timer_now_ms());
+		if (wheel.stopping){
+			break;
+		}
+		wheel.wakeup = wheel.held ? UINT64_MAX : next_wakeup();
+		if (wheel.wakeup == UINT64_MAX){
+			pthread_cond_wait(&wheel.cond, &wheel.mutex);
+		}
+		else{
+			struct timespec ts;
+			ts.tv_sec = wheel.wakeup / 1000;
+			ts.tv_nsec = (wheel.wakeup % 1000) * 1000000;
+			pthread_cond_timedwait(&wheel.cond, &wheel.mutex, &ts);
+		}
+	}
+	pthread_mutex_unlock(&wheel.mutex);
+	return NULL;
+}
+
+/*
+ * Start the timer thread.
+ *
+ * @return 0 if successful, otherwise -1.
+ */
+int timer_init(void){
+	if (wheel.running){
+		return -1;
+	}
+	memset(wheel.slots, 0, sizeof(wheel.slots));
+	memset(wheel.levelCount, 0, sizeof(wheel.levelCount));
+	wheel.armed = 0;
+	wheel.stopping = 0;
+	wheel.held = 0;
+	wheel.inCallback = 0;
+	wheel.current = timer_now_ms();
+	wheel.wakeup = UINT64_MAX;
+	pthread_mutex_init(&wheel.mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wheel.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&wheel.idle, NULL);
+	if (pthread_create(&wheel.tid, NULL, timer_thread, NULL)){
+		return -1;
+	}
+	wheel.running = 1;
+	return 0;
+}
+
+/*
+ * Stop the timer thread.  Timers that are still armed never fire.
+ */
+void timer_fini(void){
+	if (!wheel.running){
+		return;
+	}
+	pthread_mutex_lock(&wheel.mutex);
+	wheel.stopping = 1;
+	pthread_cond_signal(&wheel.cond);
+	pthread_mutex_unlock(&wheel.mutex);
+	pthread_join(wheel.tid, NULL);
+	wheel.running = 0;
+}
+
+/*
+ * Initialize a TIMER before it is first armed.
+ *
+ * @param timer  The TIMER to be initialized.
+ * @param func  The function to be called when the timer expires.
+ * @param arg  The argument to be passed to the function.
+ */
+void timer_setup(TIMER *timer, void (*func)(void *), void *arg){
+	timer -> next = NULL;
+	timer -> pprev = NULL;
+	timer -> expires = 0;
+	timer -> level = 0;
+	timer -> func = func;
+	timer -> arg = arg;
+}
+
+/*
+ * Arm a TIMER to expire at an absolute time.
+ *
+ * @param timer  The TIMER to be armed.
+ * @param when_ms  The deadline, in timer_now_ms() time.
+ * @return 1 if the timer was already armed, 0 if it was not.
+ */
+int timer_arm_at(TIMER *timer, uint64_t when_ms){
+	if (timer == NULL || !wheel.running){
+		return -1;
+	}
+	pthread_mutex_lock(&wheel.mutex);
+	int was = timer -> pprev != NULL;
+	if (was){
+		unlink_timer(timer);
+	}
+	timer -> expires = when_ms;
+	enqueue(timer);
+	if (when_ms < wheel.wakeup){
+		pthread_cond_signal(&wheel.cond);
+	}
+	pthread_mutex_unlock(&wheel.mutex);
+	return was;
+}
+
+/*
+ * Arm a TIMER to expire after a delay.
+ *
+ * @param timer  The TIMER to be armed.
+ * @param delay_ms  The delay, in milliseconds.
+ * @return 1 if the timer was already armed, 0 if it was not.
+ */
+int timer_arm(TIMER *timer, uint64_t delay_ms){
+	return timer_arm_at(timer, timer_now_ms() + delay_ms);
+}
+
+/*
+ * Disarm a TIMER.
+ *
+ * @param timer  The TIMER to be disarmed.
+ * @return 1 if the timer was armed and will now not fire, otherwise 0.
+ */
+int timer_cancel(TIMER *timer){
+	if (timer == NULL || !wheel.running){
+		return 0;
+	}
+	pthread_mutex_lock(&wheel.mutex);
+	int was = timer -> pprev != NULL;
+	if (was){
+		unlink_timer(timer);
+	}
+	pthread_mutex_unlock(&wheel.mutex);
+	return was;
+}
+
+/*
+ * Keep timers from firing until timer_release() is called.
+ */
+void timer_hold(void){
+	if (!wheel.running){
+		return;
+	}
+	pthread_mutex_lock(&wheel.mutex);
+	wheel.held = 1;
+	while (wheel.inCallback){
+		pthread_cond_wait(&wheel.idle, &wheel.mutex);
+	}
+	pthread_mutex_unlock(&wheel.mutex);
+}
+
+/*
+ * Let timers fire again after timer_hold().
+ */
+void timer_release(void){
+	if (!wheel.running){
+		return;
+	}
+	pthread_mutex_lock(&wheel.mutex);
+	wheel.held = 0;
+	pthread_cond_signal(&wheel.cond);
+	pthread_mutex_unlock(&wheel.mutex);
+}
+
+/*
+ * Get the deadline of a TIMER.
+ *
+ * @param timer  The TIMER to be queried.
+ * @return the deadline, or 0 if the timer is not armed.
+ */
+uint64_t timer_deadline(TIMER *timer){
+	if (timer == NULL || !wheel.running){
+		return 0;
+	}
+	pthread_mutex_lock(&wheel.mutex);
+	uint64_t when = timer -> pprev != NULL ? timer -> expires : 0;
+	pthread_mutex_unlock(&wheel.mutex);
+	return when;
+}
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags){
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n){
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(URING *ring, unsigned entries){
+	memset(ring, 0, sizeof(URING));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring -> fd = sys_setup(entries, &p);
+	if (ring -> fd < 0){
+		return -1;
+	}
+	ring -> sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring -> cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		if (ring -> cqRingSize > ring -> sqRingSize){
+			ring -> sqRingSize = ring -> cqRingSize;
+		}
+		ring -> cqRingSize = ring -> sqRingSize;
+	}
+	ring -> sqRing = mmap(NULL, ring -> sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                      ring -> fd, IORING_OFF_SQ_RING);
+	if (ring -> sqRing == MAP_FAILED){
+		close(ring -> fd);
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		ring -> cqRing = ring -> sqRing;
+	}
+	else{
+		ring -> cqRing = mmap(NULL, ring -> cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                      ring -> fd, IORING_OFF_CQ_RING);
+		if (ring -> cqRing == MAP_FAILED){
+			munmap(ring -> sqRing, ring -> sqRingSize);
+			close(ring -> fd);
+			return -1;
+		}
+	}
+	ring -> sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring -> sqes = mmap(NULL, ring -> sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring -> fd, IORING_OFF_SQES);
+	if (ring -> sqes == MAP_FAILED){
+		if (ring -> cqRing != ring -> sqRing){
+			munmap(ring -> cqRing, ring -> cqRingSize);
+		}
+		munmap(ring -> sqRing, ring -> sqRingSize);
+		close(ring -> fd);
+		return -1;
+	}
+	char *sq = ring -> sqRing;
+	char *cq = ring -> cqRing;
+	ring -> sqHead = (unsigned *)(sq + p.sq_off.head);
+	ring -> sqTail = (unsigned *)(sq + p.sq_off.tail);
+	ring -> sqFlags = (unsigned *)(sq + p.sq_off.flags);
+	ring -> sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ring -> sqEntries = p.sq_entries;
+	ring -> cqHead = (unsigned *)(cq + p.cq_off.head);
+	ring -> cqTail = (unsigned *)(cq + p.cq_off.tail);
+	ring -> cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ring -> cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	//entries are filled in order, so slot i of the array always names entry i
+	unsigned *array = (unsigned *)(sq + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++){
+		array[i] = i;
+	}
+	return 0;
+}
+
+void uring_fini(URING *ring){
+	munmap(ring -> sqes, ring -> sqesSize);
+	if (ring -> cqRing != ring -> sqRing){
+		munmap(ring -> cqRing, ring -> cqRingSize);
+	}
+	munmap(ring -> sqRing, ring -> sqRingSize);
+	close(ring -> fd);
+	ring -> fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(URING *ring){
+	unsigned head = __atomic_load_n(ring -> sqHead, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring -> sqTail;
+	if (tail - head >= ring -> sqEntries){
+		if (uring_submit(ring, 0)){
+			return NULL;
+		}
+		head = __atomic_load_n(ring -> sqHead, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring -> sqEntries){
+			return NULL;
+		}
+	}
+	struct io_uring_sqe *sqe = &ring -> sqes[tail & ring -> sqMask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	//the kernel sees it once the tail moves past it
+	__atomic_store_n(ring -> sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring -> pending += 1;
+	return sqe;
+}
+
+int uring_submit(URING *ring, unsigned wait){
+	while (ring -> pending > 0 || wait > 0){
+		int n = sys_enter(ring -> fd, ring -> pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (n < 0){
+			return -1;
+		}
+		ring -> pending -= n < (int)ring -> pending ? (unsigned)n : ring -> pending;
+		if (wait > 0){
+			break;
+		}
+		if (n == 0){
+			//the kernel is out of resources for now, so the rest waits for the next call
+			break;
+		}
+	}
+	return 0;
+}
+
+struct io_uring_cqe *uring_cqe(URING *ring){
+	unsigned head = *ring -> cqHead;
+	if (head == __atomic_load_n(ring -> cqTail, __ATOMIC_ACQUIRE)){
+		if (!(__atomic_load_n(ring -> sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)){
+			return NULL;
+		}
+		sys_enter(ring -> fd, 0, 0, IORING_ENTER_GETEVENTS);
+		if (head == __atomic_load_n(ring -> cqTail, __ATOMIC_ACQUIRE)){
+			return NULL;
+		}
+	}
+	return &ring -> cqes[head & ring -> cqMask];
+}
+
+void uring_cqe_seen(URING *ring){
+	__atomic_store_n(ring -> cqHead, *ring -> cqHead + 1, __ATOMIC_RELEASE);
+}
+
+int uring_bufs_init(URING *ring, URING_BUFS *bufs, unsigned short group, unsigned count, unsigned size){
+	memset(bufs, 0, sizeof(URING_BUFS));
+	bufs -> ringSize = count * sizeof(struct io_uring_buf);
+	bufs -> ring = mmap(NULL, bufs -> ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs -> ring == MAP_FAILED){
+		return -1;
+	}
+	bufs -> base = malloc((size_t)count * size);
+	if (bufs -> base == NULL){
+		munmap(bufs -> ring, bufs -> ringSize);
+		return -1;
+	}
+	bufs -> count = count;
+	bufs -> size = size;
+	bufs -> group = group;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)bufs -> ring;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (sys_register(ring -> fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		free(bufs -> base);
+		munmap(bufs -> ring, bufs -> ringSize);
+		return -1;
+	}
+	for (unsigned i = 0; i < count; i++){
+		uring_buf_return(bufs, i);
+	}
+	return 0;
+}
+
+void uring_bufs_fini(URING_BUFS *bufs){
+	free(bufs -> base);
+	munmap(bufs -> ring, bufs -> ringSize);
+}
+
+char *uring_buf(URING_BUFS *bufs, unsigned bid){
+	return bufs -> base + (size_t)bid * bufs -> size;
+}
+
+void uring_buf_return(URING_BUFS *bufs, unsigned bid){
+	struct io_uring_buf *buf = &bufs -> ring -> bufs[bufs -> tail & (bufs -> count - 1)];
+	buf -> addr = (unsigned long)uring_buf(bufs, bid);
+	buf -> len = bufs -> size;
+	buf -> bid = bid;
+	bufs -> tail += 1;
+	__atomic_store_n(&bufs -> ring -> tail, bufs -> tail, __ATOMIC_RELEASE);
+}
+
+int uring_usable(void){
+	URING ring;
+	URING_BUFS bufs;
+	if (uring_init(&ring, 4)){
+		debug("no io_uring: %s", strerror(errno));
+		return 0;
+	}
+	if (uring_bufs_init(&ring, &bufs, 0, 4, 64)){
+		debug("no provided buffer rings: %s", strerror(errno));
+		uring_fini(&ring);
+		return 0;
+	}
+	int usable = 0;
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0){
+		struct io_uring_sqe *sqe = uring_sqe(&ring);
+		sqe -> opcode = IORING_OP_RECV;
+		sqe -> fd = sv[0];
+		sqe -> ioprio = IORING_RECV_MULTISHOT;
+		sqe -> flags = IOSQE_BUFFER_SELECT;
+		sqe -> buf_group = 0;
+		if (write(sv[1], "x", 1) == 1 && uring_submit(&ring, 1) == 0){
+			struct io_uring_cqe *cqe = uring_cqe(&ring);
+			//an older kernel fails the request, or receives only once
+			usable = cqe != NULL && cqe -> res == 1 && (cqe -> flags & IORING_CQE_F_BUFFER) &&
+			         (cqe -> flags & IORING_CQE_F_MORE);
+		}
+		close(sv[0]);
+		close(sv[1]);
+	}
+	uring_fini(&ring);
+	uring_bufs_fini(&bufs);
+	debug("multishot receive %s", usable ? "works" : "does not work");
+	return usable;
+}
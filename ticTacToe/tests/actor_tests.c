@@ -0,0 +1,145 @@
+#include <criterion/criterion.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "actor.h"
+
+/*
+ * Unit tests of the actor mailbox: messages posted by many threads are
+ * handled one at a time, messages that pile up while another thread
+ * handles them are handled in the order they were posted, and a handler
+ * that posts to its own actor has the message handled on the spot.
+ */
+
+#define ACTOR_TEST_THREADS 8
+#define ACTOR_TEST_CALLS 5000
+
+typedef struct test_msg {
+    ACTOR_MSG msg;
+    int thread;
+    int seq;
+} TEST_MSG;
+
+static ACTOR actor;
+static int inside;                      //handlers running at the moment
+static int handled;                     //changed by handlers only, without a lock
+static int last[ACTOR_TEST_THREADS];    //the last seq handled for each thread
+static int overlapped;                  //a handler started while another ran
+static int misordered;                  //a thread's messages were handled out of order
+static int order[ACTOR_TEST_THREADS];
+static int ordered;
+static sem_t gate, started;
+
+static void count(ACTOR_MSG *msg){
+    TEST_MSG *m = (TEST_MSG *)msg;
+    //checked by the test itself, since handlers run on the posting threads
+    if (__atomic_add_fetch(&inside, 1, __ATOMIC_SEQ_CST) != 1){
+        overlapped = 1;
+    }
+    if (m -> seq != last[m -> thread] + 1){
+        misordered = 1;
+    }
+    last[m -> thread] = m -> seq;
+    handled++;
+    __atomic_sub_fetch(&inside, 1, __ATOMIC_SEQ_CST);
+}
+
+static void *call_many(void *arg){
+    int t = (int)(long)arg;
+    for (int i = 1; i <= ACTOR_TEST_CALLS; i++){
+        TEST_MSG m = {.thread = t, .seq = i};
+        actor_call(&actor, &m.msg, count);
+    }
+    return NULL;
+}
+
+Test(actor_suite, 00_handled_one_at_a_time, .timeout = 5) {
+    actor_init(&actor);
+    handled = 0;
+    overlapped = 0;
+    misordered = 0;
+    memset(last, 0, sizeof(last));
+    pthread_t tids[ACTOR_TEST_THREADS];
+    for (long t = 0; t < ACTOR_TEST_THREADS; t++){
+        cr_assert_eq(pthread_create(&tids[t], NULL, call_many, (void *)t), 0);
+    }
+    for (int t = 0; t < ACTOR_TEST_THREADS; t++){
+        pthread_join(tids[t], NULL);
+    }
+    cr_assert_not(overlapped, "Two handlers ran at once");
+    cr_assert_not(misordered, "Messages of a thread handled out of order");
+    cr_assert_eq(handled, ACTOR_TEST_THREADS * ACTOR_TEST_CALLS, "Handled %d messages", handled);
+    for (int t = 0; t < ACTOR_TEST_THREADS; t++){
+        cr_assert_eq(last[t], ACTOR_TEST_CALLS);
+    }
+    cr_assert_null(actor.mailbox);
+    cr_assert_eq(actor.running, 0);
+}
+
+static TEST_MSG msgs[ACTOR_TEST_THREADS];
+
+static void record(ACTOR_MSG *msg){
+    TEST_MSG *m = (TEST_MSG *)msg;
+    if (m -> thread == 0){
+        //hold the actor while the other threads post
+        sem_post(&started);
+        sem_wait(&gate);
+    }
+    order[ordered++] = m -> thread;
+}
+
+static void *call_once(void *arg){
+    int t = (int)(long)arg;
+    msgs[t].thread = t;
+    actor_call(&actor, &msgs[t].msg, record);
+    return NULL;
+}
+
+Test(actor_suite, 01_piled_up_messages_in_order, .timeout = 5) {
+    actor_init(&actor);
+    ordered = 0;
+    sem_init(&gate, 0, 0);
+    sem_init(&started, 0, 0);
+    pthread_t tids[ACTOR_TEST_THREADS];
+    cr_assert_eq(pthread_create(&tids[0], NULL, call_once, (void *)0), 0);
+    sem_wait(&started);
+    for (long t = 1; t < ACTOR_TEST_THREADS; t++){
+        cr_assert_eq(pthread_create(&tids[t], NULL, call_once, (void *)t), 0);
+        //the next thread posts only once this one's message is in the mailbox
+        while (__atomic_load_n(&actor.mailbox, __ATOMIC_SEQ_CST) != &msgs[t].msg){
+            usleep(1000);
+        }
+    }
+    sem_post(&gate);
+    for (int t = 0; t < ACTOR_TEST_THREADS; t++){
+        pthread_join(tids[t], NULL);
+    }
+    cr_assert_eq(ordered, ACTOR_TEST_THREADS);
+    for (int t = 0; t < ACTOR_TEST_THREADS; t++){
+        cr_assert_eq(order[t], t, "Message of thread %d handled in place %d", order[t], t);
+    }
+    sem_destroy(&gate);
+    sem_destroy(&started);
+}
+
+static void inner(ACTOR_MSG *msg){
+    ((TEST_MSG *)msg) -> seq = 2;
+}
+
+static void outer(ACTOR_MSG *msg){
+    TEST_MSG m = {0};
+    actor_call(&actor, &m.msg, inner);
+    //handled before the call returned, not left in the mailbox
+    ((TEST_MSG *)msg) -> seq = m.seq;
+}
+
+Test(actor_suite, 02_posting_to_own_actor, .timeout = 5) {
+    actor_init(&actor);
+    TEST_MSG m = {0};
+    actor_call(&actor, &m.msg, outer);
+    cr_assert_eq(m.seq, 2, "Message posted by a handler to its own actor not handled on the spot");
+    cr_assert_null(actor.mailbox);
+}
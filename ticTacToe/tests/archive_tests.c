@@ -0,0 +1,288 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "game.h"
+#include "game_ext.h"
+#include "player.h"
+
+/*
+ * Unit tests of the game archive: games are written by the writer thread,
+ * read back after the archive is closed and opened again, and must decode
+ * to exactly what was played.
+ */
+
+#define ARCHIVE_TEST_MAX 64
+
+static char dir[32];
+
+static void remove_dir(char *path){
+    DIR *d = opendir(path);
+    struct dirent *de;
+    while (d != NULL && (de = readdir(d)) != NULL){
+        if (strcmp(de -> d_name, ".") == 0 || strcmp(de -> d_name, "..") == 0){
+            continue;
+        }
+        char sub[512];
+        snprintf(sub, sizeof(sub), "%s/%s", path, de -> d_name);
+        struct stat st;
+        if (lstat(sub, &st) == 0 && S_ISDIR(st.st_mode)){
+            remove_dir(sub);
+        }
+        else{
+            unlink(sub);
+        }
+    }
+    if (d != NULL){
+        closedir(d);
+    }
+    rmdir(path);
+}
+
+static void open_archive(void){
+    strcpy(dir, "/tmp/archive_testXXXXXX");
+    cr_assert_not_null(mkdtemp(dir));
+    cr_assert_eq(archive_init(dir), 0, "Archive in %s did not open", dir);
+}
+
+static void remove_archive(void){
+    archive_fini();
+    remove_dir(dir);
+}
+
+/*
+ * Play a game through to its end and archive it.
+ *
+ * @return the game, for the caller to check the record against.
+ */
+static GAME *play_and_archive(PLAYER *first, PLAYER *second, char **moves, int n, int result,
+                              double before[2], double after[2]){
+    GAME *game = game_create();
+    cr_assert_not_null(game);
+    for (int i = 0; i < n; i++){
+        cr_assert_eq(game_play_move(game, i % 2 ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE, moves[i]), 0,
+                     "Move %s was refused", moves[i]);
+    }
+    archive_game(game, first, second, result, ARCHIVE_END_NORMAL, before, after);
+    return game;
+}
+
+static void check_record(ARCHIVE_RECORD *rec, GAME *game, char *first, char *second, int result,
+                         double before[2], double after[2]){
+    GAME_MOVE_RECORD moves[GAME_MAX_MOVES];
+    int n = game_get_moves(game, moves, GAME_MAX_MOVES);
+    cr_assert_eq(rec -> game_id, game_get_id(game), "Record of game %u, expected %u", rec -> game_id, game_get_id(game));
+    cr_assert_eq(rec -> start_ms, game_get_start_time(game));
+    cr_assert_geq(rec -> end_ms, rec -> start_ms);
+    cr_assert_eq(rec -> result, result);
+    cr_assert_eq(rec -> reason, ARCHIVE_END_NORMAL);
+    cr_assert_eq(rec -> moves, n, "Record has %d moves, expected %d", rec -> moves, n);
+    for (int i = 0; i < n; i++){
+        cr_assert_eq(rec -> cells[i], moves[i].cell, "Move %d in cell %d, expected %d", i, rec -> cells[i], moves[i].cell);
+        cr_assert_eq(rec -> roles[i], moves[i].role);
+        cr_assert_eq(rec -> times[i], moves[i].time_ms - rec -> start_ms);
+    }
+    //kept to the hundredth of a point
+    int ratings[4] = {lround(before[0] * 100), lround(after[0] * 100), lround(before[1] * 100), lround(after[1] * 100)};
+    for (int i = 0; i < 4; i++){
+        cr_assert_eq(rec -> ratings[i], ratings[i], "Rating %d is %d, expected %d", i, rec -> ratings[i], ratings[i]);
+    }
+    cr_assert_eq(rec -> first_len, strlen(first));
+    cr_assert_eq(strncmp(rec -> first, first, rec -> first_len), 0);
+    cr_assert_eq(rec -> second_len, strlen(second));
+    cr_assert_eq(strncmp(rec -> second, second, rec -> second_len), 0);
+    cr_assert_eq(archive_record_player(rec, first), 1);
+    cr_assert_eq(archive_record_player(rec, second), 2);
+    cr_assert_eq(archive_record_player(rec, "nobody"), 0);
+}
+
+/*
+ * Read the records found by a query and collect the IDs of their games,
+ * checking that they come newest first.
+ */
+static void read_ids(ARCHIVE_REF *refs, int n, uint32_t *ids){
+    for (int i = 0; i < n; i++){
+        char buf[ARCHIVE_RECORD_FIXED + GAME_MAX_MOVES * ARCHIVE_MOVE_SIZE + 64];
+        ARCHIVE_RECORD rec;
+        cr_assert_eq(archive_read(&refs[i], buf), 0);
+        cr_assert_eq(archive_decode(buf, refs[i].length, &rec), 0);
+        ids[i] = rec.game_id;
+        if (i > 0){
+            cr_assert_leq(refs[i].end_ms, refs[i - 1].end_ms, "Game %d ended after the one before it", i);
+        }
+    }
+}
+
+static void count_record(ARCHIVE_RECORD *rec, void *arg){
+    *(int *)arg += 1;
+}
+
+Test(archive_suite, 00_round_trip, .timeout = 5) {
+    open_archive();
+    PLAYER *alice = player_create("alice");
+    PLAYER *bob = player_create("bob");
+    char *win[] = {"1", "4", "2", "5", "3"};
+    char *draw[] = {"5", "1", "9", "3", "2", "8", "4", "6", "7"};
+    double before1[2] = {1500, 1500}, after1[2] = {1516, 1484};
+    double before2[2] = {1484, 1516}, after2[2] = {1484.37, 1515.63};
+    GAME *g1 = play_and_archive(alice, bob, win, 5, 1, before1, after1);
+    GAME *g2 = play_and_archive(bob, alice, draw, 9, 0, before2, after2);
+    //written out when the archive closes, and read back when it opens again
+    archive_fini();
+    cr_assert_eq(archive_init(dir), 0);
+
+    ARCHIVE_REF refs[ARCHIVE_TEST_MAX];
+    int n = archive_lookup(NULL, 0, UINT64_MAX, refs, ARCHIVE_TEST_MAX);
+    cr_assert_eq(n, 2, "Found %d games, expected 2", n);
+    //newest first
+    char buf[2][ARCHIVE_RECORD_FIXED + GAME_MAX_MOVES * ARCHIVE_MOVE_SIZE + 64];
+    ARCHIVE_RECORD rec[2];
+    for (int i = 0; i < 2; i++){
+        cr_assert_leq(refs[i].length, sizeof(buf[i]));
+        cr_assert_eq(archive_read(&refs[i], buf[i]), 0);
+        cr_assert_eq(archive_decode(buf[i], refs[i].length, &rec[i]), 0, "Record %d does not decode", i);
+    }
+    check_record(&rec[0], g2, "bob", "alice", 0, before2, after2);
+    check_record(&rec[1], g1, "alice", "bob", 1, before1, after1);
+    int count = 0;
+    cr_assert_eq(archive_scan(count_record, &count), 2);
+    cr_assert_eq(count, 2);
+
+    game_unref(g1, "archive test done");
+    game_unref(g2, "archive test done");
+    player_unref(alice, "archive test done");
+    player_unref(bob, "archive test done");
+    remove_archive();
+}
+
+Test(archive_suite, 01_malformed_records_do_not_decode, .timeout = 5) {
+    open_archive();
+    PLAYER *alice = player_create("alice");
+    PLAYER *bob = player_create("bob");
+    char *win[] = {"1", "4", "2", "5", "3"};
+    double before[2] = {1500, 1500}, after[2] = {1516, 1484};
+    GAME *game = play_and_archive(alice, bob, win, 5, 1, before, after);
+    archive_fini();
+    cr_assert_eq(archive_init(dir), 0);
+
+    ARCHIVE_REF ref;
+    cr_assert_eq(archive_lookup("alice", 0, UINT64_MAX, &ref, 1), 1);
+    char buf[ARCHIVE_RECORD_FIXED + GAME_MAX_MOVES * ARCHIVE_MOVE_SIZE + 64];
+    cr_assert_eq(archive_read(&ref, buf), 0);
+    ARCHIVE_RECORD rec;
+    cr_assert_eq(archive_decode(buf, ref.length, &rec), 0);
+    //cut short anywhere, with lengths that do not add up, or with the wrong magic
+    for (size_t len = 0; len < ref.length; len++){
+        cr_assert_eq(archive_decode(buf, len, &rec), -1, "Record cut to %zu bytes decoded", len);
+    }
+    buf[30] += 1;
+    cr_assert_eq(archive_decode(buf, ref.length, &rec), -1, "Record with a move too many decoded");
+    buf[30] -= 1;
+    buf[0] ^= 1;
+    cr_assert_eq(archive_decode(buf, ref.length, &rec), -1, "Record with a bad magic decoded");
+
+    game_unref(game, "archive test done");
+    player_unref(alice, "archive test done");
+    player_unref(bob, "archive test done");
+    remove_archive();
+}
+
+/*
+ * Games between the players, in the order they are archived, and the
+ * expected answers to queries by player and opponent.  "u31992" and
+ * "u605430" have the same name hash.
+ */
+static char *pairings[][2] = {
+    {"alice", "bob"}, {"carol", "alice"}, {"bob", "carol"}, {"alice", "u31992"},
+    {"bob", "alice"}, {"u605430", "alice"}, {"alice", "carol"}, {"alice", "bob"},
+    {"u605430", "bob"}, {"alice", "u31992"}
+};
+#define PAIRINGS (int)(sizeof(pairings) / sizeof(pairings[0]))
+
+static uint32_t archived[PAIRINGS];
+
+static void archive_pairings(void){
+    char *win[] = {"1", "4", "2", "5", "3"};
+    double before[2] = {1500, 1500}, after[2] = {1516, 1484};
+    for (int i = 0; i < PAIRINGS; i++){
+        PLAYER *first = player_create(pairings[i][0]);
+        PLAYER *second = player_create(pairings[i][1]);
+        GAME *game = play_and_archive(first, second, win, 5, 1, before, after);
+        archived[i] = game_get_id(game);
+        game_unref(game, "archive test done");
+        player_unref(first, "archive test done");
+        player_unref(second, "archive test done");
+        //so that the games end in order
+        usleep(2000);
+    }
+}
+
+/*
+ * Check a query by player, and opponent if not NULL, against the games
+ * that were archived, the most recent max of them.
+ */
+static void check_query(char *player, char *opponent, int max){
+    uint32_t expect[PAIRINGS];
+    int expected = 0;
+    for (int i = PAIRINGS - 1; i >= 0 && expected < max; i--){
+        int first = strcmp(pairings[i][0], player) == 0, second = strcmp(pairings[i][1], player) == 0;
+        char *other = first ? pairings[i][1] : pairings[i][0];
+        if ((first || second) && (opponent == NULL || strcmp(other, opponent) == 0)){
+            expect[expected++] = archived[i];
+        }
+    }
+    ARCHIVE_REF refs[ARCHIVE_TEST_MAX];
+    uint32_t ids[ARCHIVE_TEST_MAX];
+    int n = archive_player_games(player, opponent, refs, max);
+    cr_assert_eq(n, expected, "Found %d games of %s against %s, expected %d", n, player, opponent, expected);
+    read_ids(refs, n, ids);
+    for (int i = 0; i < n; i++){
+        cr_assert_eq(ids[i], expect[i], "Game %d of %s against %s is %u, expected %u",
+                     i, player, opponent, ids[i], expect[i]);
+    }
+}
+
+static void check_queries(void){
+    check_query("alice", NULL, ARCHIVE_TEST_MAX);
+    check_query("alice", NULL, 3);
+    check_query("bob", NULL, ARCHIVE_TEST_MAX);
+    check_query("u31992", NULL, ARCHIVE_TEST_MAX);
+    check_query("u605430", NULL, ARCHIVE_TEST_MAX);
+    check_query("alice", "bob", ARCHIVE_TEST_MAX);
+    check_query("bob", "alice", 2);
+    check_query("carol", "bob", ARCHIVE_TEST_MAX);
+    check_query("alice", "u31992", ARCHIVE_TEST_MAX);
+    check_query("u605430", "alice", ARCHIVE_TEST_MAX);
+    check_query("carol", "u31992", ARCHIVE_TEST_MAX);
+    check_query("dave", NULL, ARCHIVE_TEST_MAX);
+}
+
+Test(archive_suite, 02_posting_lists, .timeout = 5) {
+    cr_assert_eq(archive_name_hash("u31992"), archive_name_hash("u605430"), "The test names no longer collide");
+    open_archive();
+    archive_pairings();
+    archive_fini();
+    cr_assert_eq(archive_init(dir), 0);
+    check_queries();
+    remove_archive();
+}
+
+Test(archive_suite, 03_pair_lists_rebuilt, .timeout = 5) {
+    open_archive();
+    archive_pairings();
+    archive_fini();
+    //an archive written before there were pair lists has them built when it is opened
+    char pairs[64];
+    snprintf(pairs, sizeof(pairs), "%s/pairs", dir);
+    remove_dir(pairs);
+    cr_assert_eq(archive_init(dir), 0);
+    check_queries();
+    remove_archive();
+}
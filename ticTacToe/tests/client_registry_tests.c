@@ -0,0 +1,242 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "player.h"
+#include "player_ext.h"
+
+/*
+ * Unit tests of the username index queries behind USERS_PAGE.  Clients
+ * are registered on descriptors that are never used, and put straight
+ * into the index, without going through a login.  Also tests of the
+ * bounded wait for the registry to empty at shutdown.
+ */
+
+#define QUERY_PLAYERS 40
+
+static CLIENT_REGISTRY *cr;
+static CLIENT *clients[QUERY_PLAYERS];
+static PLAYER *players[QUERY_PLAYERS];
+
+/*
+ * Index players "p00" to "p39", registered in reverse order so that the
+ * index cannot simply be in the order of registration, rated 1000 for
+ * even numbers and 2000 for odd ones.
+ */
+static void setup_index(void){
+    cr = creg_init();
+    cr_assert_not_null(cr);
+    for (int i = QUERY_PLAYERS - 1; i >= 0; i--){
+        char name[8];
+        snprintf(name, sizeof(name), "p%02d", i);
+        clients[i] = creg_register(cr, 1000 + i);
+        players[i] = player_create(name);
+        cr_assert_not_null(clients[i]);
+        cr_assert_not_null(players[i]);
+        player_set_rating(players[i], i % 2 ? 2000 : 1000);
+        cr_assert_eq(creg_index_add(cr, clients[i], players[i]), 0, "Player %s was not indexed", name);
+    }
+}
+
+static CREG_QUERY query_all(int limit){
+    CREG_QUERY q = {0};
+    q.limit = limit;
+    q.min_rating = INT_MIN;
+    q.max_rating = INT_MAX;
+    q.min_deviation = INT_MIN;
+    q.max_deviation = INT_MAX;
+    return q;
+}
+
+static void unref_all(PLAYER **found, int n){
+    for (int i = 0; i < n; i++){
+        player_unref(found[i], "query test done");
+    }
+}
+
+Test(creg_query_suite, 00_pages_cover_index_in_order, .timeout = 5) {
+    setup_index();
+    CREG_QUERY q = query_all(7);
+    PLAYER *found[QUERY_PLAYERS];
+    char next[64] = "";
+    int seen = 0;
+    do {
+        q.cursor = next[0] ? next : NULL;
+        char cursor[64];
+        int n = creg_query_players(cr, &q, found, cursor, sizeof(cursor));
+        cr_assert_geq(n, 0);
+        cr_assert_leq(n, 7, "Page of %d exceeds the limit", n);
+        for (int i = 0; i < n; i++){
+            cr_assert_str_eq(player_get_name(found[i]), player_get_name(players[seen]),
+                             "Expected %s, got %s", player_get_name(players[seen]), player_get_name(found[i]));
+            seen += 1;
+        }
+        unref_all(found, n);
+        strcpy(next, cursor);
+    } while (next[0] != '\0');
+    cr_assert_eq(seen, QUERY_PLAYERS, "Pages returned %d players, expected %d", seen, QUERY_PLAYERS);
+}
+
+Test(creg_query_suite, 01_cursor_is_exclusive, .timeout = 5) {
+    setup_index();
+    CREG_QUERY q = query_all(3);
+    q.cursor = "p10";
+    PLAYER *found[3];
+    char next[64];
+    int n = creg_query_players(cr, &q, found, next, sizeof(next));
+    cr_assert_eq(n, 3);
+    cr_assert_str_eq(player_get_name(found[0]), "p11");
+    cr_assert_str_eq(player_get_name(found[2]), "p13");
+    cr_assert_str_eq(next, "p13", "Next page should start after p13, not %s", next);
+    unref_all(found, n);
+
+    //a cursor that is not itself indexed starts at the next name up
+    q.cursor = "p105";
+    n = creg_query_players(cr, &q, found, next, sizeof(next));
+    cr_assert_eq(n, 3);
+    cr_assert_str_eq(player_get_name(found[0]), "p11");
+    unref_all(found, n);
+}
+
+Test(creg_query_suite, 02_last_page_has_empty_cursor, .timeout = 5) {
+    setup_index();
+    CREG_QUERY q = query_all(10);
+    q.cursor = "p35";
+    PLAYER *found[10];
+    char next[64];
+    int n = creg_query_players(cr, &q, found, next, sizeof(next));
+    cr_assert_eq(n, 4);
+    cr_assert_str_empty(next, "Listing is complete, but the cursor is %s", next);
+    unref_all(found, n);
+}
+
+Test(creg_query_suite, 03_prefix_and_rating_filters, .timeout = 5) {
+    setup_index();
+    CREG_QUERY q = query_all(QUERY_PLAYERS);
+    q.prefix = "p1";
+    PLAYER *found[QUERY_PLAYERS];
+    char next[64];
+    int n = creg_query_players(cr, &q, found, next, sizeof(next));
+    cr_assert_eq(n, 10, "Prefix p1 matched %d players, expected 10", n);
+    cr_assert_str_eq(player_get_name(found[0]), "p10");
+    cr_assert_str_eq(player_get_name(found[9]), "p19");
+    cr_assert_str_empty(next);
+    unref_all(found, n);
+
+    q.prefix = NULL;
+    q.min_rating = 1500;
+    n = creg_query_players(cr, &q, found, next, sizeof(next));
+    cr_assert_eq(n, QUERY_PLAYERS / 2);
+    for (int i = 0; i < n; i++){
+        cr_assert_eq(player_get_rating(found[i]), 2000, "%s is rated below the minimum", player_get_name(found[i]));
+    }
+    unref_all(found, n);
+}
+
+Test(creg_query_suite, 04_index_follows_removal, .timeout = 5) {
+    setup_index();
+    cr_assert_eq(creg_index_remove(cr, clients[0]), 0);
+    cr_assert_neq(creg_index_remove(cr, clients[0]), 0, "Removing twice should fail");
+    //someone else cannot take a name that is still indexed
+    CLIENT *other = creg_register(cr, 2000);
+    PLAYER *dup = player_create("p01");
+    cr_assert_neq(creg_index_add(cr, other, dup), 0, "Duplicate name was indexed");
+    CREG_QUERY q = query_all(1);
+    PLAYER *found[1];
+    char next[64];
+    int n = creg_query_players(cr, &q, found, next, sizeof(next));
+    cr_assert_eq(n, 1);
+    cr_assert_str_eq(player_get_name(found[0]), "p01");
+    cr_assert_str_eq(next, "p01");
+    unref_all(found, n);
+}
+
+Test(creg_query_suite, 05_listing_version_follows_changes, .timeout = 5) {
+    //the USERS listing is rebuilt when this sum changes, and only then
+    setup_index();
+    uint64_t version = creg_version(cr) + player_rating_version();
+    CREG_QUERY q = query_all(QUERY_PLAYERS);
+    PLAYER *found[QUERY_PLAYERS];
+    char next[64];
+    unref_all(found, creg_query_players(cr, &q, found, next, sizeof(next)));
+    CLIENT *other = creg_register(cr, 2000);
+    PLAYER *dup = player_create("p01");
+    cr_assert_neq(creg_index_add(cr, other, dup), 0);
+    cr_assert_eq(creg_version(cr) + player_rating_version(), version, "Version changed with the listing unchanged");
+
+    cr_assert_eq(creg_index_remove(cr, clients[0]), 0);
+    uint64_t removed = creg_version(cr) + player_rating_version();
+    cr_assert_neq(removed, version, "Version unchanged by a logout");
+    PLAYER *fresh = player_create("q00");
+    cr_assert_eq(creg_index_add(cr, other, fresh), 0);
+    uint64_t added = creg_version(cr) + player_rating_version();
+    cr_assert_neq(added, removed, "Version unchanged by a login");
+    player_post_result(players[1], players[2], 1);
+    cr_assert_neq(creg_version(cr) + player_rating_version(), added, "Version unchanged by a result");
+}
+
+static struct timespec deadline_in(long ms){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000){
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+static long ms_since(struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - start -> tv_sec) * 1000 + (now.tv_nsec - start -> tv_nsec) / 1000000;
+}
+
+static CLIENT *leaving;
+
+static void *unregister_later(void *arg){
+    usleep(50 * 1000);
+    creg_unregister(cr, leaving);
+    return NULL;
+}
+
+Test(creg_drain_suite, 00_wait_gives_up_at_deadline, .timeout = 5) {
+    cr = creg_init();
+    int fds[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    CLIENT *c = creg_register(cr, fds[0]);
+    cr_assert_not_null(c);
+    struct timespec start, deadline = deadline_in(100);
+    clock_gettime(CLOCK_REALTIME, &start);
+    cr_assert_eq(creg_wait_for_empty_until(cr, &deadline), -1, "Registry with a client reported empty");
+    long waited = ms_since(&start);
+    cr_assert_geq(waited, 90, "Gave up after %ld ms, before the deadline", waited);
+    cr_assert_lt(waited, 1000, "Gave up after %ld ms, long after the deadline", waited);
+    cr_assert_eq(creg_unregister(cr, c), 0);
+    close(fds[1]);
+}
+
+Test(creg_drain_suite, 01_wait_ends_when_empty, .timeout = 5) {
+    cr = creg_init();
+    int fds[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    leaving = creg_register(cr, fds[0]);
+    cr_assert_not_null(leaving);
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, unregister_later, NULL), 0);
+    struct timespec start, deadline = deadline_in(3000);
+    clock_gettime(CLOCK_REALTIME, &start);
+    cr_assert_eq(creg_wait_for_empty_until(cr, &deadline), 0, "Deadline passed though the registry emptied");
+    long waited = ms_since(&start);
+    cr_assert_lt(waited, 1000, "Waited %ld ms for the last client to go", waited);
+    pthread_join(tid, NULL);
+    close(fds[1]);
+}
@@ -0,0 +1,141 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "client_registry.h"
+#include "client_ext.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Unit tests of a client's connection: the round-trip time estimate
+ * taken from the timestamps that PONGs echo, and the packets held back
+ * while a request is handled going out in one write.  The client's
+ * connection is a socket pair whose far end is read by the test; a
+ * SOCK_SEQPACKET pair shows each write as one message.
+ */
+
+static CLIENT_REGISTRY *cr;
+static CLIENT *client;
+static int fds[2];
+
+static void setup_client(int type){
+    cr = creg_init();
+    cr_assert_not_null(cr);
+    cr_assert_eq(socketpair(AF_UNIX, type, 0, fds), 0, "socketpair failed");
+    client = client_create(cr, fds[0]);
+    cr_assert_not_null(client);
+}
+
+static void teardown_client(void){
+    client_unref(client, "client test done");
+    close(fds[0]);
+    close(fds[1]);
+    creg_fini(cr);
+}
+
+/*
+ * A PONG echoing a PING sent ago_us microseconds ago.
+ */
+static JEUX_PACKET_HEADER pong_of(int64_t ago_us){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - ago_us;
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = JEUX_PONG_PKT;
+    hdr.timestamp_sec = htonl(us / 1000000);
+    hdr.timestamp_nsec = htonl(us % 1000000 * 1000);
+    return hdr;
+}
+
+Test(client_suite, 00_rtt_from_pongs, .timeout = 5) {
+    setup_client(SOCK_STREAM);
+    uint32_t srtt, rttvar;
+    cr_assert_eq(client_get_rtt(client, &srtt, &rttvar), -1, "Estimate before any PONG");
+
+    //the first sample is taken as it is, with half of it as the deviation
+    JEUX_PACKET_HEADER hdr = pong_of(20000);
+    client_note_pong(client, &hdr);
+    cr_assert_eq(client_get_rtt(client, &srtt, &rttvar), 0);
+    cr_assert(srtt >= 20000 && srtt < 25000, "First estimate %u us", srtt);
+    cr_assert(rttvar >= 10000 && rttvar < 12500, "First deviation %u us", rttvar);
+
+    //later ones move the estimate an eighth of the way
+    uint32_t first = srtt;
+    hdr = pong_of(100000);
+    client_note_pong(client, &hdr);
+    cr_assert_eq(client_get_rtt(client, &srtt, &rttvar), 0);
+    uint32_t expect = (7 * (uint64_t)first + 100000) / 8;
+    cr_assert(srtt >= expect && srtt < expect + 2000, "Estimate %u us, expected about %u", srtt, expect);
+
+    //timestamps that cannot be of our PINGs are ignored
+    uint32_t before = srtt;
+    hdr = pong_of(-5000000);
+    client_note_pong(client, &hdr);
+    hdr = pong_of(3600 * (int64_t)1000000);
+    client_note_pong(client, &hdr);
+    cr_assert_eq(client_get_rtt(client, &srtt, &rttvar), 0);
+    cr_assert_eq(srtt, before, "Estimate moved by a PONG that echoes no PING");
+    teardown_client();
+}
+
+static int send_type(JEUX_PACKET_TYPE type, char *payload){
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = type;
+    hdr.size = htons(payload ? strlen(payload) : 0);
+    return client_send_packet(client, &hdr, payload);
+}
+
+static void *send_from_other_thread(void *arg){
+    send_type(JEUX_ENDED_PKT, NULL);
+    return NULL;
+}
+
+/*
+ * Check that a message read from the far end is made of packets of the
+ * given types, in order.
+ */
+static void check_packets(char *buf, ssize_t len, JEUX_PACKET_TYPE *types, int n){
+    ssize_t off = 0;
+    for (int i = 0; i < n; i++){
+        cr_assert_leq(off + (ssize_t)sizeof(JEUX_PACKET_HEADER), len, "Packet %d missing", i);
+        JEUX_PACKET_HEADER *hdr = (JEUX_PACKET_HEADER *)(buf + off);
+        cr_assert_eq(hdr -> type, types[i], "Packet %d is of type %d, expected %d", i, hdr -> type, types[i]);
+        off += sizeof(JEUX_PACKET_HEADER) + ntohs(hdr -> size);
+    }
+    cr_assert_eq(off, len, "Message holds more than %d packets", n);
+}
+
+Test(client_suite, 01_held_packets_in_one_write, .timeout = 5) {
+    setup_client(SOCK_SEQPACKET);
+    char buf[1024];
+    client_hold_sends();
+    cr_assert_eq(send_type(JEUX_ACK_PKT, "5"), 0);
+    cr_assert_eq(send_type(JEUX_MOVED_PKT, "board"), 0);
+    //another thread's packet waits behind those held back
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, send_from_other_thread, NULL), 0);
+    pthread_join(tid, NULL);
+    cr_assert_eq(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), -1, "Held packet written");
+    cr_assert_eq(errno, EAGAIN);
+    client_release_sends();
+
+    ssize_t len = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+    JEUX_PACKET_TYPE held[] = {JEUX_ACK_PKT, JEUX_MOVED_PKT, JEUX_ENDED_PKT};
+    check_packets(buf, len, held, 3);
+    cr_assert_eq(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), -1, "Held packets took more than one write");
+
+    //nothing is held back once released
+    cr_assert_eq(send_type(JEUX_NACK_PKT, NULL), 0);
+    len = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+    JEUX_PACKET_TYPE after[] = {JEUX_NACK_PKT};
+    check_packets(buf, len, after, 1);
+    teardown_client();
+}
@@ -0,0 +1,124 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "protocol_ext.h"
+
+/*
+ * Unit tests of payload compression: what is compressed inflates back
+ * to the payload with the preset dictionary, as a client would do it,
+ * and what would not shrink is not compressed.
+ */
+
+#define COMPRESS_TEST_THREADS 8
+
+/*
+ * Inflate a compressed payload the way a client does.
+ *
+ * @return the length of the inflated payload, or -1 if it is not a
+ * valid stream made with the dictionary.
+ */
+static long inflate_payload(void *z, size_t zlen, char *out, size_t size){
+    z_stream s = {0};
+    if (inflateInit(&s) != Z_OK){
+        return -1;
+    }
+    s.next_in = z;
+    s.avail_in = zlen;
+    s.next_out = (Bytef *)out;
+    s.avail_out = size;
+    int ret = inflate(&s, Z_FINISH);
+    if (ret == Z_NEED_DICT){
+        if (inflateSetDictionary(&s, (const Bytef *)JEUX_COMPRESS_DICTIONARY,
+                                 sizeof(JEUX_COMPRESS_DICTIONARY) - 1) != Z_OK){
+            inflateEnd(&s);
+            return -1;
+        }
+        ret = inflate(&s, Z_FINISH);
+    }
+    long len = ret == Z_STREAM_END ? (long)s.total_out : -1;
+    inflateEnd(&s);
+    return len;
+}
+
+/*
+ * Make a USERS listing of n players, named after seed.
+ */
+static size_t make_listing(char *buf, int n, int seed){
+    size_t len = 0;
+    for (int i = 0; i < n; i++){
+        len += sprintf(buf + len, "user%d_%d\t%d\n", seed, i, 1300 + (i * 37 + seed) % 400);
+    }
+    return len;
+}
+
+Test(compress_suite, 00_round_trip, .timeout = 5) {
+    static char listing[64 * 1024], back[64 * 1024];
+    //the same thread's stream is reused, so several payloads in a row
+    for (int n = 20; n <= 2000; n *= 10){
+        size_t len = make_listing(listing, n, n);
+        size_t zlen = 0;
+        void *z = compress_payload(listing, len, &zlen);
+        cr_assert_not_null(z, "Listing of %d players not compressed", n);
+        cr_assert_lt(zlen, len);
+        cr_assert_eq(inflate_payload(z, zlen, back, sizeof(back)), len, "Listing of %d players inflated wrong", n);
+        cr_assert_arr_eq(back, listing, len);
+        free(z);
+    }
+}
+
+Test(compress_suite, 01_not_compressed_unless_smaller, .timeout = 5) {
+    size_t zlen = 0;
+    cr_assert_null(compress_payload("x", 1, &zlen), "A single byte came out smaller");
+    //bytes with no pattern at all
+    char noise[4096];
+    uint32_t x = 12345;
+    for (size_t i = 0; i < sizeof(noise); i++){
+        x = x * 1103515245 + 12345;
+        noise[i] = x >> 24;
+    }
+    cr_assert_null(compress_payload(noise, sizeof(noise), &zlen), "Noise came out smaller");
+    //the stream is still fit for use afterwards
+    char listing[4096], back[4096];
+    size_t len = make_listing(listing, 50, 1);
+    void *z = compress_payload(listing, len, &zlen);
+    cr_assert_not_null(z);
+    cr_assert_eq(inflate_payload(z, zlen, back, sizeof(back)), len);
+    cr_assert_arr_eq(back, listing, len);
+    free(z);
+}
+
+static int failed[COMPRESS_TEST_THREADS];
+
+static void *compress_many(void *arg){
+    int t = (int)(long)arg;
+    static __thread char listing[16 * 1024], back[16 * 1024];
+    for (int i = 0; i < 200; i++){
+        size_t len = make_listing(listing, 20 + (i * 7 + t) % 300, t * 1000 + i);
+        size_t zlen = 0;
+        void *z = compress_payload(listing, len, &zlen);
+        //checked by the test itself, away from this thread
+        if (z == NULL || inflate_payload(z, zlen, back, sizeof(back)) != (long)len || memcmp(back, listing, len)){
+            failed[t] = 1;
+        }
+        free(z);
+    }
+    return NULL;
+}
+
+Test(compress_suite, 02_threads_have_streams_of_their_own, .timeout = 5) {
+    pthread_t tids[COMPRESS_TEST_THREADS];
+    for (long t = 0; t < COMPRESS_TEST_THREADS; t++){
+        cr_assert_eq(pthread_create(&tids[t], NULL, compress_many, (void *)t), 0);
+    }
+    for (int t = 0; t < COMPRESS_TEST_THREADS; t++){
+        pthread_join(tids[t], NULL);
+    }
+    for (int t = 0; t < COMPRESS_TEST_THREADS; t++){
+        cr_assert_not(failed[t], "Payload compressed by thread %d did not inflate back", t);
+    }
+}
@@ -0,0 +1,129 @@
+#include <criterion/criterion.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "coro.h"
+
+/*
+ * Unit tests of the coroutine scheduler: many coroutines waiting on their
+ * connections share one scheduler thread without holding each other up,
+ * and a suspended coroutine is resumed by coro_wake(), even one asked
+ * for before it suspended itself.  Results are passed back to the test
+ * through variables, since the coroutines run on the scheduler thread.
+ */
+
+#define CORO_TEST_SESSIONS 50
+#define CORO_TEST_ROUNDS 20
+
+static int fds[CORO_TEST_SESSIONS][2];
+static int ended;                       //sessions whose peer has gone
+static int wrongThread;                 //a session ran on another thread
+static int notCoroutine;                //coro_running() or coro_self() said otherwise
+static pthread_t schedThread;
+static int schedKnown;
+
+/*
+ * Echo what comes in on the connection until it ends.
+ */
+static void *echo_session(void *arg){
+    int fd = *(int *)arg;
+    if (!coro_running() || coro_self() == NULL){
+        __atomic_store_n(&notCoroutine, 1, __ATOMIC_SEQ_CST);
+    }
+    int known = 0;
+    if (__atomic_compare_exchange_n(&schedKnown, &known, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+        schedThread = pthread_self();
+        __atomic_store_n(&schedKnown, 2, __ATOMIC_SEQ_CST);
+    }
+    else{
+        while (__atomic_load_n(&schedKnown, __ATOMIC_SEQ_CST) != 2){
+        }
+        if (!pthread_equal(schedThread, pthread_self())){
+            __atomic_store_n(&wrongThread, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    char buf[64];
+    while (1){
+        ssize_t n = coro_recv(fd, buf, sizeof(buf));
+        if (n > 0){
+            write(fd, buf, n);
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+            break;
+        }
+        if (coro_wait_fd(fd, POLLIN) < 0){
+            break;
+        }
+    }
+    __atomic_add_fetch(&ended, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void *suspended;                 //handle of the suspending coroutine
+static int resumed;
+
+static void *suspend_twice(void *arg){
+    __atomic_store_n(&suspended, coro_self(), __ATOMIC_SEQ_CST);
+    coro_suspend();
+    __atomic_store_n(&resumed, 1, __ATOMIC_SEQ_CST);
+    //woken while running: the wakeup is kept for the next suspension
+    while (__atomic_load_n(&resumed, __ATOMIC_SEQ_CST) != 2){
+    }
+    coro_suspend();
+    __atomic_store_n(&resumed, 3, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void wait_for(int *var, int value){
+    for (int i = 0; i < 2000 && __atomic_load_n(var, __ATOMIC_SEQ_CST) != value; i++){
+        usleep(1000);
+    }
+}
+
+Test(coro_suite, 00_sessions_share_a_thread, .timeout = 5) {
+    cr_assert_eq(coro_init(1, CORO_EPOLL), 0);
+    cr_assert_eq(coro_backend(), CORO_EPOLL);
+    cr_assert_not(coro_running(), "Test thread taken for a coroutine");
+    cr_assert_null(coro_self());
+    for (int i = 0; i < CORO_TEST_SESSIONS; i++){
+        cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]), 0, "socketpair failed");
+        cr_assert_eq(coro_spawn(echo_session, &fds[i][0]), 0);
+    }
+    //sessions are served in turn, each of them waiting in between
+    for (int r = 0; r < CORO_TEST_ROUNDS; r++){
+        for (int i = CORO_TEST_SESSIONS - 1; i >= 0; i--){
+            char msg[16], back[16];
+            int len = snprintf(msg, sizeof(msg), "%d.%d", r, i);
+            cr_assert_eq(write(fds[i][1], msg, len), len);
+            cr_assert_eq(read(fds[i][1], back, sizeof(back)), len, "Session %d not served in round %d", i, r);
+            cr_assert_arr_eq(back, msg, len);
+        }
+    }
+    for (int i = 0; i < CORO_TEST_SESSIONS; i++){
+        close(fds[i][1]);
+    }
+    wait_for(&ended, CORO_TEST_SESSIONS);
+    cr_assert_eq(ended, CORO_TEST_SESSIONS, "Only %d sessions saw their peer go", ended);
+    cr_assert_not(notCoroutine, "Session not told it is a coroutine");
+    cr_assert_not(wrongThread, "Sessions ran on more than one thread");
+
+    cr_assert_eq(coro_spawn(suspend_twice, NULL), 0);
+    while (__atomic_load_n(&suspended, __ATOMIC_SEQ_CST) == NULL){
+        usleep(1000);
+    }
+    usleep(10000);
+    cr_assert_eq(resumed, 0, "Suspended coroutine ran on");
+    coro_wake(suspended);
+    wait_for(&resumed, 1);
+    cr_assert_eq(resumed, 1, "Suspended coroutine not woken");
+    coro_wake(suspended);
+    __atomic_store_n(&resumed, 2, __ATOMIC_SEQ_CST);
+    wait_for(&resumed, 3);
+    cr_assert_eq(resumed, 3, "Wakeup asked for while running was lost");
+}
@@ -0,0 +1,87 @@
+#include <criterion/criterion.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "elo.h"
+
+/*
+ * Unit tests of the Elo rating computations, checked against the
+ * logistic computed directly with pow().
+ */
+
+#define ELO_TEST_PLAYERS 5
+#define ELO_TEST_GAMES 200
+
+static double logistic(double diff){
+    return 1 / (1 + pow(10, diff / ELO_SCALE));
+}
+
+Test(elo_suite, 00_table_matches_logistic, .timeout = 5) {
+    //whole points, which are in the table, and points in between, which are not
+    for (double d = -ELO_TABLE_SPAN - 500; d <= ELO_TABLE_SPAN + 500; d += 0.37){
+        cr_assert_float_eq(elo_expected(d), logistic(d), 1e-6, "Expected score off at %.2f", d);
+    }
+    for (int d = -ELO_TABLE_SPAN; d <= ELO_TABLE_SPAN; d++){
+        cr_assert_float_eq(elo_expected(d), logistic(d), 1e-12, "Table entry off at %d", d);
+    }
+    //far outside the table
+    cr_assert_float_eq(elo_expected(1e5), logistic(1e5), 1e-12);
+    cr_assert_float_eq(elo_expected(-1e5), logistic(-1e5), 1e-12);
+}
+
+Test(elo_suite, 01_expected_scores_sum_to_one, .timeout = 5) {
+    cr_assert_float_eq(elo_expected(0), 0.5, 1e-12);
+    for (double d = 0; d < 3000; d += 13.1){
+        cr_assert_float_eq(elo_expected(d) + elo_expected(-d), 1, 1e-6, "Scores at %.1f do not sum to 1", d);
+        cr_assert_leq(elo_expected(d + 13.1), elo_expected(d), "Expected score grows with the opponent's rating");
+    }
+}
+
+Test(elo_suite, 02_update_conserves_points, .timeout = 5) {
+    double r1 = 1500, r2 = 1500;
+    elo_update(&r1, &r2, 1);
+    cr_assert_float_eq(r1, 1500 + ELO_K / 2, 1e-9, "Winner at equal ratings got %f", r1);
+    cr_assert_float_eq(r2, 1500 - ELO_K / 2, 1e-9);
+    r1 = 1500, r2 = 1500;
+    elo_update(&r1, &r2, 0);
+    cr_assert_float_eq(r1, 1500, 1e-9, "Draw at equal ratings changed %f", r1);
+
+    //whatever the ratings and result, no points are created or destroyed
+    for (int result = 0; result <= 2; result++){
+        for (double d = -900; d <= 900; d += 150){
+            r1 = 1500;
+            r2 = 1500 + d;
+            elo_update(&r1, &r2, result);
+            cr_assert_float_eq(r1 + r2, 3000 + d, 1e-9);
+            double expect = ELO_K * ((result == 1 ? 1 : result == 2 ? 0 : 0.5) - logistic(d));
+            cr_assert_float_eq(r1 - 1500, expect, 1e-4, "Change off for result %d at %.0f", result, d);
+        }
+    }
+    //an invalid result changes nothing
+    r1 = 1400, r2 = 1600;
+    elo_update(&r1, &r2, 3);
+    cr_assert_float_eq(r1, 1400, 0);
+    cr_assert_float_eq(r2, 1600, 0);
+}
+
+Test(elo_suite, 03_rate_matches_update, .timeout = 5) {
+    ELO_GAME games[ELO_TEST_GAMES];
+    double rated[ELO_TEST_PLAYERS], updated[ELO_TEST_PLAYERS];
+    for (int p = 0; p < ELO_TEST_PLAYERS; p++){
+        rated[p] = updated[p] = 1200 + 100 * p;
+    }
+    unsigned seed = 12345;
+    for (int i = 0; i < ELO_TEST_GAMES; i++){
+        games[i].first = rand_r(&seed) % ELO_TEST_PLAYERS;
+        games[i].second = (games[i].first + 1 + rand_r(&seed) % (ELO_TEST_PLAYERS - 1)) % ELO_TEST_PLAYERS;
+        games[i].result = rand_r(&seed) % 3;
+        elo_update(&updated[games[i].first], &updated[games[i].second], games[i].result);
+    }
+    elo_rate(games, ELO_TEST_GAMES, rated);
+    double total = 0;
+    for (int p = 0; p < ELO_TEST_PLAYERS; p++){
+        cr_assert_float_eq(rated[p], updated[p], 1e-9, "Player %d rated %f, updated to %f", p, rated[p], updated[p]);
+        total += rated[p];
+    }
+    cr_assert_float_eq(total, 5 * 1200 + 100 * 10, 1e-6);
+}
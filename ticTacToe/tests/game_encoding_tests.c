@@ -0,0 +1,132 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "game.h"
+#include "game_ext.h"
+
+/*
+ * Unit tests of the board encodings that a client can select, checked
+ * against the layouts documented in game_ext.h.
+ */
+
+static uint32_t packed_state(GAME *game){
+    uint32_t v;
+    cr_assert_eq(game_encode_state(game, GAME_ENC_PACKED, &v, sizeof(v)), 4);
+    return ntohl(v);
+}
+
+static int packed_cell(uint32_t v, int cell){
+    return (v >> (2 * cell)) & 3;
+}
+
+/*
+ * Apply a delta to a packed state, as a client that selected the delta
+ * encoding has to.
+ */
+static uint32_t apply_delta(uint32_t v, unsigned char *delta){
+    int role = delta[1] & 3;
+    v &= ~((uint32_t)3 << (2 * delta[0]));
+    v |= (uint32_t)role << (2 * delta[0]);
+    int first_is_o = role == FIRST_PLAYER_ROLE ? (delta[1] >> 2) & 1 : !((delta[1] >> 2) & 1);
+    v &= ~((uint32_t)1 << 18);
+    v |= (uint32_t)first_is_o << 18;
+    v &= ~((uint32_t)3 << 19);
+    v |= (uint32_t)(role == FIRST_PLAYER_ROLE ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE) << 19;
+    v &= ~((uint32_t)0xf << 21);
+    v |= (uint32_t)(delta[1] >> 4) << 21;
+    return v;
+}
+
+Test(game_encoding_suite, 00_sizes, .timeout = 5) {
+    cr_assert_eq(game_encoding_size(GAME_ENC_ASCII), 18);
+    cr_assert_eq(game_encoding_size(GAME_ENC_PACKED), 4);
+    cr_assert_eq(game_encoding_size(GAME_ENC_DELTA), 2);
+    cr_assert_eq(game_encoding_size(GAME_ENC_COUNT), 0, "Invalid encoding has a size");
+    for (int enc = 0; enc < GAME_ENC_COUNT; enc++){
+        cr_assert_leq(game_encoding_size(enc), GAME_ENC_MAX_SIZE);
+    }
+    cr_assert_eq(game_full_encoding(GAME_ENC_ASCII), GAME_ENC_ASCII);
+    cr_assert_eq(game_full_encoding(GAME_ENC_PACKED), GAME_ENC_PACKED);
+    cr_assert_eq(game_full_encoding(GAME_ENC_DELTA), GAME_ENC_PACKED);
+}
+
+Test(game_encoding_suite, 01_initial_state, .timeout = 5) {
+    GAME *game = game_create();
+    cr_assert_not_null(game);
+    uint32_t v = packed_state(game);
+    cr_assert_eq(v, (uint32_t)FIRST_PLAYER_ROLE << 19, "Empty board packed as %#x", v);
+    unsigned char delta[2];
+    cr_assert_eq(game_encode_state(game, GAME_ENC_DELTA, delta, sizeof(delta)), 2);
+    cr_assert_eq(delta[0], 0xff, "No move made, but the delta names cell %d", delta[0]);
+    cr_assert_eq(delta[1], 0);
+    char ascii[GAME_ENC_MAX_SIZE];
+    cr_assert_eq(game_encode_state(game, GAME_ENC_ASCII, ascii, sizeof(ascii)), 18);
+    cr_assert_arr_eq(ascii, " | | \n | | \n | | \n", 18);
+    game_unref(game, "encoding test done");
+}
+
+Test(game_encoding_suite, 02_packed_fields, .timeout = 5) {
+    GAME *game = game_create();
+    cr_assert_eq(game_play_move(game, FIRST_PLAYER_ROLE, "5"), 0);
+    cr_assert_eq(game_play_move(game, SECOND_PLAYER_ROLE, "1"), 0);
+    cr_assert_eq(game_play_move(game, FIRST_PLAYER_ROLE, "9"), 0);
+    uint32_t v = packed_state(game);
+    for (int cell = 0; cell < 9; cell++){
+        int expected = cell == 4 || cell == 8 ? FIRST_PLAYER_ROLE : cell == 0 ? SECOND_PLAYER_ROLE : 0;
+        cr_assert_eq(packed_cell(v, cell), expected, "Cell %d packed as %d", cell, packed_cell(v, cell));
+    }
+    cr_assert_eq((v >> 18) & 1, 0, "First player is X, but packed as O");
+    cr_assert_eq((v >> 19) & 3, SECOND_PLAYER_ROLE);
+    cr_assert_eq((v >> 21) & 0xf, 3);
+    cr_assert_eq(v >> 25, 0, "Unused bits set in %#x", v);
+
+    //the ASCII board is the one game_unparse_state() has always returned
+    char ascii[GAME_ENC_MAX_SIZE];
+    game_encode_state(game, GAME_ENC_ASCII, ascii, sizeof(ascii));
+    char *state = game_unparse_state(game);
+    cr_assert_arr_eq(ascii, state, 18);
+    cr_assert_arr_eq(ascii, "O| | \n |X| \n | |X\n", 18);
+    free(state);
+    game_unref(game, "encoding test done");
+}
+
+Test(game_encoding_suite, 03_deltas_rebuild_packed_state, .timeout = 5) {
+    GAME *game = game_create();
+    char *moves[] = {"1", "4", "2", "5"};
+    uint32_t v = packed_state(game);
+    for (int i = 0; i < 4; i++){
+        GAME_ROLE role = i % 2 ? SECOND_PLAYER_ROLE : FIRST_PLAYER_ROLE;
+        cr_assert_eq(game_play_move(game, role, moves[i]), 0);
+        unsigned char delta[2];
+        game_encode_state(game, GAME_ENC_DELTA, delta, sizeof(delta));
+        cr_assert_eq(delta[0], moves[i][0] - '1');
+        cr_assert_eq(delta[1] & 3, role);
+        cr_assert_eq((delta[1] >> 2) & 1, role == SECOND_PLAYER_ROLE, "Symbol bit wrong for move %d", i);
+        cr_assert_eq(delta[1] >> 4, i + 1);
+        v = apply_delta(v, delta);
+        uint32_t full = packed_state(game);
+        cr_assert_eq(v, full, "After move %d, delta gives %#x, packed is %#x", i, v, full);
+    }
+    //the winning move leaves no one to move
+    cr_assert_eq(game_play_move(game, FIRST_PLAYER_ROLE, "3"), 0);
+    cr_assert(game_is_over(game));
+    v = packed_state(game);
+    cr_assert_eq((v >> 19) & 3, NULL_ROLE, "Game is over, but %d is to move", (v >> 19) & 3);
+    cr_assert_eq((v >> 21) & 0xf, 5);
+    game_unref(game, "encoding test done");
+}
+
+Test(game_encoding_suite, 04_rejects_short_buffer, .timeout = 5) {
+    GAME *game = game_create();
+    unsigned char buf[GAME_ENC_MAX_SIZE];
+    memset(buf, 0xaa, sizeof(buf));
+    cr_assert_eq(game_encode_state(game, GAME_ENC_PACKED, buf, 3), 0);
+    cr_assert_eq(game_encode_state(game, GAME_ENC_ASCII, buf, 17), 0);
+    cr_assert_eq(game_encode_state(game, GAME_ENC_COUNT, buf, sizeof(buf)), 0);
+    cr_assert_eq(game_encode_state(NULL, GAME_ENC_DELTA, buf, sizeof(buf)), 0);
+    cr_assert_eq(buf[0], 0xaa, "Buffer written by a failed encode");
+    game_unref(game, "encoding test done");
+}
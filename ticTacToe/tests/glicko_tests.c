@@ -0,0 +1,100 @@
+#include <criterion/criterion.h>
+#include <math.h>
+
+#include "glicko.h"
+#include "player.h"
+#include "player_ext.h"
+#include "player_registry.h"
+
+/*
+ * Unit tests of the Glicko-2 rating computations, checked against the
+ * example worked through in Glickman's "Example of the Glicko-2 system".
+ */
+
+static GLICKO_RATING rating(double r, double rd, double sigma){
+    GLICKO_RATING g = {r, rd, sigma};
+    return g;
+}
+
+Test(glicko_suite, 00_glickman_example, .timeout = 5) {
+    GLICKO_RATING r = rating(1500, 200, 0.06);
+    GLICKO_GAME games[3] = {
+        {rating(1400, 30, 0.06), 1},
+        {rating(1550, 100, 0.06), 0},
+        {rating(1700, 300, 0.06), 0}
+    };
+    glicko_update(&r, games, 3);
+    //the example rounds as it goes, so its results are only good to the last digit
+    cr_assert_float_eq(r.rating, 1464.06, 0.02, "Rating is %.4f, expected 1464.06", r.rating);
+    cr_assert_float_eq(r.deviation, 151.52, 0.01, "Deviation is %.4f, expected 151.52", r.deviation);
+    cr_assert_float_eq(r.volatility, 0.05999, 0.00001, "Volatility is %.6f, expected 0.05999", r.volatility);
+}
+
+Test(glicko_suite, 01_idle_player_grows_uncertain, .timeout = 5) {
+    GLICKO_RATING r = rating(1700, 200, 0.06);
+    glicko_update(&r, NULL, 0);
+    cr_assert_float_eq(r.rating, 1700, 0, "An idle player's rating changed");
+    cr_assert_float_eq(r.volatility, 0.06, 0);
+    double expected = sqrt(200 * 200 + (0.06 * GLICKO_SCALE) * (0.06 * GLICKO_SCALE));
+    cr_assert_float_eq(r.deviation, expected, 1e-6, "Deviation is %.4f, expected %.4f", r.deviation, expected);
+
+    //never beyond that of a new player
+    r = rating(1500, GLICKO_INITIAL_DEVIATION - 0.01, 0.06);
+    for (int i = 0; i < 10; i++){
+        glicko_update(&r, NULL, 0);
+    }
+    cr_assert_float_eq(r.deviation, GLICKO_INITIAL_DEVIATION, 1e-9, "Deviation grew to %f", r.deviation);
+}
+
+Test(glicko_suite, 02_results_move_ratings_the_right_way, .timeout = 5) {
+    GLICKO_RATING opponent = rating(1500, 80, 0.06);
+    //a draw against an equal opponent changes the rating very little
+    GLICKO_RATING r = rating(1500, 80, 0.06);
+    GLICKO_GAME game = {opponent, 0.5};
+    glicko_update(&r, &game, 1);
+    cr_assert_float_eq(r.rating, 1500, 1e-6, "Draw moved the rating to %f", r.rating);
+    cr_assert_lt(r.deviation, 80, "Playing did not make the rating more certain");
+
+    //an uncertain rating moves further than a certain one
+    GLICKO_RATING sure = rating(1500, 50, 0.06);
+    GLICKO_RATING unsure = rating(1500, 300, 0.06);
+    game.score = 1;
+    glicko_update(&sure, &game, 1);
+    glicko_update(&unsure, &game, 1);
+    cr_assert_gt(sure.rating, 1500);
+    cr_assert_gt(unsure.rating - 1500, 2 * (sure.rating - 1500),
+                 "Uncertain rating moved %f, certain one %f", unsure.rating - 1500, sure.rating - 1500);
+}
+
+Test(glicko_suite, 03_period_rates_registered_players, .timeout = 5) {
+    player_rating_system = PLAYER_RATING_GLICKO2;
+    PLAYER_REGISTRY *preg = preg_init();
+    cr_assert_not_null(preg);
+    PLAYER *winner = preg_register(preg, "winner");
+    PLAYER *loser = preg_register(preg, "loser");
+    PLAYER *idle = preg_register(preg, "idle");
+    player_set_glicko(idle, 1500, 100, 0.06);
+    //a long period, so that it only ends when asked to
+    cr_assert_eq(glicko_init(preg, 3600 * 1000), 0);
+    glicko_post_result(winner, loser, 1);
+    cr_assert_eq(player_get_rating(winner), PLAYER_INITIAL_RATING, "Result was rated before the period ended");
+    glicko_end_period();
+
+    double r, rd, sigma;
+    player_get_glicko(winner, &r, &rd, &sigma);
+    GLICKO_RATING expect = rating(PLAYER_INITIAL_RATING, GLICKO_INITIAL_DEVIATION, GLICKO_INITIAL_VOLATILITY);
+    GLICKO_GAME game = {expect, 1};
+    glicko_update(&expect, &game, 1);
+    cr_assert_float_eq(r, expect.rating, 1e-9, "Winner rated %f, expected %f", r, expect.rating);
+    cr_assert_float_eq(rd, expect.deviation, 1e-9);
+    player_get_glicko(loser, &r, &rd, &sigma);
+    cr_assert_float_eq(r, 2 * PLAYER_INITIAL_RATING - expect.rating, 1e-6, "Loser rated %f", r);
+    player_get_glicko(idle, &r, &rd, &sigma);
+    cr_assert_float_eq(r, 1500, 0);
+    cr_assert_gt(rd, 100, "An idle player's deviation did not grow");
+    glicko_fini();
+    player_unref(winner, "glicko test done");
+    player_unref(loser, "glicko test done");
+    player_unref(idle, "glicko test done");
+    preg_fini(preg);
+}
@@ -0,0 +1,168 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "client_registry.h"
+#include "client_registry_ext.h"
+#include "client_ext.h"
+#include "handoff.h"
+#include "player.h"
+#include "player_ext.h"
+#include "player_registry.h"
+#include "server.h"
+
+/*
+ * Unit tests of taking over from an old server: the test plays the old
+ * server, sending records over the upgrade socket as handoff_send() does,
+ * and checks what handoff_receive() rebuilds from them.
+ */
+
+extern PLAYER_REGISTRY *player_registry;
+
+//the first record of a handoff, as handoff.c sends it
+#define HANDOFF_TEST_HELLO "H\tJEUX-HANDOFF\t4"
+
+static int upgrade[2];
+
+static void setup_upgrade(void){
+    client_registry = creg_init();
+    player_registry = preg_init();
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, upgrade), 0, "socketpair failed");
+}
+
+/*
+ * Send a record as the old server, with a descriptor attached if fd is
+ * not -1.
+ */
+static void send_record(char *rec, int fd){
+    struct iovec iov = {rec, strlen(rec)};
+    struct msghdr msg = {0};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0){
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg -> cmsg_level = SOL_SOCKET;
+        cmsg -> cmsg_type = SCM_RIGHTS;
+        cmsg -> cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    cr_assert_eq(sendmsg(upgrade[1], &msg, 0), (ssize_t)strlen(rec), "Record %s not sent", rec);
+}
+
+/*
+ * Open a listening socket on a port of its own, and say which port.
+ */
+static int open_listener(int *port){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    cr_assert_geq(fd, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cr_assert_eq(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    cr_assert_eq(listen(fd, 4), 0);
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int port_of(int fd){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    cr_assert_eq(getsockname(fd, (struct sockaddr *)&addr, &len), 0, "Listening socket not taken over");
+    return ntohs(addr.sin_port);
+}
+
+Test(handoff_suite, 00_players_and_clients_taken_over, .timeout = 5) {
+    setup_upgrade();
+    int port;
+    int tcp = open_listener(&port);
+    int alice[2], anon[2];
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, alice), 0);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, anon), 0);
+    //everything is queued on the upgrade socket, the answer to READY too
+    send_record(HANDOFF_TEST_HELLO, -1);
+    send_record("L", tcp);
+    send_record("P\t1612.25\t81.5\t0.0625\talice", -1);
+    send_record("P\t1400\t350\t0.06\tbob", -1);
+    send_record("C\t2\t3\talice", alice[0]);
+    send_record("C\t0\t0\t", anon[0]);
+    send_record("E", -1);
+    send_record("DONE", -1);
+    close(tcp);
+    close(alice[0]);
+    close(anon[0]);
+
+    HANDOFF_LISTENERS listeners;
+    cr_assert_eq(handoff_receive(upgrade[0], &listeners), 0, "Handoff failed");
+    char buf[64];
+    ssize_t n = recv(upgrade[1], buf, sizeof(buf) - 1, 0);
+    cr_assert_eq(n, 5);
+    buf[n] = '\0';
+    cr_assert_str_eq(buf, "READY");
+    cr_assert_eq(port_of(listeners.tcp), port, "Another listening socket taken over");
+    cr_assert_eq(listeners.local, -1);
+    cr_assert_eq(listeners.shm, -1);
+
+    double r, rd, vol;
+    PLAYER *p = preg_register(player_registry, "alice");
+    player_get_glicko(p, &r, &rd, &vol);
+    cr_assert(r == 1612.25 && rd == 81.5 && vol == 0.0625, "Rating of alice not carried over");
+    player_unref(p, "handoff test done");
+
+    CLIENT *clients[MAX_CLIENTS];
+    int nc = creg_snapshot(client_registry, clients);
+    cr_assert_eq(nc, 2, "Took over %d clients", nc);
+    for (int i = 0; i < nc; i++){
+        PLAYER *player = client_get_player(clients[i]);
+        int peer = player == NULL ? anon[1] : alice[1];
+        if (player != NULL){
+            cr_assert_str_eq(player_get_name(player), "alice");
+            cr_assert_eq(client_get_board_encoding(clients[i]), 2);
+            cr_assert_eq(client_get_caps(clients[i]), 3);
+        }
+        //the connection itself was passed, not a copy of its state
+        cr_assert_eq(write(client_get_fd(clients[i]), "x", 1), 1);
+        cr_assert_eq(read(peer, buf, 1), 1, "Connection of client %d not taken over", i);
+        client_unref(clients[i], "handoff test done");
+    }
+}
+
+Test(handoff_suite, 01_other_servers_refused, .timeout = 5) {
+    setup_upgrade();
+    int port;
+    int tcp = open_listener(&port);
+    send_record("H\tJEUX-HANDOFF\t0", -1);
+    send_record("L", tcp);
+    send_record("E", -1);
+    send_record("DONE", -1);
+    close(tcp);
+    HANDOFF_LISTENERS listeners;
+    cr_assert_eq(handoff_receive(upgrade[0], &listeners), -1, "Handoff from another version accepted");
+    cr_assert_eq(listeners.tcp, -1);
+}
+
+Test(handoff_suite, 02_no_listener_no_takeover, .timeout = 5) {
+    setup_upgrade();
+    send_record(HANDOFF_TEST_HELLO, -1);
+    send_record("P\t1500\t350\t0.06\tcarol", -1);
+    send_record("E", -1);
+    send_record("DONE", -1);
+    HANDOFF_LISTENERS listeners;
+    cr_assert_eq(handoff_receive(upgrade[0], &listeners), -1, "Took over without a listening socket");
+    cr_assert_eq(listeners.tcp, -1);
+    //the old server is not told to stop
+    char buf[16];
+    cr_assert_eq(recv(upgrade[1], buf, sizeof(buf), MSG_DONTWAIT), -1, "READY sent");
+}
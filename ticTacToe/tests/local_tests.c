@@ -0,0 +1,165 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "local.h"
+
+/*
+ * Unit tests of the shared-memory transport, with the test playing the
+ * client: it maps the rings, and puts bytes into them and takes bytes out
+ * of them as described in local.h, while the server side reads and writes
+ * through local_read() and local_write().
+ */
+
+#define LOCAL_TEST_CHUNK 70001
+
+static int fds[2];
+static int memfd;
+static LOCAL_SHM *shm;
+
+/*
+ * Make the rings, as a client that was sent them would find them, and
+ * have the server's end of a socket pair use them.
+ */
+static void setup_rings(void){
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "socketpair failed");
+    char path[] = "/tmp/local_testXXXXXX";
+    memfd = mkstemp(path);
+    cr_assert_geq(memfd, 0);
+    unlink(path);
+    cr_assert_eq(ftruncate(memfd, sizeof(LOCAL_SHM)), 0);
+    shm = mmap(NULL, sizeof(LOCAL_SHM), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    cr_assert_neq(shm, MAP_FAILED);
+    memcpy(shm -> magic, LOCAL_SHM_MAGIC, sizeof(shm -> magic));
+    shm -> ringSize = LOCAL_RING_SIZE;
+    cr_assert_eq(local_shm_adopt(fds[0], memfd), 0, "Rings not adopted");
+}
+
+static void teardown_rings(void){
+    local_detach(fds[0]);
+    munmap(shm, sizeof(LOCAL_SHM));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/*
+ * Put bytes into the ring to the server, ringing its bell if it sleeps.
+ */
+static void client_put(char *buf, size_t n){
+    LOCAL_RING *r = &shm -> toServer;
+    uint32_t tail = __atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST);
+    cr_assert_leq(tail - __atomic_load_n(&r -> head, __ATOMIC_SEQ_CST) + n, LOCAL_RING_SIZE);
+    for (size_t i = 0; i < n; i++){
+        r -> data[(tail + i) % LOCAL_RING_SIZE] = buf[i];
+    }
+    __atomic_store_n(&r -> tail, tail + (uint32_t)n, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&r -> sleeping, 0, __ATOMIC_SEQ_CST)){
+        cr_assert_eq(send(fds[1], "", 1, 0), 1);
+    }
+}
+
+/*
+ * Take what there is out of the ring from the server.
+ */
+static size_t client_take(char *buf, size_t n){
+    LOCAL_RING *r = &shm -> toClient;
+    uint32_t head = __atomic_load_n(&r -> head, __ATOMIC_SEQ_CST);
+    uint32_t avail = __atomic_load_n(&r -> tail, __ATOMIC_SEQ_CST) - head;
+    size_t k = avail < n ? avail : n;
+    for (size_t i = 0; i < k; i++){
+        buf[i] = r -> data[(head + i) % LOCAL_RING_SIZE];
+    }
+    __atomic_store_n(&r -> head, head + (uint32_t)k, __ATOMIC_SEQ_CST);
+    return k;
+}
+
+static void fill(char *buf, size_t n, unsigned seed){
+    for (size_t i = 0; i < n; i++){
+        buf[i] = (char)(seed * 31 + i * 7 + i / 251);
+    }
+}
+
+Test(local_suite, 00_round_trip_through_rings, .timeout = 5) {
+    setup_rings();
+    cr_assert_eq(local_shm_fd(fds[0]), memfd);
+    static char out[LOCAL_TEST_CHUNK], in[LOCAL_TEST_CHUNK];
+    //enough chunks for both rings to wrap around a few times
+    for (unsigned c = 0; c < 4 * LOCAL_RING_SIZE / LOCAL_TEST_CHUNK; c++){
+        fill(out, sizeof(out), c);
+        client_put(out, sizeof(out));
+        size_t got = 0;
+        while (got < sizeof(in)){
+            ssize_t n = local_read(fds[0], in + got, sizeof(in) - got);
+            cr_assert_gt(n, 0, "Read %ld from a ring holding %zu bytes", (long)n, sizeof(in) - got);
+            got += n;
+        }
+        cr_assert_arr_eq(in, out, sizeof(out), "Chunk %u to the server changed on the way", c);
+
+        fill(out, sizeof(out), c + 1000);
+        cr_assert_eq(local_write(fds[0], out, sizeof(out)), sizeof(out));
+        cr_assert_eq(client_take(in, sizeof(in)), sizeof(in));
+        cr_assert_arr_eq(in, out, sizeof(out), "Chunk %u to the client changed on the way", c);
+    }
+    cr_assert_eq(local_shm_fd(fds[1]), -1, "Connection without rings reported as having them");
+    teardown_rings();
+}
+
+static char woken[16];
+static ssize_t wokenLen;
+
+static void *read_when_woken(void *arg){
+    wokenLen = local_read(fds[0], woken, sizeof(woken));
+    return NULL;
+}
+
+Test(local_suite, 01_sleeping_reader_is_rung, .timeout = 5) {
+    setup_rings();
+    pthread_t tid;
+    cr_assert_eq(pthread_create(&tid, NULL, read_when_woken, NULL), 0);
+    //the server finds its ring empty and says it is going to sleep
+    while (!__atomic_load_n(&shm -> toServer.sleeping, __ATOMIC_SEQ_CST)){
+        usleep(1000);
+    }
+    client_put("hello", 5);
+    pthread_join(tid, NULL);
+    cr_assert_eq(wokenLen, 5, "Sleeping reader got %ld bytes", (long)wokenLen);
+    cr_assert_arr_eq(woken, "hello", 5);
+
+    //once the client has gone, the reader finds the end
+    close(fds[1]);
+    char buf[8];
+    cr_assert_eq(local_read(fds[0], buf, sizeof(buf)), 0);
+    local_detach(fds[0]);
+    munmap(shm, sizeof(LOCAL_SHM));
+    close(fds[0]);
+}
+
+Test(local_suite, 02_shutdown_stops_rings, .timeout = 5) {
+    setup_rings();
+    client_put("left", 4);
+    cr_assert_eq(local_shutdown(fds[0], SHUT_RDWR), 0);
+    char buf[8];
+    cr_assert_eq(local_read(fds[0], buf, sizeof(buf)), 0, "Read after shutdown");
+    cr_assert_eq(local_write(fds[0], "x", 1), -1, "Wrote after shutdown");
+    teardown_rings();
+}
+
+Test(local_suite, 03_foreign_memory_not_adopted, .timeout = 5) {
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "socketpair failed");
+    char path[] = "/tmp/local_testXXXXXX";
+    int fd = mkstemp(path);
+    cr_assert_geq(fd, 0);
+    unlink(path);
+    cr_assert_eq(ftruncate(fd, sizeof(LOCAL_SHM)), 0);
+    //no magic
+    cr_assert_eq(local_shm_adopt(fds[0], fd), -1, "Rings without the magic adopted");
+    cr_assert_eq(local_shm_fd(fds[0]), -1);
+    cr_assert_eq(local_read(fds[0], path, 1), LOCAL_NOT_SHM);
+    close(fds[0]);
+    close(fds[1]);
+}
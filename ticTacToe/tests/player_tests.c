@@ -0,0 +1,121 @@
+#include <criterion/criterion.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "elo.h"
+#include "player.h"
+#include "player_ext.h"
+
+/*
+ * Unit tests of posting results under Elo, where the two ratings changed
+ * by a result are changed together under both players' locks.  Threads
+ * post results between overlapping pairs of players, taken in both
+ * orders, and the ratings reported are checked to form one history.
+ */
+
+#define PLAYER_TEST_PLAYERS 4
+#define PLAYER_TEST_THREADS 8
+#define PLAYER_TEST_RESULTS 2000
+
+typedef struct posted {
+    int players[2];
+    int result;
+    double before[2];
+    double after[2];
+} POSTED;
+
+static PLAYER *players[PLAYER_TEST_PLAYERS];
+static POSTED posted[PLAYER_TEST_THREADS][PLAYER_TEST_RESULTS];
+
+static void *post_results(void *arg){
+    int t = (int)(long)arg;
+    for (int i = 0; i < PLAYER_TEST_RESULTS; i++){
+        POSTED *p = &posted[t][i];
+        p -> players[0] = (t + i) % PLAYER_TEST_PLAYERS;
+        p -> players[1] = (p -> players[0] + 1 + i % (PLAYER_TEST_PLAYERS - 1)) % PLAYER_TEST_PLAYERS;
+        p -> result = i % 3;
+        player_post_result_ratings(players[p -> players[0]], players[p -> players[1]], p -> result,
+                                   p -> before, p -> after);
+    }
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+Test(player_suite, 00_paired_updates_concurrently, .timeout = 5) {
+    char name[16];
+    for (int i = 0; i < PLAYER_TEST_PLAYERS; i++){
+        snprintf(name, sizeof(name), "player%d", i);
+        players[i] = player_create(name);
+        cr_assert_not_null(players[i]);
+    }
+    uint64_t version = player_rating_version();
+    pthread_t tids[PLAYER_TEST_THREADS];
+    for (long t = 0; t < PLAYER_TEST_THREADS; t++){
+        cr_assert_eq(pthread_create(&tids[t], NULL, post_results, (void *)t), 0);
+    }
+    for (int t = 0; t < PLAYER_TEST_THREADS; t++){
+        pthread_join(tids[t], NULL);
+    }
+    int total = PLAYER_TEST_THREADS * PLAYER_TEST_RESULTS;
+    cr_assert_eq(player_rating_version() - version, total, "Rating version not bumped once per result");
+
+    //each result changed both ratings at once from what they were
+    for (int t = 0; t < PLAYER_TEST_THREADS; t++){
+        for (int i = 0; i < PLAYER_TEST_RESULTS; i++){
+            POSTED *p = &posted[t][i];
+            double r[2] = {p -> before[0], p -> before[1]};
+            elo_update(&r[0], &r[1], p -> result);
+            cr_assert(r[0] == p -> after[0] && r[1] == p -> after[1],
+                      "Result %d of thread %d not rated from the ratings before", i, t);
+        }
+    }
+
+    //the ratings each player went through form one chain from the initial one
+    double sum = 0;
+    static double from[PLAYER_TEST_THREADS * PLAYER_TEST_RESULTS + 1];
+    static double to[PLAYER_TEST_THREADS * PLAYER_TEST_RESULTS + 1];
+    for (int k = 0; k < PLAYER_TEST_PLAYERS; k++){
+        int n = 0;
+        from[n] = player_get_rating_exact(players[k]);
+        to[n++] = PLAYER_INITIAL_RATING;
+        for (int t = 0; t < PLAYER_TEST_THREADS; t++){
+            for (int i = 0; i < PLAYER_TEST_RESULTS; i++){
+                POSTED *p = &posted[t][i];
+                for (int j = 0; j < 2; j++){
+                    if (p -> players[j] == k){
+                        from[n] = p -> before[j];
+                        to[n++] = p -> after[j];
+                    }
+                }
+            }
+        }
+        qsort(from, n, sizeof(double), compare_doubles);
+        qsort(to, n, sizeof(double), compare_doubles);
+        for (int i = 0; i < n; i++){
+            cr_assert(from[i] == to[i], "Rating of player %d changed from a value it never had", k);
+        }
+        sum += player_get_rating_exact(players[k]);
+    }
+    cr_assert_float_eq(sum, PLAYER_TEST_PLAYERS * PLAYER_INITIAL_RATING, 1e-6, "Ratings not conserved");
+
+    for (int i = 0; i < PLAYER_TEST_PLAYERS; i++){
+        player_unref(players[i], "player test done");
+    }
+}
+
+Test(player_suite, 01_result_against_oneself_not_rated, .timeout = 5) {
+    PLAYER *p = player_create("alone");
+    uint64_t version = player_rating_version();
+    double before[2], after[2];
+    player_post_result_ratings(p, p, 1, before, after);
+    cr_assert_eq(player_rating_version(), version);
+    cr_assert_float_eq(after[0], PLAYER_INITIAL_RATING, 1e-12);
+    cr_assert_float_eq(before[0], after[0], 1e-12);
+    cr_assert_float_eq(player_get_rating_exact(p), PLAYER_INITIAL_RATING, 1e-12);
+    player_unref(p, "player test done");
+}
@@ -0,0 +1,180 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "protocol_ext.h"
+
+/*
+ * Unit tests of the protocol extensions: capability lists, and the
+ * framing of tagged packets and of the requests carried by a BATCH.
+ * Packets are sent over a socket pair.
+ */
+
+static int fds[2];
+
+static void setup_pair(void){
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "socketpair failed");
+}
+
+static JEUX_PACKET_HEADER make_header(uint8_t type, uint8_t id, uint16_t size){
+    JEUX_PACKET_HEADER hdr = {0};
+    hdr.type = type;
+    hdr.id = id;
+    hdr.size = htons(size);
+    hdr.timestamp_sec = htonl(1234);
+    hdr.timestamp_nsec = htonl(5678);
+    return hdr;
+}
+
+Test(protocol_suite, 00_packed_layout, .timeout = 5) {
+    char payload[] = "alice";
+    JEUX_PACKET_HEADER hdr = make_header(JEUX_LOGIN_PKT, 3, 5);
+    uint32_t seq = 0x01020304;
+    char buf[64];
+    cr_assert_eq(proto_packed_size(&hdr, &seq), sizeof(hdr) + 4 + 5);
+    size_t len = proto_pack_packet_seq(&hdr, &seq, payload, buf);
+    cr_assert_eq(len, sizeof(hdr) + 4 + 5);
+    cr_assert_eq(((JEUX_PACKET_HEADER *)buf) -> type, JEUX_LOGIN_PKT | JEUX_SEQ_FLAG);
+    cr_assert_eq(((JEUX_PACKET_HEADER *)buf) -> size, htons(5), "Sequence number counted in the size");
+    cr_assert_arr_eq(buf + sizeof(hdr), "\x01\x02\x03\x04", 4, "Sequence number not in network byte order");
+    cr_assert_arr_eq(buf + sizeof(hdr) + 4, payload, 5);
+
+    //without a sequence number the flag is cleared again
+    cr_assert_eq(proto_packed_size(&hdr, NULL), sizeof(hdr) + 5);
+    len = proto_pack_packet_seq(&hdr, NULL, payload, buf);
+    cr_assert_eq(len, sizeof(hdr) + 5);
+    cr_assert_eq(((JEUX_PACKET_HEADER *)buf) -> type, JEUX_LOGIN_PKT);
+    cr_assert_arr_eq(buf + sizeof(hdr), payload, 5);
+}
+
+Test(protocol_suite, 01_pipelined_packets, .timeout = 5) {
+    setup_pair();
+    //two tagged packets and an untagged one, written at once
+    char buf[256];
+    size_t len = 0;
+    uint32_t seqs[2] = {7, 0xfffffffe};
+    JEUX_PACKET_HEADER hdr = make_header(JEUX_USERS_PKT, 0, 0);
+    len += proto_pack_packet_seq(&hdr, &seqs[0], NULL, buf + len);
+    hdr = make_header(JEUX_INVITE_PKT, 0, 3);
+    len += proto_pack_packet_seq(&hdr, &seqs[1], "bob", buf + len);
+    hdr = make_header(JEUX_PING_PKT, 0, 0);
+    len += proto_pack_packet_seq(&hdr, NULL, NULL, buf + len);
+    cr_assert_eq(write(fds[0], buf, len), len);
+
+    JEUX_PACKET_HEADER got;
+    uint32_t seq;
+    int tagged;
+    void *payload;
+    cr_assert_eq(proto_recv_packet_seq(fds[1], &got, &seq, &tagged, &payload), 0);
+    cr_assert_eq(got.type, JEUX_USERS_PKT, "Sequence flag not cleared");
+    cr_assert_eq(tagged, 1);
+    cr_assert_eq(seq, 7);
+    cr_assert_null(payload);
+    cr_assert_eq(proto_recv_packet_seq(fds[1], &got, &seq, &tagged, &payload), 0);
+    cr_assert_eq(got.type, JEUX_INVITE_PKT);
+    cr_assert_eq(seq, 0xfffffffe);
+    cr_assert_not_null(payload);
+    cr_assert_str_eq(payload, "bob", "Payload read from the wrong place");
+    free(payload);
+    cr_assert_eq(proto_recv_packet_seq(fds[1], &got, &seq, &tagged, &payload), 0);
+    cr_assert_eq(got.type, JEUX_PING_PKT);
+    cr_assert_eq(tagged, 0);
+    cr_assert_eq(ntohl(got.timestamp_nsec), 5678);
+}
+
+Test(protocol_suite, 02_truncated_packet, .timeout = 5) {
+    setup_pair();
+    char buf[64];
+    JEUX_PACKET_HEADER hdr = make_header(JEUX_LOGIN_PKT, 0, 5);
+    uint32_t seq = 1;
+    size_t len = proto_pack_packet_seq(&hdr, &seq, "alice", buf);
+    //the connection ends in the middle of the payload
+    cr_assert_eq(write(fds[0], buf, len - 2), len - 2);
+    close(fds[0]);
+    JEUX_PACKET_HEADER got;
+    void *payload = NULL;
+    cr_assert_eq(proto_recv_packet_seq(fds[1], &got, NULL, NULL, &payload), -1, "Short packet was accepted");
+}
+
+Test(protocol_suite, 03_batch_framing, .timeout = 5) {
+    setup_pair();
+    //each request in a BATCH is laid out as it would be sent on its own
+    char items[256];
+    size_t size = 0;
+    char *names[3] = {"alice", NULL, "carol"};
+    for (int i = 0; i < 3; i++){
+        uint16_t n = names[i] ? strlen(names[i]) : 0;
+        JEUX_PACKET_HEADER item = make_header(i == 1 ? JEUX_USERS_PKT : JEUX_INVITE_PKT, i, n);
+        size += proto_pack_packet_seq(&item, NULL, names[i], items + size);
+    }
+    cr_assert_eq(size, 3 * sizeof(JEUX_PACKET_HEADER) + 10);
+    JEUX_PACKET_HEADER hdr = make_header(JEUX_BATCH_PKT, 0, size);
+    uint32_t seq = 42;
+    cr_assert_eq(proto_send_packet_seq(fds[0], &hdr, &seq, items), 0);
+
+    JEUX_PACKET_HEADER got;
+    uint32_t gotSeq;
+    int tagged;
+    void *payload;
+    cr_assert_eq(proto_recv_packet_seq(fds[1], &got, &gotSeq, &tagged, &payload), 0);
+    cr_assert_eq(got.type, JEUX_BATCH_PKT);
+    cr_assert_eq(gotSeq, 42);
+    cr_assert_eq(ntohs(got.size), size);
+    //walk the items as the server does
+    char *p = payload;
+    size_t off = 0;
+    int n = 0;
+    while (off < size){
+        JEUX_PACKET_HEADER item;
+        cr_assert_geq(size - off, sizeof(item), "Item %d header cut short", n);
+        memcpy(&item, p + off, sizeof(item));
+        off += sizeof(item);
+        cr_assert_eq(item.type & JEUX_SEQ_FLAG, 0, "Item %d is tagged", n);
+        cr_assert_eq(item.id, n);
+        uint16_t len = ntohs(item.size);
+        cr_assert_leq(len, size - off);
+        if (names[n] != NULL){
+            cr_assert_eq(len, strlen(names[n]));
+            cr_assert_arr_eq(p + off, names[n], len);
+        }
+        else{
+            cr_assert_eq(len, 0);
+        }
+        off += len;
+        n++;
+    }
+    cr_assert_eq(n, 3);
+    free(payload);
+}
+
+Test(protocol_suite, 04_caps_round_trip, .timeout = 5) {
+    char buf[JEUX_CAP_MAX_LIST];
+    unsigned all = (1u << JEUX_CAP_COUNT) - 1;
+    for (unsigned caps = 0; caps <= all; caps++){
+        size_t len = proto_format_caps(caps, buf);
+        cr_assert_eq(len, strlen(buf));
+        cr_assert_lt(len, JEUX_CAP_MAX_LIST, "List of %#x is too long", caps);
+        int version = -1;
+        cr_assert_eq(proto_parse_caps(buf, &version), caps, "\"%s\" parsed wrongly", buf);
+        cr_assert_eq(version, JEUX_PROTOCOL_VERSION);
+    }
+    cr_assert_str_eq((proto_format_caps(JEUX_CAP_PIPELINE | JEUX_CAP_BATCH, buf), buf), "2 pipeline batch");
+}
+
+Test(protocol_suite, 05_caps_offer_parsing, .timeout = 5) {
+    int version = -1;
+    unsigned caps = proto_parse_caps("7  telepathy  batch compress batched", &version);
+    cr_assert_eq(version, 7);
+    cr_assert_eq(caps, JEUX_CAP_BATCH | JEUX_CAP_COMPRESS, "Unknown names were not ignored: %#x", caps);
+    cr_assert_eq(proto_parse_caps("", &version), 0);
+    cr_assert_eq(version, 0, "Empty offer has version %d", version);
+    cr_assert_eq(proto_parse_caps("2", &version), 0);
+    cr_assert_eq(version, 2);
+    //a name in the version's place is not a capability
+    cr_assert_eq(proto_parse_caps("pipeline", &version), 0);
+}
@@ -0,0 +1,116 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "rating_history.h"
+
+/*
+ * Unit tests of the rating history: points go through the delta and
+ * varint encoding, in memory and spilled to disk, and must come back
+ * exactly as they were recorded, to the hundredth of a point.
+ */
+
+#define RHIST_TEST_POINTS 200
+
+static RHIST_POINT recorded[RHIST_TEST_POINTS];
+
+/*
+ * Record a series with irregular gaps, some of them long, some points at
+ * the same time, and ratings that fall as well as rise, by large amounts
+ * and by hundredths.
+ */
+static void record_series(char *name, int from, int to){
+    uint64_t t = 1700000000000ULL;
+    int32_t r = 150000;
+    for (int i = 0; i < to; i++){
+        t += i % 7 == 0 ? 0 : i % 11 == 0 ? 86400000ULL * 30 : (uint64_t)(i * 37 % 1000);
+        r += i % 5 == 0 ? -(i * 131) : i % 3 == 0 ? 1 : 4321 - i * 17;
+        if (i >= from){
+            recorded[i].time_ms = t;
+            recorded[i].rating = r;
+            rhist_record(name, t, r / 100.0);
+        }
+    }
+}
+
+static void check_points(RHIST_POINT *points, int n, int first){
+    for (int i = 0; i < n; i++){
+        cr_assert_eq(points[i].time_ms, recorded[first + i].time_ms, "Point %d at %lu, expected %lu",
+                     first + i, (unsigned long)points[i].time_ms, (unsigned long)recorded[first + i].time_ms);
+        cr_assert_eq(points[i].rating, recorded[first + i].rating, "Point %d rated %d, expected %d",
+                     first + i, points[i].rating, recorded[first + i].rating);
+    }
+}
+
+Test(rhist_suite, 00_memory_round_trip, .timeout = 5) {
+    cr_assert_eq(rhist_init(NULL), 0);
+    record_series("alice", 0, RHIST_TEST_POINTS);
+    rhist_record("bob", 5, 1234.5);
+    RHIST_POINT points[RHIST_TEST_POINTS + 1];
+    int n = rhist_query("alice", 0, points, RHIST_TEST_POINTS + 1);
+    cr_assert_eq(n, RHIST_TEST_POINTS, "Got %d points, expected %d", n, RHIST_TEST_POINTS);
+    check_points(points, n, 0);
+    //other players' series are kept apart
+    cr_assert_eq(rhist_query("bob", 0, points, 10), 1);
+    cr_assert_eq(points[0].rating, 123450);
+    cr_assert_eq(rhist_query("carol", 0, points, 10), 0);
+    rhist_fini();
+}
+
+Test(rhist_suite, 01_since_and_max, .timeout = 5) {
+    cr_assert_eq(rhist_init(NULL), 0);
+    record_series("alice", 0, RHIST_TEST_POINTS);
+    RHIST_POINT points[RHIST_TEST_POINTS];
+    //the most recent points, oldest first
+    int n = rhist_query("alice", 0, points, 10);
+    cr_assert_eq(n, 10);
+    check_points(points, n, RHIST_TEST_POINTS - 10);
+
+    int from = 120;
+    while (recorded[from - 1].time_ms == recorded[from].time_ms){
+        from -= 1;
+    }
+    n = rhist_query("alice", recorded[from].time_ms, points, RHIST_TEST_POINTS);
+    cr_assert_eq(n, RHIST_TEST_POINTS - from, "Got %d points since point %d", n, from);
+    check_points(points, n, from);
+    cr_assert_eq(rhist_query("alice", recorded[RHIST_TEST_POINTS - 1].time_ms + 1, points, 10), 0);
+    cr_assert_eq(rhist_query("alice", 0, points, 0), -1, "A query for no points should fail");
+    rhist_fini();
+}
+
+Test(rhist_suite, 02_spilled_round_trip, .timeout = 5) {
+    char dir[] = "/tmp/rhist_testXXXXXX";
+    cr_assert_not_null(mkdtemp(dir));
+    cr_assert_eq(rhist_init(dir), 0);
+    //part of the series on disk and the rest in memory
+    record_series("alice", 0, 80);
+    cr_assert_eq(rhist_spill(), 0);
+    record_series("alice", 80, RHIST_TEST_POINTS);
+    RHIST_POINT points[RHIST_TEST_POINTS];
+    int n = rhist_query("alice", 0, points, RHIST_TEST_POINTS);
+    cr_assert_eq(n, RHIST_TEST_POINTS, "Got %d points across the spill", n);
+    check_points(points, n, 0);
+    //all of it on disk, read back after a restart
+    rhist_fini();
+    cr_assert_eq(rhist_init(dir), 0);
+    n = rhist_query("alice", 0, points, RHIST_TEST_POINTS);
+    cr_assert_eq(n, RHIST_TEST_POINTS, "Got %d points after a restart", n);
+    check_points(points, n, 0);
+    n = rhist_query("alice", recorded[150].time_ms, points, 5);
+    cr_assert_eq(n, 5);
+    check_points(points, n, RHIST_TEST_POINTS - 5);
+    rhist_fini();
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%08x.rts", dir, archive_name_hash("alice"));
+    struct stat st;
+    cr_assert_eq(stat(path, &st), 0, "No history file %s", path);
+    //two blocks, each costing a few bytes a point
+    cr_assert_lt(st.st_size, 2 * (RHIST_BLOCK_FIXED + 5) + RHIST_TEST_POINTS * 8, "History file is %ld bytes", (long)st.st_size);
+    unlink(path);
+    rmdir(dir);
+}
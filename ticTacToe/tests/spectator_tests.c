@@ -0,0 +1,139 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "client_registry.h"
+#include "client_ext.h"
+#include "game.h"
+#include "game_ext.h"
+#include "player.h"
+#include "protocol.h"
+#include "protocol_ext.h"
+#include "spectator.h"
+
+/*
+ * Unit tests of the spectator fan-out: a spectator that keeps up is sent
+ * every notification, and one that does not has MOVED notifications
+ * dropped and is sent a full state afterwards.  The spectator's
+ * connection is a socket pair whose far end is read by the test.
+ */
+
+static CLIENT_REGISTRY *cr;
+static CLIENT *client;
+static GAME *game;
+static PLAYER *first, *second;
+static int fds[2];
+
+/*
+ * Start a game with one move made, and a client watching it over a
+ * socket pair in the delta encoding.
+ */
+static void watch_game(int sndbuf){
+    cr = creg_init();
+    cr_assert_not_null(cr);
+    cr_assert_eq(spec_init(), 0);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0, "socketpair failed");
+    if (sndbuf > 0){
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &sndbuf, sizeof(sndbuf));
+    }
+    //a test that goes wrong fails instead of hanging
+    struct timeval tv = {2, 0};
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    client = client_create(cr, fds[0]);
+    cr_assert_not_null(client);
+    cr_assert_eq(client_set_board_encoding(client, GAME_ENC_DELTA), 0);
+    first = player_create("alice");
+    second = player_create("bob");
+    game = game_create();
+    cr_assert_not_null(game);
+    cr_assert_eq(game_play_move(game, FIRST_PLAYER_ROLE, "5"), 0);
+    cr_assert_eq(spec_game_started(game, first, second), 0);
+    char what[16];
+    snprintf(what, sizeof(what), "%c%u", SPEC_GAME_ID_PREFIX, game_get_id(game));
+    cr_assert_eq(spec_watch(client, what), JEUX_WATCH_ID_BASE, "Watch not assigned the first ID");
+}
+
+static void unwatch_game(void){
+    spec_client_gone(client);
+    client_unref(client, "spectator test done");
+    close(fds[0]);
+    close(fds[1]);
+    game_unref(game, "spectator test done");
+    player_unref(first, "spectator test done");
+    player_unref(second, "spectator test done");
+    spec_fini();
+    creg_fini(cr);
+}
+
+/*
+ * Read what the spectator was sent up to the end of the game, checking
+ * that it is an ACK with a full state, then MOVED notifications, then ENDED.
+ *
+ * @param fulls  Set to the number of MOVED notifications with a full state.
+ * @return the number of MOVED notifications.
+ */
+static int read_notifications(int *fulls){
+    JEUX_PACKET_HEADER hdr;
+    void *payload;
+    size_t full = game_encoding_size(GAME_ENC_PACKED), delta = game_encoding_size(GAME_ENC_DELTA);
+    cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0);
+    cr_assert_eq(hdr.type, JEUX_ACK_PKT);
+    cr_assert_eq(hdr.id, JEUX_WATCH_ID_BASE);
+    char prefix[16];
+    int len = snprintf(prefix, sizeof(prefix), "%u\n", game_get_id(game));
+    cr_assert_eq(ntohs(hdr.size), len + full, "ACK does not carry a full state");
+    free(payload);
+    int moved = 0;
+    *fulls = 0;
+    while (1){
+        cr_assert_eq(proto_recv_packet(fds[1], &hdr, &payload), 0, "Stream ended after %d MOVED", moved);
+        cr_assert_eq(hdr.id, JEUX_WATCH_ID_BASE);
+        if (hdr.type == JEUX_ENDED_PKT){
+            cr_assert_eq(ntohs(hdr.size), 0);
+            break;
+        }
+        cr_assert_eq(hdr.type, JEUX_MOVED_PKT, "Unexpected packet type %d", hdr.type);
+        size_t size = ntohs(hdr.size);
+        cr_assert(size == full || size == delta, "MOVED of %zu bytes", size);
+        *fulls += size == full;
+        moved++;
+        free(payload);
+    }
+    return moved;
+}
+
+Test(spectator_suite, 00_all_notifications_delivered, .timeout = 5) {
+    watch_game(0);
+    int n = SPEC_QUEUE_DEPTH / 2;
+    for (int i = 0; i < n; i++){
+        spec_publish(game, JEUX_MOVED_PKT, FIRST_PLAYER_ROLE);
+    }
+    spec_publish(game, JEUX_ENDED_PKT, NULL_ROLE);
+    int fulls;
+    int moved = read_notifications(&fulls);
+    cr_assert_eq(moved, n, "Spectator sent %d of %d MOVED", moved, n);
+    cr_assert_eq(fulls, 0, "Spectator that kept up sent %d full states", fulls);
+    unwatch_game();
+}
+
+Test(spectator_suite, 01_overflow_drops_and_resyncs, .timeout = 5) {
+    watch_game(4096);
+    //far more than the connection and the queue hold while nothing is read
+    int n = 4000;
+    for (int i = 0; i < n; i++){
+        spec_publish(game, JEUX_MOVED_PKT, FIRST_PLAYER_ROLE);
+    }
+    spec_publish(game, JEUX_ENDED_PKT, NULL_ROLE);
+    int fulls;
+    int moved = read_notifications(&fulls);
+    cr_assert_lt(moved, n, "No MOVED dropped");
+    cr_assert_gt(moved, 0);
+    cr_assert_gt(fulls, 0, "No full state sent after MOVED were dropped");
+    unwatch_game();
+}
@@ -0,0 +1,132 @@
+#include <criterion/criterion.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "timer.h"
+
+/*
+ * Unit tests of the timing wheel, run against the real timer thread.
+ * Deadlines are checked to fire no earlier than asked, and not much later.
+ */
+
+#define TIMER_SLACK_MS 100
+
+typedef struct fired {
+    TIMER timer;
+    uint64_t at;                //when the callback ran, 0 if it has not
+    int count;
+    int order;                  //position among the callbacks that ran
+    int rearm;                  //times left for the callback to re-arm itself
+} FIRED;
+
+static int fireOrder;
+
+static void record_fire(void *arg){
+    FIRED *f = arg;
+    f -> at = timer_now_ms();
+    f -> count += 1;
+    f -> order = __atomic_add_fetch(&fireOrder, 1, __ATOMIC_SEQ_CST);
+    if (f -> rearm > 0){
+        f -> rearm -= 1;
+        timer_arm(&f -> timer, 10);
+    }
+}
+
+static void setup_timers(void){
+    cr_assert_eq(timer_init(), 0, "Timer thread did not start");
+}
+
+static void wait_for(FIRED *f, int count, uint64_t limit_ms){
+    uint64_t until = timer_now_ms() + limit_ms;
+    while (__atomic_load_n(&f -> count, __ATOMIC_SEQ_CST) < count && timer_now_ms() < until){
+        usleep(1000);
+    }
+}
+
+Test(timer_suite, 00_fires_in_deadline_order, .timeout = 5) {
+    setup_timers();
+    //one delay for each of the first three levels, armed out of order
+    uint64_t delays[3] = {300, 5, 70};
+    FIRED f[3] = {{{0}}};
+    uint64_t start = timer_now_ms();
+    for (int i = 0; i < 3; i++){
+        timer_setup(&f[i].timer, record_fire, &f[i]);
+        cr_assert_eq(timer_arm(&f[i].timer, delays[i]), 0, "Fresh timer reported as armed");
+    }
+    wait_for(&f[0], 1, 1000);
+    cr_assert_eq(f[1].order, 1);
+    cr_assert_eq(f[2].order, 2);
+    cr_assert_eq(f[0].order, 3);
+    for (int i = 0; i < 3; i++){
+        cr_assert_eq(f[i].count, 1, "Timer %d fired %d times", i, f[i].count);
+        cr_assert_geq(f[i].at, start + delays[i], "Timer %d fired early", i);
+        cr_assert_leq(f[i].at, start + delays[i] + TIMER_SLACK_MS, "Timer %d fired late", i);
+    }
+    timer_fini();
+}
+
+Test(timer_suite, 01_cascades_from_upper_level, .timeout = 10) {
+    setup_timers();
+    //beyond two levels, so the timer is moved down twice before it fires
+    uint64_t delay = ((uint64_t)1 << (2 * TIMER_WHEEL_BITS)) + 150;
+    FIRED f = {{0}};
+    timer_setup(&f.timer, record_fire, &f);
+    uint64_t start = timer_now_ms();
+    timer_arm(&f.timer, delay);
+    cr_assert_eq(f.timer.level, 2, "Timer was placed in level %d", f.timer.level);
+    cr_assert_eq(timer_deadline(&f.timer), start + delay);
+    wait_for(&f, 1, delay + 1000);
+    cr_assert_eq(f.count, 1, "Timer did not fire");
+    cr_assert_geq(f.at, start + delay, "Timer fired %lu ms early", (unsigned long)(start + delay - f.at));
+    cr_assert_leq(f.at, start + delay + TIMER_SLACK_MS, "Timer fired late");
+    cr_assert_eq(timer_deadline(&f.timer), 0, "Fired timer still has a deadline");
+    timer_fini();
+}
+
+Test(timer_suite, 02_cancel_and_rearm, .timeout = 5) {
+    setup_timers();
+    FIRED f = {{0}};
+    timer_setup(&f.timer, record_fire, &f);
+    cr_assert_eq(timer_cancel(&f.timer), 0, "Cancelling an idle timer should return 0");
+    timer_arm(&f.timer, 50);
+    cr_assert_eq(timer_cancel(&f.timer), 1, "Cancelling an armed timer should return 1");
+    cr_assert_eq(timer_cancel(&f.timer), 0);
+    usleep(150 * 1000);
+    cr_assert_eq(f.count, 0, "Cancelled timer fired");
+
+    //re-arming moves the deadline
+    uint64_t start = timer_now_ms();
+    timer_arm(&f.timer, 2000);
+    cr_assert_eq(timer_arm(&f.timer, 20), 1, "Re-arming should report the timer as armed");
+    wait_for(&f, 1, 1000);
+    cr_assert_eq(f.count, 1);
+    cr_assert_leq(f.at, start + 20 + TIMER_SLACK_MS, "Timer kept its old deadline");
+    timer_fini();
+}
+
+Test(timer_suite, 03_callback_rearms_itself, .timeout = 5) {
+    setup_timers();
+    FIRED f = {{0}};
+    f.rearm = 3;
+    timer_setup(&f.timer, record_fire, &f);
+    timer_arm(&f.timer, 10);
+    wait_for(&f, 4, 1000);
+    cr_assert_eq(f.count, 4, "Timer fired %d times, expected 4", f.count);
+    usleep(50 * 1000);
+    cr_assert_eq(f.count, 4, "Timer kept firing");
+    timer_fini();
+}
+
+Test(timer_suite, 04_hold_defers_firing, .timeout = 5) {
+    setup_timers();
+    FIRED f = {{0}};
+    timer_setup(&f.timer, record_fire, &f);
+    timer_hold();
+    timer_arm(&f.timer, 10);
+    usleep(100 * 1000);
+    cr_assert_eq(f.count, 0, "Timer fired while the wheel was held");
+    timer_release();
+    wait_for(&f, 1, 500);
+    cr_assert_eq(f.count, 1, "Timer due while held did not fire on release");
+    timer_fini();
+}